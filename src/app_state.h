@@ -3,15 +3,33 @@
 #include <Arduino.h>
 #include <time.h>
 
-// Maximum number of flow intervals stored per day; extra intervals are dropped.
-// This caps memory usage but can make day totals exceed the sum of displayed rows.
-constexpr int MAX_INTERVALS = 48;
+// Intervals of all seven days share one pool of fixed-size chunks, so quiet
+// days cost nothing. When the pool runs dry the busiest day gives up its
+// oldest chunk; those rows stay in intervals.csv (see interval_pool.h).
+constexpr int INTERVAL_CHUNK_SIZE = 8;
+constexpr int INTERVAL_POOL_CHUNKS = 32;
 constexpr int BLOCKED_WINDOW_COUNT = 3;
+// Liters per time-of-day bin; 96 would give quarter hours.
+constexpr int USAGE_BINS_PER_DAY = 24;
+constexpr uint32_t USAGE_BIN_SECONDS = 86400 / USAGE_BINS_PER_DAY;
 
+// One interval as the pool keeps it (32 bytes). Flow statistics are stored
+// in 0.01 L/min and saturate at 655.35; read them through the helpers in
+// interval_coalescer.h. Only the interval being filled has the running
+// Welford state, in the coalescer.
 struct DayInterval {
   uint32_t startSec;
   uint32_t endSec;
   float liters;
+  uint32_t pulses;
+  // Flow samples (ticks) seen; 0 for rows stored without statistics.
+  uint32_t samples;
+  uint16_t minClpm;
+  uint16_t peakClpm;
+  uint16_t meanClpm;
+  uint16_t sdClpm;
+  // Pauses shorter than config->mergeGapSec folded into this interval.
+  uint16_t mergedGaps;
 };
 
 struct DayUsage {
@@ -21,8 +39,35 @@ struct DayUsage {
   int wday;
   uint32_t totalSeconds;
   float totalLiters;
-  uint8_t intervalCount;
-  DayInterval intervals[MAX_INTERVALS];
+  float binLiters[USAGE_BINS_PER_DAY];
+  // Logical interval indices run 0..intervalCount-1; the first spilledCount
+  // of them were moved out of RAM and only exist in intervals.csv.
+  uint16_t intervalCount;
+  uint16_t spilledCount;
+  // The first savedCount rows are known to be in intervals.csv: loaded from
+  // it, or in a snapshot the storage writer finished (interval_pool.h).
+  uint16_t savedCount;
+  int16_t firstChunk;
+  int16_t lastChunk;
+};
+
+enum BootPhase {
+  BOOT_PHASE_STORAGE,
+  BOOT_PHASE_CONFIG,
+  BOOT_PHASE_USAGE_LOAD,
+  BOOT_PHASE_WIFI,
+  BOOT_PHASE_SERVER,
+  BOOT_PHASE_TIME_SYNC,
+  BOOT_PHASE_COUNT
+};
+
+// Phase timestamps are millis() since reset; phases overlap (WiFi associates
+// while storage loads), so durations do not add up to the total boot time.
+struct BootPhaseTiming {
+  uint32_t startMs;
+  uint32_t endMs;
+  bool started;
+  bool done;
 };
 
 struct Config {
@@ -33,6 +78,27 @@ struct Config {
   uint32_t reportIntervalMs;
   bool leakProtectionEnabled;
   float leakThresholdLiters;
+  // Rolling-window leak limits over the last 1 h / 24 h; 0 disables.
+  float leakHourLiters;
+  float leakDayLiters;
+  // Further leak detectors (see leak_engine.h); 0 disables each.
+  uint32_t leakMaxDurationSec;
+  float leakMaxRateLpm;
+  int nightStartHour;
+  int nightEndHour;
+  float nightMinLpm;
+  float closedWindowLiters;
+  // Hour-of-week baseline: sigmas above the learned mean that count as a
+  // leak (0 = off), and whether that closes the valve or only logs it.
+  float baselineSigma;
+  bool baselineCloseValve;
+  // A flow start this soon after the previous interval ended continues it
+  // instead of opening a new one; 0 disables merging.
+  uint32_t mergeGapSec;
+  // Days of interval detail and of daily totals kept on flash; older data
+  // is dropped by the storage manager. 0 keeps everything.
+  uint32_t intervalKeepDays;
+  uint32_t usageKeepDays;
   int closeStartHour[BLOCKED_WINDOW_COUNT];
   int closeStartMin[BLOCKED_WINDOW_COUNT];
   int closeEndHour[BLOCKED_WINDOW_COUNT];
@@ -41,30 +107,38 @@ struct Config {
   char tzInfo[32];
 };
 
-extern Config config;
+// A published config: the settings plus what the control loop derives from
+// them, computed once when the version is staged. Never modified after
+// publishing; applyConfig() stages a new one and the loop swaps `config` over
+// to it at the start of a tick (see config.h).
+struct ConfigVersion : Config {
+  uint32_t seq;
+  float litersPerPulse;
+  // One bit per minute of the day inside a blocked window.
+  uint32_t closedMinutes[(24 * 60) / 32];
+  // One bit per hour inside the night window.
+  uint32_t nightHours;
+};
+
+extern const ConfigVersion *config;
 extern DayUsage weekUsage[7];
 extern int weekIndex;
 extern bool timeValid;
-extern bool valveState;
 extern float flowRateLpm;
 extern float totalLiters;
 extern float dailyLiters;
 extern bool flowActive;
 extern int activeIntervalIndex;
-extern bool leakTripped;
 extern float continuousLiters;
 extern int currentYear;
 extern int currentYday;
 extern bool skipPersistOnNextRollover;
+extern BootPhaseTiming bootPhases[BOOT_PHASE_COUNT];
 
 bool getLocalTimeSafe(struct tm &tmNow);
 bool isWithinClosedWindow(int hour, int minute);
-void openValve();
-void closeValve();
 void resetCounters();
 void ensureDaySlot(struct tm &tmNow);
-void startInterval(DayUsage &day, int secOfDay);
-void updateIntervalEnd(DayUsage &day, int secOfDay);
-void closeInterval(DayUsage &day, int secOfDay);
-void manualOverrideOpen();
-void manualOverrideClose();
+void addBinnedLiters(DayUsage &day, uint32_t startSec, uint32_t endSec, float liters);
+const char *bootPhaseName(int phase);
+bool bootComplete();
@@ -0,0 +1,183 @@
+#include "baseline.h"
+
+#include <freertos/FreeRTOS.h>
+#include <math.h>
+#include <rom/crc.h>
+
+#include "app_state.h"
+#include "channels.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "storage.h"
+#include "storage_writer.h"
+
+const char *BASELINE_PATH = "/baseline.bin";
+
+// Weight of the newest week; 0.2 forgets a one-off within a month or so.
+static const float BASELINE_ALPHA = 0.2f;
+// Weeks a bucket must have seen before it may flag anything.
+static const uint8_t BASELINE_WARMUP = 3;
+// Floor for sd so a bucket that was always empty does not flag a glass of
+// water.
+static const float BASELINE_MIN_SD_LITERS = 2.0f;
+static const uint32_t BASELINE_MAGIC = 0x4C534142;  // "BASL"
+static const uint16_t BASELINE_VERSION = 1;
+
+struct BaselineBucket {
+  float mean;
+  float var;
+  uint8_t samples;
+};
+
+// On flash: mean and sd in 0.1 L, 5 bytes per bucket.
+struct __attribute__((packed)) BaselineRecord {
+  uint16_t meanDl;
+  uint16_t sdDl;
+  uint8_t samples;
+};
+
+struct __attribute__((packed)) BaselineFileHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+};
+
+static BaselineBucket buckets[BASELINE_BUCKETS];
+static portMUX_TYPE baselineMux = portMUX_INITIALIZER_UNLOCKED;
+
+static int currentBucket = -1;
+static float hourLiters = 0.0f;
+// The current hour counts only if it was entered from the previous hour,
+// no leak trip closed the valve during it and it was not flagged itself;
+// with BASELINE log only, a persistent leak would otherwise become normal.
+static bool hourComplete = false;
+static bool hourFlagged = false;
+
+static void learnHour(int bucket, float liters) {
+  BaselineBucket &b = buckets[bucket];
+  portENTER_CRITICAL(&baselineMux);
+  if (b.samples == 0) {
+    b.mean = liters;
+    b.var = 0.0f;
+  } else {
+    float delta = liters - b.mean;
+    b.mean += BASELINE_ALPHA * delta;
+    b.var = (1.0f - BASELINE_ALPHA) * (b.var + (BASELINE_ALPHA * delta * delta));
+  }
+  if (b.samples < 255) b.samples++;
+  portEXIT_CRITICAL(&baselineMux);
+}
+
+void feedBaseline(const struct tm &tmNow, float liters) {
+  int bucket = (tmNow.tm_wday * 24) + tmNow.tm_hour;
+  if (bucket != currentBucket) {
+    bool next = currentBucket >= 0 && bucket == (currentBucket + 1) % BASELINE_BUCKETS;
+    if (hourComplete && next) {
+      learnHour(currentBucket, hourLiters);
+      queueBaselineSave();
+    }
+    hourComplete = next;
+    currentBucket = bucket;
+    hourLiters = 0.0f;
+    hourFlagged = false;
+  }
+  hourLiters += liters;
+  if (channels[MAIN_CHANNEL].leakTripped) {
+    hourComplete = false;
+  }
+}
+
+static float bucketLimit(const BaselineBucket &b, float sigmas) {
+  if (sigmas <= 0.0f || b.samples < BASELINE_WARMUP) return 0.0f;
+  float sd = sqrtf(b.var);
+  if (sd < BASELINE_MIN_SD_LITERS) sd = BASELINE_MIN_SD_LITERS;
+  return b.mean + (sigmas * sd);
+}
+
+bool checkBaseline(float sigmas, float &value, float &limit) {
+  value = hourLiters;
+  limit = 0.0f;
+  if (currentBucket < 0) return false;
+  limit = bucketLimit(buckets[currentBucket], sigmas);
+  if (limit <= 0.0f || hourFlagged || hourLiters < limit) return false;
+  hourFlagged = true;
+  hourComplete = false;
+  return true;
+}
+
+void getBaselineInfo(BaselineBucketInfo &info) {
+  info.bucket = currentBucket;
+  info.hourLiters = hourLiters;
+  info.meanLiters = 0.0f;
+  info.sdLiters = 0.0f;
+  info.samples = 0;
+  if (currentBucket < 0) return;
+  const BaselineBucket &b = buckets[currentBucket];
+  info.meanLiters = b.mean;
+  info.sdLiters = sqrtf(b.var);
+  info.samples = b.samples;
+}
+
+static uint16_t toDeciliters(float liters) {
+  float dl = (liters * 10.0f) + 0.5f;
+  if (dl <= 0.0f) return 0;
+  if (dl >= 65535.0f) return 65535;
+  return (uint16_t)dl;
+}
+
+bool loadBaseline() {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  File file = flashFs.open(BASELINE_PATH, "r");
+  if (!file) return false;
+
+  BaselineFileHeader header;
+  BaselineRecord records[BASELINE_BUCKETS];
+  uint32_t crc = 0;
+  bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            header.magic == BASELINE_MAGIC && header.version == BASELINE_VERSION &&
+            header.count == BASELINE_BUCKETS &&
+            file.read((uint8_t *)records, sizeof(records)) == sizeof(records) &&
+            file.read((uint8_t *)&crc, sizeof(crc)) == sizeof(crc) &&
+            crc == crc32_le(0, (const uint8_t *)records, sizeof(records));
+  file.close();
+  if (!ok) return false;
+
+  for (int i = 0; i < BASELINE_BUCKETS; i++) {
+    float sd = records[i].sdDl / 10.0f;
+    buckets[i].mean = records[i].meanDl / 10.0f;
+    buckets[i].var = sd * sd;
+    buckets[i].samples = records[i].samples;
+  }
+  return true;
+}
+
+bool writeBaselineFile() {
+  if (!storageReady()) return false;
+  BaselineRecord records[BASELINE_BUCKETS];
+  portENTER_CRITICAL(&baselineMux);
+  for (int i = 0; i < BASELINE_BUCKETS; i++) {
+    records[i].meanDl = toDeciliters(buckets[i].mean);
+    records[i].sdDl = toDeciliters(sqrtf(buckets[i].var));
+    records[i].samples = buckets[i].samples;
+  }
+  portEXIT_CRITICAL(&baselineMux);
+
+  BaselineFileHeader header = {BASELINE_MAGIC, BASELINE_VERSION, BASELINE_BUCKETS};
+  uint32_t crc = crc32_le(0, (const uint8_t *)records, sizeof(records));
+
+  StorageLock lock;
+  File file = flashFs.open("/baseline.tmp", "w");
+  if (!file) return false;
+  bool ok = file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            file.write((const uint8_t *)records, sizeof(records)) == sizeof(records) &&
+            file.write((const uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+  file.close();
+  if (!ok) {
+    flashFs.remove("/baseline.tmp");
+    return false;
+  }
+  uint32_t size = sizeof(header) + sizeof(records) + sizeof(crc);
+  noteFlashRewrite(WEAR_FILE_BASELINE, size, size);
+  return replaceFileAtomic("/baseline.tmp", BASELINE_PATH);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// Learned usage profile: one bucket per hour of the week holding an
+// exponentially decayed mean and variance of the liters used in that hour.
+// Fed from the 1 s tick; a bucket learns only from hours that were observed
+// from start to end with the valve not tripped and nothing flagged.
+constexpr int BASELINE_BUCKETS = 168;
+
+struct BaselineBucketInfo {
+  int bucket;
+  float hourLiters;
+  float meanLiters;
+  float sdLiters;
+  uint8_t samples;
+};
+
+void feedBaseline(const struct tm &tmNow, float liters);
+// True once per hour when this hour's liters exceed mean + sigmas * sd.
+// limit is 0 while the bucket is still warming up or sigmas is 0.
+bool checkBaseline(float sigmas, float &value, float &limit);
+void getBaselineInfo(BaselineBucketInfo &info);
+
+bool loadBaseline();
+// Called on the storage writer task; copies the table before writing.
+bool writeBaselineFile();
+
+extern const char *BASELINE_PATH;
@@ -0,0 +1,425 @@
+#include "channels.h"
+
+#include <Preferences.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "app_state.h"
+#include "flash_wear.h"
+#include "leak_engine.h"
+#include "pending_usage.h"
+#include "storage.h"
+#include "storage_writer.h"
+#include "telemetry.h"
+
+// Reject pulses that are "too close" (noise/ringing). Start at 300us.
+static const uint32_t MIN_PULSE_US = 300;
+static const uint32_t CHANNEL_SNAPSHOT_INTERVAL_MS = 30 * 60 * 1000;
+
+static const int8_t DEFAULT_FLOW_PIN[METER_CHANNEL_COUNT] = {22, 21, 18};
+static const int8_t DEFAULT_VALVE_PIN[METER_CHANNEL_COUNT] = {23, 19, 5};
+static const char *DEFAULT_NAME[METER_CHANNEL_COUNT] = {"main", "branch1", "branch2"};
+static const float DEFAULT_PULSES_PER_LITER = 450.0f;
+static const float DEFAULT_FLOW_ACTIVE_LPM = 0.1f;
+
+ChannelConfig channelConfigs[METER_CHANNEL_COUNT];
+ChannelState channels[METER_CHANNEL_COUNT];
+
+static int8_t attachedFlowPin[METER_CHANNEL_COUNT] = {-1, -1, -1};
+static int8_t attachedValvePin[METER_CHANNEL_COUNT] = {-1, -1, -1};
+static uint32_t lastSnapshotMs[METER_CHANNEL_COUNT];
+static float lastSnapshotLiters[METER_CHANNEL_COUNT];
+// Active milliseconds not yet counted as a whole second, as loop() keeps
+// for the main line.
+static uint32_t dailyMsCarry[METER_CHANNEL_COUNT];
+// Newest stored day of each branch, read at boot; 0 when there is none.
+static uint32_t restoredDayKey[METER_CHANNEL_COUNT];
+static uint32_t restoredSeconds[METER_CHANNEL_COUNT];
+static float restoredLiters[METER_CHANNEL_COUNT];
+
+template <int CH>
+static void IRAM_ATTR channelPulseIsr() {
+  ChannelState &st = channels[CH];
+  uint32_t now = micros();
+  if ((uint32_t)(now - st.lastPulseMicros) >= MIN_PULSE_US) {
+    st.pulseCount++;
+    st.lastPulseMicros = now;
+  }
+}
+
+static_assert(METER_CHANNEL_COUNT == 3, "extend CHANNEL_ISRS");
+static void (*const CHANNEL_ISRS[METER_CHANNEL_COUNT])() = {
+  channelPulseIsr<0>, channelPulseIsr<1>, channelPulseIsr<2>
+};
+
+static void nvsNamespace(int ch, char *buf, size_t size) {
+  snprintf(buf, size, "waterch%d", ch);
+}
+
+static bool usableGpio(long pin) {
+  if (pin < 0 || pin > 39) return false;
+  if (pin >= 6 && pin <= 11) return false;
+  return pin != 20 && pin != 24 && (pin < 28 || pin > 31);
+}
+
+bool validFlowPin(long pin) {
+  return usableGpio(pin);
+}
+
+bool validValvePin(long pin) {
+  return usableGpio(pin) && pin < 34;
+}
+
+static void loadBranchConfig(int ch) {
+  ChannelConfig &cfg = channelConfigs[ch];
+  char ns[16];
+  nvsNamespace(ch, ns, sizeof(ns));
+  Preferences prefs;
+  prefs.begin(ns, true);
+  cfg.enabled = prefs.getBool("en", false);
+  String name = prefs.getString("name", DEFAULT_NAME[ch]);
+  name.toCharArray(cfg.name, sizeof(cfg.name));
+  cfg.flowPin = (int8_t)prefs.getInt("fpin", DEFAULT_FLOW_PIN[ch]);
+  cfg.valvePin = (int8_t)prefs.getInt("vpin", DEFAULT_VALVE_PIN[ch]);
+  cfg.pulsesPerLiter = prefs.getFloat("ppl", DEFAULT_PULSES_PER_LITER);
+  cfg.flowActiveLpm = prefs.getFloat("act_lpm", DEFAULT_FLOW_ACTIVE_LPM);
+  cfg.leakLiters = prefs.getFloat("leak_l", 0.0f);
+  cfg.leakMaxSec = prefs.getUInt("leak_s", 0);
+  cfg.leakRateLpm = prefs.getFloat("leak_lpm", 0.0f);
+  cfg.nightMinLpm = prefs.getFloat("night_lpm", 0.0f);
+  cfg.closedLiters = prefs.getFloat("closed_l", 0.0f);
+  cfg.closeStartMin = prefs.getInt("cs", 0);
+  cfg.closeEndMin = prefs.getInt("ce", 0);
+  prefs.end();
+  // Older firmware stored pins unchecked; attaching one of those at every
+  // boot would keep the board from starting.
+  if (!validFlowPin(cfg.flowPin) || (cfg.valvePin != -1 && !validValvePin(cfg.valvePin))) {
+    Serial.printf("CH%d: invalid pins %d/%d, disabled\n", ch, cfg.flowPin, cfg.valvePin);
+    cfg.enabled = false;
+  }
+}
+
+static void detachChannel(int ch) {
+  if (attachedFlowPin[ch] >= 0) {
+    detachInterrupt(digitalPinToInterrupt(attachedFlowPin[ch]));
+    attachedFlowPin[ch] = -1;
+  }
+  attachedValvePin[ch] = -1;
+}
+
+static void attachChannel(int ch) {
+  detachChannel(ch);
+  const ChannelConfig &cfg = channelConfigs[ch];
+  if (!cfg.enabled || cfg.flowPin < 0) return;
+  if (cfg.valvePin >= 0) {
+    pinMode(cfg.valvePin, OUTPUT);
+    digitalWrite(cfg.valvePin, channels[ch].valveOpen ? LOW : HIGH);
+    attachedValvePin[ch] = cfg.valvePin;
+  }
+  pinMode(cfg.flowPin, INPUT);
+  attachInterrupt(digitalPinToInterrupt(cfg.flowPin), CHANNEL_ISRS[ch], RISING);
+  attachedFlowPin[ch] = cfg.flowPin;
+}
+
+void saveChannelConfig(int ch) {
+  if (ch <= MAIN_CHANNEL || ch >= METER_CHANNEL_COUNT) return;
+  const ChannelConfig &cfg = channelConfigs[ch];
+  char ns[16];
+  nvsNamespace(ch, ns, sizeof(ns));
+  Preferences prefs;
+  prefs.begin(ns, false);
+  size_t bytes = prefs.putBool("en", cfg.enabled);
+  bytes += prefs.putString("name", cfg.name);
+  bytes += prefs.putInt("fpin", cfg.flowPin);
+  bytes += prefs.putInt("vpin", cfg.valvePin);
+  bytes += prefs.putFloat("ppl", cfg.pulsesPerLiter);
+  bytes += prefs.putFloat("act_lpm", cfg.flowActiveLpm);
+  bytes += prefs.putFloat("leak_l", cfg.leakLiters);
+  bytes += prefs.putUInt("leak_s", cfg.leakMaxSec);
+  bytes += prefs.putFloat("leak_lpm", cfg.leakRateLpm);
+  bytes += prefs.putFloat("night_lpm", cfg.nightMinLpm);
+  bytes += prefs.putFloat("closed_l", cfg.closedLiters);
+  bytes += prefs.putInt("cs", cfg.closeStartMin);
+  bytes += prefs.putInt("ce", cfg.closeEndMin);
+  prefs.end();
+  noteNvsWrite(13, (uint32_t)bytes);
+  // Pins may have moved; the valve starts open like the main line at boot.
+  bool open = !channels[ch].leakTripped;
+  attachChannel(ch);
+  if (channelHasValve(ch)) setChannelValve(ch, open);
+}
+
+// Sensor inputs use one edge (RISING). The main valve stays closed until
+// setup() knows the leak state.
+void initMainChannel() {
+  ChannelConfig &main = channelConfigs[MAIN_CHANNEL];
+  memset(&main, 0, sizeof(main));
+  main.enabled = true;
+  strncpy(main.name, DEFAULT_NAME[MAIN_CHANNEL], sizeof(main.name) - 1);
+  main.flowPin = DEFAULT_FLOW_PIN[MAIN_CHANNEL];
+  main.valvePin = DEFAULT_VALVE_PIN[MAIN_CHANNEL];
+  channels[MAIN_CHANNEL].valveOpen = false;
+  attachChannel(MAIN_CHANNEL);
+}
+
+void initChannels() {
+  for (int ch = MAIN_CHANNEL + 1; ch < METER_CHANNEL_COUNT; ch++) {
+    loadBranchConfig(ch);
+    attachChannel(ch);
+  }
+  // Branch valves open until their schedule is known, as the main one does.
+  for (int ch = MAIN_CHANNEL + 1; ch < METER_CHANNEL_COUNT; ch++) {
+    setChannelValve(ch, true);
+  }
+}
+
+void restoreChannelDays() {
+  for (int ch = MAIN_CHANNEL + 1; ch < METER_CHANNEL_COUNT; ch++) {
+    if (!loadLastChannelDayCsv(ch, restoredDayKey[ch], restoredSeconds[ch], restoredLiters[ch])) {
+      restoredDayKey[ch] = 0;
+    }
+  }
+}
+
+void takeChannelPulses(int ch, uint32_t &pulses, uint32_t &lastPulseUs) {
+  ChannelState &st = channels[ch];
+  noInterrupts();
+  pulses = st.pulseCount;
+  st.pulseCount = 0;
+  lastPulseUs = st.lastPulseMicros;
+  interrupts();
+}
+
+void resetChannelPulses(int ch) {
+  noInterrupts();
+  channels[ch].pulseCount = 0;
+  interrupts();
+}
+
+bool channelHasValve(int ch) {
+  return ch >= 0 && ch < METER_CHANNEL_COUNT && attachedValvePin[ch] >= 0;
+}
+
+void setChannelValve(int ch, bool open) {
+  if (!channelHasValve(ch)) return;
+  digitalWrite(attachedValvePin[ch], open ? LOW : HIGH);
+  channels[ch].valveOpen = open;
+  Serial.printf(">>> CH%d VALVE %s <<<\n", ch, open ? "OPENED" : "CLOSED");
+  telemetryValve(ch, open);
+}
+
+bool channelInClosedWindow(int ch, const struct tm *tmNow) {
+  if (!tmNow) return false;
+  if (ch == MAIN_CHANNEL) return isWithinClosedWindow(tmNow->tm_hour, tmNow->tm_min);
+  const ChannelConfig &cfg = channelConfigs[ch];
+  if (cfg.closeStartMin == cfg.closeEndMin) return false;
+  int nowMin = (tmNow->tm_hour * 60) + tmNow->tm_min;
+  if (cfg.closeStartMin < cfg.closeEndMin) {
+    return nowMin >= cfg.closeStartMin && nowMin < cfg.closeEndMin;
+  }
+  return nowMin >= cfg.closeStartMin || nowMin < cfg.closeEndMin;
+}
+
+// A released trip starts the next run from zero.
+static void releaseLeakTrip(int ch) {
+  ChannelState &st = channels[ch];
+  st.leakTripped = false;
+  resetLeakDetectors(ch);
+}
+
+void channelManualOverride(int ch, bool open) {
+  if (ch < 0 || ch >= METER_CHANNEL_COUNT) return;
+  ChannelState &st = channels[ch];
+  if (open) releaseLeakTrip(ch);
+  struct tm tmNow;
+  bool haveTime = timeValid && getLocalTimeSafe(tmNow);
+  st.manualOverride = true;
+  st.manualOverrideStartInClosed = channelInClosedWindow(ch, haveTime ? &tmNow : nullptr);
+  setChannelValve(ch, open);
+}
+
+static uint32_t dayKeyOf(const struct tm *tmNow) {
+  return (uint32_t)((tmNow->tm_year + 1900) * 10000 + (tmNow->tm_mon + 1) * 100 + tmNow->tm_mday);
+}
+
+static void rollBranchDay(int ch, const struct tm *tmNow, uint32_t nowMs) {
+  ChannelState &st = channels[ch];
+  if (!tmNow) return;
+  uint32_t key = dayKeyOf(tmNow);
+  if (st.dayKey == key) return;
+  if (st.dayKey == 0) {
+    // First valid clock since boot: continue today's totals from the row
+    // restoreChannelDays() read.
+    if (restoredDayKey[ch] == key) {
+      st.dailySeconds += restoredSeconds[ch];
+      st.dailyLiters += restoredLiters[ch];
+    }
+    restoredDayKey[ch] = 0;
+  } else {
+    queueChannelDay(ch, st.dayKey, st.dailySeconds, st.dailyLiters);
+    st.dailySeconds = 0;
+    st.dailyLiters = 0.0f;
+    dailyMsCarry[ch] = 0;
+  }
+  st.dayKey = key;
+  lastSnapshotLiters[ch] = st.dailyLiters;
+  lastSnapshotMs[ch] = nowMs;
+}
+
+void applyChannelValve(int ch, const struct tm *tmNow) {
+  ChannelState &st = channels[ch];
+  if (!channelHasValve(ch)) return;
+  if (!tmNow) {
+    if (st.leakTripped && st.valveOpen) setChannelValve(ch, false);
+    return;
+  }
+  bool inClosed = channelInClosedWindow(ch, tmNow);
+  if (st.leakTripped && st.lastInClosedWindow && !inClosed) {
+    releaseLeakTrip(ch);
+  }
+  bool wantOpen = !inClosed;
+  if (st.leakTripped) {
+    wantOpen = false;
+  } else if (st.manualOverride) {
+    if (inClosed != st.manualOverrideStartInClosed) {
+      st.manualOverride = false;
+    } else {
+      wantOpen = st.valveOpen;
+    }
+  }
+  if (wantOpen != st.valveOpen) setChannelValve(ch, wantOpen);
+  st.lastInClosedWindow = inClosed;
+}
+
+void tickBranchChannels(uint32_t nowMs, uint32_t windowMs, const struct tm *tmNow) {
+  for (int ch = MAIN_CHANNEL + 1; ch < METER_CHANNEL_COUNT; ch++) {
+    const ChannelConfig &cfg = channelConfigs[ch];
+    if (!cfg.enabled || attachedFlowPin[ch] < 0) continue;
+    ChannelState &st = channels[ch];
+
+    uint32_t pulses;
+    uint32_t lastPulseUs;
+    takeChannelPulses(ch, pulses, lastPulseUs);
+    float liters = (float)pulses / cfg.pulsesPerLiter;
+    st.flowRateLpm = (liters * 60000.0f) / (float)windowMs;
+    rollBranchDay(ch, tmNow, nowMs);
+
+    bool active = st.flowRateLpm > cfg.flowActiveLpm;
+    if (active) {
+      st.totalLiters += liters;
+      if (st.dayKey != 0) {
+        st.dailyLiters += liters;
+        dailyMsCarry[ch] += windowMs;
+        st.dailySeconds += dailyMsCarry[ch] / 1000;
+        dailyMsCarry[ch] %= 1000;
+      }
+    }
+    if (!config->leakProtectionEnabled) {
+      st.leakTripped = false;
+      st.continuousLiters = 0.0f;
+    }
+
+    LeakTickInput leakIn;
+    leakIn.channel = ch;
+    leakIn.uptimeSec = uptimeSeconds();
+    leakIn.liters = liters;
+    leakIn.flowLpm = st.flowRateLpm;
+    leakIn.active = active;
+    leakIn.tmNow = tmNow;
+    leakIn.inClosedWindow = channelInClosedWindow(ch, tmNow);
+    runLeakDetectors(leakIn);
+    applyChannelValve(ch, tmNow);
+
+    if (st.dayKey != 0 && nowMs - lastSnapshotMs[ch] >= CHANNEL_SNAPSHOT_INTERVAL_MS) {
+      if (st.dailyLiters != lastSnapshotLiters[ch]) {
+        queueChannelDay(ch, st.dayKey, st.dailySeconds, st.dailyLiters);
+        lastSnapshotLiters[ch] = st.dailyLiters;
+      }
+      lastSnapshotMs[ch] = nowMs;
+    }
+  }
+}
+
+static void appendChannelJson(String &json, int ch) {
+  const ChannelConfig &cfg = channelConfigs[ch];
+  const ChannelState &st = channels[ch];
+  json += "{\"id\":";
+  json += ch;
+  json += ",\"name\":\"";
+  json += cfg.name;
+  json += "\",\"enabled\":";
+  json += cfg.enabled ? "true" : "false";
+  json += ",\"flow_pin\":";
+  json += cfg.flowPin;
+  json += ",\"valve_pin\":";
+  json += cfg.valvePin;
+  json += ",\"flow_lpm\":";
+  json += String(st.flowRateLpm, 3);
+  json += ",\"total_l\":";
+  json += String(st.totalLiters, 3);
+  json += ",\"daily_l\":";
+  json += String(st.dailyLiters, 3);
+  json += ",\"continuous_l\":";
+  json += String(st.continuousLiters, 3);
+  json += ",\"valve\":\"";
+  json += st.valveOpen ? "OPEN" : "CLOSED";
+  json += "\",\"leak_tripped\":";
+  json += st.leakTripped ? "true" : "false";
+  if (ch != MAIN_CHANNEL) {
+    char buf[8];
+    json += ",\"has_valve\":";
+    json += channelHasValve(ch) ? "true" : "false";
+    json += ",\"pulses_per_liter\":";
+    json += String(cfg.pulsesPerLiter, 2);
+    json += ",\"flow_active_lpm\":";
+    json += String(cfg.flowActiveLpm, 3);
+    json += ",\"leak_l\":";
+    json += String(cfg.leakLiters, 2);
+    json += ",\"leak_max_s\":";
+    json += cfg.leakMaxSec;
+    json += ",\"leak_max_lpm\":";
+    json += String(cfg.leakRateLpm, 2);
+    json += ",\"night_min_lpm\":";
+    json += String(cfg.nightMinLpm, 2);
+    json += ",\"closed_window_l\":";
+    json += String(cfg.closedLiters, 2);
+    snprintf(buf, sizeof(buf), "%02d:%02d", cfg.closeStartMin / 60, cfg.closeStartMin % 60);
+    json += ",\"close_start\":\"";
+    json += buf;
+    snprintf(buf, sizeof(buf), "%02d:%02d", cfg.closeEndMin / 60, cfg.closeEndMin % 60);
+    json += "\",\"close_end\":\"";
+    json += buf;
+    json += "\",\"daily_sec\":";
+    json += st.dailySeconds;
+  }
+  json += "}";
+}
+
+String buildChannelsJson() {
+  String json;
+  json.reserve(256 * METER_CHANNEL_COUNT);
+  json += "{\"channels\":[";
+  for (int ch = 0; ch < METER_CHANNEL_COUNT; ch++) {
+    if (ch > 0) json += ",";
+    appendChannelJson(json, ch);
+  }
+  json += "]}";
+  return json;
+}
+
+void printChannelsTo(Print &out) {
+  out.println("\n=== CHANNELS ===");
+  for (int ch = 0; ch < METER_CHANNEL_COUNT; ch++) {
+    const ChannelConfig &cfg = channelConfigs[ch];
+    const ChannelState &st = channels[ch];
+    if (!cfg.enabled) {
+      out.printf("CH%d %-15s disabled\n", ch, cfg.name);
+      continue;
+    }
+    out.printf("CH%d %-15s %7.2f L/min %9.3f L valve %s%s\n", ch, cfg.name,
+               st.flowRateLpm, st.totalLiters,
+               channelHasValve(ch) ? (st.valveOpen ? "OPEN" : "CLOSED") : "-",
+               st.leakTripped ? " LEAK" : "");
+  }
+  out.println("================\n");
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// Meter/valve channels. Every channel, the main line included, keeps its
+// valve, leak trip, manual override and closed-window state in channels[]
+// and goes through the same valve path (applyChannelValve). Channel 0 is
+// the main line: loop() takes its pulses and runs the full accounting on
+// them (week usage, intervals, leak engine, baseline) and copies its flow
+// and totals into channels[0]. Branch channels 1..N-1 (garden, boiler...)
+// have their own pins, calibration, closed window, day totals, NVS
+// namespace, usage file and leak limits, run the same leak detectors as the
+// main line minus those that need its history (leak_engine.h), and are
+// ticked in one O(N) pass.
+constexpr int METER_CHANNEL_COUNT = 3;
+constexpr int MAIN_CHANNEL = 0;
+
+struct ChannelConfig {
+  bool enabled;
+  char name[16];
+  int8_t flowPin;
+  // -1 for a meter without a valve.
+  int8_t valvePin;
+  float pulsesPerLiter;
+  float flowActiveLpm;
+  // Leak limits (leak_engine.h); 0 disables each.
+  float leakLiters;
+  uint32_t leakMaxSec;
+  float leakRateLpm;
+  float nightMinLpm;
+  float closedLiters;
+  // Closed window in minutes of the day; start == end means none.
+  int closeStartMin;
+  int closeEndMin;
+};
+
+struct ChannelState {
+  // Written by the channel's ISR.
+  volatile uint32_t pulseCount;
+  volatile uint32_t lastPulseMicros;
+  float flowRateLpm;
+  float totalLiters;
+  float dailyLiters;
+  uint32_t dailySeconds;
+  float continuousLiters;
+  bool valveOpen;
+  bool leakTripped;
+  bool manualOverride;
+  bool manualOverrideStartInClosed;
+  bool lastInClosedWindow;
+  // yyyymmdd the daily totals belong to; 0 until the clock is valid.
+  uint32_t dayKey;
+};
+
+// Only the pins and name of the main channel are used; its calibration and
+// limits stay in `config`.
+extern ChannelConfig channelConfigs[METER_CHANNEL_COUNT];
+extern ChannelState channels[METER_CHANNEL_COUNT];
+
+// Attaches the main line on its fixed pins with the valve closed; first
+// thing at boot, before flash is touched.
+void initMainChannel();
+// Loads branch configs from NVS and attaches their ISRs.
+void initChannels();
+// Reads each branch's newest stored day at boot, so the first valid clock
+// can continue today's totals without touching flash from loop().
+void restoreChannelDays();
+void takeChannelPulses(int ch, uint32_t &pulses, uint32_t &lastPulseUs);
+void resetChannelPulses(int ch);
+void tickBranchChannels(uint32_t nowMs, uint32_t windowMs, const struct tm *tmNow);
+
+// GPIOs a meter input / a valve output may use: not the SPI flash pins
+// (6-11) or missing ones, and for valves not the input-only 34-39.
+bool validFlowPin(long pin);
+bool validValvePin(long pin);
+
+bool channelHasValve(int ch);
+void setChannelValve(int ch, bool open);
+// The main line uses config's blocked windows, a branch its own one.
+bool channelInClosedWindow(int ch, const struct tm *tmNow);
+// Schedule, leak trip and manual override to valve; once per tick. A trip
+// is released when the closed window it happened in ends.
+void applyChannelValve(int ch, const struct tm *tmNow);
+// Manual valve command; lasts until the next window edge. Opening clears a
+// leak trip.
+void channelManualOverride(int ch, bool open);
+
+// Persists the branch config to its NVS namespace and re-attaches its pins.
+void saveChannelConfig(int ch);
+
+String buildChannelsJson();
+void printChannelsTo(Print &out);
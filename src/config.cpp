@@ -1,10 +1,18 @@
 #include "config.h"
 
 #include <Preferences.h>
+#include <rom/crc.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "app_state.h"
+#include "csv_reader.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
 #include "storage.h"
+#include "storage_manager.h"
 
 static const float DEFAULT_PULSES_PER_LITER = 450.0f;
 static const float DEFAULT_FLOW_ACTIVE_LPM = 0.1f;
@@ -12,90 +20,582 @@ static const float DEFAULT_MIN_INTERVAL_LITERS = 0.1f;
 static const uint32_t DEFAULT_REPORT_INTERVAL_MS = 10000;
 static const bool DEFAULT_LEAK_PROTECTION_ENABLED = true;
 static const float DEFAULT_LEAK_THRESHOLD_LITERS = 100.0f;
+static const uint32_t DEFAULT_MERGE_GAP_SEC = 10;
+static const float DEFAULT_LEAK_HOUR_LITERS = 0.0f;
+static const float DEFAULT_LEAK_DAY_LITERS = 0.0f;
+static const uint32_t DEFAULT_LEAK_MAX_DURATION_SEC = 0;
+static const float DEFAULT_LEAK_MAX_RATE_LPM = 0.0f;
+static const int DEFAULT_NIGHT_START_HOUR = 2;
+static const int DEFAULT_NIGHT_END_HOUR = 5;
+static const float DEFAULT_NIGHT_MIN_LPM = 0.0f;
+static const float DEFAULT_CLOSED_WINDOW_LITERS = 0.0f;
+static const float DEFAULT_BASELINE_SIGMA = 0.0f;
+static const bool DEFAULT_BASELINE_CLOSE_VALVE = false;
+static const uint32_t DEFAULT_INTERVAL_KEEP_DAYS = 365;
+static const uint32_t DEFAULT_USAGE_KEEP_DAYS = 3 * 365;
 static const int DEFAULT_CLOSE_START_HOUR[BLOCKED_WINDOW_COUNT] = {19, 0, 0};
 static const int DEFAULT_CLOSE_START_MIN[BLOCKED_WINDOW_COUNT] = {24, 0, 0};
 static const int DEFAULT_CLOSE_END_HOUR[BLOCKED_WINDOW_COUNT] = {6, 0, 0};
 static const int DEFAULT_CLOSE_END_MIN[BLOCKED_WINDOW_COUNT] = {0, 0, 0};
 static const char *DEFAULT_TZ_INFO = "IST-2IDT,M3.4.4/26,M10.5.0";
 
-static Preferences prefs;
+static const char *CONFIG_NAMESPACE = "config";
+static const char *CONFIG_BLOB_KEY = "blob";
+// Per-key layout of older firmware; read once for the migration.
+static const char *LEGACY_NAMESPACE = "watercfg";
+static const uint32_t CONFIG_MAGIC = 0x47464357;  // "WCFG"
+static const uint16_t CONFIG_VERSION = 1;
 
-void loadConfig() {
-  bool loaded = false;
+static const char *CONFIG_CSV_HEADER =
+    "flow_active_lpm,min_interval_l,report_interval_ms,close1_start_hour,close1_start_min,close1_end_hour,close1_end_min,close2_start_hour,close2_start_min,close2_end_hour,close2_end_min,close3_start_hour,close3_start_min,close3_end_hour,close3_end_min,pulses_per_liter,tz_info,leak_enabled,leak_threshold_l,merge_gap_s,leak_1h_l,leak_24h_l,leak_max_dur_s,leak_max_lpm,night_start_hour,night_end_hour,night_min_lpm,closed_window_l,baseline_sigma,baseline_close,interval_keep_days,usage_keep_days";
+
+// The stored form of Config: fixed widths, packed, independent of the
+// in-RAM struct. Fields are only ever appended; a shorter record from
+// older firmware loads its prefix and takes defaults for the rest, so
+// CONFIG_VERSION only changes when a field changes meaning.
+struct __attribute__((packed)) ConfigRecord {
+  float flowActiveLpm;
+  float minIntervalLiters;
+  uint32_t reportIntervalMs;
+  int8_t closeStartHour[BLOCKED_WINDOW_COUNT];
+  int8_t closeStartMin[BLOCKED_WINDOW_COUNT];
+  int8_t closeEndHour[BLOCKED_WINDOW_COUNT];
+  int8_t closeEndMin[BLOCKED_WINDOW_COUNT];
+  float pulsesPerLiter;
+  char tzInfo[32];
+  uint8_t leakProtectionEnabled;
+  float leakThresholdLiters;
+  uint32_t mergeGapSec;
+  float leakHourLiters;
+  float leakDayLiters;
+  uint32_t leakMaxDurationSec;
+  float leakMaxRateLpm;
+  int8_t nightStartHour;
+  int8_t nightEndHour;
+  float nightMinLpm;
+  float closedWindowLiters;
+  float baselineSigma;
+  uint8_t baselineCloseValve;
+  uint32_t intervalKeepDays;
+  uint32_t usageKeepDays;
+};
+
+struct __attribute__((packed)) ConfigBlob {
+  uint32_t magic;
+  uint16_t version;
+  // Bytes of record that were written.
+  uint16_t length;
+  // Over those bytes.
+  uint32_t crc;
+  ConfigRecord record;
+};
+
+void setDefaultConfig(Config &cfg) {
+  cfg = Config();
+  cfg.flowActiveLpm = DEFAULT_FLOW_ACTIVE_LPM;
+  cfg.minIntervalLiters = DEFAULT_MIN_INTERVAL_LITERS;
+  cfg.reportIntervalMs = DEFAULT_REPORT_INTERVAL_MS;
+  cfg.leakProtectionEnabled = DEFAULT_LEAK_PROTECTION_ENABLED;
+  cfg.leakThresholdLiters = DEFAULT_LEAK_THRESHOLD_LITERS;
+  cfg.mergeGapSec = DEFAULT_MERGE_GAP_SEC;
+  cfg.leakHourLiters = DEFAULT_LEAK_HOUR_LITERS;
+  cfg.leakDayLiters = DEFAULT_LEAK_DAY_LITERS;
+  cfg.leakMaxDurationSec = DEFAULT_LEAK_MAX_DURATION_SEC;
+  cfg.leakMaxRateLpm = DEFAULT_LEAK_MAX_RATE_LPM;
+  cfg.nightStartHour = DEFAULT_NIGHT_START_HOUR;
+  cfg.nightEndHour = DEFAULT_NIGHT_END_HOUR;
+  cfg.nightMinLpm = DEFAULT_NIGHT_MIN_LPM;
+  cfg.closedWindowLiters = DEFAULT_CLOSED_WINDOW_LITERS;
+  cfg.baselineSigma = DEFAULT_BASELINE_SIGMA;
+  cfg.baselineCloseValve = DEFAULT_BASELINE_CLOSE_VALVE;
+  cfg.intervalKeepDays = DEFAULT_INTERVAL_KEEP_DAYS;
+  cfg.usageKeepDays = DEFAULT_USAGE_KEEP_DAYS;
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    cfg.closeStartHour[i] = DEFAULT_CLOSE_START_HOUR[i];
+    cfg.closeStartMin[i] = DEFAULT_CLOSE_START_MIN[i];
+    cfg.closeEndHour[i] = DEFAULT_CLOSE_END_HOUR[i];
+    cfg.closeEndMin[i] = DEFAULT_CLOSE_END_MIN[i];
+  }
+  cfg.pulsesPerLiter = DEFAULT_PULSES_PER_LITER;
+  strncpy(cfg.tzInfo, DEFAULT_TZ_INFO, sizeof(cfg.tzInfo) - 1);
+}
+
+bool validateConfig(const Config &cfg) {
+  if (cfg.flowActiveLpm <= 0.0f || cfg.flowActiveLpm > 100.0f) return false;
+  if (cfg.minIntervalLiters < 0.0f || cfg.minIntervalLiters > 1000.0f) return false;
+  if (cfg.reportIntervalMs < 1000 || cfg.reportIntervalMs > 3600000) return false;
+  if (cfg.pulsesPerLiter <= 1.0f || cfg.pulsesPerLiter > 10000.0f) return false;
+  size_t tzLen = strnlen(cfg.tzInfo, sizeof(cfg.tzInfo));
+  if (tzLen == 0 || tzLen >= sizeof(cfg.tzInfo)) return false;
+  if (cfg.leakThresholdLiters < 1.0f || cfg.leakThresholdLiters > 100000.0f) return false;
+  if (cfg.mergeGapSec > 3600) return false;
+  if (cfg.leakHourLiters < 0.0f || cfg.leakHourLiters > 100000.0f) return false;
+  if (cfg.leakDayLiters < 0.0f || cfg.leakDayLiters > 100000.0f) return false;
+  if (cfg.leakMaxDurationSec > 86400) return false;
+  if (cfg.leakMaxRateLpm < 0.0f || cfg.leakMaxRateLpm > 1000.0f) return false;
+  if (cfg.nightStartHour < 0 || cfg.nightStartHour > 23) return false;
+  if (cfg.nightEndHour < 0 || cfg.nightEndHour > 23) return false;
+  if (cfg.nightMinLpm < 0.0f || cfg.nightMinLpm > 100.0f) return false;
+  if (cfg.closedWindowLiters < 0.0f || cfg.closedWindowLiters > 100000.0f) return false;
+  if (cfg.baselineSigma < 0.0f || cfg.baselineSigma > 20.0f) return false;
+  if (!validKeepDays((long)cfg.intervalKeepDays) || !validKeepDays((long)cfg.usageKeepDays)) {
+    return false;
+  }
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    if (cfg.closeStartHour[i] < 0 || cfg.closeStartHour[i] > 23) return false;
+    if (cfg.closeStartMin[i] < 0 || cfg.closeStartMin[i] > 59) return false;
+    if (cfg.closeEndHour[i] < 0 || cfg.closeEndHour[i] > 23) return false;
+    if (cfg.closeEndMin[i] < 0 || cfg.closeEndMin[i] > 59) return false;
+  }
+  return true;
+}
+
+static void toRecord(const Config &cfg, ConfigRecord &r) {
+  memset(&r, 0, sizeof(r));
+  r.flowActiveLpm = cfg.flowActiveLpm;
+  r.minIntervalLiters = cfg.minIntervalLiters;
+  r.reportIntervalMs = cfg.reportIntervalMs;
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    r.closeStartHour[i] = (int8_t)cfg.closeStartHour[i];
+    r.closeStartMin[i] = (int8_t)cfg.closeStartMin[i];
+    r.closeEndHour[i] = (int8_t)cfg.closeEndHour[i];
+    r.closeEndMin[i] = (int8_t)cfg.closeEndMin[i];
+  }
+  r.pulsesPerLiter = cfg.pulsesPerLiter;
+  memcpy(r.tzInfo, cfg.tzInfo, sizeof(r.tzInfo));
+  r.leakProtectionEnabled = cfg.leakProtectionEnabled ? 1 : 0;
+  r.leakThresholdLiters = cfg.leakThresholdLiters;
+  r.mergeGapSec = cfg.mergeGapSec;
+  r.leakHourLiters = cfg.leakHourLiters;
+  r.leakDayLiters = cfg.leakDayLiters;
+  r.leakMaxDurationSec = cfg.leakMaxDurationSec;
+  r.leakMaxRateLpm = cfg.leakMaxRateLpm;
+  r.nightStartHour = (int8_t)cfg.nightStartHour;
+  r.nightEndHour = (int8_t)cfg.nightEndHour;
+  r.nightMinLpm = cfg.nightMinLpm;
+  r.closedWindowLiters = cfg.closedWindowLiters;
+  r.baselineSigma = cfg.baselineSigma;
+  r.baselineCloseValve = cfg.baselineCloseValve ? 1 : 0;
+  r.intervalKeepDays = cfg.intervalKeepDays;
+  r.usageKeepDays = cfg.usageKeepDays;
+}
+
+static void fromRecord(const ConfigRecord &r, Config &cfg) {
+  cfg.flowActiveLpm = r.flowActiveLpm;
+  cfg.minIntervalLiters = r.minIntervalLiters;
+  cfg.reportIntervalMs = r.reportIntervalMs;
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    cfg.closeStartHour[i] = r.closeStartHour[i];
+    cfg.closeStartMin[i] = r.closeStartMin[i];
+    cfg.closeEndHour[i] = r.closeEndHour[i];
+    cfg.closeEndMin[i] = r.closeEndMin[i];
+  }
+  cfg.pulsesPerLiter = r.pulsesPerLiter;
+  memcpy(cfg.tzInfo, r.tzInfo, sizeof(cfg.tzInfo));
+  cfg.tzInfo[sizeof(cfg.tzInfo) - 1] = '\0';
+  cfg.leakProtectionEnabled = r.leakProtectionEnabled != 0;
+  cfg.leakThresholdLiters = r.leakThresholdLiters;
+  cfg.mergeGapSec = r.mergeGapSec;
+  cfg.leakHourLiters = r.leakHourLiters;
+  cfg.leakDayLiters = r.leakDayLiters;
+  cfg.leakMaxDurationSec = r.leakMaxDurationSec;
+  cfg.leakMaxRateLpm = r.leakMaxRateLpm;
+  cfg.nightStartHour = r.nightStartHour;
+  cfg.nightEndHour = r.nightEndHour;
+  cfg.nightMinLpm = r.nightMinLpm;
+  cfg.closedWindowLiters = r.closedWindowLiters;
+  cfg.baselineSigma = r.baselineSigma;
+  cfg.baselineCloseValve = r.baselineCloseValve != 0;
+  cfg.intervalKeepDays = r.intervalKeepDays;
+  cfg.usageKeepDays = r.usageKeepDays;
+}
+
+static bool loadConfigBlob(Config &cfg) {
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_NAMESPACE, true)) return false;
+  ConfigBlob blob;
+  size_t stored = prefs.getBytesLength(CONFIG_BLOB_KEY);
+  size_t got = 0;
+  if (stored >= offsetof(ConfigBlob, record) && stored <= sizeof(blob)) {
+    got = prefs.getBytes(CONFIG_BLOB_KEY, &blob, stored);
+  }
+  prefs.end();
+  if (got != stored || got < offsetof(ConfigBlob, record)) return false;
+  if (blob.magic != CONFIG_MAGIC || blob.version != CONFIG_VERSION) return false;
+  if (blob.length == 0 || offsetof(ConfigBlob, record) + blob.length != got) return false;
+  if (crc32_le(0, (const uint8_t *)&blob.record, blob.length) != blob.crc) return false;
+
+  // Fields the record predates keep their defaults.
+  ConfigRecord record;
+  setDefaultConfig(cfg);
+  toRecord(cfg, record);
+  memcpy(&record, &blob.record, blob.length);
+  fromRecord(record, cfg);
+  return validateConfig(cfg);
+}
+
+static bool saveConfigBlob(const Config &cfg) {
+  ConfigBlob blob;
+  blob.magic = CONFIG_MAGIC;
+  blob.version = CONFIG_VERSION;
+  blob.length = sizeof(ConfigRecord);
+  toRecord(cfg, blob.record);
+  blob.crc = crc32_le(0, (const uint8_t *)&blob.record, sizeof(blob.record));
+
+  Preferences prefs;
+  if (!prefs.begin(CONFIG_NAMESPACE, false)) return false;
+  // A single blob write: NVS keeps the old value until the new one is
+  // complete, so a reset leaves one or the other.
+  size_t written = prefs.putBytes(CONFIG_BLOB_KEY, &blob, sizeof(blob));
+  prefs.end();
+  noteNvsWrite(2, (uint32_t)written);
+  return written == sizeof(blob);
+}
+
+// Schema 0: one NVS key per field.
+static bool loadLegacyKeys(Config &cfg) {
+  Preferences prefs;
+  if (!prefs.begin(LEGACY_NAMESPACE, true)) return false;
+  cfg.flowActiveLpm = prefs.getFloat("flow_lpm", cfg.flowActiveLpm);
+  cfg.minIntervalLiters = prefs.getFloat("min_int_l", cfg.minIntervalLiters);
+  cfg.reportIntervalMs = prefs.getUInt("report_ms", cfg.reportIntervalMs);
+  cfg.leakProtectionEnabled = prefs.getBool("leak_en", cfg.leakProtectionEnabled);
+  cfg.leakThresholdLiters = prefs.getFloat("leak_l", cfg.leakThresholdLiters);
+  cfg.mergeGapSec = prefs.getUInt("merge_gap", cfg.mergeGapSec);
+  cfg.leakHourLiters = prefs.getFloat("leak_1h_l", cfg.leakHourLiters);
+  cfg.leakDayLiters = prefs.getFloat("leak_24h_l", cfg.leakDayLiters);
+  cfg.leakMaxDurationSec = prefs.getUInt("leak_dur_s", cfg.leakMaxDurationSec);
+  cfg.leakMaxRateLpm = prefs.getFloat("leak_lpm", cfg.leakMaxRateLpm);
+  cfg.nightStartHour = prefs.getInt("night_sh", cfg.nightStartHour);
+  cfg.nightEndHour = prefs.getInt("night_eh", cfg.nightEndHour);
+  cfg.nightMinLpm = prefs.getFloat("night_lpm", cfg.nightMinLpm);
+  cfg.closedWindowLiters = prefs.getFloat("closed_l", cfg.closedWindowLiters);
+  cfg.baselineSigma = prefs.getFloat("base_sigma", cfg.baselineSigma);
+  cfg.baselineCloseValve = prefs.getBool("base_close", cfg.baselineCloseValve);
+  cfg.intervalKeepDays = prefs.getUInt("iv_keep_d", cfg.intervalKeepDays);
+  cfg.usageKeepDays = prefs.getUInt("us_keep_d", cfg.usageKeepDays);
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    char key[8];
+    const char *suffix = "";
+    char digit[4];
+    if (i > 0) {
+      snprintf(digit, sizeof(digit), "%d", i + 1);
+      suffix = digit;
+    }
+    snprintf(key, sizeof(key), "csh%s", suffix);
+    cfg.closeStartHour[i] = prefs.getInt(key, cfg.closeStartHour[i]);
+    snprintf(key, sizeof(key), "csm%s", suffix);
+    cfg.closeStartMin[i] = prefs.getInt(key, cfg.closeStartMin[i]);
+    snprintf(key, sizeof(key), "ceh%s", suffix);
+    cfg.closeEndHour[i] = prefs.getInt(key, cfg.closeEndHour[i]);
+    snprintf(key, sizeof(key), "cem%s", suffix);
+    cfg.closeEndMin[i] = prefs.getInt(key, cfg.closeEndMin[i]);
+  }
+  cfg.pulsesPerLiter = prefs.getFloat("ppl", cfg.pulsesPerLiter);
+  String tz = prefs.getString("tz", cfg.tzInfo);
+  tz.toCharArray(cfg.tzInfo, sizeof(cfg.tzInfo));
+  prefs.end();
+  return true;
+}
+
+static bool clearLegacyKeys() {
+  Preferences prefs;
+  if (!prefs.begin(LEGACY_NAMESPACE, false)) return false;
+  bool ok = prefs.clear();
+  prefs.end();
+  return ok;
+}
+
+// Schema 0 also kept config.csv, which won over the keys when valid.
+static bool loadLegacyCsv(Config &cfg) {
+  if (!storageReady()) return false;
+  char text[512];
+  size_t len = 0;
+  {
+    StorageLock lock;
+    File file = flashFs.open(CONFIG_CSV_PATH, "r");
+    if (!file) return false;
+    len = file.read((uint8_t *)text, sizeof(text) - 1);
+    file.close();
+  }
+  return parseConfigCsv(text, len, cfg);
+}
+
+static bool migrateLegacyConfig(Config &cfg) {
+  setDefaultConfig(cfg);
+  const char *source = "defaults";
+  if (loadLegacyCsv(cfg)) {
+    source = "config.csv";
+  } else {
+    setDefaultConfig(cfg);
+    if (loadLegacyKeys(cfg)) source = "per-key NVS";
+  }
+  if (!validateConfig(cfg)) {
+    setDefaultConfig(cfg);
+    source = "defaults";
+  }
+  // Older firmware wrote UTC0 when it had no zone.
+  if (strcmp(cfg.tzInfo, "UTC0") == 0) {
+    strncpy(cfg.tzInfo, DEFAULT_TZ_INFO, sizeof(cfg.tzInfo) - 1);
+    cfg.tzInfo[sizeof(cfg.tzInfo) - 1] = '\0';
+  }
+  if (!saveConfigBlob(cfg)) return false;
+  // Only once the blob is in place; a reset before this redoes the
+  // migration from the same sources.
+  clearLegacyKeys();
   if (storageReady()) {
-    loaded = loadConfigCsv();
-  }
-
-  if (!loaded) {
-    prefs.begin("watercfg", true);
-    config.flowActiveLpm = prefs.getFloat("flow_lpm", DEFAULT_FLOW_ACTIVE_LPM);
-    config.minIntervalLiters = prefs.getFloat("min_int_l", DEFAULT_MIN_INTERVAL_LITERS);
-    config.reportIntervalMs = prefs.getUInt("report_ms", DEFAULT_REPORT_INTERVAL_MS);
-    config.leakProtectionEnabled = prefs.getBool("leak_en", DEFAULT_LEAK_PROTECTION_ENABLED);
-    config.leakThresholdLiters = prefs.getFloat("leak_l", DEFAULT_LEAK_THRESHOLD_LITERS);
-    for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-      if (i == 0) {
-        config.closeStartHour[i] = prefs.getInt("csh", DEFAULT_CLOSE_START_HOUR[i]);
-        config.closeStartMin[i] = prefs.getInt("csm", DEFAULT_CLOSE_START_MIN[i]);
-        config.closeEndHour[i] = prefs.getInt("ceh", DEFAULT_CLOSE_END_HOUR[i]);
-        config.closeEndMin[i] = prefs.getInt("cem", DEFAULT_CLOSE_END_MIN[i]);
-      } else {
-        char key[8];
-        snprintf(key, sizeof(key), "csh%d", i + 1);
-        config.closeStartHour[i] = prefs.getInt(key, DEFAULT_CLOSE_START_HOUR[i]);
-        snprintf(key, sizeof(key), "csm%d", i + 1);
-        config.closeStartMin[i] = prefs.getInt(key, DEFAULT_CLOSE_START_MIN[i]);
-        snprintf(key, sizeof(key), "ceh%d", i + 1);
-        config.closeEndHour[i] = prefs.getInt(key, DEFAULT_CLOSE_END_HOUR[i]);
-        snprintf(key, sizeof(key), "cem%d", i + 1);
-        config.closeEndMin[i] = prefs.getInt(key, DEFAULT_CLOSE_END_MIN[i]);
-      }
+    StorageLock lock;
+    flashFs.remove(CONFIG_CSV_PATH);
+  }
+  Serial.printf("Config migrated to blob v%u from %s\n", (unsigned)CONFIG_VERSION, source);
+  return true;
+}
+
+// Live, previous and staged versions. The previous one is left alone for a
+// swap so a reader on another task that fetched `config` just before it
+// changed still sees a whole version.
+static ConfigVersion versions[3];
+static int liveSlot = 0;
+static int previousSlot = -1;
+static int stagedSlot = -1;
+static uint32_t nextSeq = 1;
+const ConfigVersion *config = &versions[0];
+
+static bool inWindow(int startMin, int endMin, int nowMin) {
+  if (startMin == endMin) return false;
+  if (startMin < endMin) return nowMin >= startMin && nowMin < endMin;
+  return nowMin >= startMin || nowMin < endMin;
+}
+
+static void deriveConfig(ConfigVersion &v) {
+  v.litersPerPulse = 1.0f / v.pulsesPerLiter;
+  memset(v.closedMinutes, 0, sizeof(v.closedMinutes));
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    int startMin = (v.closeStartHour[i] * 60) + v.closeStartMin[i];
+    int endMin = (v.closeEndHour[i] * 60) + v.closeEndMin[i];
+    for (int m = 0; m < 24 * 60; m++) {
+      if (inWindow(startMin, endMin, m)) v.closedMinutes[m / 32] |= 1UL << (m % 32);
     }
-    config.pulsesPerLiter = prefs.getFloat("ppl", DEFAULT_PULSES_PER_LITER);
-    String tz = prefs.getString("tz", DEFAULT_TZ_INFO);
-    tz.toCharArray(config.tzInfo, sizeof(config.tzInfo));
-    prefs.end();
-    if (storageReady()) {
-      saveConfigCsv();
+  }
+  v.nightHours = 0;
+  for (int h = 0; h < 24; h++) {
+    if (inWindow(v.nightStartHour, v.nightEndHour, h)) v.nightHours |= 1UL << h;
+  }
+}
+
+static void stageConfig(const Config &cfg) {
+  if (stagedSlot < 0) {
+    for (int i = 0; i < 3; i++) {
+      if (i != liveSlot && i != previousSlot) {
+        stagedSlot = i;
+        break;
+      }
     }
   }
+  ConfigVersion &v = versions[stagedSlot];
+  static_cast<Config &>(v) = cfg;
+  v.seq = nextSeq++;
+  deriveConfig(v);
+}
 
-  if (strcmp(config.tzInfo, "UTC0") == 0) {
-    strncpy(config.tzInfo, DEFAULT_TZ_INFO, sizeof(config.tzInfo) - 1);
-    config.tzInfo[sizeof(config.tzInfo) - 1] = '\0';
-    saveConfig();
+void loadConfig() {
+  Config cfg;
+  if (!loadConfigBlob(cfg)) {
+    migrateLegacyConfig(cfg);
   }
+  stageConfig(cfg);
+  publishStagedConfig();
 }
 
-void saveConfig() {
-  prefs.begin("watercfg", false);
-  prefs.putFloat("flow_lpm", config.flowActiveLpm);
-  prefs.putFloat("min_int_l", config.minIntervalLiters);
-  prefs.putUInt("report_ms", config.reportIntervalMs);
-  prefs.putBool("leak_en", config.leakProtectionEnabled);
-  prefs.putFloat("leak_l", config.leakThresholdLiters);
+bool applyConfig(const Config &cfg) {
+  if (!validateConfig(cfg)) return false;
+  // Only a stored config is staged, so a reset never falls back to older
+  // settings than the ones running.
+  if (!saveConfigBlob(cfg)) return false;
+  stageConfig(cfg);
+  return true;
+}
+
+const Config &latestConfig() {
+  return stagedSlot >= 0 ? versions[stagedSlot] : *config;
+}
+
+bool publishStagedConfig() {
+  if (stagedSlot < 0) return false;
+  const ConfigVersion &next = versions[stagedSlot];
+  bool tzChanged = strcmp(next.tzInfo, config->tzInfo) != 0 || config->seq == 0;
+  previousSlot = liveSlot;
+  liveSlot = stagedSlot;
+  stagedSlot = -1;
+  config = &next;
+  // Only here, between ticks on the loop task, so no localtime_r of a tick
+  // runs against half-parsed rules.
+  if (tzChanged) {
+    setenv("TZ", config->tzInfo, 1);
+    tzset();
+  }
+  return true;
+}
+
+void printConfigCsvTo(Print &out, const Config &cfg) {
+  out.println(CONFIG_CSV_HEADER);
+  out.print(cfg.flowActiveLpm, 3);
+  out.print(",");
+  out.print(cfg.minIntervalLiters, 3);
+  out.print(",");
+  out.print(cfg.reportIntervalMs);
+  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
+    out.print(",");
+    out.print(cfg.closeStartHour[i]);
+    out.print(",");
+    out.print(cfg.closeStartMin[i]);
+    out.print(",");
+    out.print(cfg.closeEndHour[i]);
+    out.print(",");
+    out.print(cfg.closeEndMin[i]);
+  }
+  out.print(",");
+  out.print(cfg.pulsesPerLiter, 2);
+  out.print(",");
+  out.print(cfg.tzInfo);
+  out.print(",");
+  out.print(cfg.leakProtectionEnabled ? 1 : 0);
+  out.print(",");
+  out.print(cfg.leakThresholdLiters, 2);
+  out.print(",");
+  out.print(cfg.mergeGapSec);
+  out.print(",");
+  out.print(cfg.leakHourLiters, 2);
+  out.print(",");
+  out.print(cfg.leakDayLiters, 2);
+  out.print(",");
+  out.print(cfg.leakMaxDurationSec);
+  out.print(",");
+  out.print(cfg.leakMaxRateLpm, 2);
+  out.print(",");
+  out.print(cfg.nightStartHour);
+  out.print(",");
+  out.print(cfg.nightEndHour);
+  out.print(",");
+  out.print(cfg.nightMinLpm, 2);
+  out.print(",");
+  out.print(cfg.closedWindowLiters, 2);
+  out.print(",");
+  out.print(cfg.baselineSigma, 2);
+  out.print(",");
+  out.print(cfg.baselineCloseValve ? 1 : 0);
+  out.print(",");
+  out.print(cfg.intervalKeepDays);
+  out.print(",");
+  out.println(cfg.usageKeepDays);
+}
+
+// One data row. Older exports have fewer columns; what they lack keeps
+// the value cfg came in with.
+static bool parseConfigCsvLine(const char *line, size_t len, Config &cfg) {
+  char buf[256];
+  if (len >= sizeof(buf)) return false;
+  memcpy(buf, line, len);
+  buf[len] = '\0';
+
+  char *tokens[40];
+  int count = 0;
+  char *save = nullptr;
+  char *tok = strtok_r(buf, ",", &save);
+  while (tok && count < (int)(sizeof(tokens) / sizeof(tokens[0]))) {
+    tokens[count++] = tok;
+    tok = strtok_r(nullptr, ",", &save);
+  }
+
+  const int expectedOld = 9;
+  const int expectedNew = 3 + (BLOCKED_WINDOW_COUNT * 4) + 2;
+  const int expectedLeak = expectedNew + 2;
+  const int expectedGap = expectedLeak + 1;
+  const int expectedRolling = expectedGap + 2;
+  const int expectedDetectors = expectedRolling + 6;
+  const int expectedBaseline = expectedDetectors + 2;
+  const int expectedRetention = expectedBaseline + 2;
+  if (count != expectedOld && count != expectedNew && count != expectedLeak &&
+      count != expectedGap && count != expectedRolling && count != expectedDetectors &&
+      count != expectedBaseline && count != expectedRetention) {
+    return false;
+  }
+
+  Config next = cfg;
+  next.flowActiveLpm = atof(tokens[0]);
+  next.minIntervalLiters = atof(tokens[1]);
+  next.reportIntervalMs = (uint32_t)strtoul(tokens[2], nullptr, 10);
+  const int startIndex = 3;
+  const int tail = startIndex + (BLOCKED_WINDOW_COUNT * 4);
+  const char *tz = nullptr;
   for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    if (i == 0) {
-      prefs.putInt("csh", config.closeStartHour[i]);
-      prefs.putInt("csm", config.closeStartMin[i]);
-      prefs.putInt("ceh", config.closeEndHour[i]);
-      prefs.putInt("cem", config.closeEndMin[i]);
-    } else {
-      char key[8];
-      snprintf(key, sizeof(key), "csh%d", i + 1);
-      prefs.putInt(key, config.closeStartHour[i]);
-      snprintf(key, sizeof(key), "csm%d", i + 1);
-      prefs.putInt(key, config.closeStartMin[i]);
-      snprintf(key, sizeof(key), "ceh%d", i + 1);
-      prefs.putInt(key, config.closeEndHour[i]);
-      snprintf(key, sizeof(key), "cem%d", i + 1);
-      prefs.putInt(key, config.closeEndMin[i]);
+    bool present = count != expectedOld || i == 0;
+    int idx = startIndex + (i * 4);
+    next.closeStartHour[i] = present ? atoi(tokens[idx]) : 0;
+    next.closeStartMin[i] = present ? atoi(tokens[idx + 1]) : 0;
+    next.closeEndHour[i] = present ? atoi(tokens[idx + 2]) : 0;
+    next.closeEndMin[i] = present ? atoi(tokens[idx + 3]) : 0;
+  }
+  if (count == expectedOld) {
+    next.pulsesPerLiter = atof(tokens[7]);
+    tz = tokens[8];
+  } else {
+    next.pulsesPerLiter = atof(tokens[tail]);
+    tz = tokens[tail + 1];
+    if (count >= expectedLeak) {
+      next.leakProtectionEnabled = atoi(tokens[tail + 2]) != 0;
+      next.leakThresholdLiters = atof(tokens[tail + 3]);
+    }
+    if (count >= expectedGap) {
+      long mergeGap = atol(tokens[tail + 4]);
+      if (mergeGap < 0) return false;
+      next.mergeGapSec = (uint32_t)mergeGap;
+    }
+    if (count >= expectedRolling) {
+      next.leakHourLiters = atof(tokens[tail + 5]);
+      next.leakDayLiters = atof(tokens[tail + 6]);
+    }
+    if (count >= expectedDetectors) {
+      long leakDuration = atol(tokens[tail + 7]);
+      if (leakDuration < 0) return false;
+      next.leakMaxDurationSec = (uint32_t)leakDuration;
+      next.leakMaxRateLpm = atof(tokens[tail + 8]);
+      next.nightStartHour = atoi(tokens[tail + 9]);
+      next.nightEndHour = atoi(tokens[tail + 10]);
+      next.nightMinLpm = atof(tokens[tail + 11]);
+      next.closedWindowLiters = atof(tokens[tail + 12]);
+    }
+    if (count >= expectedBaseline) {
+      next.baselineSigma = atof(tokens[tail + 13]);
+      next.baselineCloseValve = atoi(tokens[tail + 14]) != 0;
+    }
+    if (count >= expectedRetention) {
+      long intervalKeep = atol(tokens[tail + 15]);
+      long usageKeep = atol(tokens[tail + 16]);
+      if (!validKeepDays(intervalKeep) || !validKeepDays(usageKeep)) return false;
+      next.intervalKeepDays = (uint32_t)intervalKeep;
+      next.usageKeepDays = (uint32_t)usageKeep;
     }
   }
-  prefs.putFloat("ppl", config.pulsesPerLiter);
-  prefs.putString("tz", config.tzInfo);
-  prefs.end();
-  if (storageReady()) {
-    saveConfigCsv();
+  if (strlen(tz) >= sizeof(next.tzInfo)) return false;
+  strncpy(next.tzInfo, tz, sizeof(next.tzInfo) - 1);
+  next.tzInfo[sizeof(next.tzInfo) - 1] = '\0';
+  if (!validateConfig(next)) return false;
+  cfg = next;
+  return true;
+}
+
+bool parseConfigCsv(const char *text, size_t len, Config &cfg) {
+  size_t pos = 0;
+  while (pos < len) {
+    size_t end = pos;
+    while (end < len && text[end] != '\n') end++;
+    size_t lineLen = end - pos;
+    if (lineLen > 0 && text[pos + lineLen - 1] == '\r') lineLen--;
+    const char *line = text + pos;
+    pos = end + 1;
+    if (lineLen == 0 || csvLineStartsWith(line, lineLen, "flow_active_lpm")) continue;
+    return parseConfigCsvLine(line, lineLen, cfg);
   }
+  return false;
 }
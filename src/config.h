@@ -1,4 +1,35 @@
 #pragma once
 
+#include <Arduino.h>
+
+#include "app_state.h"
+
+// Config lives in NVS as one versioned, CRC-checked binary record and is
+// read and written in one piece. loadConfig() migrates the per-key layout
+// and config.csv of older firmware into it once. CSV remains only as an
+// export and import format.
+//
+// `config` points at an immutable ConfigVersion. Changes are validated and
+// staged into a spare version with their derived tables built, and the loop
+// publishes it with one pointer swap at the start of a tick, so a tick
+// never sees two configs.
+// Loads and publishes the stored config; boot only.
 void loadConfig();
-void saveConfig();
+void setDefaultConfig(Config &cfg);
+// Range checks for a whole config; shared by every path that sets one.
+bool validateConfig(const Config &cfg);
+// Validates cfg as a whole, saves it and stages it; it takes effect on the
+// next publishStagedConfig(). False, with nothing staged, when it is invalid
+// or could not be saved. Loop task only, like the web handlers.
+bool applyConfig(const Config &cfg);
+// The staged config if there is one, else the live one. Edits build on it
+// so two changes within a tick do not undo each other.
+const Config &latestConfig();
+// Swaps the staged version in and applies its time zone if that changed.
+// False if nothing was staged.
+bool publishStagedConfig();
+
+void printConfigCsvTo(Print &out, const Config &cfg);
+// Reads the first data row of a config CSV over cfg; columns missing from
+// older exports keep cfg's values. False, leaving cfg alone, if invalid.
+bool parseConfigCsv(const char *text, size_t len, Config &cfg);
@@ -0,0 +1,425 @@
+#include "csv_import.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "app_state.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "interval_pool.h"
+#include "storage.h"
+
+static const char *IMPORT_STAGING_PATH = "/import.tmp";
+// Longest row kept when it straddles two upload chunks; a usage row with
+// all 24 bins is about 200 bytes.
+static const size_t IMPORT_LINE_MAX = 512;
+static const size_t IMPORT_OUT_SIZE = 1024;
+// Interval rows buffered for days in weekUsage. An upload with more falls
+// back to a full reload after the swap.
+static const int IMPORT_MERGE_ROWS_MAX = 384;
+
+enum ImportKind {
+  IMPORT_USAGE,
+  IMPORT_INTERVALS,
+  IMPORT_LEAKS,
+};
+
+struct UsagePatch {
+  int slot;
+  uint32_t dayKey;
+  uint32_t seconds;
+  float liters;
+  float bins[USAGE_BINS_PER_DAY];
+};
+
+struct IntervalPatch {
+  int8_t slot;
+  DayInterval row;
+};
+
+static CsvImportStats stats = {};
+static ImportKind kind = IMPORT_USAGE;
+static const char *targetPath = nullptr;
+static File stagingFile;
+static bool active = false;
+static bool lenientMode = false;
+static bool failed = false;
+static uint32_t startMs = 0;
+static uint32_t lineNumber = 0;
+
+static char carry[IMPORT_LINE_MAX];
+static size_t carryLen = 0;
+static bool carryOverflow = false;
+static char outBuf[IMPORT_OUT_SIZE];
+static size_t outLen = 0;
+
+static UsagePatch usagePatches[7];
+static int usagePatchCount = 0;
+static IntervalPatch *intervalPatches = nullptr;
+static int intervalPatchCount = 0;
+static bool intervalOverflow = false;
+// Day key each slot had when its first interval row was seen; 0 = untouched.
+static uint32_t slotDayKeys[7];
+
+static uint32_t makeDayKey(int year, int month, int day) {
+  return (uint32_t)((year * 10000) + (month * 100) + day);
+}
+
+static uint32_t slotDayKey(int slot) {
+  const DayUsage &day = weekUsage[slot];
+  if (day.year < 0) return 0;
+  return makeDayKey(day.year, day.month, day.day);
+}
+
+// Slot of a past day in weekUsage; the live day is never patched.
+static int pastSlotFor(uint32_t dayKey) {
+  for (int i = 0; i < 7; i++) {
+    if (i != weekIndex && slotDayKey(i) == dayKey) return i;
+  }
+  return -1;
+}
+
+static void fail(const char *error) {
+  if (!failed) stats.error = error;
+  failed = true;
+}
+
+static void flushOut() {
+  if (outLen == 0 || failed) {
+    outLen = 0;
+    return;
+  }
+  StorageLock lock;
+  if (stagingFile.write((const uint8_t *)outBuf, outLen) != outLen) {
+    fail("write failed");
+  }
+  outLen = 0;
+}
+
+static void appendOut(const char *line, size_t len) {
+  if (outLen + len + 1 > IMPORT_OUT_SIZE) flushOut();
+  memcpy(outBuf + outLen, line, len);
+  outLen += len;
+  outBuf[outLen++] = '\n';
+}
+
+static void rejectRow() {
+  stats.badRows++;
+  if (stats.firstBadLine == 0) stats.firstBadLine = lineNumber;
+  if (!lenientMode) fail("invalid row");
+}
+
+static void keepUsageRow(uint32_t dayKey, uint32_t seconds, float liters, const float *bins) {
+  int slot = pastSlotFor(dayKey);
+  if (slot < 0) return;
+  UsagePatch *patch = nullptr;
+  for (int i = 0; i < usagePatchCount; i++) {
+    if (usagePatches[i].slot == slot) patch = &usagePatches[i];
+  }
+  if (!patch) patch = &usagePatches[usagePatchCount++];
+  // A later row for the same date wins, as in loadUsageFromCsv().
+  patch->slot = slot;
+  patch->dayKey = dayKey;
+  patch->seconds = seconds;
+  patch->liters = liters;
+  memcpy(patch->bins, bins, sizeof(patch->bins));
+}
+
+static void keepIntervalRow(uint32_t dayKey, const DayInterval &row) {
+  int slot = pastSlotFor(dayKey);
+  if (slot < 0 || intervalOverflow) return;
+  if (!intervalPatches) {
+    intervalPatches = (IntervalPatch *)malloc(sizeof(IntervalPatch) * IMPORT_MERGE_ROWS_MAX);
+  }
+  if (!intervalPatches || intervalPatchCount >= IMPORT_MERGE_ROWS_MAX) {
+    intervalOverflow = true;
+    return;
+  }
+  intervalPatches[intervalPatchCount].slot = (int8_t)slot;
+  intervalPatches[intervalPatchCount].row = row;
+  intervalPatchCount++;
+}
+
+static void processLine(const char *line, size_t len) {
+  lineNumber++;
+  if (len > 0 && line[len - 1] == '\r') len--;
+  if (len == 0) return;
+  // The upload's own header; the canonical one is already in the file.
+  if (lineNumber == 1 && (line[0] < '0' || line[0] > '9')) return;
+
+  bool ok = false;
+  int year = 0;
+  int month = 0;
+  int dayNum = 0;
+  int wday = 0;
+  if (kind == IMPORT_USAGE) {
+    uint32_t seconds = 0;
+    float liters = 0.0f;
+    float bins[USAGE_BINS_PER_DAY];
+    ok = parseUsageLine(line, len, year, month, dayNum, wday, seconds, liters, bins);
+    if (ok) keepUsageRow(makeDayKey(year, month, dayNum), seconds, liters, bins);
+  } else if (kind == IMPORT_INTERVALS) {
+    DayInterval row;
+    ok = parseIntervalLine(line, len, year, month, dayNum, wday, row) &&
+         row.endSec >= row.startSec;
+    if (ok) keepIntervalRow(makeDayKey(year, month, dayNum), row);
+  } else {
+    ok = parseLeakLine(line, len);
+  }
+
+  if (!ok) {
+    rejectRow();
+    return;
+  }
+  stats.rows++;
+  appendOut(line, len);
+}
+
+static void resetImport() {
+  if (stagingFile) stagingFile.close();
+  active = false;
+  carryLen = 0;
+  carryOverflow = false;
+  outLen = 0;
+  usagePatchCount = 0;
+  intervalPatchCount = 0;
+  intervalOverflow = false;
+  free(intervalPatches);
+  intervalPatches = nullptr;
+}
+
+static void discardStaging() {
+  StorageLock lock;
+  resetImport();
+  flashFs.remove(IMPORT_STAGING_PATH);
+}
+
+bool beginCsvImport(const char *path, bool lenient) {
+  if (active) discardStaging();
+  stats = CsvImportStats();
+  if (strcmp(path, USAGE_CSV_PATH) == 0) {
+    kind = IMPORT_USAGE;
+    stats.type = "usage";
+  } else if (strcmp(path, INTERVALS_CSV_PATH) == 0) {
+    kind = IMPORT_INTERVALS;
+    stats.type = "intervals";
+  } else if (strcmp(path, LEAKS_CSV_PATH) == 0) {
+    kind = IMPORT_LEAKS;
+    stats.type = "leaks";
+  } else {
+    stats.error = "unknown type";
+    return false;
+  }
+  if (!storageReady()) {
+    stats.error = "storage unavailable";
+    return false;
+  }
+
+  StorageLock lock;
+  flashFs.remove(IMPORT_STAGING_PATH);
+  stagingFile = flashFs.open(IMPORT_STAGING_PATH, "w");
+  if (!stagingFile) {
+    stats.error = "staging open failed";
+    return false;
+  }
+  writeCsvHeader(stagingFile, path);
+  targetPath = path;
+  lenientMode = lenient;
+  failed = false;
+  lineNumber = 0;
+  // Every past day in the week is replaced, including those the upload
+  // has no rows for.
+  for (int slot = 0; slot < 7; slot++) {
+    slotDayKeys[slot] = slot == weekIndex ? 0 : slotDayKey(slot);
+  }
+  startMs = millis();
+  active = true;
+  return true;
+}
+
+void feedCsvImport(const uint8_t *data, size_t len) {
+  if (!active) return;
+  stats.bytes += len;
+  if (failed) return;
+
+  const char *p = (const char *)data;
+  const char *end = p + len;
+  while (p < end && !failed) {
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    const char *stop = nl ? nl : end;
+    size_t n = (size_t)(stop - p);
+    if (nl && carryLen == 0 && !carryOverflow) {
+      processLine(p, n);
+    } else {
+      if (carryLen + n > IMPORT_LINE_MAX) {
+        carryOverflow = true;
+      } else {
+        memcpy(carry + carryLen, p, n);
+        carryLen += n;
+      }
+      if (nl) {
+        if (carryOverflow) {
+          lineNumber++;
+          rejectRow();
+        } else {
+          processLine(carry, carryLen);
+        }
+        carryLen = 0;
+        carryOverflow = false;
+      }
+    }
+    p = nl ? nl + 1 : end;
+  }
+  flushOut();
+}
+
+static bool reloadUsageFromCsv() {
+  int lastYear = 0;
+  int lastMonth = 0;
+  int lastDay = 0;
+  bool usageLoaded = loadUsageFromCsv(lastYear, lastMonth, lastDay);
+  if (timeValid && usageLoaded) {
+    struct tm tmLast = {};
+    tmLast.tm_year = lastYear - 1900;
+    tmLast.tm_mon = lastMonth - 1;
+    tmLast.tm_mday = lastDay;
+    tmLast.tm_hour = 12;
+    tmLast.tm_isdst = -1;
+    time_t lastTs = mktime(&tmLast);
+    localtime_r(&lastTs, &tmLast);
+    currentYear = tmLast.tm_year;
+    currentYday = tmLast.tm_yday;
+    skipPersistOnNextRollover = true;
+  }
+  return usageLoaded;
+}
+
+static FlashWearFile importWearFile() {
+  switch (kind) {
+    case IMPORT_USAGE:
+      return WEAR_FILE_USAGE;
+    case IMPORT_INTERVALS:
+      return WEAR_FILE_INTERVALS;
+    case IMPORT_LEAKS:
+      return WEAR_FILE_LEAKS;
+  }
+  return WEAR_FILE_OTHER;
+}
+
+// Slots are re-checked against their day keys: the week may have rolled over
+// while the upload was still arriving. A past day the new file has no rows
+// for ends up empty, as a reload from it would leave it.
+static void mergeImport() {
+  if (kind == IMPORT_USAGE) {
+    for (int slot = 0; slot < 7; slot++) {
+      if (slotDayKeys[slot] == 0 || slot == weekIndex) continue;
+      if (slotDayKey(slot) != slotDayKeys[slot]) continue;
+      const UsagePatch *patch = nullptr;
+      for (int i = 0; i < usagePatchCount; i++) {
+        if (usagePatches[i].slot == slot) patch = &usagePatches[i];
+      }
+      DayUsage &day = weekUsage[slot];
+      day.totalSeconds = patch ? patch->seconds : 0;
+      day.totalLiters = patch ? patch->liters : 0.0f;
+      if (patch) {
+        memcpy(day.binLiters, patch->bins, sizeof(day.binLiters));
+      } else {
+        memset(day.binLiters, 0, sizeof(day.binLiters));
+      }
+      stats.mergedDays++;
+    }
+  } else if (kind == IMPORT_INTERVALS) {
+    if (intervalOverflow) {
+      stats.fullReload = reloadUsageFromCsv();
+      return;
+    }
+    bool merged[7] = {};
+    // Rows merged here are already on flash, so pool spills need no snapshot.
+    setIntervalSpillSnapshots(false);
+    for (int slot = 0; slot < 7; slot++) {
+      if (slotDayKeys[slot] == 0 || slot == weekIndex) continue;
+      if (slotDayKey(slot) != slotDayKeys[slot]) continue;
+      clearDayIntervals(weekUsage[slot]);
+      merged[slot] = true;
+      stats.mergedDays++;
+    }
+    for (int i = 0; i < intervalPatchCount; i++) {
+      if (merged[intervalPatches[i].slot]) {
+        addDayInterval(weekUsage[intervalPatches[i].slot], intervalPatches[i].row);
+      }
+    }
+    setIntervalSpillSnapshots(true);
+  }
+}
+
+bool finishCsvImport() {
+  if (!active) return false;
+  if (!failed && carryLen > 0) {
+    if (carryOverflow) {
+      lineNumber++;
+      rejectRow();
+    } else {
+      processLine(carry, carryLen);
+    }
+  }
+  flushOut();
+  if (!failed && stats.rows == 0) fail("no rows");
+  uint32_t stagedBytes = 0;
+  {
+    StorageLock lock;
+    stagedBytes = (uint32_t)stagingFile.position();
+    stagingFile.close();
+  }
+  if (failed) {
+    discardStaging();
+    stats.elapsedMs = millis() - startMs;
+    return false;
+  }
+  noteFlashRewrite(importWearFile(), stagedBytes, stagedBytes);
+  if (!replaceFileAtomic(IMPORT_STAGING_PATH, targetPath)) {
+    fail("swap failed");
+    discardStaging();
+    stats.elapsedMs = millis() - startMs;
+    return false;
+  }
+
+  uint32_t mergeStart = millis();
+  mergeImport();
+  stats.mergeMs = millis() - mergeStart;
+  resetImport();
+  stats.ok = true;
+  stats.elapsedMs = millis() - startMs;
+  return true;
+}
+
+void abortCsvImport() {
+  if (!active) return;
+  discardStaging();
+  stats.ok = false;
+  stats.error = "aborted";
+  stats.elapsedMs = millis() - startMs;
+}
+
+const CsvImportStats &lastCsvImport() {
+  return stats;
+}
+
+String buildCsvImportJson() {
+  uint32_t ms = stats.elapsedMs > 0 ? stats.elapsedMs : 1;
+  String json = "{";
+  json += "\"ok\":" + String(stats.ok ? "true" : "false");
+  if (stats.type) json += ",\"type\":\"" + String(stats.type) + "\"";
+  if (stats.error) json += ",\"error\":\"" + String(stats.error) + "\"";
+  json += ",\"bytes\":" + String(stats.bytes);
+  json += ",\"rows\":" + String(stats.rows);
+  json += ",\"bad_rows\":" + String(stats.badRows);
+  if (stats.firstBadLine) json += ",\"first_bad_line\":" + String(stats.firstBadLine);
+  json += ",\"merged_days\":" + String(stats.mergedDays);
+  json += ",\"reloaded\":" + String(stats.fullReload ? "true" : "false");
+  json += ",\"ms\":" + String(stats.elapsedMs);
+  json += ",\"merge_ms\":" + String(stats.mergeMs);
+  json += ",\"bytes_per_sec\":" + String((uint32_t)(((uint64_t)stats.bytes * 1000) / ms));
+  json += ",\"rows_per_sec\":" + String((uint32_t)(((uint64_t)stats.rows * 1000) / ms));
+  json += "}";
+  return json;
+}
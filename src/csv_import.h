@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Streams an uploaded usage, intervals or leaks CSV into a staging file one
+// request chunk at a time. Rows are checked with the storage parsers as they
+// arrive; the live file is only replaced, by rename, once the whole upload
+// parsed. Past days still held in weekUsage are then rebuilt from the rows
+// seen for their dates, and emptied if the upload has none, so nothing is
+// reloaded from flash. The live day keeps its counters; its next snapshot
+// rewrites its rows.
+struct CsvImportStats {
+  bool ok;
+  const char *type;
+  const char *error;
+  uint32_t bytes;
+  uint32_t rows;
+  uint32_t badRows;
+  uint32_t firstBadLine;
+  uint16_t mergedDays;
+  bool fullReload;
+  uint32_t elapsedMs;
+  uint32_t mergeMs;
+};
+
+// Strict imports reject the upload on the first bad row; lenient ones drop
+// bad rows and keep the rest.
+bool beginCsvImport(const char *path, bool lenient);
+void feedCsvImport(const uint8_t *data, size_t len);
+bool finishCsvImport();
+void abortCsvImport();
+const CsvImportStats &lastCsvImport();
+String buildCsvImportJson();
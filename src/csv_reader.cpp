@@ -0,0 +1,170 @@
+#include "csv_reader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+CsvLineReader::CsvLineReader(File &file)
+    : file(file), buf((char *)malloc(BLOCK_SIZE)), head(0), tail(0), eof(false) {}
+
+CsvLineReader::~CsvLineReader() {
+  free(buf);
+}
+
+bool CsvLineReader::refill() {
+  if (eof) return false;
+  // Slide the unfinished line to the front so the next block can complete it.
+  if (head > 0) {
+    memmove(buf, buf + head, tail - head);
+    tail -= head;
+    head = 0;
+  }
+  if (tail >= BLOCK_SIZE) return false;
+  size_t got = file.read((uint8_t *)buf + tail, BLOCK_SIZE - tail);
+  if (got == 0) {
+    eof = true;
+    return false;
+  }
+  tail += got;
+  return true;
+}
+
+bool CsvLineReader::next(const char *&line, size_t &len) {
+  if (!buf) return false;
+  while (true) {
+    char *start = buf + head;
+    char *nl = (char *)memchr(start, '\n', tail - head);
+    if (nl) {
+      len = (size_t)(nl - start);
+      head += len + 1;
+      if (len > 0 && start[len - 1] == '\r') len--;
+      line = start;
+      return true;
+    }
+    if (refill()) continue;
+    if (!eof) {
+      // Line does not fit the block; drop it up to the next newline.
+      head = tail = 0;
+      bool found = false;
+      while (!found && refill()) {
+        nl = (char *)memchr(buf, '\n', tail);
+        if (nl) {
+          head = (size_t)(nl - buf) + 1;
+          found = true;
+        } else {
+          tail = 0;
+        }
+      }
+      if (found) continue;
+    }
+    if (head < tail) {
+      // Last line without a trailing newline.
+      line = buf + head;
+      len = tail - head;
+      head = tail;
+      if (len > 0 && line[len - 1] == '\r') len--;
+      return true;
+    }
+    return false;
+  }
+}
+
+bool CsvFields::endField() {
+  if (p == end) return true;
+  if (*p != ',') return false;
+  p++;
+  return true;
+}
+
+static bool takeDigits(const char *&p, const char *end, int count, int &value) {
+  if (end - p < count) return false;
+  int v = 0;
+  for (int i = 0; i < count; i++) {
+    char c = p[i];
+    if (c < '0' || c > '9') return false;
+    v = (v * 10) + (c - '0');
+  }
+  p += count;
+  value = v;
+  return true;
+}
+
+bool CsvFields::takeDate(int &year, int &month, int &day) {
+  if (!takeDigits(p, end, 4, year)) return false;
+  if (p == end || *p++ != '-') return false;
+  if (!takeDigits(p, end, 2, month)) return false;
+  if (p == end || *p++ != '-') return false;
+  if (!takeDigits(p, end, 2, day)) return false;
+  return endField();
+}
+
+bool CsvFields::takeUInt(uint32_t &value) {
+  const char *start = p;
+  uint32_t v = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = (v * 10) + (uint32_t)(*p - '0');
+    p++;
+  }
+  if (p == start) return false;
+  value = v;
+  return endField();
+}
+
+bool CsvFields::takeInt(int &value) {
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    p++;
+  }
+  uint32_t v = 0;
+  if (!takeUInt(v)) return false;
+  value = neg ? -(int)v : (int)v;
+  return true;
+}
+
+bool CsvFields::takeFloat(float &value) {
+  static const float POW10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f};
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    p++;
+  }
+  int digits = 0;
+  uint32_t whole = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    whole = (whole * 10) + (uint32_t)(*p - '0');
+    p++;
+    digits++;
+  }
+  uint32_t frac = 0;
+  int fracDigits = 0;
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      // Digits past 1e-9 cannot change a float; skip them.
+      if (fracDigits < 9) {
+        frac = (frac * 10) + (uint32_t)(*p - '0');
+        fracDigits++;
+      }
+      p++;
+      digits++;
+    }
+  }
+  if (digits == 0) return false;
+  float v = (float)whole + ((float)frac / POW10[fracDigits]);
+  value = neg ? -v : v;
+  return endField();
+}
+
+bool CsvFields::takeText(const char *&text, size_t &len) {
+  const char *comma = (const char *)memchr(p, ',', end - p);
+  const char *stop = comma ? comma : end;
+  text = p;
+  len = (size_t)(stop - p);
+  p = stop;
+  return endField();
+}
+
+bool csvLineStartsWith(const char *line, size_t len, const char *prefix) {
+  size_t n = strlen(prefix);
+  return len >= n && memcmp(line, prefix, n) == 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// Reads a file in fixed-size blocks and hands out line views that point into
+// the block buffer. A view stays valid only until the next call to next().
+// Trailing '\r' is stripped; lines longer than the block are skipped.
+class CsvLineReader {
+public:
+  static const size_t BLOCK_SIZE = 4096;
+
+  explicit CsvLineReader(File &file);
+  ~CsvLineReader();
+
+  // False if the block buffer could not be allocated. next() then returns
+  // false at once, which looks like an empty file: anything that rewrites
+  // a file from a reader checks this before replacing it.
+  bool ok() const { return buf != nullptr; }
+  bool next(const char *&line, size_t &len);
+
+private:
+  CsvLineReader(const CsvLineReader &) = delete;
+  CsvLineReader &operator=(const CsvLineReader &) = delete;
+
+  bool refill();
+
+  File &file;
+  char *buf;
+  size_t head;
+  size_t tail;
+  bool eof;
+};
+
+// Cursor over the comma-separated fields of one line view. Every take*()
+// consumes exactly one field (and its trailing comma) and fails on malformed
+// input; extra trailing fields are left for the caller to ignore.
+class CsvFields {
+public:
+  CsvFields(const char *line, size_t len) : p(line), end(line + len) {}
+
+  bool takeDate(int &year, int &month, int &day);
+  bool takeInt(int &value);
+  bool takeUInt(uint32_t &value);
+  bool takeFloat(float &value);
+  bool takeText(const char *&text, size_t &len);
+  bool atEnd() const { return p >= end; }
+
+private:
+  bool endField();
+
+  const char *p;
+  const char *end;
+};
+
+bool csvLineStartsWith(const char *line, size_t len, const char *prefix);
@@ -0,0 +1,103 @@
+#include "drip_detector.h"
+
+#include <math.h>
+
+#include "app_state.h"
+
+// Faster than one pulse per DRIP_MIN_GAP_MS is a trickle the flow threshold
+// should handle; slower than DRIP_MAX_GAP_MS ends the pulse train.
+static const uint32_t DRIP_MIN_GAP_MS = 2000;
+static const uint32_t DRIP_MAX_GAP_MS = 10UL * 60UL * 1000UL;
+static const float DRIP_ALPHA = 1.0f / 32.0f;
+static const uint32_t DRIP_MIN_PULSES = 120;
+static const uint32_t DRIP_MIN_OBSERVED_MS = 2UL * 3600UL * 1000UL;
+static const float DRIP_MAX_CV = 0.35f;
+
+static bool chainValid = false;
+static uint32_t prevPulseUs = 0;
+static uint32_t lastPulseSeenMs = 0;
+static uint32_t trainStartMs = 0;
+static uint32_t trainPulses = 0;
+static float meanGapMs = 0.0f;
+static float varGapMs = 0.0f;
+static bool suspected = false;
+static bool suspectedEdge = false;
+
+static void resetTrain() {
+  chainValid = false;
+  trainPulses = 0;
+  meanGapMs = 0.0f;
+  varGapMs = 0.0f;
+  suspected = false;
+  suspectedEdge = false;
+}
+
+static float currentCv() {
+  if (meanGapMs <= 0.0f) return 0.0f;
+  return sqrtf(varGapMs) / meanGapMs;
+}
+
+void feedDripDetector(uint32_t nowMs, uint32_t pulses, uint32_t lastPulseUs) {
+  if (trainPulses > 0 && nowMs - lastPulseSeenMs > DRIP_MAX_GAP_MS) {
+    // Silence: whatever was dripping has stopped.
+    resetTrain();
+  }
+  if (pulses == 0) {
+    return;
+  }
+  lastPulseSeenMs = nowMs;
+  if (pulses > 1) {
+    // Real use hides the drip; keep the statistics but do not measure a gap
+    // across it.
+    chainValid = false;
+    return;
+  }
+
+  if (chainValid) {
+    uint32_t gapMs = (lastPulseUs - prevPulseUs) / 1000UL;
+    if (gapMs >= DRIP_MIN_GAP_MS && gapMs <= DRIP_MAX_GAP_MS) {
+      if (trainPulses == 0) {
+        trainStartMs = nowMs;
+        meanGapMs = (float)gapMs;
+        varGapMs = 0.0f;
+      } else {
+        float delta = (float)gapMs - meanGapMs;
+        meanGapMs += DRIP_ALPHA * delta;
+        varGapMs = (1.0f - DRIP_ALPHA) * (varGapMs + (DRIP_ALPHA * delta * delta));
+      }
+      trainPulses++;
+    }
+  }
+  prevPulseUs = lastPulseUs;
+  chainValid = true;
+
+  bool nowSuspected = trainPulses >= DRIP_MIN_PULSES &&
+                      nowMs - trainStartMs >= DRIP_MIN_OBSERVED_MS &&
+                      currentCv() <= DRIP_MAX_CV;
+  if (nowSuspected && !suspected) {
+    suspectedEdge = true;
+  }
+  suspected = nowSuspected;
+}
+
+static float litersPerDay() {
+  if (meanGapMs <= 0.0f) return 0.0f;
+  float pulsesPerDay = 86400000.0f / meanGapMs;
+  return pulsesPerDay * config->litersPerPulse;
+}
+
+bool takeDripSuspected(float &liters) {
+  liters = litersPerDay();
+  if (!suspectedEdge) return false;
+  suspectedEdge = false;
+  return true;
+}
+
+void getDripStatus(DripStatus &status) {
+  status.suspected = suspected;
+  status.periodSec = meanGapMs / 1000.0f;
+  status.cv = currentCv();
+  status.pulses = trainPulses;
+  status.observedSec = trainPulses > 0 ? (lastPulseSeenMs - trainStartMs) / 1000UL : 0;
+  status.litersPerDay = suspected ? litersPerDay() : 0.0f;
+}
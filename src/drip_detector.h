@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Looks for a slow, steady pulse train, one pulse every few seconds to
+// minutes (a dripping tap or a toilet refilling a little at a time), which
+// the flow threshold either ignores or splits into one-second intervals.
+// Each isolated pulse contributes its gap to the previous one to an
+// exponentially weighted mean and variance. A drip is suspected once gaps
+// have stayed regular (low coefficient of variation) for a few hours.
+struct DripStatus {
+  bool suspected;
+  float periodSec;
+  float cv;
+  uint32_t pulses;
+  uint32_t observedSec;
+  float litersPerDay;
+};
+
+// Once per tick: pulses counted in the tick and the ISR's last pulse time.
+void feedDripDetector(uint32_t nowMs, uint32_t pulses, uint32_t lastPulseUs);
+// True once when the detector enters the suspected state; the edge stays
+// pending until taken, or until the pulse train ends.
+bool takeDripSuspected(float &litersPerDay);
+void getDripStatus(DripStatus &status);
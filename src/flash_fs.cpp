@@ -0,0 +1,489 @@
+#include "flash_fs.h"
+
+#include <Preferences.h>
+#include <SPIFFS.h>
+#include <string.h>
+#if FLASH_FS_LITTLEFS
+#include <LittleFS.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <rom/crc.h>
+#endif
+
+#include "csv_reader.h"
+#include "flash_wear.h"
+#include "storage.h"
+
+fs::FS flashFs = fs::FS(fs::FSImplPtr());
+
+static const char *BENCH_PATH = "/fs_bench.csv";
+static const char *BENCH_FILE = "/bench.tmp";
+static const char *BENCH_STAGING = "/bench2.tmp";
+static const int BENCH_ROWS = 64;
+static const size_t BENCH_ROW_SIZE = 96;
+static const int BENCH_OPENS = 64;
+static const char *const BACKEND_NAMES[] = {"none", "spiffs", "littlefs"};
+
+static FlashFsBackend backend = FLASH_BACKEND_NONE;
+static FlashFsMigration migration = {};
+static FlashBenchResult benchResults[3];
+static bool benchValid[3] = {false, false, false};
+
+const char *flashFsName(FlashFsBackend which) {
+  return BACKEND_NAMES[which];
+}
+
+FlashFsBackend flashFsBackend() {
+  return backend;
+}
+
+size_t flashFsTotalBytes() {
+#if FLASH_FS_LITTLEFS
+  if (backend == FLASH_BACKEND_LITTLEFS) return LittleFS.totalBytes();
+#endif
+  return backend == FLASH_BACKEND_SPIFFS ? SPIFFS.totalBytes() : 0;
+}
+
+size_t flashFsUsedBytes() {
+#if FLASH_FS_LITTLEFS
+  if (backend == FLASH_BACKEND_LITTLEFS) return LittleFS.usedBytes();
+#endif
+  return backend == FLASH_BACKEND_SPIFFS ? SPIFFS.usedBytes() : 0;
+}
+
+bool flashFsAtomicRename() {
+  return backend == FLASH_BACKEND_LITTLEFS;
+}
+
+void getFlashFsMigration(FlashFsMigration &out) {
+  out = migration;
+}
+
+static bool benchNameIs(const char *name, size_t len, FlashFsBackend which) {
+  return strlen(BACKEND_NAMES[which]) == len && memcmp(name, BACKEND_NAMES[which], len) == 0;
+}
+
+// fs_bench.csv row: backend,files,open_us,append_us,scan_kbps,rewrite_ms,
+//   bytes_written,allocated_bytes
+static void loadBenchResults() {
+  File file = flashFs.open(BENCH_PATH, "r");
+  if (!file) return;
+  CsvLineReader reader(file);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
+    CsvFields fields(line, len);
+    const char *name = nullptr;
+    size_t nameLen = 0;
+    if (!fields.takeText(name, nameLen)) continue;
+    int which = benchNameIs(name, nameLen, FLASH_BACKEND_SPIFFS)     ? FLASH_BACKEND_SPIFFS
+                : benchNameIs(name, nameLen, FLASH_BACKEND_LITTLEFS) ? FLASH_BACKEND_LITTLEFS
+                                                                     : FLASH_BACKEND_NONE;
+    if (which == FLASH_BACKEND_NONE) continue;
+    FlashBenchResult r = {};
+    uint32_t files = 0;
+    r.backend = (FlashFsBackend)which;
+    if (fields.takeUInt(files) && fields.takeUInt(r.openUs) && fields.takeUInt(r.appendUs) &&
+        fields.takeUInt(r.scanKBps) && fields.takeUInt(r.rewriteMs) &&
+        fields.takeUInt(r.bytesWritten) && fields.takeUInt(r.allocatedBytes)) {
+      r.files = (uint16_t)files;
+      benchResults[which] = r;
+      benchValid[which] = true;
+    }
+  }
+  file.close();
+}
+
+static bool saveBenchResults() {
+  File file = flashFs.open(BENCH_PATH, "w");
+  if (!file) return false;
+  file.println("backend,files,open_us,append_us,scan_kbps,rewrite_ms,bytes_written,allocated_bytes");
+  for (int i = FLASH_BACKEND_SPIFFS; i <= FLASH_BACKEND_LITTLEFS; i++) {
+    if (!benchValid[i]) continue;
+    const FlashBenchResult &r = benchResults[i];
+    file.printf("%s,%u,%lu,%lu,%lu,%lu,%lu,%lu\n", BACKEND_NAMES[i], (unsigned)r.files,
+                (unsigned long)r.openUs, (unsigned long)r.appendUs, (unsigned long)r.scanKBps,
+                (unsigned long)r.rewriteMs, (unsigned long)r.bytesWritten,
+                (unsigned long)r.allocatedBytes);
+  }
+  uint32_t size = (uint32_t)file.position();
+  file.close();
+  noteFlashRewrite(WEAR_FILE_OTHER, size, size);
+  return true;
+}
+
+static uint16_t countFiles() {
+  File root = flashFs.open("/");
+  if (!root) return 0;
+  uint16_t count = 0;
+  File entry = root.openNextFile();
+  while (entry) {
+    count++;
+    entry = root.openNextFile();
+  }
+  return count;
+}
+
+// The workloads the firmware puts on flash: appending a log row, opening a
+// file, scanning usage.csv and rewriting a file through a staging copy.
+static void benchmarkMounted(FlashBenchResult &r) {
+  r = FlashBenchResult();
+  r.backend = backend;
+  r.files = countFiles();
+  flashFs.remove(BENCH_FILE);
+  size_t usedBefore = flashFsUsedBytes();
+
+  char row[BENCH_ROW_SIZE];
+  memset(row, 'x', sizeof(row));
+  row[sizeof(row) - 1] = '\n';
+  uint32_t start = micros();
+  for (int i = 0; i < BENCH_ROWS; i++) {
+    File file = flashFs.open(BENCH_FILE, "a");
+    if (!file) break;
+    size_t written = file.write((const uint8_t *)row, sizeof(row));
+    file.close();
+    noteFlashAppend(WEAR_FILE_OTHER, (uint32_t)written, r.bytesWritten);
+    r.bytesWritten += written;
+  }
+  r.appendUs = (micros() - start) / BENCH_ROWS;
+  size_t usedAfter = flashFsUsedBytes();
+  r.allocatedBytes = usedAfter > usedBefore ? (uint32_t)(usedAfter - usedBefore) : 0;
+
+  start = micros();
+  for (int i = 0; i < BENCH_OPENS; i++) {
+    File file = flashFs.open(BENCH_FILE, "r");
+    file.close();
+  }
+  r.openUs = (micros() - start) / BENCH_OPENS;
+
+  const char *scanPath = flashFs.exists(USAGE_CSV_PATH) ? USAGE_CSV_PATH : BENCH_FILE;
+  File scan = flashFs.open(scanPath, "r");
+  if (scan) {
+    uint32_t bytes = 0;
+    start = micros();
+    CsvLineReader reader(scan);
+    const char *line = nullptr;
+    size_t len = 0;
+    while (reader.next(line, len)) bytes += (uint32_t)len + 1;
+    uint32_t us = micros() - start;
+    scan.close();
+    r.scanKBps = us ? (uint32_t)(((uint64_t)bytes * 1000000ULL) / ((uint64_t)us * 1024ULL)) : 0;
+  }
+
+  start = micros();
+  File in = flashFs.open(BENCH_FILE, "r");
+  File out = flashFs.open(BENCH_STAGING, "w");
+  uint32_t copied = 0;
+  if (in && out) {
+    uint8_t buf[256];
+    size_t got = 0;
+    while ((got = in.read(buf, sizeof(buf))) > 0) {
+      copied += out.write(buf, got);
+    }
+  }
+  in.close();
+  out.close();
+  r.bytesWritten += copied;
+  noteFlashRewrite(WEAR_FILE_OTHER, 0, copied);
+  // The same swap replaceFileAtomic() does, minus its storage checks so it
+  // also runs during the migration.
+  if (!flashFsAtomicRename()) flashFs.remove(BENCH_FILE);
+  flashFs.rename(BENCH_STAGING, BENCH_FILE);
+  r.rewriteMs = (micros() - start) / 1000;
+  flashFs.remove(BENCH_FILE);
+  flashFs.remove(BENCH_STAGING);
+}
+
+bool runFlashBenchmark() {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  FlashBenchResult r;
+  benchmarkMounted(r);
+  benchResults[backend] = r;
+  benchValid[backend] = true;
+  printFlashFsTo(Serial);
+  return saveBenchResults();
+}
+
+bool getFlashBenchResult(FlashFsBackend which, FlashBenchResult &result) {
+  if (which == FLASH_BACKEND_NONE || !benchValid[which]) return false;
+  result = benchResults[which];
+  return true;
+}
+
+#if FLASH_FS_LITTLEFS
+
+static const uint32_t STAGE_MAGIC = 0x47545346;  // "FSTG"
+static const uint16_t STAGE_VERSION = 1;
+static const size_t STAGE_COPY_SIZE = 2048;
+static const uint32_t STAGE_SECTOR_SIZE = 4096;
+
+// Start of the staging area; the payload follows. Each file is a name
+// length byte, the name, a uint32 size and the contents.
+struct StageHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t files;
+  uint32_t payloadLen;
+  // Over the payload.
+  uint32_t crc;
+};
+
+struct StageCursor {
+  const esp_partition_t *part;
+  uint32_t offset;
+  uint32_t crc;
+  bool ok;
+};
+
+static bool skipWhenStaging(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && strcmp(name + len - 4, ".tmp") == 0;
+}
+
+static void stageWrite(StageCursor &c, const void *data, size_t len) {
+  if (!c.ok) return;
+  if (c.offset + len > c.part->size) {
+    c.ok = false;
+    return;
+  }
+  c.ok = esp_partition_write(c.part, c.offset, data, len) == ESP_OK;
+  c.crc = crc32_le(c.crc, (const uint8_t *)data, len);
+  c.offset += len;
+}
+
+static void stageRead(StageCursor &c, void *data, size_t len) {
+  if (!c.ok) return;
+  if (c.offset + len > c.part->size) {
+    c.ok = false;
+    return;
+  }
+  c.ok = esp_partition_read(c.part, c.offset, data, len) == ESP_OK;
+  c.crc = crc32_le(c.crc, (const uint8_t *)data, len);
+  c.offset += len;
+}
+
+static const char *stageSpiffs(const esp_partition_t *part, uint8_t *buf) {
+  uint32_t needed = sizeof(StageHeader);
+  File root = SPIFFS.open("/");
+  if (!root) return "cannot list spiffs";
+  File entry = root.openNextFile();
+  while (entry) {
+    if (!skipWhenStaging(entry.name())) {
+      needed += 1 + strlen(entry.name()) + sizeof(uint32_t) + (uint32_t)entry.size();
+    }
+    entry = root.openNextFile();
+  }
+  root.close();
+  if (needed > part->size) return "data does not fit the staging partition";
+  uint32_t eraseLen = (needed + STAGE_SECTOR_SIZE - 1) & ~(STAGE_SECTOR_SIZE - 1);
+  if (esp_partition_erase_range(part, 0, eraseLen) != ESP_OK) return "staging erase failed";
+
+  StageCursor c = {part, sizeof(StageHeader), 0, true};
+  uint16_t files = 0;
+  root = SPIFFS.open("/");
+  entry = root.openNextFile();
+  while (entry && c.ok) {
+    const char *name = entry.name();
+    if (!skipWhenStaging(name)) {
+      // Old cores report SPIFFS names with the leading slash.
+      if (name[0] == '/') name++;
+      uint8_t nameLen = (uint8_t)strlen(name);
+      uint32_t size = (uint32_t)entry.size();
+      stageWrite(c, &nameLen, 1);
+      stageWrite(c, name, nameLen);
+      stageWrite(c, &size, sizeof(size));
+      uint32_t copied = 0;
+      while (c.ok && copied < size) {
+        size_t got = entry.read(buf, STAGE_COPY_SIZE);
+        if (got == 0) break;
+        stageWrite(c, buf, got);
+        copied += (uint32_t)got;
+      }
+      if (copied != size) c.ok = false;
+      files++;
+      migration.bytes += size;
+    }
+    entry = root.openNextFile();
+  }
+  root.close();
+  if (!c.ok) return "staging write failed";
+
+  StageHeader header = {STAGE_MAGIC, STAGE_VERSION, files,
+                        c.offset - (uint32_t)sizeof(StageHeader), c.crc};
+  if (esp_partition_write(part, 0, &header, sizeof(header)) != ESP_OK) {
+    return "staging write failed";
+  }
+  migration.files = files;
+
+  // Read it all back before the SPIFFS copy is given up.
+  StageCursor check = {part, sizeof(StageHeader), 0, true};
+  for (uint32_t left = header.payloadLen; check.ok && left > 0;) {
+    size_t n = left < STAGE_COPY_SIZE ? left : STAGE_COPY_SIZE;
+    stageRead(check, buf, n);
+    left -= (uint32_t)n;
+  }
+  return (check.ok && check.crc == header.crc) ? nullptr : "staging readback failed";
+}
+
+static const char *restoreStaged(const esp_partition_t *part, uint8_t *buf) {
+  StageHeader header;
+  if (esp_partition_read(part, 0, &header, sizeof(header)) != ESP_OK ||
+      header.magic != STAGE_MAGIC || header.version != STAGE_VERSION ||
+      header.payloadLen > part->size - sizeof(StageHeader)) {
+    return "no staged copy";
+  }
+  StageCursor c = {part, sizeof(StageHeader), 0, true};
+  for (uint32_t left = header.payloadLen; c.ok && left > 0;) {
+    size_t n = left < STAGE_COPY_SIZE ? left : STAGE_COPY_SIZE;
+    stageRead(c, buf, n);
+    left -= (uint32_t)n;
+  }
+  if (!c.ok || c.crc != header.crc) return "staged copy is corrupt";
+
+  c = {part, sizeof(StageHeader), 0, true};
+  migration.files = 0;
+  migration.bytes = 0;
+  for (uint16_t i = 0; i < header.files && c.ok; i++) {
+    uint8_t nameLen = 0;
+    char path[40];
+    uint32_t size = 0;
+    stageRead(c, &nameLen, 1);
+    if (nameLen == 0 || nameLen > sizeof(path) - 2) return "bad staged entry";
+    path[0] = '/';
+    stageRead(c, path + 1, nameLen);
+    path[nameLen + 1] = '\0';
+    stageRead(c, &size, sizeof(size));
+    File out = LittleFS.open(path, "w");
+    if (!out) return "littlefs write failed";
+    for (uint32_t left = size; c.ok && left > 0;) {
+      size_t n = left < STAGE_COPY_SIZE ? left : STAGE_COPY_SIZE;
+      stageRead(c, buf, n);
+      if (out.write(buf, n) != n) c.ok = false;
+      left -= (uint32_t)n;
+    }
+    out.close();
+    migration.files++;
+    migration.bytes += size;
+  }
+  return c.ok ? nullptr : "littlefs write failed";
+}
+
+static void useLittleFs() {
+  flashFs = LittleFS;
+  backend = FLASH_BACKEND_LITTLEFS;
+}
+
+// Formats the partition as LittleFS and copies the staged files onto it.
+static bool finishMigration(Preferences &prefs, const esp_partition_t *part, uint8_t *buf) {
+  // begin(true) formats a SPIFFS partition by itself; format() also clears
+  // a LittleFS a reset left half restored, and needs the label begin() sets.
+  bool formatted = LittleFS.begin(true) && LittleFS.format();
+  LittleFS.end();
+  if (!formatted || !LittleFS.begin(false)) {
+    migration.error = "littlefs format failed";
+    return false;
+  }
+  useLittleFs();
+  migration.error = restoreStaged(part, buf);
+  // Until the copy is fully restored the next boot starts over from it,
+  // including after a reset before this point.
+  if (migration.error) return false;
+  prefs.putBool("staged", false);
+  return true;
+}
+
+bool beginFlashFs() {
+  if (backend != FLASH_BACKEND_NONE) return true;
+  Preferences prefs;
+  prefs.begin("flashfs", false);
+  bool staged = prefs.getBool("staged", false);
+  if (!staged && LittleFS.begin(false)) {
+    prefs.end();
+    useLittleFs();
+    loadBenchResults();
+    return true;
+  }
+
+  const esp_partition_t *part = esp_ota_get_next_update_partition(nullptr);
+  uint8_t *buf = (uint8_t *)malloc(STAGE_COPY_SIZE);
+  uint32_t startMs = millis();
+  bool haveSpiffs = !staged && SPIFFS.begin(false);
+  if (haveSpiffs || staged) {
+    migration.ran = true;
+    if (haveSpiffs) {
+      // Stays on SPIFFS unless the staged copy is complete.
+      backend = FLASH_BACKEND_SPIFFS;
+      flashFs = SPIFFS;
+    }
+    if (!part || !buf) {
+      migration.error = !part ? "no staging partition" : "out of memory";
+    } else if (haveSpiffs) {
+      benchmarkMounted(benchResults[FLASH_BACKEND_SPIFFS]);
+      benchValid[FLASH_BACKEND_SPIFFS] = true;
+      migration.error = stageSpiffs(part, buf);
+      if (!migration.error) {
+        prefs.putBool("staged", true);
+        SPIFFS.end();
+        backend = FLASH_BACKEND_NONE;
+      }
+    }
+    if (!migration.error) {
+      migration.ok = finishMigration(prefs, part, buf);
+    }
+    migration.ms = millis() - startMs;
+    Serial.printf("Flash migration to LittleFS: %s (%u files, %lu bytes, %lu ms)\n",
+                  migration.ok ? "done" : migration.error, (unsigned)migration.files,
+                  (unsigned long)migration.bytes, (unsigned long)migration.ms);
+  }
+  free(buf);
+  prefs.end();
+
+  if (backend == FLASH_BACKEND_NONE) {
+    // Nothing to migrate, or a failed migration left an unusable partition.
+    if (!LittleFS.begin(true)) return false;
+    useLittleFs();
+  }
+  if (migration.ok) {
+    benchmarkMounted(benchResults[FLASH_BACKEND_LITTLEFS]);
+    benchValid[FLASH_BACKEND_LITTLEFS] = true;
+    saveBenchResults();
+  } else if (!migration.ran) {
+    loadBenchResults();
+  }
+  return true;
+}
+
+#else
+
+bool beginFlashFs() {
+  if (backend != FLASH_BACKEND_NONE) return true;
+  if (!SPIFFS.begin(true)) return false;
+  flashFs = SPIFFS;
+  backend = FLASH_BACKEND_SPIFFS;
+  loadBenchResults();
+  return true;
+}
+
+#endif
+
+void printFlashFsTo(Print &out) {
+  out.println("\n=== FLASH FS ===");
+  out.printf("Backend: %s  %lu / %lu KB used\n", flashFsName(backend),
+             (unsigned long)(flashFsUsedBytes() / 1024), (unsigned long)(flashFsTotalBytes() / 1024));
+  if (migration.ran) {
+    out.printf("Migration: %s, %u files, %lu bytes, %lu ms\n",
+               migration.ok ? "ok" : migration.error, (unsigned)migration.files,
+               (unsigned long)migration.bytes, (unsigned long)migration.ms);
+  }
+  out.println("Backend   files  open us  append us  scan KB/s  rewrite ms  written  allocated");
+  for (int i = FLASH_BACKEND_SPIFFS; i <= FLASH_BACKEND_LITTLEFS; i++) {
+    if (!benchValid[i]) continue;
+    const FlashBenchResult &r = benchResults[i];
+    out.printf("%-8s  %5u  %7lu  %9lu  %9lu  %10lu  %7lu  %9lu\n", BACKEND_NAMES[i],
+               (unsigned)r.files, (unsigned long)r.openUs, (unsigned long)r.appendUs,
+               (unsigned long)r.scanKBps, (unsigned long)r.rewriteMs,
+               (unsigned long)r.bytesWritten, (unsigned long)r.allocatedBytes);
+  }
+  out.println("================\n");
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// The filesystem on the "spiffs" data partition. With FLASH_FS_LITTLEFS
+// (the default) it is LittleFS: renames are copy-on-write and replace the
+// target atomically, and open/seek cost does not grow with file count the
+// way it does on SPIFFS. A partition still holding SPIFFS from older
+// firmware is migrated once at boot: every file is staged in the unused
+// second app partition, the partition is formatted as LittleFS and the
+// files are copied back. A reset mid-way redoes the copy from the staging
+// area. If the data does not fit there the device stays on SPIFFS.
+#ifndef FLASH_FS_LITTLEFS
+#define FLASH_FS_LITTLEFS 1
+#endif
+
+enum FlashFsBackend : uint8_t {
+  FLASH_BACKEND_NONE,
+  FLASH_BACKEND_SPIFFS,
+  FLASH_BACKEND_LITTLEFS
+};
+
+struct FlashFsMigration {
+  bool ran;
+  bool ok;
+  uint16_t files;
+  uint32_t bytes;
+  uint32_t ms;
+  const char *error;
+};
+
+// Open, append, scan and rewrite timings of one backend, taken on the same
+// device and data so the two can be compared.
+struct FlashBenchResult {
+  FlashFsBackend backend;
+  uint16_t files;
+  uint32_t openUs;
+  uint32_t appendUs;
+  uint32_t scanKBps;
+  uint32_t rewriteMs;
+  // Logical bytes the benchmark wrote, and how much the used space grew
+  // for them (allocation granularity).
+  uint32_t bytesWritten;
+  uint32_t allocatedBytes;
+};
+
+// Every storage module goes through this instead of SPIFFS or LittleFS.
+extern fs::FS flashFs;
+
+bool beginFlashFs();
+FlashFsBackend flashFsBackend();
+const char *flashFsName(FlashFsBackend backend);
+size_t flashFsTotalBytes();
+size_t flashFsUsedBytes();
+// Whether rename() onto an existing file replaces it atomically.
+bool flashFsAtomicRename();
+void getFlashFsMigration(FlashFsMigration &migration);
+
+// Storage writer only. Runs the benchmark on the mounted backend and keeps
+// the result with the last one of the other backend in /fs_bench.csv.
+bool runFlashBenchmark();
+// Results per backend, indexed by FlashFsBackend; false if none yet.
+bool getFlashBenchResult(FlashFsBackend backend, FlashBenchResult &result);
+void printFlashFsTo(Print &out);
@@ -0,0 +1,295 @@
+#include "flash_wear.h"
+
+#include <freertos/FreeRTOS.h>
+#include <rom/crc.h>
+
+#include "flash_fs.h"
+#include "storage.h"
+#include "storage_writer.h"
+
+static const char *WEAR_PATH = "/wear.bin";
+static const char *WEAR_TMP_PATH = "/wear.tmp";
+static const uint32_t WEAR_MAGIC = 0x52414557;  // "WEAR"
+static const uint16_t WEAR_VERSION = 1;
+static const uint32_t SAVE_INTERVAL_MS = 60UL * 60UL * 1000UL;
+
+static const uint32_t FLASH_BLOCK_BYTES = 4096;
+// Rated erase cycles per sector of the module's NOR flash.
+static const uint64_t FLASH_ENDURANCE_CYCLES = 100000;
+// nvs partition of the default partition table.
+static const uint32_t NVS_PARTITION_BYTES = 0x5000;
+// LittleFS as the ESP32 core configures it: 128-byte program unit, one
+// metadata commit per close and per rename.
+static const uint32_t LFS_PROG_BYTES = 128;
+static const uint32_t LFS_COMMIT_BYTES = 128;
+// SPIFFS pages carry a 5-byte header; every close rewrites an index page.
+static const uint32_t SPIFFS_PAGE_BYTES = 256;
+static const uint32_t SPIFFS_PAGE_DATA = 251;
+// Page references per SPIFFS index page, roughly.
+static const uint32_t SPIFFS_INDEX_SPAN = 120;
+static const uint32_t NVS_ENTRY_BYTES = 32;
+
+static const char *const FILE_NAMES[] = {"usage", "intervals", "leaks", "channels", "archive",
+                                         "baseline", "config", "telemetry", "nvs", "other"};
+static const char *const OP_NAMES[] = {"append", "rewrite", "patch", "nvs"};
+
+struct __attribute__((packed)) WearFileHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t files;
+  uint8_t ops;
+  uint32_t trackedSeconds;
+};
+
+static portMUX_TYPE wearMux = portMUX_INITIALIZER_UNLOCKED;
+static FlashWearCounters fileCounters[WEAR_FILE_COUNT];
+static FlashWearCounters opCounters[WEAR_OP_COUNT];
+static uint32_t trackedSeconds = 0;
+static uint32_t trackedRemainderMs = 0;
+static uint32_t lastServiceMs = 0;
+static uint32_t lastSaveMs = 0;
+static bool dirty = false;
+
+const char *flashWearFileName(FlashWearFile file) {
+  return FILE_NAMES[file];
+}
+
+const char *flashWearOpName(FlashWearOp op) {
+  return OP_NAMES[op];
+}
+
+static uint32_t roundUp(uint32_t value, uint32_t unit) {
+  return ((value + unit - 1) / unit) * unit;
+}
+
+static uint32_t spiffsPages(uint32_t bytes) {
+  return (bytes + SPIFFS_PAGE_DATA - 1) / SPIFFS_PAGE_DATA;
+}
+
+static bool onLittleFs() {
+  return flashFsBackend() == FLASH_BACKEND_LITTLEFS;
+}
+
+static void record(FlashWearFile file, FlashWearOp op, uint32_t logical, uint32_t bytes,
+                   uint32_t physical) {
+  portENTER_CRITICAL(&wearMux);
+  FlashWearCounters *rows[2] = {&fileCounters[file], &opCounters[op]};
+  for (FlashWearCounters *c : rows) {
+    c->ops++;
+    c->logicalBytes += logical;
+    c->fsBytes += bytes;
+    c->physicalBytes += physical;
+  }
+  dirty = true;
+  portEXIT_CRITICAL(&wearMux);
+}
+
+void noteFlashAppend(FlashWearFile file, uint32_t bytes, uint32_t sizeBefore) {
+  uint32_t physical;
+  if (onLittleFs()) {
+    // A closed file's last block is immutable, so its used part is copied.
+    physical = roundUp((sizeBefore % FLASH_BLOCK_BYTES) + bytes, LFS_PROG_BYTES) + LFS_COMMIT_BYTES;
+  } else {
+    physical = (spiffsPages(bytes) + 1) * SPIFFS_PAGE_BYTES;
+  }
+  record(file, WEAR_OP_APPEND, bytes, bytes, physical);
+}
+
+void noteFlashRewrite(FlashWearFile file, uint32_t logicalBytes, uint32_t bytes) {
+  uint32_t physical;
+  if (onLittleFs()) {
+    physical = roundUp(bytes, LFS_PROG_BYTES) + (2 * LFS_COMMIT_BYTES);
+  } else {
+    uint32_t pages = spiffsPages(bytes);
+    // Data and index pages, and the two renames of the .bak swap.
+    physical = (pages + 1 + (pages / SPIFFS_INDEX_SPAN) + 2) * SPIFFS_PAGE_BYTES;
+  }
+  record(file, WEAR_OP_REWRITE, logicalBytes, bytes, physical);
+}
+
+void noteFlashPatch(FlashWearFile file, uint32_t bytes, uint32_t offset, uint32_t fileSize) {
+  uint32_t physical;
+  if (onLittleFs()) {
+    // Blocks are back-linked, so everything from the touched block to the
+    // end of the file is written again.
+    uint32_t from = offset - (offset % FLASH_BLOCK_BYTES);
+    uint32_t end = offset + bytes > fileSize ? offset + bytes : fileSize;
+    physical = roundUp(end - from, LFS_PROG_BYTES) + LFS_COMMIT_BYTES;
+  } else {
+    uint32_t first = offset / SPIFFS_PAGE_DATA;
+    uint32_t last = (offset + (bytes ? bytes : 1) - 1) / SPIFFS_PAGE_DATA;
+    physical = (last - first + 2) * SPIFFS_PAGE_BYTES;
+  }
+  record(file, WEAR_OP_PATCH, bytes, bytes, physical);
+}
+
+void noteNvsWrite(uint16_t entries, uint32_t logicalBytes) {
+  // Values longer than an entry's 8 data bytes spill into further entries.
+  uint32_t spill = logicalBytes > (uint32_t)entries * 8 ? logicalBytes - ((uint32_t)entries * 8) : 0;
+  uint32_t physical = ((uint32_t)entries * NVS_ENTRY_BYTES) + roundUp(spill, NVS_ENTRY_BYTES);
+  record(WEAR_FILE_NVS, WEAR_OP_NVS, logicalBytes, logicalBytes, physical);
+}
+
+bool loadFlashWear() {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  File file = flashFs.open(WEAR_PATH, "r");
+  if (!file) return false;
+  WearFileHeader header;
+  FlashWearCounters files[WEAR_FILE_COUNT];
+  FlashWearCounters ops[WEAR_OP_COUNT];
+  uint32_t crc = 0;
+  bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            header.magic == WEAR_MAGIC && header.version == WEAR_VERSION &&
+            header.files == WEAR_FILE_COUNT && header.ops == WEAR_OP_COUNT &&
+            file.read((uint8_t *)files, sizeof(files)) == sizeof(files) &&
+            file.read((uint8_t *)ops, sizeof(ops)) == sizeof(ops) &&
+            file.read((uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+  file.close();
+  if (ok) {
+    uint32_t expected = crc32_le(0, (const uint8_t *)&header, sizeof(header));
+    expected = crc32_le(expected, (const uint8_t *)files, sizeof(files));
+    ok = crc == crc32_le(expected, (const uint8_t *)ops, sizeof(ops));
+  }
+  if (!ok) return false;
+
+  portENTER_CRITICAL(&wearMux);
+  // Writes made before the load (boot, migration) are added on top.
+  for (int i = 0; i < WEAR_FILE_COUNT; i++) {
+    fileCounters[i].ops += files[i].ops;
+    fileCounters[i].logicalBytes += files[i].logicalBytes;
+    fileCounters[i].fsBytes += files[i].fsBytes;
+    fileCounters[i].physicalBytes += files[i].physicalBytes;
+  }
+  for (int i = 0; i < WEAR_OP_COUNT; i++) {
+    opCounters[i].ops += ops[i].ops;
+    opCounters[i].logicalBytes += ops[i].logicalBytes;
+    opCounters[i].fsBytes += ops[i].fsBytes;
+    opCounters[i].physicalBytes += ops[i].physicalBytes;
+  }
+  trackedSeconds += header.trackedSeconds;
+  portEXIT_CRITICAL(&wearMux);
+  return true;
+}
+
+bool saveFlashWear() {
+  if (!storageReady()) return false;
+  WearFileHeader header = {WEAR_MAGIC, WEAR_VERSION, WEAR_FILE_COUNT, WEAR_OP_COUNT, 0};
+  FlashWearCounters files[WEAR_FILE_COUNT];
+  FlashWearCounters ops[WEAR_OP_COUNT];
+  portENTER_CRITICAL(&wearMux);
+  memcpy(files, fileCounters, sizeof(files));
+  memcpy(ops, opCounters, sizeof(ops));
+  header.trackedSeconds = trackedSeconds;
+  dirty = false;
+  portEXIT_CRITICAL(&wearMux);
+  uint32_t crc = crc32_le(0, (const uint8_t *)&header, sizeof(header));
+  crc = crc32_le(crc, (const uint8_t *)files, sizeof(files));
+  crc = crc32_le(crc, (const uint8_t *)ops, sizeof(ops));
+
+  StorageLock lock;
+  File file = flashFs.open(WEAR_TMP_PATH, "w");
+  if (!file) return false;
+  bool ok = file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            file.write((const uint8_t *)files, sizeof(files)) == sizeof(files) &&
+            file.write((const uint8_t *)ops, sizeof(ops)) == sizeof(ops) &&
+            file.write((const uint8_t *)&crc, sizeof(crc)) == sizeof(crc);
+  file.close();
+  if (!ok) {
+    flashFs.remove(WEAR_TMP_PATH);
+    return false;
+  }
+  uint32_t size = sizeof(header) + sizeof(files) + sizeof(ops) + sizeof(crc);
+  noteFlashRewrite(WEAR_FILE_OTHER, size, size);
+  return replaceFileAtomic(WEAR_TMP_PATH, WEAR_PATH);
+}
+
+void serviceFlashWear(uint32_t nowMs) {
+  if (lastServiceMs == 0) {
+    lastServiceMs = nowMs;
+    lastSaveMs = nowMs;
+    return;
+  }
+  uint32_t elapsed = trackedRemainderMs + (nowMs - lastServiceMs);
+  lastServiceMs = nowMs;
+  portENTER_CRITICAL(&wearMux);
+  trackedSeconds += elapsed / 1000;
+  bool due = dirty;
+  portEXIT_CRITICAL(&wearMux);
+  trackedRemainderMs = elapsed % 1000;
+  if (due && nowMs - lastSaveMs >= SAVE_INTERVAL_MS) {
+    lastSaveMs = nowMs;
+    queueFlashWearSave();
+  }
+}
+
+static void addCounters(FlashWearCounters &sum, const FlashWearCounters &c) {
+  sum.ops += c.ops;
+  sum.logicalBytes += c.logicalBytes;
+  sum.fsBytes += c.fsBytes;
+  sum.physicalBytes += c.physicalBytes;
+}
+
+static uint32_t lifetimeDays(uint64_t capacity, uint64_t used, uint64_t perDay) {
+  uint64_t budget = capacity * FLASH_ENDURANCE_CYCLES;
+  if (perDay == 0 || used >= budget) return 0;
+  uint64_t days = (budget - used) / perDay;
+  return days > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t)days;
+}
+
+void getFlashWear(FlashWear &wear) {
+  wear = FlashWear();
+  portENTER_CRITICAL(&wearMux);
+  memcpy(wear.files, fileCounters, sizeof(wear.files));
+  memcpy(wear.ops, opCounters, sizeof(wear.ops));
+  wear.trackedSeconds = trackedSeconds;
+  portEXIT_CRITICAL(&wearMux);
+
+  for (int i = 0; i < WEAR_FILE_COUNT; i++) addCounters(wear.total, wear.files[i]);
+  uint64_t nvsPhysical = wear.files[WEAR_FILE_NVS].physicalBytes;
+  uint64_t dataPhysical = wear.total.physicalBytes - nvsPhysical;
+  uint64_t capacity = flashFsTotalBytes();
+  if (capacity > 0) {
+    wear.dataWearPct = (float)((double)dataPhysical * 100.0 / ((double)capacity * FLASH_ENDURANCE_CYCLES));
+  }
+  wear.nvsWearPct =
+      (float)((double)nvsPhysical * 100.0 / ((double)NVS_PARTITION_BYTES * FLASH_ENDURANCE_CYCLES));
+  if (wear.trackedSeconds < 3600) return;
+  uint64_t dataPerDay = (dataPhysical * 86400ULL) / wear.trackedSeconds;
+  uint64_t nvsPerDay = (nvsPhysical * 86400ULL) / wear.trackedSeconds;
+  wear.physicalPerDay = (uint32_t)(dataPerDay + nvsPerDay);
+  wear.dataLifetimeDays = lifetimeDays(capacity, dataPhysical, dataPerDay);
+  wear.nvsLifetimeDays = lifetimeDays(NVS_PARTITION_BYTES, nvsPhysical, nvsPerDay);
+}
+
+static void printCountersRow(Print &out, const char *name, const FlashWearCounters &c,
+                             uint32_t trackedSeconds) {
+  uint32_t perDay = trackedSeconds >= 3600
+                        ? (uint32_t)((c.physicalBytes * 86400ULL) / trackedSeconds)
+                        : 0;
+  float amp = c.logicalBytes ? (float)c.physicalBytes / (float)c.logicalBytes : 0.0f;
+  out.printf("%-10s %8lu %11llu %11llu %11llu %7.1f %10lu\n", name, (unsigned long)c.ops,
+             (unsigned long long)c.logicalBytes, (unsigned long long)c.fsBytes,
+             (unsigned long long)c.physicalBytes, amp, (unsigned long)perDay);
+}
+
+void printFlashWearTo(Print &out) {
+  FlashWear wear;
+  getFlashWear(wear);
+  out.println("\n=== FLASH WEAR ===");
+  out.printf("Tracked %lu h on %s\n", (unsigned long)(wear.trackedSeconds / 3600),
+             flashFsName(flashFsBackend()));
+  out.println("File           ops     logical          fs    physical     amp  phys/day");
+  for (int i = 0; i < WEAR_FILE_COUNT; i++) {
+    printCountersRow(out, FILE_NAMES[i], wear.files[i], wear.trackedSeconds);
+  }
+  out.println("Op");
+  for (int i = 0; i < WEAR_OP_COUNT; i++) {
+    printCountersRow(out, OP_NAMES[i], wear.ops[i], wear.trackedSeconds);
+  }
+  printCountersRow(out, "total", wear.total, wear.trackedSeconds);
+  out.printf("Data wear %.4f%%, %lu days left;  NVS wear %.4f%%, %lu days left\n",
+             wear.dataWearPct, (unsigned long)wear.dataLifetimeDays, wear.nvsWearPct,
+             (unsigned long)wear.nvsLifetimeDays);
+  out.println("==================\n");
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Counts what each storage path writes to flash. Three figures per write:
+//   logical  - new data the feature meant to record (a day row, a leak event),
+//   fs       - bytes handed to the filesystem, i.e. the whole rewritten file,
+//   physical - an estimate of what the backend programs for them: LittleFS
+//              copies the tail block on append and everything from the
+//              touched block on in-place writes; SPIFFS writes whole pages
+//              plus an index page; NVS writes 32-byte entries.
+// Maintenance rewrites (retention, archiving) record no logical bytes, so
+// their cost shows up as pure amplification. The day snapshot rewrites
+// usage.csv for one changed row once per SNAPSHOT_INTERVAL_MS (main.cpp,
+// 30 min, so 48 times a day).
+// Counters are kept in /wear.bin and saved hourly; up to an hour is lost on
+// a reset.
+enum FlashWearFile : uint8_t {
+  WEAR_FILE_USAGE,
+  WEAR_FILE_INTERVALS,
+  WEAR_FILE_LEAKS,
+  WEAR_FILE_CHANNELS,
+  WEAR_FILE_ARCHIVE,
+  WEAR_FILE_BASELINE,
+  WEAR_FILE_CONFIG,
+  WEAR_FILE_TELEMETRY,
+  WEAR_FILE_NVS,
+  // Benchmark, wear counters, fs_bench.csv.
+  WEAR_FILE_OTHER,
+  WEAR_FILE_COUNT
+};
+
+enum FlashWearOp : uint8_t {
+  WEAR_OP_APPEND,
+  // Whole file through a staging copy.
+  WEAR_OP_REWRITE,
+  // In place at an offset.
+  WEAR_OP_PATCH,
+  WEAR_OP_NVS,
+  WEAR_OP_COUNT
+};
+
+struct FlashWearCounters {
+  uint64_t ops;
+  uint64_t logicalBytes;
+  uint64_t fsBytes;
+  uint64_t physicalBytes;
+};
+
+struct FlashWear {
+  FlashWearCounters files[WEAR_FILE_COUNT];
+  FlashWearCounters ops[WEAR_OP_COUNT];
+  FlashWearCounters total;
+  // Time the counters cover, across reboots.
+  uint32_t trackedSeconds;
+  // Erase cycles used, in percent of the rated endurance, for the data
+  // partition and the NVS partition.
+  float dataWearPct;
+  float nvsWearPct;
+  // Physical bytes per day at the rate seen so far, and the days left at
+  // that rate; 0 until an hour has been tracked, or with no writes.
+  uint32_t physicalPerDay;
+  uint32_t dataLifetimeDays;
+  uint32_t nvsLifetimeDays;
+};
+
+void noteFlashAppend(FlashWearFile file, uint32_t bytes, uint32_t sizeBefore);
+void noteFlashRewrite(FlashWearFile file, uint32_t logicalBytes, uint32_t bytes);
+void noteFlashPatch(FlashWearFile file, uint32_t bytes, uint32_t offset, uint32_t fileSize);
+// entries: keys put, each at least one 32-byte entry.
+void noteNvsWrite(uint16_t entries, uint32_t logicalBytes);
+
+bool loadFlashWear();
+// Loop: advances the tracked time and queues a save once an hour.
+void serviceFlashWear(uint32_t nowMs);
+// Storage writer only.
+bool saveFlashWear();
+void getFlashWear(FlashWear &wear);
+const char *flashWearFileName(FlashWearFile file);
+const char *flashWearOpName(FlashWearOp op);
+void printFlashWearTo(Print &out);
@@ -0,0 +1,199 @@
+#include "flow_series.h"
+
+// A 1 s tick that lands a second late leaves one or two empty slots; fill
+// those with the new value instead of reporting a gap.
+static const uint32_t JITTER_FILL_SLOTS = 2;
+
+// 1 h at 1 s, 24 h at 1 min, 31 days at 15 min, 92 days at 1 h (~20 KB).
+static uint16_t level0[3600];
+static uint16_t level1[1440];
+static uint16_t level2[31 * 96];
+static uint16_t level3[92 * 24];
+
+struct SeriesLevel {
+  uint16_t *buf;
+  uint32_t capacity;
+  uint32_t resSec;
+  // Slot = timestamp / resSec. head is the ring position of lastSlot.
+  uint32_t lastSlot;
+  uint32_t head;
+  uint32_t filled;
+  bool started;
+  // Running sum of this level's valid samples for the parent's current slot.
+  uint32_t accSum;
+  uint32_t accCount;
+};
+
+static SeriesLevel levels[FLOW_SERIES_LEVELS] = {
+    {level0, sizeof(level0) / sizeof(level0[0]), 1, 0, 0, 0, false, 0, 0},
+    {level1, sizeof(level1) / sizeof(level1[0]), 60, 0, 0, 0, false, 0, 0},
+    {level2, sizeof(level2) / sizeof(level2[0]), 900, 0, 0, 0, false, 0, 0},
+    {level3, sizeof(level3) / sizeof(level3[0]), 3600, 0, 0, 0, false, 0, 0},
+};
+
+static uint16_t quantize(float flowLpm) {
+  if (flowLpm <= 0.0f) return 0;
+  float scaled = (flowLpm * FLOW_SERIES_SCALE) + 0.5f;
+  if (scaled >= (float)(FLOW_SERIES_NO_DATA - 1)) return FLOW_SERIES_NO_DATA - 1;
+  return (uint16_t)scaled;
+}
+
+static uint32_t parentSlot(int level, uint32_t slot) {
+  return (uint32_t)(((uint64_t)slot * levels[level].resSec) / levels[level + 1].resSec);
+}
+
+static void flushToParent(int level);
+
+static void pushSample(int level, uint32_t slot, uint16_t value) {
+  SeriesLevel &l = levels[level];
+  uint32_t written = 1;
+  if (!l.started) {
+    l.started = true;
+    l.lastSlot = slot;
+    l.head = 0;
+    l.filled = 1;
+    l.buf[0] = value;
+  } else if (slot < l.lastSlot) {
+    // Clock went backwards; drop until it catches up.
+    return;
+  } else if (slot == l.lastSlot) {
+    l.buf[l.head] = value;
+  } else {
+    bool hasParent = level + 1 < FLOW_SERIES_LEVELS;
+    if (hasParent && parentSlot(level, slot) != parentSlot(level, l.lastSlot)) {
+      flushToParent(level);
+    }
+    uint32_t gap = slot - l.lastSlot - 1;
+    uint16_t fill = FLOW_SERIES_NO_DATA;
+    if (gap <= JITTER_FILL_SLOTS) {
+      fill = value;
+      written = gap + 1;
+    }
+    uint32_t steps = (gap >= l.capacity) ? l.capacity : gap + 1;
+    for (uint32_t i = 0; i < steps; i++) {
+      l.head = (l.head + 1) % l.capacity;
+      l.buf[l.head] = (i + 1 == steps) ? value : fill;
+    }
+    l.filled = (l.filled + steps > l.capacity) ? l.capacity : l.filled + steps;
+    l.lastSlot = slot;
+  }
+  if (value != FLOW_SERIES_NO_DATA && level + 1 < FLOW_SERIES_LEVELS) {
+    l.accSum += (uint32_t)value * written;
+    l.accCount += written;
+  }
+}
+
+static void flushToParent(int level) {
+  SeriesLevel &l = levels[level];
+  uint16_t mean = FLOW_SERIES_NO_DATA;
+  if (l.accCount > 0) {
+    mean = (uint16_t)((l.accSum + (l.accCount / 2)) / l.accCount);
+  }
+  uint32_t slot = parentSlot(level, l.lastSlot);
+  l.accSum = 0;
+  l.accCount = 0;
+  pushSample(level + 1, slot, mean);
+}
+
+void feedFlowSeries(uint32_t ts, float flowLpm) {
+  pushSample(0, ts / levels[0].resSec, quantize(flowLpm));
+}
+
+// First child slot of a parent slot; the resolutions divide evenly.
+static uint32_t firstChildSlot(int level, uint32_t parent) {
+  return parent * (levels[level + 1].resSec / levels[level].resSec);
+}
+
+static uint16_t slotValue(const SeriesLevel &l, uint32_t slot) {
+  return l.buf[(l.head + l.capacity - (l.lastSlot - slot)) % l.capacity];
+}
+
+// Sums the valid samples in [from, to] of the level's ring.
+static void sumSlots(const SeriesLevel &l, uint32_t from, uint32_t to, uint32_t &sum,
+                     uint32_t &count) {
+  sum = 0;
+  count = 0;
+  for (uint32_t slot = from; slot <= to; slot++) {
+    uint16_t v = slotValue(l, slot);
+    if (v == FLOW_SERIES_NO_DATA) continue;
+    sum += v;
+    count++;
+  }
+}
+
+void rebaseFlowSeries(uint32_t offsetSec) {
+  // Samples keep their ring positions; only the slot they are filed under
+  // moves. Coarse levels round the shift down to whole slots, so a level's
+  // samples not yet flushed to its parent can now straddle a parent boundary.
+  uint32_t pendingFrom[FLOW_SERIES_LEVELS] = {};
+  for (int i = 0; i < FLOW_SERIES_LEVELS; i++) {
+    SeriesLevel &l = levels[i];
+    uint32_t shift = offsetSec / l.resSec;
+    if (l.started && i + 1 < FLOW_SERIES_LEVELS) {
+      pendingFrom[i] = firstChildSlot(i, parentSlot(i, l.lastSlot)) + shift;
+    }
+    l.lastSlot += shift;
+  }
+  // Top down, so a parent already sums its own pending run when a child
+  // flushes into it.
+  for (int i = FLOW_SERIES_LEVELS - 2; i >= 0; i--) {
+    SeriesLevel &l = levels[i];
+    if (!l.started) continue;
+    uint32_t oldest = l.lastSlot - (l.filled - 1);
+    uint32_t from = pendingFrom[i] > oldest ? pendingFrom[i] : oldest;
+    uint32_t curStart = firstChildSlot(i, parentSlot(i, l.lastSlot));
+    if (curStart < from) curStart = from;
+    // The part that moved into the previous parent slot closes that slot.
+    if (from < curStart) {
+      uint32_t sum = 0;
+      uint32_t count = 0;
+      sumSlots(l, from, curStart - 1, sum, count);
+      uint16_t mean = count > 0 ? (uint16_t)((sum + (count / 2)) / count) : FLOW_SERIES_NO_DATA;
+      pushSample(i + 1, parentSlot(i, curStart - 1), mean);
+    }
+    sumSlots(l, curStart, l.lastSlot, l.accSum, l.accCount);
+  }
+}
+
+int flowSeriesLevel(uint32_t resSec) {
+  for (int i = 0; i < FLOW_SERIES_LEVELS; i++) {
+    if (levels[i].resSec == resSec) return i;
+  }
+  return -1;
+}
+
+uint32_t flowSeriesResolution(int level) {
+  return levels[level].resSec;
+}
+
+uint32_t flowSeriesCapacity(int level) {
+  return levels[level].capacity;
+}
+
+int flowSeriesSpans(int level, uint32_t fromTs, uint32_t toTs, FlowSeriesSpan spans[2],
+                    uint32_t &firstTs) {
+  const SeriesLevel &l = levels[level];
+  firstTs = 0;
+  if (!l.started || fromTs > toTs) return 0;
+  uint32_t oldest = l.lastSlot - (l.filled - 1);
+  uint32_t fromSlot = fromTs / l.resSec;
+  uint32_t toSlot = toTs / l.resSec;
+  if (fromSlot < oldest) fromSlot = oldest;
+  if (toSlot > l.lastSlot) toSlot = l.lastSlot;
+  if (fromSlot > toSlot) return 0;
+
+  uint32_t count = toSlot - fromSlot + 1;
+  uint32_t start = (l.head + l.capacity - (l.lastSlot - fromSlot)) % l.capacity;
+  firstTs = fromSlot * l.resSec;
+  uint32_t firstCount = l.capacity - start;
+  if (count <= firstCount) {
+    spans[0].data = l.buf + start;
+    spans[0].count = count;
+    return 1;
+  }
+  spans[0].data = l.buf + start;
+  spans[0].count = firstCount;
+  spans[1].data = l.buf;
+  spans[1].count = count - firstCount;
+  return 2;
+}
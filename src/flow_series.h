@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Fixed-memory flow history: the last hour at 1 s, a day at 1 min, a month at
+// 15 min and a quarter at 1 h. Only the 1 s level is fed; each coarser level
+// is the mean of its child, emitted when the child crosses a boundary.
+//
+// Samples are flow in 0.01 L/min as uint16; FLOW_SERIES_NO_DATA marks slots
+// nothing was recorded for (device off, clock jumps). Timestamps are epoch
+// seconds once the clock is valid and uptime seconds before that;
+// rebaseFlowSeries() moves the uptime history onto the wall clock.
+constexpr int FLOW_SERIES_LEVELS = 4;
+constexpr uint16_t FLOW_SERIES_NO_DATA = 0xFFFF;
+constexpr uint16_t FLOW_SERIES_SCALE = 100;
+
+struct FlowSeriesSpan {
+  const uint16_t *data;
+  size_t count;
+};
+
+void feedFlowSeries(uint32_t ts, float flowLpm);
+void rebaseFlowSeries(uint32_t offsetSec);
+
+// Level for a resolution in seconds, or -1 if there is none.
+int flowSeriesLevel(uint32_t resSec);
+uint32_t flowSeriesResolution(int level);
+uint32_t flowSeriesCapacity(int level);
+
+// Clamps [fromTs, toTs] to what the level holds and returns it as at most two
+// contiguous spans of ring memory. firstTs is the start of the first sample.
+int flowSeriesSpans(int level, uint32_t fromTs, uint32_t toTs, FlowSeriesSpan spans[2],
+                    uint32_t &firstTs);
@@ -0,0 +1,436 @@
+#include "history.h"
+
+#include <string.h>
+
+#include "app_state.h"
+#include "flash_fs.h"
+#include "interval_archive.h"
+#include "interval_coalescer.h"
+#include "storage.h"
+#include "usage_bins.h"
+
+static const uint32_t HISTORY_BLOCK_SIZE = 4096;
+static const size_t HISTORY_SCAN_SIZE = 1024;
+
+struct HistoryBlock {
+  uint32_t offset;
+  uint32_t minKey;
+  uint32_t maxKey;
+};
+
+struct HistoryIndex {
+  HistoryBlock *blocks;
+  int count;
+  int capacity;
+  // File bytes covered; the last block ends here.
+  uint32_t indexedSize;
+};
+
+static HistoryIndex usageIndex = {};
+static HistoryIndex intervalsIndex = {};
+
+static HistoryIndex *indexFor(const char *path) {
+  if (strcmp(path, USAGE_CSV_PATH) == 0) return &usageIndex;
+  if (strcmp(path, INTERVALS_CSV_PATH) == 0) return &intervalsIndex;
+  return nullptr;
+}
+
+static uint32_t blockEnd(const HistoryIndex &index, int i) {
+  return (i + 1 < index.count) ? index.blocks[i + 1].offset : index.indexedSize;
+}
+
+static void truncateIndex(HistoryIndex &index, int count) {
+  if (count < 0) count = 0;
+  if (count >= index.count) return;
+  index.count = count;
+  index.indexedSize = count > 0 ? index.blocks[count].offset : 0;
+}
+
+void noteHistoryRewrite(const char *path, uint32_t fromDayKey) {
+  HistoryIndex *index = indexFor(path);
+  if (!index) return;
+  StorageLock lock;
+  if (fromDayKey == 0) {
+    truncateIndex(*index, 0);
+    return;
+  }
+  // A day only present as new rows at the end leaves the last block
+  // partial, so that one is rescanned either way.
+  int keep = index->count - 1;
+  for (int i = 0; i < index->count; i++) {
+    if (index->blocks[i].minKey <= fromDayKey && fromDayKey <= index->blocks[i].maxKey) {
+      keep = i;
+      break;
+    }
+  }
+  truncateIndex(*index, keep);
+}
+
+static bool lineDayKey(const char *line, size_t len, uint32_t &key) {
+  if (len < 10 || line[4] != '-' || line[7] != '-') return false;
+  uint32_t v[3] = {0, 0, 0};
+  static const int starts[3] = {0, 5, 8};
+  static const int widths[3] = {4, 2, 2};
+  for (int f = 0; f < 3; f++) {
+    for (int i = 0; i < widths[f]; i++) {
+      char c = line[starts[f] + i];
+      if (c < '0' || c > '9') return false;
+      v[f] = (v[f] * 10) + (uint32_t)(c - '0');
+    }
+  }
+  key = (v[0] * 10000) + (v[1] * 100) + v[2];
+  return true;
+}
+
+static void indexLine(HistoryIndex &index, uint32_t offset, uint32_t key) {
+  if (index.count > 0 && offset - index.blocks[index.count - 1].offset < HISTORY_BLOCK_SIZE) {
+    HistoryBlock &block = index.blocks[index.count - 1];
+    if (key < block.minKey) block.minKey = key;
+    if (key > block.maxKey) block.maxKey = key;
+    return;
+  }
+  if (index.count == index.capacity) {
+    int capacity = index.capacity ? index.capacity * 2 : 64;
+    HistoryBlock *grown =
+        (HistoryBlock *)realloc(index.blocks, sizeof(HistoryBlock) * capacity);
+    if (!grown) return;
+    index.blocks = grown;
+    index.capacity = capacity;
+  }
+  index.blocks[index.count++] = {offset, key, key};
+}
+
+// Extends the index from its last block to the end of the file. Only the
+// first ten bytes of each line are looked at.
+static bool refreshIndex(HistoryIndex &index, File &file) {
+  uint32_t size = (uint32_t)file.size();
+  if (size == index.indexedSize) return true;
+  if (size < index.indexedSize) truncateIndex(index, 0);
+  // The last block may have been cut short by the end of the file.
+  truncateIndex(index, index.count - 1);
+
+  char *buf = (char *)malloc(HISTORY_SCAN_SIZE);
+  if (!buf) return false;
+  uint32_t pos = index.indexedSize;
+  file.seek(pos);
+  uint32_t lineStart = pos;
+  char head[10];
+  size_t headLen = 0;
+  while (pos < size) {
+    size_t got = file.read((uint8_t *)buf, HISTORY_SCAN_SIZE);
+    if (got == 0) break;
+    const char *p = buf;
+    const char *end = buf + got;
+    while (p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      const char *stop = nl ? nl : end;
+      size_t take = (size_t)(stop - p);
+      if (headLen < sizeof(head)) {
+        size_t n = take < sizeof(head) - headLen ? take : sizeof(head) - headLen;
+        memcpy(head + headLen, p, n);
+        headLen += n;
+      }
+      if (!nl) break;
+      uint32_t key = 0;
+      if (lineDayKey(head, headLen, key)) indexLine(index, lineStart, key);
+      lineStart = pos + (uint32_t)(nl + 1 - buf);
+      headLen = 0;
+      p = nl + 1;
+    }
+    pos += (uint32_t)got;
+  }
+  uint32_t key = 0;
+  if (headLen > 0 && lineDayKey(head, headLen, key)) indexLine(index, lineStart, key);
+  index.indexedSize = pos;
+  free(buf);
+  return true;
+}
+
+// Howard Hinnant's days_from_civil / civil_from_days.
+int32_t daysFromDayKey(uint32_t key) {
+  int y = (int)(key / 10000);
+  unsigned m = (key / 100) % 100;
+  unsigned d = key % 100;
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int32_t)doe - 719468;
+}
+
+uint32_t dayKeyFromDays(int32_t z) {
+  z += 719468;
+  int era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = (unsigned)(z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int y = (int)yoe + era * 400;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  unsigned d = doy - (153 * mp + 2) / 5 + 1;
+  unsigned m = mp < 10 ? mp + 3 : mp - 9;
+  y += m <= 2;
+  return (uint32_t)(y * 10000) + (m * 100) + d;
+}
+
+bool parseHistoryDate(const String &text, uint32_t &dayKey) {
+  uint32_t key = 0;
+  if (text.length() != 10 || !lineDayKey(text.c_str(), 10, key)) return false;
+  if (key < 19700101 || dayKeyFromDays(daysFromDayKey(key)) != key) return false;
+  dayKey = key;
+  return true;
+}
+
+// A block read whole into RAM, so lines can be walked without the file.
+class BlockReader {
+public:
+  BlockReader(File &file, HistoryIndex &index) : file(file), index(index) {}
+  ~BlockReader() { free(buf); }
+
+  bool load(int i) {
+    if (i == loaded) return true;
+    uint32_t offset = index.blocks[i].offset;
+    size_t size = blockEnd(index, i) - offset;
+    if (size > capacity) {
+      char *grown = (char *)realloc(buf, size);
+      if (!grown) return false;
+      buf = grown;
+      capacity = size;
+    }
+    file.seek(offset);
+    len = file.read((uint8_t *)buf, size);
+    loaded = i;
+    pos = 0;
+    return true;
+  }
+
+  void rewind() { pos = 0; }
+
+  bool next(const char *&line, size_t &lineLen) {
+    while (pos < len) {
+      const char *start = buf + pos;
+      const char *nl = (const char *)memchr(start, '\n', len - pos);
+      size_t n = nl ? (size_t)(nl - start) : len - pos;
+      pos += n + (nl ? 1 : 0);
+      if (n > 0 && start[n - 1] == '\r') n--;
+      if (n == 0) continue;
+      line = start;
+      lineLen = n;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  File &file;
+  HistoryIndex &index;
+  char *buf = nullptr;
+  size_t capacity = 0;
+  size_t len = 0;
+  size_t pos = 0;
+  int loaded = -1;
+};
+
+struct HistoryDay {
+  bool found;
+  int8_t wday;
+  uint32_t seconds;
+  float liters;
+  float bins[USAGE_BINS_PER_DAY];
+};
+
+static void printDate(Print &out, uint32_t key) {
+  out.printf("\"%04lu-%02lu-%02lu\"", (unsigned long)(key / 10000),
+             (unsigned long)((key / 100) % 100), (unsigned long)(key % 100));
+}
+
+static void scanDayIntervals(BlockReader &reader, const HistoryIndex &index, uint32_t key,
+                             HistoryIntervalFn fn, void *ctx) {
+  for (int i = 0; i < index.count; i++) {
+    if (key < index.blocks[i].minKey || key > index.blocks[i].maxKey) continue;
+    if (!reader.load(i)) break;
+    reader.rewind();
+    const char *line = nullptr;
+    size_t len = 0;
+    while (reader.next(line, len)) {
+      uint32_t lineKey = 0;
+      if (!lineDayKey(line, len, lineKey) || lineKey != key) continue;
+      int year = 0;
+      int month = 0;
+      int dayNum = 0;
+      int wday = 0;
+      DayInterval it;
+      if (parseIntervalLine(line, len, year, month, dayNum, wday, it)) fn(it, ctx);
+    }
+  }
+}
+
+bool forEachCsvInterval(uint32_t dayKey, HistoryIntervalFn fn, void *ctx) {
+  StorageLock lock;
+  File file = flashFs.open(INTERVALS_CSV_PATH, "r");
+  if (!file || !refreshIndex(intervalsIndex, file)) return false;
+  BlockReader reader(file, intervalsIndex);
+  scanDayIntervals(reader, intervalsIndex, dayKey, fn, ctx);
+  return true;
+}
+
+// Oldest and newest date the file has rows for; both 0 if none.
+static void indexedDayRange(const char *path, uint32_t &oldest, uint32_t &newest) {
+  oldest = 0;
+  newest = 0;
+  HistoryIndex &index = *indexFor(path);
+  StorageLock lock;
+  File file = flashFs.open(path, "r");
+  if (!file || !refreshIndex(index, file)) return;
+  for (int i = 0; i < index.count; i++) {
+    if (oldest == 0 || index.blocks[i].minKey < oldest) {
+      oldest = index.blocks[i].minKey;
+    }
+    if (index.blocks[i].maxKey > newest) newest = index.blocks[i].maxKey;
+  }
+}
+
+static uint32_t oldestIndexedDay(const char *path) {
+  uint32_t oldest = 0;
+  uint32_t newest = 0;
+  indexedDayRange(path, oldest, newest);
+  return oldest;
+}
+
+uint32_t oldestCsvIntervalDay() {
+  return oldestIndexedDay(INTERVALS_CSV_PATH);
+}
+
+uint32_t oldestCsvUsageDay() {
+  return oldestIndexedDay(USAGE_CSV_PATH);
+}
+
+uint32_t newestCsvIntervalDay() {
+  uint32_t oldest = 0;
+  uint32_t newest = 0;
+  indexedDayRange(INTERVALS_CSV_PATH, oldest, newest);
+  return newest;
+}
+
+static void appendIntervalJson(const DayInterval &it, void *ctx) {
+  String &json = *(String *)ctx;
+  if (json.length() > 0) json += ",";
+  char row[112];
+  snprintf(row, sizeof(row),
+           "{\"start_sec\":%lu,\"end_sec\":%lu,\"liters\":%.3f,\"gaps\":%u,\"peak_lpm\":%.2f}",
+           (unsigned long)it.startSec, (unsigned long)it.endSec, it.liters,
+           (unsigned)it.mergedGaps, intervalPeakLpm(it));
+  json += row;
+}
+
+// Archived months first, then whatever intervals.csv still holds for the
+// day. The rows are gathered under the storage lock and sent after it is
+// released, so a slow client never holds up the writer task; taking both
+// under one lock keeps an archive run from moving rows between the two.
+static void writeDayIntervals(Print &out, uint32_t key) {
+  String json;
+  {
+    StorageLock lock;
+    forEachArchivedInterval(key, appendIntervalJson, &json);
+    forEachCsvInterval(key, appendIntervalJson, &json);
+  }
+  out.print(",\"intervals\":[");
+  out.print(json);
+  out.print("]");
+}
+
+// Collects the page's days under the storage lock, so a snapshot cannot
+// shift the blocks under us; the caller writes them out once it is released.
+static void loadHistoryDays(const HistoryQuery &query, int32_t fromDay, uint32_t pageEndKey,
+                            HistoryDay *days, int dayCount) {
+  StorageLock lock;
+  File usage = flashFs.open(USAGE_CSV_PATH, "r");
+  if (usage && refreshIndex(usageIndex, usage)) {
+    BlockReader reader(usage, usageIndex);
+    for (int i = 0; i < usageIndex.count; i++) {
+      const HistoryBlock &block = usageIndex.blocks[i];
+      if (block.maxKey < query.fromKey || block.minKey > pageEndKey) continue;
+      if (!reader.load(i)) break;
+      const char *line = nullptr;
+      size_t len = 0;
+      while (reader.next(line, len)) {
+        uint32_t key = 0;
+        if (!lineDayKey(line, len, key) || key < query.fromKey || key > pageEndKey) continue;
+        int32_t slot = daysFromDayKey(key) - fromDay;
+        if (slot < 0 || slot >= dayCount) continue;
+        int year = 0;
+        int month = 0;
+        int dayNum = 0;
+        int wday = 0;
+        uint32_t seconds = 0;
+        float liters = 0.0f;
+        float bins[USAGE_BINS_PER_DAY];
+        if (!parseUsageLine(line, len, year, month, dayNum, wday, seconds, liters,
+                            query.bins ? bins : nullptr)) {
+          continue;
+        }
+        // A later row for the same date wins, as in loadUsageFromCsv().
+        HistoryDay &day = days[slot];
+        day.found = true;
+        day.wday = (int8_t)wday;
+        day.seconds = seconds;
+        day.liters = liters;
+        if (query.bins) memcpy(day.bins, bins, sizeof(day.bins));
+      }
+    }
+  }
+}
+
+bool writeHistoryJson(const HistoryQuery &query, Print &out) {
+  if (!storageReady()) return false;
+  int32_t fromDay = daysFromDayKey(query.fromKey);
+  int32_t toDay = daysFromDayKey(query.toKey);
+  if (toDay < fromDay) return false;
+  int limit = query.limitDays;
+  if (limit < 1) limit = 1;
+  if (limit > HISTORY_MAX_DAYS) limit = HISTORY_MAX_DAYS;
+  int32_t pageEndDay = fromDay + limit - 1;
+  if (pageEndDay > toDay) pageEndDay = toDay;
+  int dayCount = (int)(pageEndDay - fromDay + 1);
+  uint32_t pageEndKey = dayKeyFromDays(pageEndDay);
+
+  HistoryDay *days = (HistoryDay *)calloc(dayCount, sizeof(HistoryDay));
+  if (!days) return false;
+
+  loadHistoryDays(query, fromDay, pageEndKey, days, dayCount);
+
+  out.print("{\"from\":");
+  printDate(out, query.fromKey);
+  out.print(",\"to\":");
+  printDate(out, pageEndKey);
+  out.print(",\"days\":[");
+  bool first = true;
+  for (int i = 0; i < dayCount; i++) {
+    const HistoryDay &day = days[i];
+    if (!day.found) continue;
+    uint32_t key = dayKeyFromDays(fromDay + i);
+    if (!first) out.print(",");
+    first = false;
+    out.print("{\"date\":");
+    printDate(out, key);
+    out.printf(",\"wday\":%d,\"total_sec\":%lu,\"total_l\":%.3f", day.wday,
+               (unsigned long)day.seconds, day.liters);
+    if (query.bins) {
+      String bins;
+      appendBinsJson(bins, day.bins);
+      out.print(",\"bins_l\":");
+      out.print(bins);
+    }
+    if (query.intervals) writeDayIntervals(out, key);
+    out.print("}");
+  }
+  out.print("]");
+  if (pageEndDay < toDay) {
+    out.print(",\"next\":");
+    printDate(out, dayKeyFromDays(pageEndDay + 1));
+  }
+  out.print("}");
+
+  free(days);
+  return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "app_state.h"
+
+// Date-range reads of usage.csv and intervals.csv. Each file has a sparse
+// index with one entry per ~4 KB block: the block's offset and the oldest and
+// newest date in it. A query only reads blocks whose dates overlap its range.
+// The files are mostly but not strictly sorted, because a snapshot moves its
+// day to the end. So blocks are matched by date span, not binary searched.
+static const int HISTORY_DEFAULT_DAYS = 31;
+static const int HISTORY_MAX_DAYS = 62;
+
+struct HistoryQuery {
+  uint32_t fromKey;  // yyyymmdd
+  uint32_t toKey;
+  int limitDays;
+  bool bins;
+  bool intervals;
+};
+
+// Called by storage with the lock held whenever a file is rewritten. Rows of
+// fromDayKey may have moved; everything before its first block is intact.
+// 0 drops the whole index.
+void noteHistoryRewrite(const char *path, uint32_t fromDayKey);
+
+bool parseHistoryDate(const String &text, uint32_t &dayKey);
+// Days since 1970-01-01 and back.
+int32_t daysFromDayKey(uint32_t key);
+uint32_t dayKeyFromDays(int32_t days);
+
+typedef void (*HistoryIntervalFn)(const DayInterval &row, void *ctx);
+// Calls fn for each intervals.csv row of the day, in file order.
+bool forEachCsvInterval(uint32_t dayKey, HistoryIntervalFn fn, void *ctx);
+// Oldest date intervals.csv / usage.csv has rows for; 0 if none.
+uint32_t oldestCsvIntervalDay();
+uint32_t oldestCsvUsageDay();
+// Newest date intervals.csv has rows for; 0 if none.
+uint32_t newestCsvIntervalDay();
+// Writes one page of at most limitDays calendar days, starting at fromKey,
+// as JSON. Days without a usage row are left out. "next" holds the first day
+// of the following page when the range goes on. Intervals of archived
+// months are decoded from their archive.
+bool writeHistoryJson(const HistoryQuery &query, Print &out);
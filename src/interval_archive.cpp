@@ -0,0 +1,646 @@
+#include "interval_archive.h"
+
+#include <math.h>
+#include <rom/crc.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app_state.h"
+#include "csv_reader.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "interval_coalescer.h"
+#include "storage.h"
+
+static const uint32_t ARCHIVE_MAGIC = 0x31415649;  // "IVA1"
+static const uint8_t ARCHIVE_VERSION = 1;
+static const uint32_t ARCHIVE_NO_DAY = 0xFFFFFFFFUL;
+static const char *ARCHIVE_TMP_PATH = "/iva.tmp";
+// Days in weekUsage can still be snapshotted; their month stays in the CSV.
+static const int ARCHIVE_KEEP_DAYS = 7;
+static const int ARCHIVE_MAX_MONTHS = 240;
+// Longest encoded row: eleven varints of at most five bytes.
+static const size_t ARCHIVE_ROW_MAX = 55;
+
+struct ArchiveFooter {
+  uint32_t dayOffset[31];
+  uint32_t payloadLen;
+  uint32_t rowCount;
+  uint32_t csvBytes;
+  // Pulses per liter * 1000 the pulse residuals were taken against.
+  uint32_t pplMilli;
+  uint16_t year;
+  uint8_t month;
+  uint8_t version;
+  // Over the payload and the footer up to here.
+  uint32_t crc;
+  uint32_t magic;
+};
+static_assert(sizeof(ArchiveFooter) == 152, "archive footer layout");
+
+// Months whose CRC checked out since boot, with the file size it was for.
+static const int VERIFIED_CACHE = 8;
+static uint32_t verifiedMonth[VERIFIED_CACHE];
+static uint32_t verifiedSize[VERIFIED_CACHE];
+static int verifiedNext = 0;
+
+// Rebuilt from the footers after each archive run.
+static IntervalArchiveStats cachedStats = {};
+static bool statsValid = false;
+
+static void archivePath(uint32_t monthKey, char *buf, size_t size) {
+  snprintf(buf, size, "/iva_%06lu.bin", (unsigned long)monthKey);
+}
+
+static uint32_t nextMonth(uint32_t monthKey) {
+  return (monthKey % 100 == 12) ? ((monthKey / 100) + 1) * 100 + 1 : monthKey + 1;
+}
+
+static size_t putVarint(uint8_t *out, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+static size_t putZigzag(uint8_t *out, int32_t v) {
+  return putVarint(out, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 35 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static bool getZigzag(const uint8_t *&p, const uint8_t *end, int32_t &v) {
+  uint32_t u = 0;
+  if (!getVarint(p, end, u)) return false;
+  v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+  return true;
+}
+
+static uint32_t fixedPoint(float value, float scale) {
+  return value > 0.0f ? (uint32_t)lroundf(value * scale) : 0;
+}
+
+static uint32_t predictedPulses(uint32_t litersCl, uint32_t pplMilli) {
+  return (uint32_t)((((uint64_t)litersCl * pplMilli) + 50000) / 100000);
+}
+
+static size_t encodeRow(uint8_t *out, const DayInterval &it, uint32_t prevEnd, uint32_t pplMilli) {
+  size_t n = 0;
+  n += putZigzag(out + n, (int32_t)(it.startSec - prevEnd));
+  n += putZigzag(out + n, (int32_t)(it.endSec - it.startSec));
+  uint32_t litersCl = fixedPoint(it.liters, 100.0f);
+  n += putVarint(out + n, litersCl);
+  bool hasStats = it.samples > 0;
+  n += putVarint(out + n, ((uint32_t)it.mergedGaps << 1) | (hasStats ? 1 : 0));
+  if (hasStats) {
+    int32_t peak = ((int32_t)it.peakClpm + 5) / 10;
+    int32_t mean = ((int32_t)it.meanClpm + 5) / 10;
+    int32_t low = ((int32_t)it.minClpm + 5) / 10;
+    n += putVarint(out + n, (uint32_t)peak);
+    n += putZigzag(out + n, peak - mean);
+    n += putZigzag(out + n, mean - low);
+    n += putVarint(out + n, it.sdClpm);
+    n += putZigzag(out + n, (int32_t)(it.samples - (it.endSec - it.startSec)));
+  }
+  n += putZigzag(out + n, (int32_t)(it.pulses - predictedPulses(litersCl, pplMilli)));
+  return n;
+}
+
+static bool decodeRow(const uint8_t *&p, const uint8_t *end, uint32_t prevEnd, uint32_t pplMilli,
+                      DayInterval &it) {
+  it = DayInterval();
+  int32_t startDelta = 0;
+  int32_t duration = 0;
+  uint32_t litersCl = 0;
+  uint32_t flags = 0;
+  if (!getZigzag(p, end, startDelta) || !getZigzag(p, end, duration) ||
+      !getVarint(p, end, litersCl) || !getVarint(p, end, flags)) {
+    return false;
+  }
+  it.startSec = prevEnd + (uint32_t)startDelta;
+  it.endSec = it.startSec + (uint32_t)duration;
+  it.liters = (float)litersCl / 100.0f;
+  it.mergedGaps = (uint16_t)(flags >> 1);
+  if (flags & 1) {
+    uint32_t peak = 0;
+    int32_t peakToMean = 0;
+    int32_t meanToMin = 0;
+    uint32_t sd = 0;
+    int32_t samplesDelta = 0;
+    if (!getVarint(p, end, peak) || !getZigzag(p, end, peakToMean) ||
+        !getZigzag(p, end, meanToMin) || !getVarint(p, end, sd) ||
+        !getZigzag(p, end, samplesDelta)) {
+      return false;
+    }
+    int32_t mean = (int32_t)peak - peakToMean;
+    setIntervalStats(it, (uint32_t)duration + (uint32_t)samplesDelta,
+                     (float)(mean - meanToMin) / 10.0f, (float)peak / 10.0f,
+                     (float)mean / 10.0f, (float)sd / 100.0f);
+  }
+  int32_t pulseResidual = 0;
+  if (!getZigzag(p, end, pulseResidual)) return false;
+  it.pulses = predictedPulses(litersCl, pplMilli) + (uint32_t)pulseResidual;
+  return true;
+}
+
+// Counts what printIntervalCsvRow() would have written.
+class CountingPrint : public Print {
+public:
+  size_t write(uint8_t) override {
+    count++;
+    return 1;
+  }
+  size_t write(const uint8_t *, size_t size) override {
+    count += size;
+    return size;
+  }
+  uint32_t count = 0;
+};
+
+typedef void (*ArchiveRowFn)(uint32_t dayKey, const DayInterval &row, void *ctx);
+static bool decodeMonth(uint32_t monthKey, int dayNum, ArchiveRowFn fn, void *ctx);
+
+// A span of an archived row, so a CSV row that was archived before its drop
+// from intervals.csv failed is not merged in twice.
+struct ArchivedSpan {
+  uint32_t startSec;
+  uint32_t endSec;
+};
+
+struct MonthEncoder {
+  File file;
+  uint32_t crc;
+  uint32_t pplMilli;
+  ArchiveFooter footer;
+  uint8_t *day;
+  size_t dayLen;
+  size_t dayCap;
+  uint32_t dayRows;
+  uint32_t prevEnd;
+  ArchivedSpan *spans;
+  size_t spanCount;
+  size_t spanCap;
+  int year;
+  int month;
+  int dayNum;
+  bool ok;
+};
+
+static void encodeRowInto(MonthEncoder &enc, const DayInterval &it) {
+  if (!enc.ok) return;
+  if (enc.dayLen + ARCHIVE_ROW_MAX > enc.dayCap) {
+    size_t cap = enc.dayCap ? enc.dayCap * 2 : 1024;
+    uint8_t *grown = (uint8_t *)realloc(enc.day, cap);
+    if (!grown) {
+      enc.ok = false;
+      return;
+    }
+    enc.day = grown;
+    enc.dayCap = cap;
+  }
+  enc.dayLen += encodeRow(enc.day + enc.dayLen, it, enc.prevEnd, enc.pplMilli);
+  enc.prevEnd = it.endSec;
+  enc.dayRows++;
+
+  CountingPrint counter;
+  printIntervalCsvRow(counter, enc.year, enc.month, enc.dayNum, 0, it);
+  enc.footer.csvBytes += counter.count;
+}
+
+static void encodeArchivedRow(uint32_t, const DayInterval &it, void *ctx) {
+  MonthEncoder &enc = *(MonthEncoder *)ctx;
+  if (!enc.ok) return;
+  if (enc.spanCount == enc.spanCap) {
+    size_t cap = enc.spanCap ? enc.spanCap * 2 : 32;
+    ArchivedSpan *grown = (ArchivedSpan *)realloc(enc.spans, cap * sizeof(ArchivedSpan));
+    if (!grown) {
+      enc.ok = false;
+      return;
+    }
+    enc.spans = grown;
+    enc.spanCap = cap;
+  }
+  enc.spans[enc.spanCount++] = {it.startSec, it.endSec};
+  encodeRowInto(enc, it);
+}
+
+static void countCsvRow(const DayInterval &, void *ctx) { (*(uint32_t *)ctx)++; }
+
+static void encodeCsvRow(const DayInterval &it, void *ctx) {
+  MonthEncoder &enc = *(MonthEncoder *)ctx;
+  for (size_t i = 0; i < enc.spanCount; i++) {
+    if (enc.spans[i].startSec == it.startSec && enc.spans[i].endSec == it.endSec) return;
+  }
+  encodeRowInto(enc, it);
+}
+
+static void encoderWrite(MonthEncoder &enc, const uint8_t *data, size_t len) {
+  if (!enc.ok) return;
+  if (enc.file.write(data, len) != len) {
+    enc.ok = false;
+    return;
+  }
+  enc.crc = crc32_le(enc.crc, data, len);
+  enc.footer.payloadLen += len;
+}
+
+// Writes the month's intervals.csv rows to its archive. An existing archive
+// is merged in ahead of them day by day, and left alone when the CSV has
+// nothing new for it; one that no longer decodes fails the run, so its CSV
+// rows are kept.
+static bool encodeMonth(uint32_t monthKey, const char *path) {
+  int32_t first = daysFromDayKey((monthKey * 100) + 1);
+  bool merge = flashFs.exists(path);
+  if (merge) {
+    uint32_t csvRows = 0;
+    for (int d = 0; d < 31; d++) {
+      uint32_t dayKey = dayKeyFromDays(first + d);
+      if (dayKey / 100 == monthKey) forEachCsvInterval(dayKey, countCsvRow, &csvRows);
+    }
+    if (csvRows == 0) return true;
+  }
+  MonthEncoder enc = {};
+  enc.ok = true;
+  enc.year = (int)(monthKey / 100);
+  enc.month = (int)(monthKey % 100);
+  enc.pplMilli = fixedPoint(config->pulsesPerLiter, 1000.0f);
+  enc.footer.pplMilli = enc.pplMilli;
+  enc.footer.year = (uint16_t)enc.year;
+  enc.footer.month = (uint8_t)enc.month;
+  enc.footer.version = ARCHIVE_VERSION;
+  enc.footer.magic = ARCHIVE_MAGIC;
+  flashFs.remove(ARCHIVE_TMP_PATH);
+  enc.file = flashFs.open(ARCHIVE_TMP_PATH, "w");
+  if (!enc.file) return false;
+
+  for (int d = 0; d < 31 && enc.ok; d++) {
+    enc.footer.dayOffset[d] = ARCHIVE_NO_DAY;
+    uint32_t dayKey = dayKeyFromDays(first + d);
+    if (dayKey / 100 != monthKey) continue;
+    enc.dayNum = d + 1;
+    enc.dayLen = 0;
+    enc.dayRows = 0;
+    enc.prevEnd = 0;
+    enc.spanCount = 0;
+    if (merge && !decodeMonth(monthKey, d + 1, encodeArchivedRow, &enc)) enc.ok = false;
+    if (!forEachCsvInterval(dayKey, encodeCsvRow, &enc)) enc.ok = false;
+    if (enc.dayRows == 0) continue;
+    uint8_t count[5];
+    enc.footer.dayOffset[d] = enc.footer.payloadLen;
+    encoderWrite(enc, count, putVarint(count, enc.dayRows));
+    encoderWrite(enc, enc.day, enc.dayLen);
+    enc.footer.rowCount += enc.dayRows;
+  }
+  free(enc.day);
+  free(enc.spans);
+
+  bool ok = enc.ok;
+  if (ok && enc.footer.rowCount > 0) {
+    enc.footer.crc = crc32_le(enc.crc, (const uint8_t *)&enc.footer, offsetof(ArchiveFooter, crc));
+    ok = enc.file.write((const uint8_t *)&enc.footer, sizeof(enc.footer)) == sizeof(enc.footer);
+  }
+  uint32_t size = (uint32_t)enc.file.position();
+  enc.file.close();
+  if (!ok || enc.footer.rowCount == 0) {
+    flashFs.remove(ARCHIVE_TMP_PATH);
+    return ok;
+  }
+  // Moves rows intervals.csv already paid for: no logical bytes.
+  noteFlashRewrite(WEAR_FILE_ARCHIVE, 0, size);
+  if (!merge) return flashFs.rename(ARCHIVE_TMP_PATH, path);
+  for (int i = 0; i < VERIFIED_CACHE; i++) {
+    if (verifiedMonth[i] == monthKey) verifiedMonth[i] = 0;
+  }
+  return replaceFileAtomic(ARCHIVE_TMP_PATH, path);
+}
+
+static bool monthInList(uint32_t monthKey, const uint32_t *months, int count) {
+  for (int i = 0; i < count; i++) {
+    if (months[i] == monthKey) return true;
+  }
+  return false;
+}
+
+static bool dropArchivedCsvRows(const uint32_t *months, int count) {
+  File in = flashFs.open(INTERVALS_CSV_PATH, "r");
+  if (!in) return true;
+  File out = flashFs.open("/intervals.tmp", "w");
+  if (!out) {
+    in.close();
+    return false;
+  }
+  CsvLineReader reader(in);
+  const char *line = nullptr;
+  size_t len = 0;
+  bool ok = true;
+  while (ok && reader.next(line, len)) {
+    int year = 0;
+    int month = 0;
+    int dayNum = 0;
+    CsvFields fields(line, len);
+    if (fields.takeDate(year, month, dayNum) &&
+        monthInList((uint32_t)((year * 100) + month), months, count)) {
+      continue;
+    }
+    ok = out.write((const uint8_t *)line, len) == len && out.write('\n') == 1;
+  }
+  // A buffer that could not be allocated reads as an empty file.
+  ok = ok && reader.ok();
+  in.close();
+  noteFlashRewrite(WEAR_FILE_INTERVALS, 0, (uint32_t)out.position());
+  out.close();
+  if (!ok) {
+    flashFs.remove("/intervals.tmp");
+    return false;
+  }
+  return replaceFileAtomic("/intervals.tmp", INTERVALS_CSV_PATH);
+}
+
+bool archiveClosedIntervalMonths(uint32_t todayKey) {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  uint32_t cutoffMonth = dayKeyFromDays(daysFromDayKey(todayKey) - ARCHIVE_KEEP_DAYS) / 100;
+  uint32_t oldest = oldestCsvIntervalDay();
+  if (oldest == 0 || oldest / 100 >= cutoffMonth) return true;
+
+  uint32_t *months = (uint32_t *)malloc(sizeof(uint32_t) * ARCHIVE_MAX_MONTHS);
+  if (!months) return false;
+  int count = 0;
+  bool ok = true;
+  for (uint32_t m = oldest / 100; m < cutoffMonth && count < ARCHIVE_MAX_MONTHS; m = nextMonth(m)) {
+    char path[24];
+    archivePath(m, path, sizeof(path));
+    if (encodeMonth(m, path)) {
+      months[count++] = m;
+    } else {
+      ok = false;
+    }
+  }
+  if (count > 0) ok = dropArchivedCsvRows(months, count) && ok;
+  statsValid = false;
+  free(months);
+  return ok;
+}
+
+static bool readFooter(File &file, ArchiveFooter &footer) {
+  size_t size = file.size();
+  if (size < sizeof(footer)) return false;
+  file.seek(size - sizeof(footer));
+  if (file.read((uint8_t *)&footer, sizeof(footer)) != sizeof(footer)) return false;
+  return footer.magic == ARCHIVE_MAGIC && footer.version == ARCHIVE_VERSION &&
+         footer.payloadLen + sizeof(footer) == size;
+}
+
+static bool verifyMonth(uint32_t monthKey, File &file, const ArchiveFooter &footer) {
+  uint32_t size = (uint32_t)file.size();
+  for (int i = 0; i < VERIFIED_CACHE; i++) {
+    if (verifiedMonth[i] == monthKey && verifiedSize[i] == size) return true;
+  }
+  uint8_t buf[256];
+  uint32_t crc = 0;
+  uint32_t left = footer.payloadLen;
+  file.seek(0);
+  while (left > 0) {
+    size_t want = left < sizeof(buf) ? left : sizeof(buf);
+    if (file.read(buf, want) != want) return false;
+    crc = crc32_le(crc, buf, want);
+    left -= want;
+  }
+  crc = crc32_le(crc, (const uint8_t *)&footer, offsetof(ArchiveFooter, crc));
+  if (crc != footer.crc) return false;
+  verifiedMonth[verifiedNext] = monthKey;
+  verifiedSize[verifiedNext] = size;
+  verifiedNext = (verifiedNext + 1) % VERIFIED_CACHE;
+  return true;
+}
+
+// Decodes one day of the month (dayNum 1..31), or all of them for 0.
+static bool decodeMonth(uint32_t monthKey, int dayNum, ArchiveRowFn fn, void *ctx) {
+  char path[24];
+  archivePath(monthKey, path, sizeof(path));
+  File file = flashFs.open(path, "r");
+  if (!file) return false;
+  ArchiveFooter footer;
+  if (!readFooter(file, footer) || !verifyMonth(monthKey, file, footer)) return false;
+
+  uint8_t *buf = nullptr;
+  bool ok = true;
+  for (int d = 0; d < 31 && ok; d++) {
+    if (dayNum != 0 && d != dayNum - 1) continue;
+    uint32_t start = footer.dayOffset[d];
+    if (start == ARCHIVE_NO_DAY || start >= footer.payloadLen) continue;
+    uint32_t stop = footer.payloadLen;
+    for (int j = 0; j < 31; j++) {
+      uint32_t other = footer.dayOffset[j];
+      if (other != ARCHIVE_NO_DAY && other > start && other < stop) stop = other;
+    }
+    uint8_t *grown = (uint8_t *)realloc(buf, stop - start);
+    if (!grown) {
+      ok = false;
+      break;
+    }
+    buf = grown;
+    file.seek(start);
+    if (file.read(buf, stop - start) != stop - start) {
+      ok = false;
+      break;
+    }
+    const uint8_t *p = buf;
+    const uint8_t *end = buf + (stop - start);
+    uint32_t rows = 0;
+    ok = getVarint(p, end, rows);
+    uint32_t dayKey = (monthKey * 100) + (uint32_t)(d + 1);
+    uint32_t prevEnd = 0;
+    for (uint32_t i = 0; ok && i < rows; i++) {
+      DayInterval it;
+      ok = decodeRow(p, end, prevEnd, footer.pplMilli, it);
+      if (ok) fn(dayKey, it, ctx);
+      prevEnd = it.endSec;
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+struct HistoryFnCtx {
+  HistoryIntervalFn fn;
+  void *ctx;
+};
+
+static void forwardRow(uint32_t, const DayInterval &row, void *ctx) {
+  HistoryFnCtx &forward = *(HistoryFnCtx *)ctx;
+  forward.fn(row, forward.ctx);
+}
+
+bool forEachArchivedInterval(uint32_t dayKey, HistoryIntervalFn fn, void *ctx) {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  HistoryFnCtx forward = {fn, ctx};
+  return decodeMonth(dayKey / 100, (int)(dayKey % 100), forwardRow, &forward);
+}
+
+static int listArchiveMonths(uint32_t *months, int maxCount) {
+  File root = flashFs.open("/");
+  if (!root) return 0;
+  int count = 0;
+  File entry = root.openNextFile();
+  while (entry && count < maxCount) {
+    const char *name = entry.name();
+    if (name[0] == '/') name++;
+    unsigned long key = 0;
+    char tail[8] = "";
+    if (sscanf(name, "iva_%6lu.%7s", &key, tail) == 2 && strcmp(tail, "bin") == 0) {
+      int at = count++;
+      while (at > 0 && months[at - 1] > key) {
+        months[at] = months[at - 1];
+        at--;
+      }
+      months[at] = (uint32_t)key;
+    }
+    entry = root.openNextFile();
+  }
+  return count;
+}
+
+uint32_t oldestArchivedMonth() {
+  if (!storageReady()) return 0;
+  StorageLock lock;
+  uint32_t *months = (uint32_t *)malloc(sizeof(uint32_t) * ARCHIVE_MAX_MONTHS);
+  if (!months) return 0;
+  int count = listArchiveMonths(months, ARCHIVE_MAX_MONTHS);
+  uint32_t oldest = count > 0 ? months[0] : 0;
+  free(months);
+  return oldest;
+}
+
+bool dropArchivedMonth(uint32_t monthKey) {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  char path[24];
+  archivePath(monthKey, path, sizeof(path));
+  if (!flashFs.exists(path)) return true;
+  for (int i = 0; i < VERIFIED_CACHE; i++) {
+    if (verifiedMonth[i] == monthKey) verifiedMonth[i] = 0;
+  }
+  statsValid = false;
+  return flashFs.remove(path);
+}
+
+// Collects CSV text in RAM, so a day can be gathered under the storage lock
+// and sent after it is released.
+class StringPrint : public Print {
+public:
+  size_t write(uint8_t c) override {
+    text += (char)c;
+    return 1;
+  }
+  size_t write(const uint8_t *buf, size_t size) override {
+    text.concat((const char *)buf, size);
+    return size;
+  }
+  String text;
+};
+
+static void printExportRow(Print &out, uint32_t dayKey, const DayInterval &row) {
+  int wday = (int)((daysFromDayKey(dayKey) + 4) % 7);  // 1970-01-01 was a Thursday
+  printIntervalCsvRow(out, (int)(dayKey / 10000), (int)((dayKey / 100) % 100),
+                      (int)(dayKey % 100), wday, row);
+}
+
+static void printArchivedRow(uint32_t dayKey, const DayInterval &row, void *ctx) {
+  printExportRow(*(Print *)ctx, dayKey, row);
+}
+
+struct CsvExportDay {
+  Print *out;
+  uint32_t dayKey;
+};
+
+static void printCsvRow(const DayInterval &row, void *ctx) {
+  CsvExportDay &exp = *(CsvExportDay *)ctx;
+  printExportRow(*exp.out, exp.dayKey, row);
+}
+
+// Goes one day at a time, from the oldest archived month to the newest
+// intervals.csv row: each day's archived and live rows are gathered under
+// the storage lock, which is released before they are sent, so a slow client
+// never holds up the writer task and an archive run cannot move a day's rows
+// while it is being read.
+bool writeIntervalsCsvExport(Print &out) {
+  if (!storageReady()) return false;
+  writeCsvHeader(out, INTERVALS_CSV_PATH);
+  uint32_t *months = (uint32_t *)malloc(sizeof(uint32_t) * ARCHIVE_MAX_MONTHS);
+  if (!months) return false;
+  int count = 0;
+  {
+    StorageLock lock;
+    count = listArchiveMonths(months, ARCHIVE_MAX_MONTHS);
+  }
+  uint32_t firstKey = oldestCsvIntervalDay();
+  uint32_t lastKey = newestCsvIntervalDay();
+  if (count > 0) {
+    if (firstKey == 0 || months[0] * 100 + 1 < firstKey) firstKey = months[0] * 100 + 1;
+    uint32_t archiveEnd = months[count - 1] * 100 + 31;
+    if (archiveEnd > lastKey) lastKey = archiveEnd;
+  }
+
+  int monthAt = 0;
+  StringPrint rows;
+  for (int32_t day = daysFromDayKey(firstKey); firstKey != 0 && day <= daysFromDayKey(lastKey);
+       day++) {
+    uint32_t dayKey = dayKeyFromDays(day);
+    while (monthAt < count && months[monthAt] < dayKey / 100) monthAt++;
+    bool archived = monthAt < count && months[monthAt] == dayKey / 100;
+    rows.text = "";
+    {
+      StorageLock lock;
+      if (archived) decodeMonth(dayKey / 100, (int)(dayKey % 100), printArchivedRow, &rows);
+      CsvExportDay exp = {&rows, dayKey};
+      forEachCsvInterval(dayKey, printCsvRow, &exp);
+    }
+    out.print(rows.text);
+  }
+  free(months);
+  return true;
+}
+
+void getIntervalArchiveStats(IntervalArchiveStats &stats) {
+  StorageLock lock;
+  if (statsValid || !storageReady()) {
+    stats = cachedStats;
+    return;
+  }
+  stats = IntervalArchiveStats();
+  uint32_t *months = (uint32_t *)malloc(sizeof(uint32_t) * ARCHIVE_MAX_MONTHS);
+  if (!months) return;
+  int count = listArchiveMonths(months, ARCHIVE_MAX_MONTHS);
+  for (int i = 0; i < count; i++) {
+    char path[24];
+    archivePath(months[i], path, sizeof(path));
+    File file = flashFs.open(path, "r");
+    ArchiveFooter footer;
+    stats.months++;
+    if (!file || !readFooter(file, footer)) {
+      stats.badMonths++;
+      continue;
+    }
+    stats.rows += footer.rowCount;
+    stats.bytes += (uint32_t)file.size();
+    stats.csvBytes += footer.csvBytes;
+  }
+  free(months);
+  cachedStats = stats;
+  statsValid = true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "history.h"
+
+// Closed months of intervals.csv are moved into one binary file each,
+// /iva_YYYYMM.bin, and dropped from the CSV. Rows are grouped by day and
+// packed as varints: start as a zigzag delta from the previous row's end, the
+// duration, liters in 0.01 L, flow stats in 0.1 L/min, and pulses as a
+// residual against liters * pulses-per-liter. A footer holds each day's
+// offset and a CRC over the whole file.
+struct IntervalArchiveStats {
+  uint16_t months;
+  uint16_t badMonths;
+  uint32_t rows;
+  uint32_t bytes;
+  // What the same rows took in intervals.csv.
+  uint32_t csvBytes;
+};
+
+// Storage writer only. Archives every month that ended more than a week
+// before todayKey; CSV rows that turn up for a month with an archive already
+// are merged into it before they are dropped.
+bool archiveClosedIntervalMonths(uint32_t todayKey);
+// Oldest archived month as yyyymm; 0 if none.
+uint32_t oldestArchivedMonth();
+// Storage writer only. Deletes the month's archive; usage.csv still holds
+// the totals of its days.
+bool dropArchivedMonth(uint32_t monthKey);
+bool forEachArchivedInterval(uint32_t dayKey, HistoryIntervalFn fn, void *ctx);
+// intervals.csv as exported: the header, then day by day the archived rows
+// followed by the live ones.
+bool writeIntervalsCsvExport(Print &out);
+void getIntervalArchiveStats(IntervalArchiveStats &stats);
@@ -0,0 +1,144 @@
+#include "interval_coalescer.h"
+
+#include <math.h>
+
+#include "interval_pool.h"
+#include "pending_usage.h"
+
+static uint32_t mergedGaps = 0;
+static ClosedInterval closed;
+static bool closedPending = false;
+static uint32_t closedAtUptime = 0;
+// Belongs to the row at activeIntervalIndex.
+static IntervalStats activeStats;
+
+void beginIntervalFlow(DayUsage &day, int secOfDay) {
+  if (config->mergeGapSec > 0 && day.intervalCount > 0) {
+    int last = day.intervalCount - 1;
+    // Spilled rows come back as nullptr and simply start a new interval.
+    DayInterval *prev = dayInterval(day, last);
+    if (prev && (uint32_t)secOfDay >= prev->endSec &&
+        (uint32_t)secOfDay - prev->endSec <= config->mergeGapSec) {
+      if (prev->mergedGaps < 0xFFFF) prev->mergedGaps++;
+      mergedGaps++;
+      closedPending = false;
+      activeIntervalIndex = last;
+      loadIntervalStats(activeStats, *prev);
+      return;
+    }
+  }
+  activeIntervalIndex = addDayInterval(day, secOfDay, secOfDay, 0.0f);
+  activeStats = IntervalStats();
+}
+
+void resumeIntervalFlow(DayUsage &day, int index) {
+  const DayInterval *it = dayInterval(day, index);
+  activeIntervalIndex = it ? index : -1;
+  if (it) loadIntervalStats(activeStats, *it);
+}
+
+void addIntervalFlow(DayUsage &day, int secOfDay, float liters, float flowLpm, uint32_t pulses) {
+  DayInterval *it = dayInterval(day, activeIntervalIndex);
+  if (!it) {
+    return;
+  }
+  it->liters += liters;
+  it->endSec = secOfDay;
+  addIntervalSample(activeStats, *it, flowLpm, pulses);
+}
+
+void endIntervalFlow(DayUsage &day, int secOfDay) {
+  DayInterval *it = dayInterval(day, activeIntervalIndex);
+  if (it) {
+    it->endSec = secOfDay;
+    closed.year = day.year;
+    closed.month = day.month;
+    closed.day = day.day;
+    closed.row = *it;
+    closedPending = true;
+    closedAtUptime = uptimeSeconds();
+  }
+  activeIntervalIndex = -1;
+}
+
+bool takeClosedInterval(ClosedInterval &out) {
+  if (!closedPending) return false;
+  // A running interval here is a new one; a merge would have cleared
+  // closedPending.
+  if (activeIntervalIndex < 0 && uptimeSeconds() - closedAtUptime <= config->mergeGapSec) {
+    return false;
+  }
+  out = closed;
+  closedPending = false;
+  return true;
+}
+
+uint32_t mergedGapTotal() {
+  return mergedGaps;
+}
+
+static uint16_t toClpm(float lpm) {
+  if (!(lpm > 0.0f)) return 0;
+  if (lpm >= 655.35f) return 0xFFFF;
+  return (uint16_t)lroundf(lpm * 100.0f);
+}
+
+static float stdDevLpm(const IntervalStats &stats) {
+  if (stats.samples < 2 || stats.m2 <= 0.0f) {
+    return 0.0f;
+  }
+  return sqrtf(stats.m2 / (float)(stats.samples - 1));
+}
+
+void loadIntervalStats(IntervalStats &stats, const DayInterval &it) {
+  stats.samples = it.samples;
+  stats.minLpm = intervalMinLpm(it);
+  stats.peakLpm = intervalPeakLpm(it);
+  stats.meanLpm = intervalMeanLpm(it);
+  float sd = intervalStdDevLpm(it);
+  stats.m2 = (it.samples > 1) ? sd * sd * (float)(it.samples - 1) : 0.0f;
+}
+
+void addIntervalSample(IntervalStats &stats, DayInterval &it, float flowLpm, uint32_t pulses) {
+  it.pulses += pulses;
+  stats.samples++;
+  if (stats.samples == 1) {
+    stats.minLpm = flowLpm;
+    stats.peakLpm = flowLpm;
+    stats.meanLpm = flowLpm;
+    stats.m2 = 0.0f;
+  } else {
+    if (flowLpm < stats.minLpm) stats.minLpm = flowLpm;
+    if (flowLpm > stats.peakLpm) stats.peakLpm = flowLpm;
+    float delta = flowLpm - stats.meanLpm;
+    stats.meanLpm += delta / (float)stats.samples;
+    stats.m2 += delta * (flowLpm - stats.meanLpm);
+  }
+  setIntervalStats(it, stats.samples, stats.minLpm, stats.peakLpm, stats.meanLpm,
+                   stdDevLpm(stats));
+}
+
+void setIntervalStats(DayInterval &it, uint32_t samples, float minLpm, float peakLpm,
+                      float meanLpm, float sdLpm) {
+  it.samples = samples;
+  it.minClpm = toClpm(minLpm);
+  it.peakClpm = toClpm(peakLpm);
+  it.meanClpm = toClpm(meanLpm);
+  it.sdClpm = toClpm(sdLpm);
+}
+
+float intervalMinLpm(const DayInterval &it) {
+  return (float)it.minClpm / 100.0f;
+}
+
+float intervalPeakLpm(const DayInterval &it) {
+  return (float)it.peakClpm / 100.0f;
+}
+
+float intervalMeanLpm(const DayInterval &it) {
+  return (float)it.meanClpm / 100.0f;
+}
+
+float intervalStdDevLpm(const DayInterval &it) {
+  return (float)it.sdClpm / 100.0f;
+}
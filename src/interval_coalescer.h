@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "app_state.h"
+
+// Builds the day's intervals from per-tick flow state. A flow start within
+// config->mergeGapSec of the previous interval's end reopens that interval
+// rather than adding a row, so short pauses do not fragment one draw.
+// Merging never crosses midnight: each day starts with no previous interval.
+void beginIntervalFlow(DayUsage &day, int secOfDay);
+void addIntervalFlow(DayUsage &day, int secOfDay, float liters, float flowLpm, uint32_t pulses);
+void endIntervalFlow(DayUsage &day, int secOfDay);
+uint32_t mergedGapTotal();
+
+// An interval is final once a new one has started or its merge gap has run
+// out. Hands out each final interval once, for telemetry.
+struct ClosedInterval {
+  int year;
+  int month;
+  int day;
+  DayInterval row;
+};
+bool takeClosedInterval(ClosedInterval &out);
+
+// Points activeIntervalIndex at an existing row and resumes its statistics.
+void resumeIntervalFlow(DayUsage &day, int index);
+
+// Running flow statistics of an interval being filled. m2 is Welford's
+// running sum of squared deviations from the mean; variance is
+// m2 / (samples - 1).
+struct IntervalStats {
+  uint32_t samples;
+  float minLpm;
+  float peakLpm;
+  float meanLpm;
+  float m2;
+};
+// Rebuilds the running state of a reopened row; m2 comes back from the
+// stored standard deviation.
+void loadIntervalStats(IntervalStats &stats, const DayInterval &it);
+// O(1) streaming update for one tick; also stores the row's summary.
+void addIntervalSample(IntervalStats &stats, DayInterval &it, float flowLpm, uint32_t pulses);
+// Stores a summary read back from flash.
+void setIntervalStats(DayInterval &it, uint32_t samples, float minLpm, float peakLpm,
+                      float meanLpm, float sdLpm);
+float intervalMinLpm(const DayInterval &it);
+float intervalPeakLpm(const DayInterval &it);
+float intervalMeanLpm(const DayInterval &it);
+float intervalStdDevLpm(const DayInterval &it);
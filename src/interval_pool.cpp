@@ -0,0 +1,207 @@
+#include "interval_pool.h"
+
+#include <freertos/FreeRTOS.h>
+
+#include "storage_writer.h"
+
+struct IntervalChunk {
+  DayInterval items[INTERVAL_CHUNK_SIZE];
+  int16_t next;
+};
+
+static IntervalChunk chunks[INTERVAL_POOL_CHUNKS];
+static int16_t freeHead = -1;
+static IntervalPoolStats poolStats;
+static bool spillSnapshots = true;
+
+// Only the loop task changes chunk links; the lock makes copies taken for the
+// storage writer task see a consistent list.
+static portMUX_TYPE poolMux = portMUX_INITIALIZER_UNLOCKED;
+
+static int ramCount(const DayUsage &day) {
+  return day.intervalCount - day.spilledCount;
+}
+
+static int chunkCount(const DayUsage &day) {
+  return (ramCount(day) + INTERVAL_CHUNK_SIZE - 1) / INTERVAL_CHUNK_SIZE;
+}
+
+void initIntervalPool() {
+  for (int i = 0; i < INTERVAL_POOL_CHUNKS; i++) {
+    chunks[i].next = (i + 1 < INTERVAL_POOL_CHUNKS) ? (int16_t)(i + 1) : -1;
+  }
+  freeHead = 0;
+  poolStats = IntervalPoolStats();
+  for (int i = 0; i < 7; i++) {
+    initDayIntervals(weekUsage[i]);
+  }
+}
+
+void initDayIntervals(DayUsage &day) {
+  day.intervalCount = 0;
+  day.spilledCount = 0;
+  day.savedCount = 0;
+  day.firstChunk = -1;
+  day.lastChunk = -1;
+}
+
+void clearDayIntervals(DayUsage &day) {
+  portENTER_CRITICAL(&poolMux);
+  int16_t c = day.firstChunk;
+  while (c >= 0) {
+    int16_t next = chunks[c].next;
+    chunks[c].next = freeHead;
+    freeHead = c;
+    poolStats.chunksUsed--;
+    c = next;
+  }
+  initDayIntervals(day);
+  portEXIT_CRITICAL(&poolMux);
+}
+
+// Releases the oldest chunk of the day holding the most chunks. Rows not yet
+// known to be on flash are queued in a snapshot first; no spill otherwise.
+static bool spillOldestChunk() {
+  DayUsage *victim = nullptr;
+  for (int i = 0; i < 7; i++) {
+    DayUsage &day = weekUsage[i];
+    int count = chunkCount(day);
+    if (count == 0) continue;
+    // The only chunk of the live day holds the interval still being filled.
+    if (count == 1 && i == weekIndex && activeIntervalIndex >= 0) continue;
+    if (!victim || count > chunkCount(*victim)) {
+      victim = &day;
+    }
+  }
+  if (!victim) {
+    return false;
+  }
+  int released = ramCount(*victim);
+  if (released > INTERVAL_CHUNK_SIZE) released = INTERVAL_CHUNK_SIZE;
+  bool saved = victim != &weekUsage[weekIndex] &&
+               victim->savedCount >= victim->spilledCount + released;
+  if (spillSnapshots && !saved && victim->year >= 0) {
+    if (!queueDaySnapshot(*victim)) {
+      return false;
+    }
+  }
+
+  portENTER_CRITICAL(&poolMux);
+  int16_t c = victim->firstChunk;
+  victim->firstChunk = chunks[c].next;
+  if (victim->firstChunk < 0) {
+    victim->lastChunk = -1;
+  }
+  victim->spilledCount += released;
+  chunks[c].next = freeHead;
+  freeHead = c;
+  poolStats.chunksUsed--;
+  poolStats.spillEvents++;
+  poolStats.spilledIntervals += released;
+  portEXIT_CRITICAL(&poolMux);
+  return true;
+}
+
+void markDayIntervalsOnFlash(DayUsage &day, int count) {
+  clearDayIntervals(day);
+  portENTER_CRITICAL(&poolMux);
+  day.intervalCount = (uint16_t)count;
+  day.spilledCount = (uint16_t)count;
+  day.savedCount = (uint16_t)count;
+  portEXIT_CRITICAL(&poolMux);
+}
+
+int addDayInterval(DayUsage &day, uint32_t startSec, uint32_t endSec, float liters) {
+  DayInterval row = {};
+  row.startSec = startSec;
+  row.endSec = endSec;
+  row.liters = liters;
+  return addDayInterval(day, row);
+}
+
+int addDayInterval(DayUsage &day, const DayInterval &row) {
+  if (ramCount(day) % INTERVAL_CHUNK_SIZE == 0) {
+    if (freeHead < 0 && !spillOldestChunk()) {
+      poolStats.droppedIntervals++;
+      return -1;
+    }
+    portENTER_CRITICAL(&poolMux);
+    int16_t c = freeHead;
+    freeHead = chunks[c].next;
+    chunks[c].next = -1;
+    if (day.lastChunk >= 0) {
+      chunks[day.lastChunk].next = c;
+    } else {
+      day.firstChunk = c;
+    }
+    day.lastChunk = c;
+    poolStats.chunksUsed++;
+    if (poolStats.chunksUsed > poolStats.chunksPeak) {
+      poolStats.chunksPeak = poolStats.chunksUsed;
+    }
+    portEXIT_CRITICAL(&poolMux);
+  }
+
+  portENTER_CRITICAL(&poolMux);
+  chunks[day.lastChunk].items[ramCount(day) % INTERVAL_CHUNK_SIZE] = row;
+  day.intervalCount++;
+  if (!spillSnapshots) day.savedCount = day.intervalCount;
+  portEXIT_CRITICAL(&poolMux);
+  return day.intervalCount - 1;
+}
+
+const DayInterval *dayInterval(const DayUsage &day, int index) {
+  if (index < day.spilledCount || index >= day.intervalCount) {
+    return nullptr;
+  }
+  int ramIndex = index - day.spilledCount;
+  int chunkNo = ramIndex / INTERVAL_CHUNK_SIZE;
+  // The hot path (the interval being filled) is always in the last chunk.
+  int16_t c = day.lastChunk;
+  if (chunkNo != (ramCount(day) - 1) / INTERVAL_CHUNK_SIZE) {
+    c = day.firstChunk;
+    for (int i = 0; i < chunkNo; i++) {
+      c = chunks[c].next;
+    }
+  }
+  return &chunks[c].items[ramIndex % INTERVAL_CHUNK_SIZE];
+}
+
+DayInterval *dayInterval(DayUsage &day, int index) {
+  return const_cast<DayInterval *>(dayInterval((const DayUsage &)day, index));
+}
+
+int copyDayIntervals(const DayUsage &day, DayInterval *out, int maxCount) {
+  int copied = 0;
+  portENTER_CRITICAL(&poolMux);
+  int remaining = ramCount(day);
+  for (int16_t c = day.firstChunk; c >= 0 && remaining > 0 && copied < maxCount; c = chunks[c].next) {
+    int n = remaining < INTERVAL_CHUNK_SIZE ? remaining : INTERVAL_CHUNK_SIZE;
+    if (n > maxCount - copied) n = maxCount - copied;
+    memcpy(out + copied, chunks[c].items, n * sizeof(DayInterval));
+    copied += n;
+    remaining -= n;
+  }
+  portEXIT_CRITICAL(&poolMux);
+  return copied;
+}
+
+void setIntervalSpillSnapshots(bool enabled) {
+  spillSnapshots = enabled;
+}
+
+void noteDaySnapshotSaved(const DayUsage &written, int rowCount) {
+  int saved = written.spilledCount + rowCount;
+  portENTER_CRITICAL(&poolMux);
+  for (int i = 0; i < 7; i++) {
+    DayUsage &day = weekUsage[i];
+    if (day.year != written.year || day.month != written.month || day.day != written.day) continue;
+    if (saved > day.intervalCount) saved = day.intervalCount;
+    if (saved > day.savedCount) day.savedCount = (uint16_t)saved;
+  }
+  portEXIT_CRITICAL(&poolMux);
+}
+
+void getIntervalPoolStats(IntervalPoolStats &stats) {
+  stats = poolStats;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "app_state.h"
+
+// Shared chunk pool behind DayUsage intervals. Indices passed in and out are
+// logical (stable across spills); rows below day.spilledCount return nullptr.
+//
+// A spilled row is always one of the first spilledCount rows of its date in
+// intervals.csv: a chunk is only released once its rows are on flash or in
+// a queued snapshot. The live day is always snapshotted first, since its
+// rows still change; a past day only when savedCount does not cover them,
+// e.g. when its closing snapshot was dropped or has not run yet.
+struct IntervalPoolStats {
+  int chunksUsed;
+  int chunksPeak;
+  uint32_t spillEvents;
+  uint32_t spilledIntervals;
+  uint32_t droppedIntervals;
+};
+
+void initIntervalPool();
+void initDayIntervals(DayUsage &day);
+void clearDayIntervals(DayUsage &day);
+// Drops the day's RAM rows and files its first `count` rows as spilled, for
+// rows only intervals.csv can still have.
+void markDayIntervalsOnFlash(DayUsage &day, int count);
+int addDayInterval(DayUsage &day, uint32_t startSec, uint32_t endSec, float liters);
+int addDayInterval(DayUsage &day, const DayInterval &row);
+DayInterval *dayInterval(DayUsage &day, int index);
+const DayInterval *dayInterval(const DayUsage &day, int index);
+int copyDayIntervals(const DayUsage &day, DayInterval *out, int maxCount);
+// Rows added while disabled are taken to come from intervals.csv.
+void setIntervalSpillSnapshots(bool enabled);
+// Storage writer: a snapshot of `written` with rowCount RAM rows is on flash.
+void noteDaySnapshotSaved(const DayUsage &written, int rowCount);
+void getIntervalPoolStats(IntervalPoolStats &stats);
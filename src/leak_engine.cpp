@@ -0,0 +1,352 @@
+#include "leak_engine.h"
+
+#include "app_state.h"
+#include "baseline.h"
+#include "channels.h"
+#include "drip_detector.h"
+#include "rolling_usage.h"
+#include "storage_writer.h"
+#include "telemetry.h"
+
+// Rate must stay above its limit this many ticks, so one noisy window
+// does not shut the water off.
+static const uint8_t RATE_CONFIRM_TICKS = 3;
+
+// Per-run state of one channel's detectors.
+struct DetectorState {
+  uint32_t runStartSec;
+  bool runActive;
+  bool durationFired;
+  uint8_t rateTicks;
+  // Set once a rolling window fired, until it drops back below its limit.
+  bool hourFired;
+  bool dayFired;
+  bool nightInWindow;
+  float nightMinLpm;
+  bool closedInWindow;
+  bool closedFired;
+  float closedLiters;
+};
+
+struct LeakDetector {
+  const char *reason;
+  // Updates state for one tick and returns true when it should trip.
+  // value and limit are what gets logged and reported.
+  bool (*tick)(const LeakTickInput &in, DetectorState &st, float &value, float &limit);
+  void (*reset)(int ch, DetectorState &st);
+  // nullptr: always closes the valve. Otherwise false means log only.
+  bool (*closesValve)();
+  // Detectors without a configurable limit are always on.
+  bool hasLimit;
+  // Needs the main line's history (rolling windows, baseline, drip), so
+  // branches skip it.
+  bool mainOnly;
+};
+
+static DetectorState states[METER_CHANNEL_COUNT];
+
+static bool isMain(const LeakTickInput &in) {
+  return in.channel == MAIN_CHANNEL;
+}
+
+// The main line's run volume is global (and kept across resets in RTC RAM);
+// a branch keeps its own in channels[].
+static float &runLiters(int ch) {
+  return ch == MAIN_CHANNEL ? continuousLiters : channels[ch].continuousLiters;
+}
+
+// FLOW_LIMIT: liters of one uninterrupted run.
+static bool tickContinuous(const LeakTickInput &in, DetectorState &, float &value, float &limit) {
+  limit = isMain(in) ? config->leakThresholdLiters : channelConfigs[in.channel].leakLiters;
+  float &liters = runLiters(in.channel);
+  if (!in.active) {
+    liters = 0.0f;
+  } else if (config->leakProtectionEnabled && !channels[in.channel].leakTripped) {
+    liters += in.liters;
+  }
+  value = liters;
+  return in.active && limit > 0.0f && liters >= limit;
+}
+
+static void resetContinuous(int ch, DetectorState &) {
+  runLiters(ch) = 0.0f;
+}
+
+// DURATION_LIMIT: seconds of one uninterrupted run.
+static bool tickDuration(const LeakTickInput &in, DetectorState &st, float &value, float &limit) {
+  uint32_t maxSec = isMain(in) ? config->leakMaxDurationSec : channelConfigs[in.channel].leakMaxSec;
+  limit = (float)maxSec;
+  if (!in.active) {
+    st.runActive = false;
+    st.durationFired = false;
+    value = 0.0f;
+    return false;
+  }
+  if (!st.runActive) {
+    st.runActive = true;
+    st.runStartSec = in.uptimeSec;
+  }
+  value = (float)(in.uptimeSec - st.runStartSec);
+  if (maxSec == 0 || st.durationFired || value < limit) {
+    return false;
+  }
+  st.durationFired = true;
+  return true;
+}
+
+static void resetDuration(int, DetectorState &st) {
+  st.runActive = false;
+  st.durationFired = false;
+}
+
+// RATE_LIMIT: flow above the limit for RATE_CONFIRM_TICKS ticks in a row.
+static bool tickRate(const LeakTickInput &in, DetectorState &st, float &value, float &limit) {
+  limit = isMain(in) ? config->leakMaxRateLpm : channelConfigs[in.channel].leakRateLpm;
+  value = in.flowLpm;
+  if (limit <= 0.0f || in.flowLpm < limit) {
+    st.rateTicks = 0;
+    return false;
+  }
+  if (st.rateTicks < RATE_CONFIRM_TICKS) {
+    st.rateTicks++;
+    return st.rateTicks == RATE_CONFIRM_TICKS;
+  }
+  return false;
+}
+
+static void resetRate(int, DetectorState &st) {
+  st.rateTicks = 0;
+}
+
+// HOUR_LIMIT / DAY_LIMIT: rolling-window volume. These fire when the window
+// crosses the limit and re-arm once it drops back below, so a released trip
+// does not re-trip on the same old liters.
+static bool tickWindow(RollingWindow window, float limitLiters, bool &fired, float &value,
+                       float &limit) {
+  limit = limitLiters;
+  value = rollingLiters(window);
+  if (limit <= 0.0f || value < limit) {
+    fired = false;
+    return false;
+  }
+  if (fired) {
+    return false;
+  }
+  fired = true;
+  return true;
+}
+
+static bool tickHour(const LeakTickInput &, DetectorState &st, float &value, float &limit) {
+  return tickWindow(ROLLING_1H, config->leakHourLiters, st.hourFired, value, limit);
+}
+
+static bool tickDay(const LeakTickInput &, DetectorState &st, float &value, float &limit) {
+  return tickWindow(ROLLING_24H, config->leakDayLiters, st.dayFired, value, limit);
+}
+
+// NIGHT_FLOW: the lowest flow seen across the night window. A line that
+// never drops below the limit all night has a constant background leak;
+// judged once, when the window ends. Every channel uses the main night
+// hours with its own limit.
+static bool inNightWindow(const struct tm *tmNow) {
+  return tmNow && ((config->nightHours >> tmNow->tm_hour) & 1);
+}
+
+static bool tickNight(const LeakTickInput &in, DetectorState &st, float &value, float &limit) {
+  limit = isMain(in) ? config->nightMinLpm : channelConfigs[in.channel].nightMinLpm;
+  bool inWindow = limit > 0.0f && inNightWindow(in.tmNow);
+  if (inWindow) {
+    if (!st.nightInWindow || in.flowLpm < st.nightMinLpm) {
+      st.nightMinLpm = in.flowLpm;
+    }
+    st.nightInWindow = true;
+    value = st.nightMinLpm;
+    return false;
+  }
+  bool ended = st.nightInWindow;
+  st.nightInWindow = false;
+  value = st.nightMinLpm;
+  return ended && limit > 0.0f && st.nightMinLpm >= limit;
+}
+
+// CLOSED_WINDOW: liters that still flow while a blocked window holds the
+// valve shut; fires once per window. Log only: the valve is already closed,
+// and a trip would be released when the window ends anyway.
+static bool tickClosedWindow(const LeakTickInput &in, DetectorState &st, float &value,
+                             float &limit) {
+  limit = isMain(in) ? config->closedWindowLiters : channelConfigs[in.channel].closedLiters;
+  if (!in.inClosedWindow) {
+    st.closedInWindow = false;
+    value = 0.0f;
+    return false;
+  }
+  if (!st.closedInWindow) {
+    st.closedInWindow = true;
+    st.closedFired = false;
+    st.closedLiters = 0.0f;
+  }
+  st.closedLiters += in.liters;
+  value = st.closedLiters;
+  if (limit <= 0.0f || st.closedFired || st.closedLiters < limit) {
+    return false;
+  }
+  st.closedFired = true;
+  return true;
+}
+
+// BASELINE: this hour's liters against the learned hour-of-week profile.
+static bool tickBaseline(const LeakTickInput &, DetectorState &, float &value, float &limit) {
+  return checkBaseline(config->baselineSigma, value, limit);
+}
+
+static bool baselineClosesValve() {
+  return config->baselineCloseValve;
+}
+
+// DRIP: a steady slow pulse train; logged with its estimated liters/day.
+static bool tickDrip(const LeakTickInput &, DetectorState &, float &value, float &limit) {
+  limit = 0.0f;
+  // Leave the edge pending while leak protection is off, so a drip found
+  // meanwhile is still logged once it is turned back on.
+  if (!config->leakProtectionEnabled) {
+    DripStatus status;
+    getDripStatus(status);
+    value = status.litersPerDay;
+    return false;
+  }
+  return takeDripSuspected(value);
+}
+
+static bool logOnly() {
+  return false;
+}
+
+static const LeakDetector detectors[] = {
+    {"FLOW_LIMIT", tickContinuous, resetContinuous, nullptr, true, false},
+    {"DURATION_LIMIT", tickDuration, resetDuration, nullptr, true, false},
+    {"RATE_LIMIT", tickRate, resetRate, nullptr, true, false},
+    {"HOUR_LIMIT", tickHour, nullptr, nullptr, true, true},
+    {"DAY_LIMIT", tickDay, nullptr, nullptr, true, true},
+    {"NIGHT_FLOW", tickNight, nullptr, nullptr, true, false},
+    {"CLOSED_WINDOW", tickClosedWindow, nullptr, logOnly, true, false},
+    {"BASELINE", tickBaseline, nullptr, baselineClosesValve, true, true},
+    {"DRIP", tickDrip, nullptr, logOnly, false, true},
+};
+static const int DETECTOR_COUNT = sizeof(detectors) / sizeof(detectors[0]);
+
+struct DetectorRuntime {
+  float value;
+  float limit;
+  uint32_t trips;
+  uint32_t ticks;
+  uint32_t lastCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+};
+
+static DetectorRuntime runtime[METER_CHANNEL_COUNT][DETECTOR_COUNT];
+
+// Writes the leaks.csv row and the telemetry event; branch reasons carry
+// their channel, e.g. "CH1:FLOW_LIMIT".
+static void reportLeak(int index, const LeakTickInput &in, bool valveClosed) {
+  const DetectorRuntime &rt = runtime[in.channel][index];
+  const ChannelState &st = channels[in.channel];
+  const char *reason = detectors[index].reason;
+  char tagged[24];
+  if (!isMain(in)) {
+    snprintf(tagged, sizeof(tagged), "CH%d:%s", in.channel, reason);
+    reason = tagged;
+  }
+  queueLeakEvent(in.tmNow, reason, isMain(in) ? totalLiters : st.totalLiters,
+                 isMain(in) ? dailyLiters : st.dailyLiters, rt.value, rt.limit, valveClosed);
+  telemetryLeak(in.channel, detectors[index].reason, rt.value, rt.limit, valveClosed);
+  Serial.print(valveClosed ? "!!! LEAK DETECTED: " : "Leak warning: ");
+  Serial.print(reason);
+  Serial.println(valveClosed ? " - VALVE CLOSED !!!" : "");
+}
+
+// A branch without a valve still latches the trip and logs it, with the
+// valve reported open.
+static void trip(int index, const LeakTickInput &in) {
+  channels[in.channel].leakTripped = true;
+  bool closed = channelHasValve(in.channel);
+  if (closed) setChannelValve(in.channel, false);
+  reportLeak(index, in, closed);
+}
+
+void runLeakDetectors(const LeakTickInput &in) {
+  DetectorState &st = states[in.channel];
+  for (int i = 0; i < DETECTOR_COUNT; i++) {
+    if (detectors[i].mainOnly && !isMain(in)) continue;
+    DetectorRuntime &rt = runtime[in.channel][i];
+    uint32_t start = ESP.getCycleCount();
+    bool fire = detectors[i].tick(in, st, rt.value, rt.limit);
+    uint32_t cycles = ESP.getCycleCount() - start;
+    rt.lastCycles = cycles;
+    if (cycles > rt.maxCycles) rt.maxCycles = cycles;
+    rt.totalCycles += cycles;
+    rt.ticks++;
+    if (!fire || !config->leakProtectionEnabled) {
+      continue;
+    }
+    if (detectors[i].closesValve && !detectors[i].closesValve()) {
+      rt.trips++;
+      reportLeak(i, in, false);
+    } else if (!channels[in.channel].leakTripped) {
+      // Several detectors may fire on one tick; the first one owns the trip.
+      rt.trips++;
+      trip(i, in);
+    }
+  }
+}
+
+void resetLeakDetectors(int ch) {
+  for (int i = 0; i < DETECTOR_COUNT; i++) {
+    if (detectors[i].reset) detectors[i].reset(ch, states[ch]);
+  }
+}
+
+int leakDetectorCount() {
+  return DETECTOR_COUNT;
+}
+
+void getLeakDetectorStats(int ch, int index, LeakDetectorStats &stats) {
+  const DetectorRuntime &rt = runtime[ch][index];
+  stats.reason = detectors[index].reason;
+  stats.enabled = (ch == MAIN_CHANNEL || !detectors[index].mainOnly) &&
+                  (!detectors[index].hasLimit || rt.limit > 0.0f);
+  stats.value = rt.value;
+  stats.limit = rt.limit;
+  stats.trips = rt.trips;
+  stats.lastCycles = rt.lastCycles;
+  stats.maxCycles = rt.maxCycles;
+  stats.avgCycles = rt.ticks ? (uint32_t)(rt.totalCycles / rt.ticks) : 0;
+}
+
+void printLeakDetectorsTo(Print &out) {
+  out.println("\n=== LEAK DETECTORS ===");
+  out.print("CPU MHz: ");
+  out.println(ESP.getCpuFreqMHz());
+  for (int ch = 0; ch < METER_CHANNEL_COUNT; ch++) {
+    if (!channelConfigs[ch].enabled) continue;
+    out.printf("CH%d %s\n", ch, channelConfigs[ch].name);
+    for (int i = 0; i < DETECTOR_COUNT; i++) {
+      if (detectors[i].mainOnly && ch != MAIN_CHANNEL) continue;
+      LeakDetectorStats s;
+      getLeakDetectorStats(ch, i, s);
+      out.print(s.reason);
+      out.print(s.enabled ? "  on " : "  off");
+      out.print("  value ");
+      out.print(s.value, 2);
+      out.print(" / ");
+      out.print(s.limit, 2);
+      out.print("  trips ");
+      out.print(s.trips);
+      out.print("  cycles avg ");
+      out.print(s.avgCycles);
+      out.print(" max ");
+      out.println(s.maxCycles);
+    }
+  }
+  out.println("======================\n");
+}
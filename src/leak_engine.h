@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// Leak detectors run once per control tick and channel, each in O(1), and
+// each can trip the channel's valve on its own with a reason code that goes
+// to leaks.csv. A detector whose limit is 0 is off. Every channel has its
+// own detector state and limits; the hour/day windows, baseline and drip
+// detectors need the main line's history and only run on it. Per-detector
+// cost is measured in CPU cycles.
+struct LeakTickInput {
+  int channel;
+  uint32_t uptimeSec;
+  float liters;
+  float flowLpm;
+  bool active;
+  // tmNow is nullptr and inClosedWindow false until the clock is valid.
+  const struct tm *tmNow;
+  bool inClosedWindow;
+};
+
+struct LeakDetectorStats {
+  const char *reason;
+  bool enabled;
+  float value;
+  float limit;
+  uint32_t trips;
+  uint32_t lastCycles;
+  uint32_t maxCycles;
+  uint32_t avgCycles;
+};
+
+void runLeakDetectors(const LeakTickInput &in);
+// Clears per-run state (continuous volume, duration, rate) after a trip is
+// released so the next run starts from zero.
+void resetLeakDetectors(int ch);
+int leakDetectorCount();
+void getLeakDetectorStats(int ch, int index, LeakDetectorStats &stats);
+void printLeakDetectorsTo(Print &out);
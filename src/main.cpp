@@ -3,21 +3,26 @@
 #include <time.h>
 
 #include "app_state.h"
+#include "baseline.h"
+#include "channels.h"
 #include "config.h"
+#include "drip_detector.h"
+#include "flash_wear.h"
+#include "flow_series.h"
+#include "interval_coalescer.h"
+#include "interval_pool.h"
+#include "leak_engine.h"
+#include "pending_usage.h"
 #include "report.h"
+#include "rolling_usage.h"
+#include "rtc_state.h"
 #include "storage.h"
+#include "storage_manager.h"
+#include "storage_writer.h"
+#include "telemetry.h"
 #include "web_ui.h"
 #include "secrets.h"
 
-#define FLOW_SENSOR_PIN 22
-#define VALVE_PIN 23
-
-volatile uint32_t pulseCount = 0;
-volatile uint32_t lastPulseMicros = 0;
-
-// Reject pulses that are "too close" (noise/ringing). Start at 300us.
-static const uint32_t MIN_PULSE_US = 300;
-
 uint32_t lastCalcMs = 0;
 uint32_t lastReportMs = 0;
 uint32_t lastFlowLogMs = 0;
@@ -26,12 +31,19 @@ uint32_t lastWifiRetryMs = 0;
 uint32_t lastSnapshotMs = 0;
 uint32_t lastSnapshotSeconds = 0;
 float lastSnapshotLiters = 0.0f;
-uint8_t lastSnapshotIntervals = 0;
-static const uint32_t SNAPSHOT_INTERVAL_MS = 5 * 60 * 1000;
+uint16_t lastSnapshotIntervals = 0;
+// Week slot whose closing snapshot found the writer queue full; -1 if none.
+static int closedDayRetryIndex = -1;
+// Active time below a whole second, carried into the next tick.
+static uint32_t activeMsCarry = 0;
+// RTC memory carries the live day across resets, so flash only needs an
+// occasional copy in case of power loss.
+static const uint32_t SNAPSHOT_INTERVAL_MS = 30 * 60 * 1000;
+static const uint32_t WIFI_RETRY_MS = 15000;
+static const uint32_t TIME_SYNC_RETRY_MS = 60000;
 float flowRateLpm = 0.0f;
 float totalLiters = 0.0f;
 float dailyLiters = 0.0f;
-bool valveState = false;
 
 static const char *NTP_SERVER_1 = "pool.ntp.org";
 static const char *NTP_SERVER_2 = "time.nist.gov";
@@ -44,79 +56,64 @@ bool timeValid = false;
 bool flowActive = false;
 int activeIntervalIndex = -1;
 bool skipPersistOnNextRollover = false;
-bool manualOverride = false;
-bool manualOverrideStartInClosed = false;
-bool leakTripped = false;
 float continuousLiters = 0.0f;
-bool lastInClosedWindow = false;
 
 int lastLoadedYear = 0;
 int lastLoadedMonth = 0;
 int lastLoadedDay = 0;
+bool usageLoaded = false;
+bool serverStarted = false;
+bool timeSyncStarted = false;
 
-Config config;
-
-void IRAM_ATTR pulseCounter() {
-  uint32_t now = micros();
-  if ((uint32_t)(now - lastPulseMicros) >= MIN_PULSE_US) {
-    pulseCount++;
-    lastPulseMicros = now;
-  }
-}
+BootPhaseTiming bootPhases[BOOT_PHASE_COUNT];
 
-void openValve() {
-  digitalWrite(VALVE_PIN, LOW);
-  valveState = true;
-  Serial.println(">>> VALVE OPENED <<<");
-}
+static const char *BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {
+  "storage", "config", "usage_load", "wifi", "server", "time_sync"
+};
 
-void closeValve() {
-  digitalWrite(VALVE_PIN, HIGH);
-  valveState = false;
-  Serial.println(">>> VALVE CLOSED <<<");
+const char *bootPhaseName(int phase) {
+  if (phase < 0 || phase >= BOOT_PHASE_COUNT) return "";
+  return BOOT_PHASE_NAMES[phase];
 }
 
-static void setManualOverride(bool openState) {
-  manualOverride = true;
-  manualOverrideStartInClosed = false;
-  if (timeValid) {
-    struct tm tmNow;
-    if (getLocalTimeSafe(tmNow)) {
-      manualOverrideStartInClosed = isWithinClosedWindow(tmNow.tm_hour, tmNow.tm_min);
-    }
-  }
-  if (openState) {
-    openValve();
-  } else {
-    closeValve();
+bool bootComplete() {
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    if (!bootPhases[i].done) return false;
   }
+  return true;
 }
 
-void manualOverrideOpen() {
-  leakTripped = false;
-  continuousLiters = 0.0f;
-  setManualOverride(true);
+static void bootPhaseBegin(BootPhase phase) {
+  if (bootPhases[phase].started) return;
+  bootPhases[phase].startMs = millis();
+  bootPhases[phase].started = true;
 }
 
-void manualOverrideClose() {
-  setManualOverride(false);
+static void bootPhaseEnd(BootPhase phase) {
+  if (bootPhases[phase].done) return;
+  bootPhaseBegin(phase);
+  bootPhases[phase].endMs = millis();
+  bootPhases[phase].done = true;
+  Serial.print("Boot phase ");
+  Serial.print(BOOT_PHASE_NAMES[phase]);
+  Serial.print(": ");
+  Serial.print(bootPhases[phase].endMs - bootPhases[phase].startMs);
+  Serial.println(" ms");
 }
 
 void resetCounters() {
-  noInterrupts();
-  pulseCount = 0;
-  interrupts();
+  resetChannelPulses(MAIN_CHANNEL);
   totalLiters = 0.0f;
   flowRateLpm = 0.0f;
-  leakTripped = false;
-  continuousLiters = 0.0f;
+  channels[MAIN_CHANNEL].leakTripped = false;
+  resetLeakDetectors(MAIN_CHANNEL);
   Serial.println("* Counters RESET *");
 }
 
 void printStatus() {
   Serial.println("\n=== SYSTEM STATUS ===");
   Serial.print("Valve: ");
-  Serial.println(valveState ? "OPEN" : "CLOSED");
+  Serial.println(channels[MAIN_CHANNEL].valveOpen ? "OPEN" : "CLOSED");
   Serial.print("IP: ");
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println(WiFi.localIP());
@@ -139,11 +136,27 @@ void resetDayUsage(int idx, int year, int month, int day, int wday) {
   weekUsage[idx].wday = wday;
   weekUsage[idx].totalSeconds = 0;
   weekUsage[idx].totalLiters = 0.0f;
-  weekUsage[idx].intervalCount = 0;
-  for (int i = 0; i < MAX_INTERVALS; i++) {
-    weekUsage[idx].intervals[i].startSec = 0;
-    weekUsage[idx].intervals[i].endSec = 0;
-    weekUsage[idx].intervals[i].liters = 0.0f;
+  memset(weekUsage[idx].binLiters, 0, sizeof(weekUsage[idx].binLiters));
+  clearDayIntervals(weekUsage[idx]);
+}
+
+// Spreads liters evenly over the seconds of [startSec, endSec]; a single
+// tick (startSec == endSec) lands in one bin.
+void addBinnedLiters(DayUsage &day, uint32_t startSec, uint32_t endSec, float liters) {
+  if (startSec > 86399) startSec = 86399;
+  if (endSec > 86399) endSec = 86399;
+  if (endSec < startSec) endSec = startSec;
+  int firstBin = startSec / USAGE_BIN_SECONDS;
+  int lastBin = endSec / USAGE_BIN_SECONDS;
+  if (firstBin == lastBin) {
+    day.binLiters[firstBin] += liters;
+    return;
+  }
+  float perSec = liters / (float)(endSec - startSec + 1);
+  for (int bin = firstBin; bin <= lastBin; bin++) {
+    uint32_t from = (bin == firstBin) ? startSec : bin * USAGE_BIN_SECONDS;
+    uint32_t to = (bin == lastBin) ? endSec : ((bin + 1) * USAGE_BIN_SECONDS) - 1;
+    day.binLiters[bin] += perSec * (float)(to - from + 1);
   }
 }
 
@@ -152,52 +165,13 @@ bool isTimeSane() {
   return now >= 1609459200;
 }
 
-static bool isWithinWindow(int startMin, int endMin, int nowMin) {
-  if (startMin == endMin) {
-    return false;
-  }
-  if (startMin < endMin) {
-    return (nowMin >= startMin) && (nowMin < endMin);
-  }
-  return (nowMin >= startMin) || (nowMin < endMin);
-}
-
 bool isWithinClosedWindow(int hour, int minute) {
   int nowMin = (hour * 60) + minute;
-  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    int startMin = (config.closeStartHour[i] * 60) + config.closeStartMin[i];
-    int endMin = (config.closeEndHour[i] * 60) + config.closeEndMin[i];
-    if (isWithinWindow(startMin, endMin, nowMin)) {
-      return true;
-    }
-  }
-  return false;
+  return (config->closedMinutes[nowMin / 32] >> (nowMin % 32)) & 1;
 }
 
-void startInterval(DayUsage &day, int secOfDay) {
-  if (day.intervalCount >= MAX_INTERVALS) {
-    activeIntervalIndex = -1;
-    return;
-  }
-  activeIntervalIndex = day.intervalCount;
-  day.intervals[activeIntervalIndex].startSec = secOfDay;
-  day.intervals[activeIntervalIndex].endSec = secOfDay;
-  day.intervals[activeIntervalIndex].liters = 0.0f;
-  day.intervalCount++;
-}
-
-void updateIntervalEnd(DayUsage &day, int secOfDay) {
-  if (activeIntervalIndex < 0) {
-    return;
-  }
-  day.intervals[activeIntervalIndex].endSec = secOfDay;
-}
-
-void closeInterval(DayUsage &day, int secOfDay) {
-  if (activeIntervalIndex >= 0) {
-    day.intervals[activeIntervalIndex].endSec = secOfDay;
-  }
-  activeIntervalIndex = -1;
+static uint32_t todayKey(const struct tm &tmNow) {
+  return (uint32_t)(((tmNow.tm_year + 1900) * 10000) + ((tmNow.tm_mon + 1) * 100) + tmNow.tm_mday);
 }
 
 void ensureDaySlot(struct tm &tmNow) {
@@ -208,11 +182,13 @@ void ensureDaySlot(struct tm &tmNow) {
 
   int prevIndex = weekIndex;
   if (flowActive && prevIndex >= 0) {
-    closeInterval(weekUsage[prevIndex], 86399);
+    endIntervalFlow(weekUsage[prevIndex], 86399);
   }
   if (prevIndex >= 0 && weekUsage[prevIndex].year >= 0) {
     if (!skipPersistOnNextRollover) {
-      appendDayUsageCsv(weekUsage[prevIndex]);
+      // A full queue is retried from loop(); the closed day no longer changes.
+      closedDayRetryIndex = queueDaySnapshot(weekUsage[prevIndex]) ? -1 : prevIndex;
+      telemetryDayClosed(weekUsage[prevIndex]);
     } else {
       skipPersistOnNextRollover = false;
     }
@@ -223,9 +199,10 @@ void ensureDaySlot(struct tm &tmNow) {
   currentYear = tmNow.tm_year;
   currentYday = tmNow.tm_yday;
   dailyLiters = 0.0f;
+  queueIntervalArchive(todayKey(tmNow));
 
   if (flowActive) {
-    startInterval(weekUsage[weekIndex], 0);
+    beginIntervalFlow(weekUsage[weekIndex], 0);
   }
 }
 
@@ -238,206 +215,233 @@ bool getLocalTimeSafe(struct tm &tmNow) {
   return true;
 }
 
+// Association runs in the background; loop() notices when the link is up.
 void connectWiFi() {
   WiFi.mode(WIFI_STA);
   WiFi.begin(WIFI_SSID, WIFI_PASS);
+}
+
+// SNTP runs in the background; loop() polls isTimeSane() until it lands.
+void startTimeSync() {
+  configTzTime(config->tzInfo, NTP_SERVER_1, NTP_SERVER_2);
+}
 
-  uint32_t startMs = millis();
-  while (WiFi.status() != WL_CONNECTED && (millis() - startMs) < 15000) {
-    delay(250);
+static void onTimeValid() {
+  // Without a clock the loaded days could not be placed; do it now so the
+  // first rollover does not append the last stored day a second time.
+  if (usageLoaded) {
+    struct tm tmLast = {};
+    tmLast.tm_year = lastLoadedYear - 1900;
+    tmLast.tm_mon = lastLoadedMonth - 1;
+    tmLast.tm_mday = lastLoadedDay;
+    tmLast.tm_hour = 12;
+    tmLast.tm_isdst = -1;
+    time_t lastTs = mktime(&tmLast);
+    localtime_r(&lastTs, &tmLast);
+    currentYear = tmLast.tm_year;
+    currentYday = tmLast.tm_yday;
+    skipPersistOnNextRollover = true;
   }
+  rebaseFlowSeries((uint32_t)time(nullptr) - uptimeSeconds());
+  mergePendingUsage();
 }
 
-void syncTime() {
-  configTzTime(config.tzInfo, NTP_SERVER_1, NTP_SERVER_2);
+static void serviceNetwork(uint32_t nowMs) {
+  if (WiFi.status() != WL_CONNECTED) {
+    if (nowMs - lastWifiRetryMs >= WIFI_RETRY_MS) {
+      connectWiFi();
+      lastWifiRetryMs = nowMs;
+    }
+    return;
+  }
 
-  uint32_t startMs = millis();
-  while (!isTimeSane() && (millis() - startMs) < 15000) {
-    delay(250);
+  bootPhaseEnd(BOOT_PHASE_WIFI);
+  if (!serverStarted) {
+    bootPhaseBegin(BOOT_PHASE_SERVER);
+    setupServer();
+    serverStarted = true;
+    bootPhaseEnd(BOOT_PHASE_SERVER);
+    Serial.print("Web UI: http://");
+    Serial.println(WiFi.localIP());
+  }
+
+  if (timeValid) {
+    return;
+  }
+  if (timeSyncStarted && isTimeSane()) {
+    timeValid = true;
+    bootPhaseEnd(BOOT_PHASE_TIME_SYNC);
+    onTimeValid();
+  } else if (!timeSyncStarted || (nowMs - lastTimeSyncMs) >= TIME_SYNC_RETRY_MS) {
+    bootPhaseBegin(BOOT_PHASE_TIME_SYNC);
+    startTimeSync();
+    timeSyncStarted = true;
+    lastTimeSyncMs = nowMs;
   }
-  timeValid = isTimeSane();
 }
 
 void setup() {
   Serial.begin(115200);
 
-  pinMode(FLOW_SENSOR_PIN, INPUT);     // if you have external pull-up, INPUT is fine
-  pinMode(VALVE_PIN, OUTPUT);
-  digitalWrite(VALVE_PIN, HIGH);
-
-  // Use ONE edge consistently
-  attachInterrupt(digitalPinToInterrupt(FLOW_SENSOR_PIN), pulseCounter, RISING);
-
+  // Count main-line pulses from the first moment, and drive the valve pin
+  // instead of leaving it floating while flash mounts or migrates.
+  initMainChannel();
   lastCalcMs = millis();
   lastReportMs = millis();
 
+  initIntervalPool();
   for (int i = 0; i < 7; i++) {
     resetDayUsage(i, -1, -1, -1, -1);
   }
 
-  initStorage();
-  loadConfig();
-  setenv("TZ", config.tzInfo, 1);
-  tzset();
-  bool usageLoaded = loadUsageFromCsv(lastLoadedYear, lastLoadedMonth, lastLoadedDay);
+  // Start associating first so the radio works while flash is being read.
+  bootPhaseBegin(BOOT_PHASE_WIFI);
   connectWiFi();
-  if (WiFi.status() == WL_CONNECTED) {
-    syncTime();
-    setupServer();
-    Serial.print("Web UI: http://");
-    Serial.println(WiFi.localIP());
-  }
+  lastWifiRetryMs = millis();
 
-  if (timeValid && usageLoaded) {
-    struct tm tmLast = {};
-    tmLast.tm_year = lastLoadedYear - 1900;
-    tmLast.tm_mon = lastLoadedMonth - 1;
-    tmLast.tm_mday = lastLoadedDay;
-    tmLast.tm_hour = 12;
-    tmLast.tm_isdst = -1;
-    time_t lastTs = mktime(&tmLast);
-    localtime_r(&lastTs, &tmLast);
-    currentYear = tmLast.tm_year;
-    currentYday = tmLast.tm_yday;
-    skipPersistOnNextRollover = true;
-  }
+  bootPhaseBegin(BOOT_PHASE_STORAGE);
+  initStorage();
+  bootPhaseEnd(BOOT_PHASE_STORAGE);
 
-  if (timeValid) {
-    struct tm tmNow;
-    time_t now = time(nullptr);
-    localtime_r(&now, &tmNow);
-    if (isWithinClosedWindow(tmNow.tm_hour, tmNow.tm_min)) {
-      closeValve();
-    } else {
-      openValve();
-    }
-  } else {
-    openValve();
-  }
+  bootPhaseBegin(BOOT_PHASE_CONFIG);
+  loadConfig();
+  initChannels();
+  loadTelemetryConfig();
+  bootPhaseEnd(BOOT_PHASE_CONFIG);
+
+  bootPhaseBegin(BOOT_PHASE_USAGE_LOAD);
+  usageLoaded = loadUsageFromCsv(lastLoadedYear, lastLoadedMonth, lastLoadedDay);
+  restoreRtcState(lastLoadedYear, lastLoadedMonth, lastLoadedDay, usageLoaded);
+  restoreChannelDays();
+  loadBaseline();
+  loadTelemetrySpool();
+  loadFlashWear();
+  bootPhaseEnd(BOOT_PHASE_USAGE_LOAD);
+
+  // From here on the control loop only enqueues flash writes.
+  startStorageWriter();
+
+  // The schedule is applied by loop() once the clock is valid; a leak trip
+  // carried over a reset keeps the valve shut.
+  setChannelValve(MAIN_CHANNEL, !channels[MAIN_CHANNEL].leakTripped);
 
   Serial.println("=================================");
   Serial.println("ESP32 Water Flow Control System");
-  Serial.println("Commands: OP, CL, RS, ST");
+  Serial.println("Commands: OP, CL, RS, ST, BT, LK, CH, MQ, FS, FB, WR");
   Serial.println("=================================");
 }
 
 void loop() {
   // Calculate once per second
   uint32_t nowMs = millis();
-  if (WiFi.status() != WL_CONNECTED) {
-    if (nowMs - lastWifiRetryMs >= 15000) {
-      connectWiFi();
-      lastWifiRetryMs = nowMs;
-    }
-  } else if (!timeValid && (nowMs - lastTimeSyncMs) >= 60000) {
-    syncTime();
-    lastTimeSyncMs = nowMs;
-  }
+  serviceNetwork(nowMs);
 
   if (nowMs - lastCalcMs >= 1000) {
+    publishStagedConfig();
     uint32_t pulses;
+    uint32_t lastPulseUs;
+    takeChannelPulses(MAIN_CHANNEL, pulses, lastPulseUs);
 
-    noInterrupts();
-    pulses = pulseCount;
-    pulseCount = 0;
-    interrupts();
-
-    // pulses/sec over a 1s window
-    float pulsesPerSec = (float)pulses;
+    // The first tick after boot can span several seconds of setup, so scale
+    // by the real window instead of assuming exactly one second.
+    uint32_t windowMs = nowMs - lastCalcMs;
+    float pulsesPerSec = ((float)pulses * 1000.0f) / (float)windowMs;
 
     // L/min = (pulses/sec) * (60 sec/min) / (pulses/L)
-    flowRateLpm = (pulsesPerSec * 60.0f) / config.pulsesPerLiter;
+    flowRateLpm = pulsesPerSec * 60.0f * config->litersPerPulse;
+    float litersThisTick = (float)pulses * config->litersPerPulse;
 
     lastCalcMs = nowMs;
+    addRollingPulses(uptimeSeconds(), pulses);
+    feedDripDetector(nowMs, pulses, lastPulseUs);
 
+    struct tm tmNow;
+    int secOfDay = 0;
     if (timeValid) {
-      struct tm tmNow;
       time_t now = time(nullptr);
       localtime_r(&now, &tmNow);
-
       ensureDaySlot(tmNow);
+      secOfDay = (tmNow.tm_hour * 3600) + (tmNow.tm_min * 60) + tmNow.tm_sec;
+      feedFlowSeries((uint32_t)now, flowRateLpm);
+      feedBaseline(tmNow, litersThisTick);
+    } else {
+      feedFlowSeries(uptimeSeconds(), flowRateLpm);
+    }
 
-      int secOfDay = (tmNow.tm_hour * 3600) + (tmNow.tm_min * 60) + tmNow.tm_sec;
-      bool isActive = flowRateLpm > config.flowActiveLpm;
+    bool isActive = flowRateLpm > config->flowActiveLpm;
+    if (timeValid) {
       if (isActive && !flowActive) {
-        startInterval(weekUsage[weekIndex], secOfDay);
+        beginIntervalFlow(weekUsage[weekIndex], secOfDay);
       } else if (!isActive && flowActive) {
-        closeInterval(weekUsage[weekIndex], secOfDay);
-      }
-
-      if (!config.leakProtectionEnabled) {
-        leakTripped = false;
-        continuousLiters = 0.0f;
+        endIntervalFlow(weekUsage[weekIndex], secOfDay);
       }
+    } else {
+      // No wall clock yet: keep usage on the boot-relative timeline until
+      // NTP lands and onTimeValid() merges it into weekUsage.
+      recordPendingUsage(uptimeSeconds(), isActive, isActive ? litersThisTick : 0.0f, flowRateLpm, pulses);
+    }
 
-      if (isActive) {
-        float litersThisSecond = flowRateLpm / 60.0f;
-        weekUsage[weekIndex].totalSeconds++;
-        weekUsage[weekIndex].totalLiters += litersThisSecond;
-        totalLiters += litersThisSecond;
-        dailyLiters += litersThisSecond;
-        if (config.leakProtectionEnabled && !leakTripped) {
-          continuousLiters += litersThisSecond;
-          if (continuousLiters >= config.leakThresholdLiters) {
-            leakTripped = true;
-            closeValve();
-            appendLeakEventCsv(&tmNow, "FLOW_LIMIT", totalLiters, dailyLiters,
-                               continuousLiters, config.leakThresholdLiters, true);
-            Serial.println("!!! LEAK DETECTED: FLOW LIMIT EXCEEDED - VALVE CLOSED !!!");
-          }
-        }
-        if (activeIntervalIndex >= 0) {
-          weekUsage[weekIndex].intervals[activeIntervalIndex].liters += litersThisSecond;
-          updateIntervalEnd(weekUsage[weekIndex], secOfDay);
-        }
-      } else {
-        continuousLiters = 0.0f;
-      }
-      flowActive = isActive;
+    ChannelState &mainSt = channels[MAIN_CHANNEL];
+    if (!config->leakProtectionEnabled) {
+      mainSt.leakTripped = false;
+      continuousLiters = 0.0f;
+    }
 
-      bool inClosedWindow = isWithinClosedWindow(tmNow.tm_hour, tmNow.tm_min);
-      if (leakTripped && lastInClosedWindow && !inClosedWindow) {
-        leakTripped = false;
-        continuousLiters = 0.0f;
-      }
-      if (leakTripped) {
-        if (valveState) {
-          closeValve();
-        }
-      } else {
-        if (manualOverride) {
-          if (inClosedWindow != manualOverrideStartInClosed) {
-            manualOverride = false;
-            if (inClosedWindow && valveState) {
-              closeValve();
-            } else if (!inClosedWindow && !valveState) {
-              openValve();
-            }
-          }
-        } else {
-          if (inClosedWindow && valveState) {
-            closeValve();
-          } else if (!inClosedWindow && !valveState) {
-            openValve();
-          }
-        }
+    if (isActive) {
+      totalLiters += litersThisTick;
+      if (timeValid) {
+        // A tick covers windowMs, which can be well over a second after
+        // boot or a slow handler; count that, not one second per tick.
+        activeMsCarry += windowMs;
+        weekUsage[weekIndex].totalSeconds += activeMsCarry / 1000;
+        activeMsCarry %= 1000;
+        weekUsage[weekIndex].totalLiters += litersThisTick;
+        addBinnedLiters(weekUsage[weekIndex], secOfDay, secOfDay, litersThisTick);
+        dailyLiters += litersThisTick;
+        addIntervalFlow(weekUsage[weekIndex], secOfDay, litersThisTick, flowRateLpm, pulses);
       }
-      lastInClosedWindow = inClosedWindow;
     }
 
+    // Leak protection does not depend on the clock; only the time-of-day
+    // detectors sit out until it is valid.
+    bool inClosedWindow = timeValid && isWithinClosedWindow(tmNow.tm_hour, tmNow.tm_min);
+    LeakTickInput leakIn;
+    leakIn.channel = MAIN_CHANNEL;
+    leakIn.uptimeSec = uptimeSeconds();
+    leakIn.liters = litersThisTick;
+    leakIn.flowLpm = flowRateLpm;
+    leakIn.active = isActive;
+    leakIn.tmNow = timeValid ? &tmNow : nullptr;
+    leakIn.inClosedWindow = inClosedWindow;
+    runLeakDetectors(leakIn);
+    flowActive = isActive;
+
+    applyChannelValve(MAIN_CHANNEL, timeValid ? &tmNow : nullptr);
+    mainSt.flowRateLpm = flowRateLpm;
+    mainSt.totalLiters = totalLiters;
+    mainSt.dailyLiters = dailyLiters;
+    mainSt.continuousLiters = continuousLiters;
+    tickBranchChannels(nowMs, windowMs, timeValid ? &tmNow : nullptr);
+    saveRtcState();
+
+    if (closedDayRetryIndex >= 0 && queueDaySnapshot(weekUsage[closedDayRetryIndex])) {
+      closedDayRetryIndex = -1;
+    }
     if (timeValid && (nowMs - lastSnapshotMs >= SNAPSHOT_INTERVAL_MS)) {
       const DayUsage &day = weekUsage[weekIndex];
       if (day.year >= 0 &&
           (day.totalSeconds != lastSnapshotSeconds ||
            day.totalLiters != lastSnapshotLiters ||
-           day.intervalCount != lastSnapshotIntervals)) {
-        snapshotDayUsageCsv(day);
+           day.intervalCount != lastSnapshotIntervals) &&
+          queueDaySnapshot(day)) {
         lastSnapshotSeconds = day.totalSeconds;
         lastSnapshotLiters = day.totalLiters;
         lastSnapshotIntervals = day.intervalCount;
       }
       lastSnapshotMs = nowMs;
     }
+    serviceStorageManager(nowMs, timeValid ? todayKey(tmNow) : 0);
+    serviceFlashWear(nowMs);
   }
 
   if (nowMs - lastFlowLogMs >= 3000) {
@@ -460,15 +464,24 @@ void loop() {
     cmd.toUpperCase();
 
     if (cmd == "OP") {
-      manualOverrideOpen();
+      channelManualOverride(MAIN_CHANNEL, true);
     }
-    else if (cmd == "CL") manualOverrideClose();
+    else if (cmd == "CL") channelManualOverride(MAIN_CHANNEL, false);
     else if (cmd == "RS") resetCounters();
     else if (cmd == "ST") printReportTo(Serial);
-    else Serial.println("Unknown command. Use: OP, CL, RS, ST, PS");
+    else if (cmd == "BT") printBootTimingsTo(Serial);
+    else if (cmd == "LK") printLeakDetectorsTo(Serial);
+    else if (cmd == "CH") printChannelsTo(Serial);
+    else if (cmd == "MQ") printTelemetryTo(Serial);
+    else if (cmd == "FS") printStorageHealthTo(Serial);
+    else if (cmd == "FB") queueFlashBenchmark();
+    else if (cmd == "WR") printFlashWearTo(Serial);
+    else Serial.println("Unknown command. Use: OP, CL, RS, ST, BT, LK, CH, MQ, FS, FB, WR");
   }
 
-  if (WiFi.status() == WL_CONNECTED) {
+  serviceTelemetry(nowMs);
+
+  if (serverStarted && WiFi.status() == WL_CONNECTED) {
     handleWebServer();
   }
 }
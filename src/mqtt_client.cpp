@@ -0,0 +1,178 @@
+#include "mqtt_client.h"
+
+#include <string.h>
+
+static const uint8_t MQTT_CONNECT = 0x10;
+static const uint8_t MQTT_CONNACK = 0x20;
+static const uint8_t MQTT_PUBLISH = 0x30;
+static const uint8_t MQTT_PINGREQ = 0xC0;
+static const uint8_t MQTT_DISCONNECT = 0xE0;
+static const uint8_t MQTT_PROTOCOL_LEVEL = 4;
+static const uint8_t MQTT_CLEAN_SESSION = 0x02;
+static const uint32_t MQTT_MAX_LENGTH = 268435455;
+static const uint32_t CONNACK_TIMEOUT_MS = 5000;
+
+size_t mqttEncodeLength(uint32_t len, uint8_t *out) {
+  if (len > MQTT_MAX_LENGTH) return 0;
+  size_t n = 0;
+  do {
+    uint8_t digit = len % 128;
+    len /= 128;
+    if (len > 0) digit |= 0x80;
+    out[n++] = digit;
+  } while (len > 0);
+  return n;
+}
+
+MqttClient::MqttClient(Client &net)
+    : net(net), state(STATE_IDLE), refusal(0), pingOutstanding(false), keepAliveSec(60), connectMs(0),
+      lastTxMs(0), lastRxMs(0), rxState(RX_HEADER), rxType(0), rxRemaining(0),
+      rxMultiplier(1), rxPos(0) {}
+
+bool MqttClient::writeAll(const uint8_t *data, size_t len) {
+  if (len == 0) return true;
+  if (net.write(data, len) != len) {
+    stop();
+    return false;
+  }
+  lastTxMs = millis();
+  return true;
+}
+
+bool MqttClient::begin(const char *host, uint16_t port, const char *clientId, uint16_t keepAlive) {
+  stop();
+  if (!net.connect(host, port)) return false;
+  return start(clientId, keepAlive);
+}
+
+bool MqttClient::start(const char *clientId, uint16_t keepAlive) {
+  keepAliveSec = keepAlive;
+  refusal = 0;
+  pingOutstanding = false;
+  rxState = RX_HEADER;
+  size_t idLen = strlen(clientId);
+  uint8_t head[16];
+  size_t n = 0;
+  head[n++] = MQTT_CONNECT;
+  n += mqttEncodeLength(10 + 2 + idLen, head + n);
+  static const uint8_t protocolName[] = {0x00, 0x04, 'M', 'Q', 'T', 'T'};
+  memcpy(head + n, protocolName, sizeof(protocolName));
+  n += sizeof(protocolName);
+  head[n++] = MQTT_PROTOCOL_LEVEL;
+  head[n++] = MQTT_CLEAN_SESSION;
+  head[n++] = (uint8_t)(keepAliveSec >> 8);
+  head[n++] = (uint8_t)keepAliveSec;
+  head[n++] = (uint8_t)(idLen >> 8);
+  head[n++] = (uint8_t)idLen;
+  state = STATE_CONNECTING;
+  if (!writeAll(head, n) || !writeAll((const uint8_t *)clientId, idLen)) return false;
+  connectMs = lastTxMs;
+  lastRxMs = lastTxMs;
+  return true;
+}
+
+bool MqttClient::publish(const char *topic, const uint8_t *payload, size_t len, bool retain) {
+  if (state != STATE_CONNECTED) return false;
+  size_t topicLen = strlen(topic);
+  uint8_t head[8];
+  size_t n = 0;
+  head[n++] = MQTT_PUBLISH | (retain ? 0x01 : 0x00);
+  size_t lenBytes = mqttEncodeLength(2 + topicLen + len, head + n);
+  if (lenBytes == 0) return false;
+  n += lenBytes;
+  head[n++] = (uint8_t)(topicLen >> 8);
+  head[n++] = (uint8_t)topicLen;
+  return writeAll(head, n) && writeAll((const uint8_t *)topic, topicLen) && writeAll(payload, len);
+}
+
+void MqttClient::stop() {
+  if (state == STATE_CONNECTED) {
+    static const uint8_t disconnect[] = {MQTT_DISCONNECT, 0x00};
+    net.write(disconnect, sizeof(disconnect));
+  }
+  if (state != STATE_IDLE) net.stop();
+  state = STATE_IDLE;
+}
+
+void MqttClient::onPacket(uint32_t nowMs) {
+  lastRxMs = nowMs;
+  pingOutstanding = false;
+  if (rxType == MQTT_CONNACK && state == STATE_CONNECTING) {
+    // Byte 0 is the session-present flag, byte 1 the return code.
+    if (rxPos >= 2 && rxBody[1] == 0) {
+      state = STATE_CONNECTED;
+    } else {
+      refusal = rxPos >= 2 ? rxBody[1] : 0xFF;
+      stop();
+    }
+  }
+  // PINGRESP and anything unexpected only refresh lastRxMs.
+}
+
+void MqttClient::loop(uint32_t nowMs) {
+  if (state == STATE_IDLE) return;
+  if (!net.connected()) {
+    stop();
+    return;
+  }
+
+  while (state != STATE_IDLE && net.available() > 0) {
+    int c = net.read();
+    if (c < 0) break;
+    uint8_t b = (uint8_t)c;
+    switch (rxState) {
+      case RX_HEADER:
+        rxType = b & 0xF0;
+        rxRemaining = 0;
+        rxMultiplier = 1;
+        rxPos = 0;
+        rxState = RX_LENGTH;
+        break;
+      case RX_LENGTH:
+        rxRemaining += (uint32_t)(b & 0x7F) * rxMultiplier;
+        rxMultiplier *= 128;
+        if (b & 0x80) {
+          if (rxMultiplier > 128 * 128 * 128) {
+            stop();
+            return;
+          }
+          break;
+        }
+        if (rxRemaining == 0) {
+          rxState = RX_HEADER;
+          onPacket(nowMs);
+        } else {
+          rxState = RX_BODY;
+        }
+        break;
+      case RX_BODY:
+        if (rxPos < sizeof(rxBody)) rxBody[rxPos++] = b;
+        if (--rxRemaining == 0) {
+          rxState = RX_HEADER;
+          onPacket(nowMs);
+        }
+        break;
+    }
+  }
+
+  if (state == STATE_CONNECTING) {
+    if (nowMs - connectMs >= CONNACK_TIMEOUT_MS) stop();
+    return;
+  }
+  if (state != STATE_CONNECTED || keepAliveSec == 0) return;
+
+  uint32_t keepAliveMs = (uint32_t)keepAliveSec * 1000;
+  // The broker drops us after 1.5 keepalives of silence; give up on it after
+  // the same time without a PINGRESP.
+  if (nowMs - lastRxMs >= keepAliveMs + (keepAliveMs / 2)) {
+    stop();
+    return;
+  }
+  // Steady publishing keeps lastTxMs fresh, so also ping when the broker
+  // has been quiet; that is the only way to hear from it.
+  if (!pingOutstanding &&
+      (nowMs - lastTxMs >= keepAliveMs / 2 || nowMs - lastRxMs >= keepAliveMs / 2)) {
+    static const uint8_t ping[] = {MQTT_PINGREQ, 0x00};
+    pingOutstanding = writeAll(ping, sizeof(ping));
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Minimal MQTT 3.1.1 publisher: clean session, QoS 0 publishes and keepalive
+// pings, nothing is subscribed. It only talks through an Arduino Client, so
+// a host build can run it over a plain socket against a local broker.
+class MqttClient {
+public:
+  explicit MqttClient(Client &net);
+
+  // Opens the TCP link and sends CONNECT; connected() turns true once
+  // loop() has seen the CONNACK.
+  bool begin(const char *host, uint16_t port, const char *clientId, uint16_t keepAliveSec);
+  // Sends CONNECT over a link the caller has already opened, e.g. from a
+  // task so a slow DNS lookup or TCP handshake never stalls loop().
+  bool start(const char *clientId, uint16_t keepAliveSec);
+  bool publish(const char *topic, const uint8_t *payload, size_t len, bool retain = false);
+  void loop(uint32_t nowMs);
+  void stop();
+
+  bool connected() const { return state == STATE_CONNECTED; }
+  bool connecting() const { return state == STATE_CONNECTING; }
+  // CONNACK return code of the last refused connect, 0 otherwise.
+  uint8_t lastRefusal() const { return refusal; }
+
+private:
+  MqttClient(const MqttClient &) = delete;
+  MqttClient &operator=(const MqttClient &) = delete;
+
+  enum State : uint8_t { STATE_IDLE, STATE_CONNECTING, STATE_CONNECTED };
+  enum RxState : uint8_t { RX_HEADER, RX_LENGTH, RX_BODY };
+
+  bool writeAll(const uint8_t *data, size_t len);
+  void onPacket(uint32_t nowMs);
+
+  Client &net;
+  State state;
+  uint8_t refusal;
+  bool pingOutstanding;
+  uint16_t keepAliveSec;
+  uint32_t connectMs;
+  uint32_t lastTxMs;
+  uint32_t lastRxMs;
+
+  RxState rxState;
+  uint8_t rxType;
+  uint32_t rxRemaining;
+  uint32_t rxMultiplier;
+  uint8_t rxBody[4];
+  uint8_t rxPos;
+};
+
+// Writes the variable-length "remaining length" field; returns its size
+// (1..4 bytes), or 0 when len exceeds the protocol limit.
+size_t mqttEncodeLength(uint32_t len, uint8_t *out);
@@ -0,0 +1,138 @@
+#include "pending_usage.h"
+
+#include <esp_timer.h>
+#include <time.h>
+
+#include "app_state.h"
+#include "interval_coalescer.h"
+#include "interval_pool.h"
+#include "storage_writer.h"
+
+static const int MAX_PENDING_INTERVALS = 64;
+
+// Same rows as DayInterval, but startSec/endSec are uptime seconds and
+// samples doubles as the active-second count.
+static DayInterval pending[MAX_PENDING_INTERVALS];
+static int pendingCount = 0;
+static bool pendingOpen = false;
+// Running statistics of the last row while it is open.
+static IntervalStats pendingStats;
+
+uint32_t uptimeSeconds() {
+  // esp_timer is 64-bit, so this does not wrap like millis() after 49 days.
+  return (uint32_t)(esp_timer_get_time() / 1000000LL);
+}
+
+void recordPendingUsage(uint32_t uptimeSec, bool active, float liters, float flowLpm,
+                        uint32_t pulses) {
+  if (!active) {
+    if (pendingOpen) {
+      pending[pendingCount - 1].endSec = uptimeSec;
+      pendingOpen = false;
+    }
+    return;
+  }
+
+  if (!pendingOpen) {
+    // Same gap rule as beginIntervalFlow(), on the uptime timeline.
+    bool merge = pendingCount > 0 && config->mergeGapSec > 0 &&
+                 uptimeSec - pending[pendingCount - 1].endSec <= config->mergeGapSec;
+    if (merge) {
+      DayInterval &prev = pending[pendingCount - 1];
+      if (prev.mergedGaps < 0xFFFF) prev.mergedGaps++;
+      loadIntervalStats(pendingStats, prev);
+    } else if (pendingCount < MAX_PENDING_INTERVALS) {
+      DayInterval &it = pending[pendingCount++];
+      it = DayInterval();
+      it.startSec = uptimeSec;
+      it.endSec = uptimeSec;
+      pendingStats = IntervalStats();
+    } else {
+      // Out of slots: keep extending the last interval so no liters are lost.
+      loadIntervalStats(pendingStats, pending[pendingCount - 1]);
+    }
+    pendingOpen = true;
+  }
+
+  DayInterval &it = pending[pendingCount - 1];
+  it.endSec = uptimeSec;
+  it.liters += liters;
+  addIntervalSample(pendingStats, it, flowLpm, pulses);
+}
+
+int pendingIntervalCount() {
+  return pendingCount;
+}
+
+float pendingLiters() {
+  float liters = 0.0f;
+  for (int i = 0; i < pendingCount; i++) {
+    liters += pending[i].liters;
+  }
+  return liters;
+}
+
+static int secondsOfDay(const struct tm &tmVal) {
+  return (tmVal.tm_hour * 3600) + (tmVal.tm_min * 60) + tmVal.tm_sec;
+}
+
+void mergePendingUsage() {
+  if (pendingCount == 0 || !timeValid) {
+    return;
+  }
+
+  time_t nowWall = time(nullptr);
+  uint32_t nowUp = uptimeSeconds();
+  bool wasActive = flowActive;
+  // Replay closed intervals only; ensureDaySlot() must not open new ones.
+  flowActive = false;
+  activeIntervalIndex = -1;
+
+  int lastIdx = -1;
+  for (int i = 0; i < pendingCount; i++) {
+    const DayInterval &it = pending[i];
+    time_t startTs = nowWall - (time_t)(nowUp - it.startSec);
+    time_t endTs = nowWall - (time_t)(nowUp - it.endSec);
+    struct tm tmStart;
+    struct tm tmEnd;
+    localtime_r(&startTs, &tmStart);
+    localtime_r(&endTs, &tmEnd);
+
+    // Attribute the whole interval to the day it started on.
+    ensureDaySlot(tmStart);
+    DayUsage &day = weekUsage[weekIndex];
+    uint32_t startSec = secondsOfDay(tmStart);
+    uint32_t endSec = (tmEnd.tm_yday == tmStart.tm_yday) ? secondsOfDay(tmEnd) : 86399;
+    DayInterval row = it;
+    row.startSec = startSec;
+    row.endSec = endSec;
+    lastIdx = addDayInterval(day, row);
+    day.totalSeconds += it.samples;
+    day.totalLiters += it.liters;
+    addBinnedLiters(day, startSec, endSec, it.liters);
+    dailyLiters += it.liters;
+  }
+
+  struct tm tmNow;
+  localtime_r(&nowWall, &tmNow);
+  bool sameDay = (tmNow.tm_year == currentYear && tmNow.tm_yday == currentYday);
+  ensureDaySlot(tmNow);
+
+  // Flow still running: keep filling the last replayed interval if it landed
+  // on today, otherwise open a fresh one.
+  flowActive = wasActive;
+  if (wasActive) {
+    if (pendingOpen && sameDay && lastIdx >= 0) {
+      resumeIntervalFlow(weekUsage[weekIndex], lastIdx);
+    } else {
+      beginIntervalFlow(weekUsage[weekIndex], secondsOfDay(tmNow));
+    }
+  }
+
+  queueDaySnapshot(weekUsage[weekIndex]);
+  Serial.print("Merged pre-NTP usage: ");
+  Serial.print(pendingCount);
+  Serial.println(" intervals");
+  pendingCount = 0;
+  pendingOpen = false;
+}
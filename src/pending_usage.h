@@ -0,0 +1,11 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Usage seen before the wall clock is valid, kept on a boot-relative timeline.
+uint32_t uptimeSeconds();
+void recordPendingUsage(uint32_t uptimeSec, bool active, float liters, float flowLpm,
+                        uint32_t pulses);
+void mergePendingUsage();
+int pendingIntervalCount();
+float pendingLiters();
@@ -1,6 +1,9 @@
 #include "report.h"
 
 #include "app_state.h"
+#include "interval_coalescer.h"
+#include "interval_pool.h"
+#include "usage_bins.h"
 
 static void printTimeHM(Print &out, uint32_t secOfDay) {
   uint32_t hour = secOfDay / 3600;
@@ -105,17 +108,23 @@ void printReportTo(Print &out) {
     out.println(" L");
 
     bool printed = false;
-    for (int j = 0; j < weekUsage[idx].intervalCount; j++) {
+    if (weekUsage[idx].spilledCount > 0) {
+      out.print("  (");
+      out.print(weekUsage[idx].spilledCount);
+      out.println(" older intervals on flash only)");
+    }
+    for (int j = weekUsage[idx].spilledCount; j < weekUsage[idx].intervalCount; j++) {
+      const DayInterval *it = dayInterval(weekUsage[idx], j);
       // Hide tiny intervals from reports; totals still include them.
-      if (weekUsage[idx].intervals[j].liters < config.minIntervalLiters) {
+      if (!it || it->liters < config->minIntervalLiters) {
         continue;
       }
       if (!printed) {
         out.println("  FROM   TO     DUR       L");
         printed = true;
       }
-      uint32_t startSec = weekUsage[idx].intervals[j].startSec;
-      uint32_t endSec = weekUsage[idx].intervals[j].endSec;
+      uint32_t startSec = it->startSec;
+      uint32_t endSec = it->endSec;
       uint32_t duration = (endSec >= startSec) ? (endSec - startSec) : 0;
       out.print("  ");
       printTimeHM(out, startSec);
@@ -124,7 +133,7 @@ void printReportTo(Print &out) {
       printPadding(out, 2);
       printDuration(out, duration);
       printPadding(out, 2);
-      printFloatFixed(out, weekUsage[idx].intervals[j].liters, 7, 3);
+      printFloatFixed(out, it->liters, 7, 3);
       out.println();
     }
     if (!printed) {
@@ -134,6 +143,24 @@ void printReportTo(Print &out) {
   }
 }
 
+void printBootTimingsTo(Print &out) {
+  out.println("BOOT PHASE    START(ms)  DUR(ms)");
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    const BootPhaseTiming &phase = bootPhases[i];
+    char line[48];
+    if (phase.done) {
+      snprintf(line, sizeof(line), "%-12s %9lu %8lu", bootPhaseName(i),
+               (unsigned long)phase.startMs, (unsigned long)(phase.endMs - phase.startMs));
+    } else if (phase.started) {
+      snprintf(line, sizeof(line), "%-12s %9lu  pending", bootPhaseName(i),
+               (unsigned long)phase.startMs);
+    } else {
+      snprintf(line, sizeof(line), "%-12s   not started", bootPhaseName(i));
+    }
+    out.println(line);
+  }
+}
+
 static void formatTimeHM(char *buf, size_t size, uint32_t secOfDay) {
   uint32_t hour = secOfDay / 3600;
   uint32_t minute = (secOfDay % 3600) / 60;
@@ -150,7 +177,7 @@ static void formatDuration(char *buf, size_t size, uint32_t seconds) {
 
 String buildReportJson() {
   String json;
-  json.reserve(2048);
+  json.reserve(3072);
 
   uint32_t weekSeconds = 0;
   float weekLiters = 0.0f;
@@ -192,15 +219,20 @@ String buildReportJson() {
     json += String(weekUsage[idx].totalLiters, 3);
 
     int visibleIntervals = 0;
-    for (int j = 0; j < weekUsage[idx].intervalCount; j++) {
+    for (int j = weekUsage[idx].spilledCount; j < weekUsage[idx].intervalCount; j++) {
+      const DayInterval *it = dayInterval(weekUsage[idx], j);
       // Hide tiny intervals from reports; totals still include them.
-      if (weekUsage[idx].intervals[j].liters < config.minIntervalLiters) {
+      if (!it || it->liters < config->minIntervalLiters) {
         continue;
       }
       visibleIntervals++;
     }
+    json += ",\"bins_l\":";
+    appendBinsJson(json, weekUsage[idx].binLiters);
     json += ",\"intervals_count\":";
     json += String(visibleIntervals);
+    json += ",\"spilled_intervals\":";
+    json += String(weekUsage[idx].spilledCount);
     json += "}";
   }
 
@@ -247,18 +279,25 @@ String buildReportDayJson(const String &date) {
   json += String(day->totalSeconds);
   json += ",\"total_l\":";
   json += String(day->totalLiters, 3);
+  json += ",\"spilled_intervals\":";
+  json += String(day->spilledCount);
+  json += ",\"bin_sec\":";
+  json += String(USAGE_BIN_SECONDS);
+  json += ",\"bins_l\":";
+  appendBinsJson(json, day->binLiters);
   json += ",\"intervals\":[";
 
   bool firstInterval = true;
-  for (int j = 0; j < day->intervalCount; j++) {
+  for (int j = day->spilledCount; j < day->intervalCount; j++) {
+    const DayInterval *it = dayInterval(*day, j);
     // Hide tiny intervals from reports; totals still include them.
-    if (day->intervals[j].liters < config.minIntervalLiters) {
+    if (!it || it->liters < config->minIntervalLiters) {
       continue;
     }
     if (!firstInterval) json += ",";
     firstInterval = false;
-    uint32_t startSec = day->intervals[j].startSec;
-    uint32_t endSec = day->intervals[j].endSec;
+    uint32_t startSec = it->startSec;
+    uint32_t endSec = it->endSec;
     uint32_t duration = (endSec >= startSec) ? (endSec - startSec) : 0;
     char fromBuf[8];
     char toBuf[8];
@@ -274,7 +313,21 @@ String buildReportDayJson(const String &date) {
     json += "\",\"dur\":\"";
     json += durBuf;
     json += "\",\"liters\":";
-    json += String(day->intervals[j].liters, 3);
+    json += String(it->liters, 3);
+    json += ",\"gaps\":";
+    json += String(it->mergedGaps);
+    json += ",\"peak_lpm\":";
+    json += String(intervalPeakLpm(*it), 2);
+    json += ",\"min_lpm\":";
+    json += String(intervalMinLpm(*it), 2);
+    json += ",\"mean_lpm\":";
+    json += String(intervalMeanLpm(*it), 2);
+    json += ",\"sd_lpm\":";
+    json += String(intervalStdDevLpm(*it), 2);
+    json += ",\"samples\":";
+    json += String(it->samples);
+    json += ",\"pulses\":";
+    json += String(it->pulses);
     json += "}";
   }
   json += "]}";
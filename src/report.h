@@ -3,6 +3,7 @@
 #include <Arduino.h>
 
 void printReportTo(Print &out);
+void printBootTimingsTo(Print &out);
 void computeWeekTotals(uint32_t &seconds, float &liters);
 String buildReportJson();
 String buildReportDayJson(const String &date);
@@ -0,0 +1,56 @@
+#include "rolling_usage.h"
+
+#include "app_state.h"
+
+// 1 h in 1 min buckets, 24 h in 15 min buckets, 7 d in 1 h buckets.
+static uint32_t buckets1h[60];
+static uint32_t buckets24h[96];
+static uint32_t buckets7d[168];
+
+struct RollingRing {
+  const char *name;
+  uint32_t *buckets;
+  uint32_t count;
+  uint32_t bucketSec;
+  uint32_t lastBucket;
+  uint32_t pos;
+  uint32_t total;
+};
+
+static RollingRing rings[ROLLING_WINDOW_COUNT] = {
+    {"1h", buckets1h, sizeof(buckets1h) / sizeof(buckets1h[0]), 60, 0, 0, 0},
+    {"24h", buckets24h, sizeof(buckets24h) / sizeof(buckets24h[0]), 900, 0, 0, 0},
+    {"7d", buckets7d, sizeof(buckets7d) / sizeof(buckets7d[0]), 3600, 0, 0, 0},
+};
+
+void addRollingPulses(uint32_t uptimeSec, uint32_t pulses) {
+  for (int i = 0; i < ROLLING_WINDOW_COUNT; i++) {
+    RollingRing &r = rings[i];
+    uint32_t bucket = uptimeSec / r.bucketSec;
+    if (bucket > r.lastBucket) {
+      // Expire the buckets the clock moved past; bounded by the ring size.
+      uint32_t steps = bucket - r.lastBucket;
+      if (steps > r.count) steps = r.count;
+      for (uint32_t s = 0; s < steps; s++) {
+        r.pos = (r.pos + 1) % r.count;
+        r.total -= r.buckets[r.pos];
+        r.buckets[r.pos] = 0;
+      }
+      r.lastBucket = bucket;
+    }
+    r.buckets[r.pos] += pulses;
+    r.total += pulses;
+  }
+}
+
+uint32_t rollingPulses(RollingWindow window) {
+  return rings[window].total;
+}
+
+float rollingLiters(RollingWindow window) {
+  return (float)rings[window].total * config->litersPerPulse;
+}
+
+const char *rollingWindowName(RollingWindow window) {
+  return rings[window].name;
+}
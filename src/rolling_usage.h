@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Rolling consumption over the last hour, day and week, kept as rings of
+// pulse buckets on the uptime clock so NTP steps cannot distort them. Every
+// pulse counts, including flow below flow_active_lpm, so slow intermittent
+// leaks add up. A window spans its bucket count, with the oldest bucket
+// being partly expired, so totals are exact to one bucket width.
+enum RollingWindow {
+  ROLLING_1H,
+  ROLLING_24H,
+  ROLLING_7D,
+  ROLLING_WINDOW_COUNT
+};
+
+void addRollingPulses(uint32_t uptimeSec, uint32_t pulses);
+uint32_t rollingPulses(RollingWindow window);
+float rollingLiters(RollingWindow window);
+const char *rollingWindowName(RollingWindow window);
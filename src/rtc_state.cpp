@@ -0,0 +1,151 @@
+#include "rtc_state.h"
+
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <rom/crc.h>
+#include <stddef.h>
+
+#include "app_state.h"
+#include "channels.h"
+#include "interval_pool.h"
+#include "storage.h"
+
+static const uint32_t RTC_STATE_MAGIC = 0x57415452;  // "WATR"
+static const uint16_t RTC_STATE_VERSION = 6;
+// Newest intervals of the live day kept in RTC memory; older ones are on
+// flash from earlier snapshots. Two slots of these must fit RTC slow memory.
+static const int RTC_INTERVALS = 40;
+
+struct RtcState {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t seq;
+  DayUsage day;
+  uint16_t firstInterval;
+  uint16_t intervalCount;
+  DayInterval intervals[RTC_INTERVALS];
+  float totalLiters;
+  float continuousLiters;
+  uint8_t leakTripped;
+  uint32_t crc;
+};
+
+// Two slots written alternately, so a reset in the middle of an update still
+// leaves the previous tick intact.
+RTC_NOINIT_ATTR static RtcState rtcSlots[2];
+static uint32_t rtcSeq = 0;
+
+static uint32_t rtcStateCrc(const RtcState &state) {
+  return crc32_le(0, (const uint8_t *)&state, offsetof(RtcState, crc));
+}
+
+static bool rtcSlotValid(const RtcState &state) {
+  return state.magic == RTC_STATE_MAGIC &&
+         state.version == RTC_STATE_VERSION &&
+         state.size == sizeof(RtcState) &&
+         state.crc == rtcStateCrc(state);
+}
+
+void saveRtcState() {
+  rtcSeq++;
+  RtcState &state = rtcSlots[rtcSeq & 1];
+  state.magic = RTC_STATE_MAGIC;
+  state.version = RTC_STATE_VERSION;
+  state.size = sizeof(RtcState);
+  state.seq = rtcSeq;
+  const DayUsage &day = weekUsage[weekIndex];
+  state.day = day;
+  int first = day.intervalCount - RTC_INTERVALS;
+  if (first < day.spilledCount) first = day.spilledCount;
+  int count = 0;
+  for (int i = first; i < day.intervalCount; i++) {
+    state.intervals[count++] = *dayInterval(day, i);
+  }
+  state.firstInterval = first;
+  state.intervalCount = count;
+  state.totalLiters = totalLiters;
+  state.continuousLiters = continuousLiters;
+  state.leakTripped = channels[MAIN_CHANNEL].leakTripped ? 1 : 0;
+  state.crc = rtcStateCrc(state);
+}
+
+static int dateKey(int year, int month, int day) {
+  return (year * 10000) + (month * 100) + day;
+}
+
+bool restoreRtcState(int &lastYear, int &lastMonth, int &lastDay, bool &usageLoaded) {
+  if (esp_reset_reason() == ESP_RST_POWERON) {
+    return false;
+  }
+  const RtcState *state = nullptr;
+  for (int i = 0; i < 2; i++) {
+    if (rtcSlotValid(rtcSlots[i]) && (!state || rtcSlots[i].seq > state->seq)) {
+      state = &rtcSlots[i];
+    }
+  }
+  if (!state) {
+    return false;
+  }
+  rtcSeq = state->seq;
+
+  totalLiters = state->totalLiters;
+  continuousLiters = state->continuousLiters;
+  channels[MAIN_CHANNEL].leakTripped = state->leakTripped != 0;
+
+  const DayUsage &saved = state->day;
+  if (saved.year < 0) {
+    return true;
+  }
+
+  // Reconcile with the last flash snapshot: the RTC copy wins when it is for
+  // the same or a later day, since flash lags it by up to one snapshot period.
+  int savedKey = dateKey(saved.year, saved.month, saved.day);
+  int loadedKey = usageLoaded ? dateKey(lastYear, lastMonth, lastDay) : -1;
+  if (savedKey < loadedKey) {
+    return true;
+  }
+  if (savedKey > loadedKey) {
+    if (usageLoaded) {
+      weekIndex = (weekIndex + 1) % 7;
+    }
+    clearDayIntervals(weekUsage[weekIndex]);
+  }
+  DayUsage &day = weekUsage[weekIndex];
+  day.year = saved.year;
+  day.month = saved.month;
+  day.day = saved.day;
+  day.wday = saved.wday;
+  day.totalSeconds = saved.totalSeconds;
+  day.totalLiters = saved.totalLiters;
+  memcpy(day.binLiters, saved.binLiters, sizeof(day.binLiters));
+  // RTC memory only keeps the newest rows. When they start past the rows
+  // loaded from flash, the ones before them are filed as spilled, so the
+  // snapshot below keeps what intervals.csv has of them instead of
+  // replacing the day with the RTC rows alone; any that never reached
+  // flash are lost either way.
+  if (state->firstInterval > day.intervalCount) {
+    markDayIntervalsOnFlash(day, state->firstInterval);
+  }
+  // Rows flash already has are refreshed in place; newer ones are appended.
+  for (int i = 0; i < state->intervalCount; i++) {
+    int index = state->firstInterval + i;
+    if (index < day.intervalCount) {
+      DayInterval *it = dayInterval(day, index);
+      if (it) *it = state->intervals[i];
+    } else {
+      addDayInterval(day, state->intervals[i]);
+    }
+  }
+  dailyLiters = saved.totalLiters;
+  lastYear = saved.year;
+  lastMonth = saved.month;
+  lastDay = saved.day;
+  usageLoaded = true;
+  snapshotDayUsageCsv(weekUsage[weekIndex]);
+
+  Serial.print("Restored day from RTC memory: ");
+  Serial.print(saved.totalLiters, 3);
+  Serial.println(" L");
+  return true;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Mirror of the live day and counters in RTC slow memory, which survives
+// panics, watchdog and brownout resets but not a power cycle.
+void saveRtcState();
+bool restoreRtcState(int &lastYear, int &lastMonth, int &lastDay, bool &usageLoaded);
@@ -1,15 +1,40 @@
 #include "storage.h"
 
-#include <SPIFFS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <string.h>
 #include <time.h>
 
+#include "csv_reader.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "history.h"
+#include "interval_coalescer.h"
+#include "interval_pool.h"
+#include "usage_bins.h"
+
 const char *CONFIG_CSV_PATH = "/config.csv";
 const char *USAGE_CSV_PATH = "/usage.csv";
 const char *INTERVALS_CSV_PATH = "/intervals.csv";
 const char *LEAKS_CSV_PATH = "/leaks.csv";
 
+static const char *INTERVALS_CSV_HEADER =
+    "date,wday,start_sec,end_sec,liters,merged_gaps,peak_lpm,min_lpm,mean_lpm,sd_lpm,samples,pulses";
+static const char *LEAKS_CSV_HEADER =
+    "timestamp,date,time,reason,total_liters,daily_liters,continuous_liters,threshold_liters,valve";
+// Set aside by replaceFileAtomic() while its replacement is renamed in.
+static const char *const SWAP_BACKUP_SUFFIX = ".bak";
+
 static bool storageReadyFlag = false;
+static SemaphoreHandle_t storageMutex = nullptr;
+
+StorageLock::StorageLock() {
+  if (storageMutex) xSemaphoreTakeRecursive(storageMutex, portMAX_DELAY);
+}
+
+StorageLock::~StorageLock() {
+  if (storageMutex) xSemaphoreGiveRecursive(storageMutex);
+}
 
 static void initDayUsage(DayUsage &day, int year, int month, int dayNum, int wday) {
   day.year = year;
@@ -18,17 +43,77 @@ static void initDayUsage(DayUsage &day, int year, int month, int dayNum, int wda
   day.wday = wday;
   day.totalSeconds = 0;
   day.totalLiters = 0.0f;
-  day.intervalCount = 0;
-  for (int i = 0; i < MAX_INTERVALS; i++) {
-    day.intervals[i].startSec = 0;
-    day.intervals[i].endSec = 0;
-    day.intervals[i].liters = 0.0f;
+  memset(day.binLiters, 0, sizeof(day.binLiters));
+  initDayIntervals(day);
+}
+
+static void swapBackupPath(const char *path, char *buf, size_t size) {
+  snprintf(buf, size, "%s%s", path, SWAP_BACKUP_SUFFIX);
+}
+
+// A reset between the two renames of replaceFileAtomic() leaves only the
+// backup; put it back. If both exist the swap got through.
+static void recoverInterruptedSwaps() {
+  char names[8][32];
+  int count = 0;
+  File root = flashFs.open("/");
+  if (!root) return;
+  File entry = root.openNextFile();
+  size_t suffixLen = strlen(SWAP_BACKUP_SUFFIX);
+  while (entry && count < 8) {
+    const char *name = entry.name();
+    if (name[0] == '/') name++;
+    size_t len = strlen(name);
+    if (len > suffixLen && len - suffixLen < sizeof(names[0]) - 1 &&
+        strcmp(name + len - suffixLen, SWAP_BACKUP_SUFFIX) == 0) {
+      snprintf(names[count++], sizeof(names[0]), "/%.*s", (int)(len - suffixLen), name);
+    }
+    entry = root.openNextFile();
+  }
+  root.close();
+  for (int i = 0; i < count; i++) {
+    char backup[40];
+    swapBackupPath(names[i], backup, sizeof(backup));
+    if (flashFs.exists(names[i])) {
+      flashFs.remove(backup);
+    } else {
+      flashFs.rename(backup, names[i]);
+    }
   }
 }
 
+bool replaceFileAtomic(const char *stagingPath, const char *path, uint32_t fromDayKey) {
+  if (!storageReadyFlag) return false;
+  StorageLock lock;
+  if (!flashFs.exists(stagingPath)) return false;
+  if (flashFsAtomicRename()) {
+    bool ok = flashFs.rename(stagingPath, path);
+    if (ok) noteHistoryRewrite(path, fromDayKey);
+    return ok;
+  }
+  char backup[40];
+  swapBackupPath(path, backup, sizeof(backup));
+  flashFs.remove(backup);
+  bool hadLive = flashFs.exists(path);
+  if (hadLive && !flashFs.rename(path, backup)) return false;
+  if (!flashFs.rename(stagingPath, path)) {
+    if (hadLive) flashFs.rename(backup, path);
+    return false;
+  }
+  if (hadLive) flashFs.remove(backup);
+  noteHistoryRewrite(path, fromDayKey);
+  return true;
+}
+
 bool initStorage() {
+  if (!storageMutex) {
+    storageMutex = xSemaphoreCreateRecursiveMutex();
+  }
   if (storageReadyFlag) return true;
-  storageReadyFlag = SPIFFS.begin(true);
+  storageReadyFlag = beginFlashFs();
+  if (storageReadyFlag) {
+    recoverInterruptedSwaps();
+  }
   return storageReadyFlag;
 }
 
@@ -36,184 +121,141 @@ bool storageReady() {
   return storageReadyFlag;
 }
 
-static bool parseConfigCsvLine(const char *line) {
-  char buf[256];
-  strncpy(buf, line, sizeof(buf) - 1);
-  buf[sizeof(buf) - 1] = '\0';
-
-  char *tokens[32];
-  int count = 0;
-  char *save = nullptr;
-  char *tok = strtok_r(buf, ",", &save);
-  while (tok && count < (int)(sizeof(tokens) / sizeof(tokens[0]))) {
-    tokens[count++] = tok;
-    tok = strtok_r(nullptr, ",", &save);
-  }
-
-  const int expectedOld = 9;
-  const int expectedNew = 3 + (BLOCKED_WINDOW_COUNT * 4) + 2;
-  const int expectedLeak = expectedNew + 2;
-  if (count != expectedOld && count != expectedNew && count != expectedLeak) return false;
-
-  float flow = atof(tokens[0]);
-  float minInterval = atof(tokens[1]);
-  uint32_t reportMs = (uint32_t)strtoul(tokens[2], nullptr, 10);
-  int startIndex = 3;
-  float ppl = 0.0f;
-  const char *tz = nullptr;
-  bool leakEnabled = true;
-  float leakThreshold = 100.0f;
-
-  if (count == expectedOld) {
-    ppl = atof(tokens[7]);
-    tz = tokens[8];
-  } else {
-    ppl = atof(tokens[startIndex + (BLOCKED_WINDOW_COUNT * 4)]);
-    tz = tokens[startIndex + (BLOCKED_WINDOW_COUNT * 4) + 1];
-    if (count == expectedLeak) {
-      leakEnabled = atoi(tokens[startIndex + (BLOCKED_WINDOW_COUNT * 4) + 2]) != 0;
-      leakThreshold = atof(tokens[startIndex + (BLOCKED_WINDOW_COUNT * 4) + 3]);
-    }
+// usage.csv row: date,wday,total_seconds,total_liters[,bin0..binN-1]
+// Bins are optional (older files); a row with the wrong bin count loads
+// with empty bins.
+bool parseUsageLine(const char *line, size_t len, int &year, int &month, int &dayNum,
+                    int &wday, uint32_t &seconds, float &liters, float *bins) {
+  CsvFields fields(line, len);
+  if (!(fields.takeDate(year, month, dayNum) &&
+        fields.takeInt(wday) &&
+        fields.takeUInt(seconds) &&
+        fields.takeFloat(liters))) {
+    return false;
   }
-
-  if (flow <= 0.0f || flow > 100.0f) return false;
-  if (minInterval < 0.0f || minInterval > 1000.0f) return false;
-  if (reportMs < 1000 || reportMs > 3600000) return false;
-  if (ppl <= 1.0f || ppl > 10000.0f) return false;
-  if (strlen(tz) == 0 || strlen(tz) >= sizeof(config.tzInfo)) return false;
-  if (leakThreshold < 1.0f || leakThreshold > 100000.0f) return false;
-
-  config.flowActiveLpm = flow;
-  config.minIntervalLiters = minInterval;
-  config.reportIntervalMs = reportMs;
-  config.leakProtectionEnabled = leakEnabled;
-  config.leakThresholdLiters = leakThreshold;
-  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    if (count == expectedNew || i == 0) {
-      int idx = startIndex + (i * 4);
-      int csh = atoi(tokens[idx]);
-      int csm = atoi(tokens[idx + 1]);
-      int ceh = atoi(tokens[idx + 2]);
-      int cem = atoi(tokens[idx + 3]);
-      if (csh < 0 || csh > 23) return false;
-      if (csm < 0 || csm > 59) return false;
-      if (ceh < 0 || ceh > 23) return false;
-      if (cem < 0 || cem > 59) return false;
-      config.closeStartHour[i] = csh;
-      config.closeStartMin[i] = csm;
-      config.closeEndHour[i] = ceh;
-      config.closeEndMin[i] = cem;
-    } else {
-      config.closeStartHour[i] = 0;
-      config.closeStartMin[i] = 0;
-      config.closeEndHour[i] = 0;
-      config.closeEndMin[i] = 0;
-    }
+  if (!bins) return true;
+  bool ok = !fields.atEnd();
+  for (int i = 0; ok && i < USAGE_BINS_PER_DAY; i++) {
+    ok = fields.takeFloat(bins[i]);
+  }
+  if (!ok || !fields.atEnd()) {
+    memset(bins, 0, sizeof(float) * USAGE_BINS_PER_DAY);
   }
-  config.pulsesPerLiter = ppl;
-  strncpy(config.tzInfo, tz, sizeof(config.tzInfo) - 1);
-  config.tzInfo[sizeof(config.tzInfo) - 1] = '\0';
   return true;
 }
 
-bool loadConfigCsv() {
-  if (!storageReadyFlag) return false;
-  File file = SPIFFS.open(CONFIG_CSV_PATH, "r");
-  if (!file) return false;
+static void writeUsageHeader(Print &out) {
+  out.print("date,wday,total_seconds,total_liters");
+  for (int i = 0; i < USAGE_BINS_PER_DAY; i++) {
+    out.printf(",bin%02d", i);
+  }
+  out.print("\n");
+}
 
-  char line[256];
-  bool loaded = false;
-  while (file.available()) {
-    size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
-    line[len] = '\0';
-    if (len == 0) continue;
-    if (strncmp(line, "flow_active_lpm", 15) == 0) {
-      continue;
-    }
-    loaded = parseConfigCsvLine(line);
-    if (loaded) break;
+void writeCsvHeader(Print &out, const char *path) {
+  if (strcmp(path, USAGE_CSV_PATH) == 0) {
+    writeUsageHeader(out);
+  } else if (strcmp(path, INTERVALS_CSV_PATH) == 0) {
+    out.println(INTERVALS_CSV_HEADER);
+  } else if (strcmp(path, LEAKS_CSV_PATH) == 0) {
+    out.println(LEAKS_CSV_HEADER);
   }
-  file.close();
-  return loaded;
 }
 
-bool saveConfigCsv() {
-  if (!storageReadyFlag) return false;
-  File file = SPIFFS.open(CONFIG_CSV_PATH, "w");
-  if (!file) return false;
-  file.println("flow_active_lpm,min_interval_l,report_interval_ms,close1_start_hour,close1_start_min,close1_end_hour,close1_end_min,close2_start_hour,close2_start_min,close2_end_hour,close2_end_min,close3_start_hour,close3_start_min,close3_end_hour,close3_end_min,pulses_per_liter,tz_info,leak_enabled,leak_threshold_l");
-  file.print(config.flowActiveLpm, 3);
-  file.print(",");
-  file.print(config.minIntervalLiters, 3);
-  file.print(",");
-  file.print(config.reportIntervalMs);
-  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    file.print(",");
-    file.print(config.closeStartHour[i]);
-    file.print(",");
-    file.print(config.closeStartMin[i]);
-    file.print(",");
-    file.print(config.closeEndHour[i]);
-    file.print(",");
-    file.print(config.closeEndMin[i]);
-  }
-  file.print(",");
-  file.print(config.pulsesPerLiter, 2);
-  file.print(",");
-  file.print(config.tzInfo);
-  file.print(",");
-  file.print(config.leakProtectionEnabled ? 1 : 0);
-  file.print(",");
-  file.println(config.leakThresholdLiters, 2);
-  file.close();
-  return true;
+// intervals.csv row: date,wday,start_sec,end_sec,liters
+//   [,merged_gaps,peak_lpm[,min_lpm,mean_lpm,sd_lpm,samples,pulses]]
+void printIntervalCsvRow(Print &out, int year, int month, int dayNum, int wday,
+                         const DayInterval &it) {
+  // The flow columns are the stored 0.01 L/min values, written without a
+  // float round trip.
+  out.printf("%04d-%02d-%02d,%d,%lu,%lu,%.3f,%u,%u.%02u,%u.%02u,%u.%02u,%u.%02u,%lu,%lu\n",
+             year, month, dayNum, wday,
+             (unsigned long)it.startSec, (unsigned long)it.endSec, it.liters,
+             (unsigned)it.mergedGaps, it.peakClpm / 100u, it.peakClpm % 100u,
+             it.minClpm / 100u, it.minClpm % 100u, it.meanClpm / 100u, it.meanClpm % 100u,
+             it.sdClpm / 100u, it.sdClpm % 100u, (unsigned long)it.samples,
+             (unsigned long)it.pulses);
 }
 
-static bool parseUsageLine(const char *line, int &year, int &month, int &dayNum,
-                           int &wday, uint32_t &seconds, float &liters) {
-  if (strncmp(line, "date", 4) == 0) return false;
-  unsigned int secVal = 0;
-  int matched = sscanf(line, "%4d-%2d-%2d,%d,%u,%f",
-                       &year, &month, &dayNum, &wday, &secVal, &liters);
-  if (matched != 6) return false;
-  seconds = secVal;
+bool parseIntervalLine(const char *line, size_t len, int &year, int &month, int &dayNum,
+                       int &wday, DayInterval &it) {
+  it = DayInterval();
+  CsvFields fields(line, len);
+  if (!(fields.takeDate(year, month, dayNum) &&
+        fields.takeInt(wday) &&
+        fields.takeUInt(it.startSec) &&
+        fields.takeUInt(it.endSec) &&
+        fields.takeFloat(it.liters))) {
+    return false;
+  }
+  // Older files stop after liters or after peak_lpm; missing stats stay zero.
+  uint32_t gaps = 0;
+  float peak = 0.0f;
+  if (fields.atEnd() || !fields.takeUInt(gaps) || !fields.takeFloat(peak)) {
+    return true;
+  }
+  it.mergedGaps = (uint16_t)(gaps > 0xFFFF ? 0xFFFF : gaps);
+  setIntervalStats(it, 0, 0.0f, peak, 0.0f, 0.0f);
+  float low = 0.0f;
+  float mean = 0.0f;
+  float sd = 0.0f;
+  uint32_t samples = 0;
+  if (fields.atEnd() ||
+      !(fields.takeFloat(low) &&
+        fields.takeFloat(mean) &&
+        fields.takeFloat(sd) &&
+        fields.takeUInt(samples) &&
+        fields.takeUInt(it.pulses))) {
+    return true;
+  }
+  setIntervalStats(it, samples, low, peak, mean, sd);
   return true;
 }
 
-static bool parseIntervalLine(const char *line, int &year, int &month, int &dayNum,
-                              int &wday, uint32_t &startSec, uint32_t &endSec, float &liters) {
-  if (strncmp(line, "date", 4) == 0) return false;
-  unsigned int startVal = 0;
-  unsigned int endVal = 0;
-  int matched = sscanf(line, "%4d-%2d-%2d,%d,%u,%u,%f",
-                       &year, &month, &dayNum, &wday, &startVal, &endVal, &liters);
-  if (matched != 7) return false;
-  startSec = startVal;
-  endSec = endVal;
-  return true;
+// leaks.csv row: timestamp,date,time,reason,total_liters,daily_liters,
+//   continuous_liters,threshold_liters,valve. Date and time are empty for
+// events logged before the clock was set.
+bool parseLeakLine(const char *line, size_t len) {
+  CsvFields fields(line, len);
+  int ts = 0;
+  const char *text = nullptr;
+  size_t textLen = 0;
+  size_t reasonLen = 0;
+  float value = 0.0f;
+  if (!(fields.takeInt(ts) &&
+        fields.takeText(text, textLen) &&
+        fields.takeText(text, textLen) &&
+        fields.takeText(text, reasonLen))) {
+    return false;
+  }
+  if (reasonLen == 0) return false;
+  for (int i = 0; i < 4; i++) {
+    if (!fields.takeFloat(value)) return false;
+  }
+  return fields.takeText(text, textLen) && textLen > 0;
 }
 
 bool loadUsageFromCsv(int &lastYear, int &lastMonth, int &lastDay) {
   if (!storageReadyFlag) return false;
-  File file = SPIFFS.open(USAGE_CSV_PATH, "r");
+  StorageLock lock;
+  File file = flashFs.open(USAGE_CSV_PATH, "r");
   if (!file) return false;
 
   DayUsage temp[7];
   int count = 0;
 
-  char line[128];
-  while (file.available()) {
-    size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
-    line[len] = '\0';
-    if (len == 0) continue;
-
+  CsvLineReader reader(file);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
     int year = 0;
     int month = 0;
     int dayNum = 0;
     int wday = 0;
     uint32_t seconds = 0;
     float liters = 0.0f;
-    if (!parseUsageLine(line, year, month, dayNum, wday, seconds, liters)) {
+    float bins[USAGE_BINS_PER_DAY];
+    if (!parseUsageLine(line, len, year, month, dayNum, wday, seconds, liters, bins)) {
       continue;
     }
 
@@ -221,6 +263,7 @@ bool loadUsageFromCsv(int &lastYear, int &lastMonth, int &lastDay) {
     initDayUsage(day, year, month, dayNum, wday);
     day.totalSeconds = seconds;
     day.totalLiters = liters;
+    memcpy(day.binLiters, bins, sizeof(day.binLiters));
 
     bool replaced = false;
     for (int i = 0; i < count; i++) {
@@ -248,8 +291,10 @@ bool loadUsageFromCsv(int &lastYear, int &lastMonth, int &lastDay) {
   if (count == 0) return false;
 
   for (int i = 0; i < 7; i++) {
+    clearDayIntervals(weekUsage[i]);
     initDayUsage(weekUsage[i], -1, -1, -1, -1);
   }
+  activeIntervalIndex = -1;
   for (int i = 0; i < count; i++) {
     weekUsage[i] = temp[i];
   }
@@ -258,74 +303,48 @@ bool loadUsageFromCsv(int &lastYear, int &lastMonth, int &lastDay) {
   lastMonth = temp[count - 1].month;
   lastDay = temp[count - 1].day;
 
-  File intervals = SPIFFS.open(INTERVALS_CSV_PATH, "r");
+  File intervals = flashFs.open(INTERVALS_CSV_PATH, "r");
   if (!intervals) return true;
-  while (intervals.available()) {
-    size_t len = intervals.readBytesUntil('\n', line, sizeof(line) - 1);
-    line[len] = '\0';
-    if (len == 0) continue;
-
+  // Rows read here are already on flash, so pool spills need no snapshot.
+  setIntervalSpillSnapshots(false);
+  CsvLineReader intervalReader(intervals);
+  while (intervalReader.next(line, len)) {
     int year = 0;
     int month = 0;
     int dayNum = 0;
     int wday = 0;
-    uint32_t startSec = 0;
-    uint32_t endSec = 0;
-    float liters = 0.0f;
-    if (!parseIntervalLine(line, year, month, dayNum, wday, startSec, endSec, liters)) {
+    DayInterval row;
+    if (!parseIntervalLine(line, len, year, month, dayNum, wday, row)) {
       continue;
     }
     for (int i = 0; i < count; i++) {
       if (weekUsage[i].year == year && weekUsage[i].month == month && weekUsage[i].day == dayNum) {
-        if (weekUsage[i].intervalCount < MAX_INTERVALS) {
-          uint8_t idx = weekUsage[i].intervalCount;
-          weekUsage[i].intervals[idx].startSec = startSec;
-          weekUsage[i].intervals[idx].endSec = endSec;
-          weekUsage[i].intervals[idx].liters = liters;
-          weekUsage[i].intervalCount++;
-        }
+        addDayInterval(weekUsage[i], row);
         break;
       }
     }
   }
   intervals.close();
+  setIntervalSpillSnapshots(true);
   return true;
 }
 
-bool appendDayUsageCsv(const DayUsage &day) {
-  if (!storageReadyFlag) return false;
-  if (day.year < 0) return false;
-
-  File file = SPIFFS.open(USAGE_CSV_PATH, "a");
-  if (!file) return false;
-  if (file.size() == 0) {
-    file.println("date,wday,total_seconds,total_liters");
-  }
-  file.printf("%04d-%02d-%02d,%d,%lu,%.3f\n",
-              day.year, day.month, day.day, day.wday,
-              (unsigned long)day.totalSeconds, day.totalLiters);
-  file.close();
-
-  File intervals = SPIFFS.open(INTERVALS_CSV_PATH, "a");
-  if (!intervals) return false;
-  if (intervals.size() == 0) {
-    intervals.println("date,wday,start_sec,end_sec,liters");
-  }
-  for (int i = 0; i < day.intervalCount; i++) {
-    const DayInterval &it = day.intervals[i];
-    if (it.liters <= 0.0f) continue;
-    intervals.printf("%04d-%02d-%02d,%d,%lu,%lu,%.3f\n",
-                     day.year, day.month, day.day, day.wday,
-                     (unsigned long)it.startSec, (unsigned long)it.endSec, it.liters);
-  }
-  intervals.close();
-  return true;
+// A source file that could not be read to the end must not replace the
+// live file with what was copied so far.
+static bool discardStaging(File &out, const char *tmpPath) {
+  out.close();
+  flashFs.remove(tmpPath);
+  return false;
 }
 
 static void formatDateBuf(const DayUsage &day, char *buf, size_t size) {
   snprintf(buf, size, "%04d-%02d-%02d", day.year, day.month, day.day);
 }
 
+static uint32_t dayKeyOf(const DayUsage &day) {
+  return (uint32_t)((day.year * 10000) + (day.month * 100) + day.day);
+}
+
 static bool rewriteUsageCsvWithDay(const DayUsage &day) {
   if (!storageReadyFlag) return false;
   if (day.year < 0) return false;
@@ -333,111 +352,216 @@ static bool rewriteUsageCsvWithDay(const DayUsage &day) {
   char dateBuf[16];
   formatDateBuf(day, dateBuf, sizeof(dateBuf));
 
-  File out = SPIFFS.open("/usage.tmp", "w");
+  File out = flashFs.open("/usage.tmp", "w");
   if (!out) return false;
 
   bool wroteHeader = false;
-  File in = SPIFFS.open(USAGE_CSV_PATH, "r");
+  File in = flashFs.open(USAGE_CSV_PATH, "r");
   if (in) {
-    char line[128];
-    while (in.available()) {
-      size_t len = in.readBytesUntil('\n', line, sizeof(line) - 1);
-      line[len] = '\0';
+    CsvLineReader reader(in);
+    const char *line = nullptr;
+    size_t len = 0;
+    while (reader.next(line, len)) {
       if (len == 0) continue;
-      if (strncmp(line, "date", 4) == 0) {
+      if (csvLineStartsWith(line, len, "date")) {
         if (!wroteHeader) {
-          out.println("date,wday,total_seconds,total_liters");
+          writeUsageHeader(out);
           wroteHeader = true;
         }
         continue;
       }
-      if (strncmp(line, dateBuf, 10) == 0 && line[10] == ',') {
+      if (len > 10 && memcmp(line, dateBuf, 10) == 0 && line[10] == ',') {
         continue;
       }
-      out.println(line);
+      out.write((const uint8_t *)line, len);
+      out.write('\n');
     }
+    bool readOk = reader.ok();
     in.close();
+    if (!readOk) return discardStaging(out, "/usage.tmp");
   }
 
   if (!wroteHeader) {
-    out.println("date,wday,total_seconds,total_liters");
+    writeUsageHeader(out);
   }
-  out.printf("%04d-%02d-%02d,%d,%lu,%.3f\n",
+  size_t rowStart = out.position();
+  out.printf("%04d-%02d-%02d,%d,%lu,%.3f",
              day.year, day.month, day.day, day.wday,
              (unsigned long)day.totalSeconds, day.totalLiters);
+  for (int i = 0; i < USAGE_BINS_PER_DAY; i++) {
+    out.printf(",%.2f", day.binLiters[i]);
+  }
+  out.print("\n");
+  size_t size = out.position();
   out.close();
-
-  SPIFFS.remove(USAGE_CSV_PATH);
-  return SPIFFS.rename("/usage.tmp", USAGE_CSV_PATH);
+  noteFlashRewrite(WEAR_FILE_USAGE, (uint32_t)(size - rowStart), (uint32_t)size);
+  return replaceFileAtomic("/usage.tmp", USAGE_CSV_PATH, dayKeyOf(day));
 }
 
-static bool rewriteIntervalsCsvWithDay(const DayUsage &day) {
+// Spilled rows are no longer in RAM, so the first day.spilledCount rows of the
+// date are kept from the old file and `rows` (the RAM rows) follow them.
+static bool rewriteIntervalsCsvWithDay(const DayUsage &day, const DayInterval *rows, int count) {
   if (!storageReadyFlag) return false;
   if (day.year < 0) return false;
 
   char dateBuf[16];
   formatDateBuf(day, dateBuf, sizeof(dateBuf));
 
-  File out = SPIFFS.open("/intervals.tmp", "w");
+  File out = flashFs.open("/intervals.tmp", "w");
   if (!out) return false;
 
   bool wroteHeader = false;
-  File in = SPIFFS.open(INTERVALS_CSV_PATH, "r");
+  int keptRows = 0;
+  File in = flashFs.open(INTERVALS_CSV_PATH, "r");
   if (in) {
-    char line[128];
-    while (in.available()) {
-      size_t len = in.readBytesUntil('\n', line, sizeof(line) - 1);
-      line[len] = '\0';
+    CsvLineReader reader(in);
+    const char *line = nullptr;
+    size_t len = 0;
+    while (reader.next(line, len)) {
       if (len == 0) continue;
-      if (strncmp(line, "date", 4) == 0) {
+      if (csvLineStartsWith(line, len, "date")) {
         if (!wroteHeader) {
-          out.println("date,wday,start_sec,end_sec,liters");
+          out.println(INTERVALS_CSV_HEADER);
           wroteHeader = true;
         }
         continue;
       }
-      if (strncmp(line, dateBuf, 10) == 0 && line[10] == ',') {
-        continue;
+      if (len > 10 && memcmp(line, dateBuf, 10) == 0 && line[10] == ',') {
+        if (keptRows >= day.spilledCount) continue;
+        keptRows++;
       }
-      out.println(line);
+      out.write((const uint8_t *)line, len);
+      out.write('\n');
     }
+    bool readOk = reader.ok();
     in.close();
+    if (!readOk) return discardStaging(out, "/intervals.tmp");
   }
 
   if (!wroteHeader) {
-    out.println("date,wday,start_sec,end_sec,liters");
+    out.println(INTERVALS_CSV_HEADER);
   }
-  for (int i = 0; i < day.intervalCount; i++) {
-    const DayInterval &it = day.intervals[i];
-    if (it.liters <= 0.0f) continue;
-    out.printf("%04d-%02d-%02d,%d,%lu,%lu,%.3f\n",
-               day.year, day.month, day.day, day.wday,
-               (unsigned long)it.startSec, (unsigned long)it.endSec, it.liters);
+  // Every row is written, even empty ones, so spilledCount stays a row count.
+  size_t rowsStart = out.position();
+  for (int i = 0; i < count; i++) {
+    printIntervalCsvRow(out, day.year, day.month, day.day, day.wday, rows[i]);
   }
+  size_t size = out.position();
   out.close();
-
-  SPIFFS.remove(INTERVALS_CSV_PATH);
-  return SPIFFS.rename("/intervals.tmp", INTERVALS_CSV_PATH);
+  noteFlashRewrite(WEAR_FILE_INTERVALS, (uint32_t)(size - rowsStart), (uint32_t)size);
+  return replaceFileAtomic("/intervals.tmp", INTERVALS_CSV_PATH, dayKeyOf(day));
 }
 
-bool snapshotDayUsageCsv(const DayUsage &day) {
+bool writeDaySnapshotCsv(const DayUsage &day, const DayInterval *rows, int count) {
   if (!storageReadyFlag) return false;
   if (day.year < 0) return false;
+  StorageLock lock;
   bool okUsage = rewriteUsageCsvWithDay(day);
-  bool okIntervals = rewriteIntervalsCsvWithDay(day);
+  bool okIntervals = rewriteIntervalsCsvWithDay(day, rows, count);
   return okUsage && okIntervals;
 }
 
+bool snapshotDayUsageCsv(const DayUsage &day) {
+  if (!storageReadyFlag) return false;
+  if (day.year < 0) return false;
+  int count = day.intervalCount - day.spilledCount;
+  DayInterval *rows = nullptr;
+  if (count > 0) {
+    rows = (DayInterval *)malloc(count * sizeof(DayInterval));
+    if (!rows) return false;
+    count = copyDayIntervals(day, rows, count);
+  }
+  bool ok = writeDaySnapshotCsv(day, rows, count);
+  if (ok) noteDaySnapshotSaved(day, count);
+  free(rows);
+  return ok;
+}
+
+bool dropUsageRowsBefore(uint32_t dayKey) {
+  if (!storageReadyFlag) return false;
+  StorageLock lock;
+  File in = flashFs.open(USAGE_CSV_PATH, "r");
+  if (!in) return true;
+  char cutoff[16];
+  snprintf(cutoff, sizeof(cutoff), "%04lu-%02lu-%02lu", (unsigned long)(dayKey / 10000),
+           (unsigned long)((dayKey / 100) % 100), (unsigned long)(dayKey % 100));
+
+  File out = flashFs.open("/usage.tmp", "w");
+  if (!out) {
+    in.close();
+    return false;
+  }
+  writeUsageHeader(out);
+  CsvLineReader reader(in);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
+    if (len == 0 || csvLineStartsWith(line, len, "date")) continue;
+    // ISO dates compare as text.
+    if (len > 10 && memcmp(line, cutoff, 10) < 0) continue;
+    out.write((const uint8_t *)line, len);
+    out.write('\n');
+  }
+  in.close();
+  if (!reader.ok()) return discardStaging(out, "/usage.tmp");
+  noteFlashRewrite(WEAR_FILE_USAGE, 0, (uint32_t)out.position());
+  out.close();
+  return replaceFileAtomic("/usage.tmp", USAGE_CSV_PATH);
+}
+
+bool trimLeaksCsv(size_t keepBytes) {
+  if (!storageReadyFlag) return false;
+  StorageLock lock;
+  File in = flashFs.open(LEAKS_CSV_PATH, "r");
+  if (!in) return true;
+  size_t size = in.size();
+  if (size <= keepBytes) {
+    in.close();
+    return true;
+  }
+  File out = flashFs.open("/leaks.tmp", "w");
+  if (!out) {
+    in.close();
+    return false;
+  }
+  out.println(LEAKS_CSV_HEADER);
+  // The first line is a partial row, and dropped, unless the seek lands
+  // right after a newline.
+  size_t start = size - keepBytes;
+  in.seek(start - 1);
+  bool skipFirst = in.read() != '\n';
+  CsvLineReader reader(in);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
+    if (skipFirst) {
+      skipFirst = false;
+      continue;
+    }
+    if (len == 0) continue;
+    out.write((const uint8_t *)line, len);
+    out.write('\n');
+  }
+  in.close();
+  if (!reader.ok()) return discardStaging(out, "/leaks.tmp");
+  noteFlashRewrite(WEAR_FILE_LEAKS, 0, (uint32_t)out.position());
+  out.close();
+  return replaceFileAtomic("/leaks.tmp", LEAKS_CSV_PATH);
+}
+
 bool appendLeakEventCsv(const struct tm *tmNow, const char *reason,
                         float totalLiters, float dailyLiters, float continuousLiters,
                         float thresholdLiters, bool valveClosed) {
   if (!storageReadyFlag) return false;
   if (!reason || reason[0] == '\0') return false;
+  StorageLock lock;
 
-  File file = SPIFFS.open(LEAKS_CSV_PATH, "a");
+  File file = flashFs.open(LEAKS_CSV_PATH, "a");
   if (!file) return false;
-  if (file.size() == 0) {
-    file.println("timestamp,date,time,reason,total_liters,daily_liters,continuous_liters,threshold_liters,valve");
+  uint32_t sizeBefore = (uint32_t)file.size();
+  size_t written = 0;
+  if (sizeBefore == 0) {
+    written += file.println(LEAKS_CSV_HEADER);
   }
 
   char dateBuf[16] = "";
@@ -452,28 +576,102 @@ bool appendLeakEventCsv(const struct tm *tmNow, const char *reason,
              tmNow->tm_hour, tmNow->tm_min, tmNow->tm_sec);
   }
 
-  file.printf("%ld,%s,%s,%s,%.3f,%.3f,%.3f,%.2f,%s\n",
-              (long)ts,
-              dateBuf,
-              timeBuf,
-              reason,
-              totalLiters,
-              dailyLiters,
-              continuousLiters,
-              thresholdLiters,
-              valveClosed ? "CLOSED" : "OPEN");
+  written += file.printf("%ld,%s,%s,%s,%.3f,%.3f,%.3f,%.2f,%s\n",
+                         (long)ts,
+                         dateBuf,
+                         timeBuf,
+                         reason,
+                         totalLiters,
+                         dailyLiters,
+                         continuousLiters,
+                         thresholdLiters,
+                         valveClosed ? "CLOSED" : "OPEN");
   file.close();
+  noteFlashAppend(WEAR_FILE_LEAKS, (uint32_t)written, sizeBefore);
   return true;
 }
 
+void channelUsagePath(int ch, char *buf, size_t size) {
+  snprintf(buf, size, "/ch%d_usage.csv", ch);
+}
+
+// Branch channel files hold one "date,seconds,liters" row per day.
+bool writeChannelDayCsv(int ch, uint32_t dayKey, uint32_t seconds, float liters) {
+  if (!storageReadyFlag) return false;
+  StorageLock lock;
+
+  char path[24];
+  channelUsagePath(ch, path, sizeof(path));
+  char dateBuf[16];
+  snprintf(dateBuf, sizeof(dateBuf), "%04lu-%02lu-%02lu", (unsigned long)(dayKey / 10000),
+           (unsigned long)((dayKey / 100) % 100), (unsigned long)(dayKey % 100));
+
+  File out = flashFs.open("/chusage.tmp", "w");
+  if (!out) return false;
+  out.print("date,seconds,liters\n");
+  File in = flashFs.open(path, "r");
+  if (in) {
+    CsvLineReader reader(in);
+    const char *line = nullptr;
+    size_t len = 0;
+    while (reader.next(line, len)) {
+      if (len == 0 || csvLineStartsWith(line, len, "date")) continue;
+      if (len > 10 && memcmp(line, dateBuf, 10) == 0 && line[10] == ',') continue;
+      out.write((const uint8_t *)line, len);
+      out.write('\n');
+    }
+    bool readOk = reader.ok();
+    in.close();
+    if (!readOk) return discardStaging(out, "/chusage.tmp");
+  }
+  size_t row = out.printf("%s,%lu,%.3f\n", dateBuf, (unsigned long)seconds, liters);
+  size_t size = out.position();
+  out.close();
+  noteFlashRewrite(WEAR_FILE_CHANNELS, (uint32_t)row, (uint32_t)size);
+  return replaceFileAtomic("/chusage.tmp", path);
+}
+
+bool loadLastChannelDayCsv(int ch, uint32_t &dayKey, uint32_t &seconds, float &liters) {
+  if (!storageReadyFlag) return false;
+  StorageLock lock;
+
+  char path[24];
+  channelUsagePath(ch, path, sizeof(path));
+  File in = flashFs.open(path, "r");
+  if (!in) return false;
+  bool found = false;
+  CsvLineReader reader(in);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
+    CsvFields fields(line, len);
+    int year = 0;
+    int month = 0;
+    int dayNum = 0;
+    uint32_t secs = 0;
+    float l = 0.0f;
+    if (!fields.takeDate(year, month, dayNum)) continue;
+    uint32_t key = (uint32_t)((year * 10000) + (month * 100) + dayNum);
+    if (found && key < dayKey) continue;
+    if (!fields.takeUInt(secs) || !fields.takeFloat(l)) continue;
+    dayKey = key;
+    seconds = secs;
+    liters = l;
+    found = true;
+  }
+  in.close();
+  return found;
+}
+
 struct SummaryEntry {
   int year;
   int key;
   uint32_t seconds;
   float liters;
+  float bins[USAGE_BINS_PER_DAY];
 };
 
-String buildSummaryJson(const String &period, int limit) {
+String buildSummaryJson(const String &period, int limit, bool includeBins) {
   String json;
   json.reserve(1024);
   if (!storageReadyFlag) {
@@ -482,7 +680,8 @@ String buildSummaryJson(const String &period, int limit) {
     json += "\",\"items\":[]}";
     return json;
   }
-  File file = SPIFFS.open(USAGE_CSV_PATH, "r");
+  StorageLock lock;
+  File file = flashFs.open(USAGE_CSV_PATH, "r");
   if (!file) {
     json = "{\"period\":\"";
     json += period;
@@ -495,22 +694,29 @@ String buildSummaryJson(const String &period, int limit) {
   if (limit < 1) limit = 1;
   if (limit > maxEntries) limit = maxEntries;
 
-  SummaryEntry entries[104];
+  // Too big for the loop task stack once bins are included.
+  SummaryEntry *entries = (SummaryEntry *)malloc(limit * sizeof(SummaryEntry));
+  if (!entries) {
+    file.close();
+    json = "{\"period\":\"";
+    json += period;
+    json += "\",\"items\":[]}";
+    return json;
+  }
   int count = 0;
 
-  char line[128];
-  while (file.available()) {
-    size_t len = file.readBytesUntil('\n', line, sizeof(line) - 1);
-    line[len] = '\0';
-    if (len == 0) continue;
-
+  CsvLineReader reader(file);
+  const char *line = nullptr;
+  size_t len = 0;
+  while (reader.next(line, len)) {
     int year = 0;
     int month = 0;
     int dayNum = 0;
     int wday = 0;
     uint32_t seconds = 0;
     float liters = 0.0f;
-    if (!parseUsageLine(line, year, month, dayNum, wday, seconds, liters)) {
+    float bins[USAGE_BINS_PER_DAY];
+    if (!parseUsageLine(line, len, year, month, dayNum, wday, seconds, liters, bins)) {
       continue;
     }
 
@@ -530,10 +736,18 @@ String buildSummaryJson(const String &period, int limit) {
     if (count > 0 && entries[count - 1].year == year && entries[count - 1].key == key) {
       entries[count - 1].seconds += seconds;
       entries[count - 1].liters += liters;
+      for (int i = 0; i < USAGE_BINS_PER_DAY; i++) {
+        entries[count - 1].bins[i] += bins[i];
+      }
       continue;
     }
 
-    SummaryEntry entry = {year, key, seconds, liters};
+    SummaryEntry entry;
+    entry.year = year;
+    entry.key = key;
+    entry.seconds = seconds;
+    entry.liters = liters;
+    memcpy(entry.bins, bins, sizeof(entry.bins));
     if (count < limit) {
       entries[count++] = entry;
     } else {
@@ -564,8 +778,13 @@ String buildSummaryJson(const String &period, int limit) {
     json += String(entries[i].seconds);
     json += ",\"total_l\":";
     json += String(entries[i].liters, 3);
+    if (includeBins) {
+      json += ",\"bins_l\":";
+      appendBinsJson(json, entries[i].bins);
+    }
     json += "}";
   }
   json += "]}";
+  free(entries);
   return json;
 }
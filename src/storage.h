@@ -1,24 +1,61 @@
 #pragma once
 
 #include <Arduino.h>
+#include <FS.h>
 
 #include "app_state.h"
 
 bool initStorage();
 bool storageReady();
 
-bool loadConfigCsv();
-bool saveConfigCsv();
+// Serializes file access between the storage writer task and readers in
+// loop(). Recursive, so storage functions can nest it freely.
+class StorageLock {
+public:
+  StorageLock();
+  ~StorageLock();
+
+private:
+  StorageLock(const StorageLock &) = delete;
+  StorageLock &operator=(const StorageLock &) = delete;
+};
 
 bool loadUsageFromCsv(int &lastYear, int &lastMonth, int &lastDay);
-bool appendDayUsageCsv(const DayUsage &day);
+// Rewrites the day's row in usage.csv and its rows in intervals.csv.
 bool snapshotDayUsageCsv(const DayUsage &day);
+bool writeDaySnapshotCsv(const DayUsage &day, const DayInterval *rows, int count);
 bool appendLeakEventCsv(const struct tm *tmNow, const char *reason,
                         float totalLiters, float dailyLiters, float continuousLiters,
                         float thresholdLiters, bool valveClosed);
+// Retention rewrites (storage_manager.h): drop usage.csv rows dated before
+// dayKey, and cut leaks.csv down to about its newest keepBytes.
+bool dropUsageRowsBefore(uint32_t dayKey);
+bool trimLeaksCsv(size_t keepBytes);
+// Per-day totals of a branch meter channel, keyed by yyyymmdd.
+void channelUsagePath(int ch, char *buf, size_t size);
+bool writeChannelDayCsv(int ch, uint32_t dayKey, uint32_t seconds, float liters);
+// Newest day row of a branch usage file.
+bool loadLastChannelDayCsv(int ch, uint32_t &dayKey, uint32_t &seconds, float &liters);
+
+// Row parsers shared by the loaders and the CSV import. parseUsageLine
+// zeroes bins when the row has none (bins may be null).
+bool parseUsageLine(const char *line, size_t len, int &year, int &month, int &dayNum,
+                    int &wday, uint32_t &seconds, float &liters, float *bins);
+bool parseIntervalLine(const char *line, size_t len, int &year, int &month, int &dayNum,
+                       int &wday, DayInterval &it);
+bool parseLeakLine(const char *line, size_t len);
+void printIntervalCsvRow(Print &out, int year, int month, int dayNum, int wday,
+                         const DayInterval &it);
+void writeCsvHeader(Print &out, const char *path);
+// Renames stagingPath over path. LittleFS does that in one atomic rename;
+// on SPIFFS the old file is kept as path + ".bak" until the new one is in
+// place, and initStorage() restores it after a reset. Rows of fromDayKey
+// and later may have moved (see noteHistoryRewrite(); 0 = anywhere).
+bool replaceFileAtomic(const char *stagingPath, const char *path, uint32_t fromDayKey = 0);
 
-String buildSummaryJson(const String &period, int limit);
+String buildSummaryJson(const String &period, int limit, bool includeBins);
 
+// Written by older firmware only; config.cpp migrates and removes it.
 extern const char *CONFIG_CSV_PATH;
 extern const char *USAGE_CSV_PATH;
 extern const char *INTERVALS_CSV_PATH;
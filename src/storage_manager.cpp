@@ -0,0 +1,212 @@
+#include "storage_manager.h"
+
+#include <freertos/FreeRTOS.h>
+
+#include "app_state.h"
+#include "flash_fs.h"
+#include "history.h"
+#include "interval_archive.h"
+#include "storage.h"
+#include "storage_writer.h"
+
+static const uint32_t CHECK_INTERVAL_MS = 15UL * 60UL * 1000UL;
+// Between slices while work is left, so other writes get through.
+static const uint32_t SLICE_GAP_MS = 2000;
+// Free space as a percentage of the partition.
+static const uint32_t LOW_FREE_PCT = 15;
+static const uint32_t CRITICAL_FREE_PCT = 5;
+// leaks.csv is cut to half its cap once over it; the cap halves under pressure.
+static const uint32_t LEAKS_CSV_MAX_BYTES = 16 * 1024;
+// usage.csv is only rewritten once this many days have expired, not daily.
+static const int USAGE_TRIM_SLACK_DAYS = 30;
+// What pressure trimming never goes below, and how far one slice goes.
+static const int PRESSURE_KEEP_DAYS = 62;
+static const int PRESSURE_USAGE_STEP_DAYS = 30;
+
+static const char *const LEVEL_NAMES[] = {"ok", "low", "critical"};
+
+static portMUX_TYPE healthMux = portMUX_INITIALIZER_UNLOCKED;
+static StorageHealth health = {};
+static volatile bool checkSoon = true;
+static bool sliceQueued = false;
+static uint32_t lastQueueMs = 0;
+
+bool validKeepDays(long days) {
+  return days == 0 || (days >= MIN_KEEP_DAYS && days <= MAX_KEEP_DAYS);
+}
+
+const char *storageHealthLevelName(StorageHealthLevel level) {
+  return LEVEL_NAMES[level];
+}
+
+static uint32_t fileSize(const char *path) {
+  File file = flashFs.open(path, "r");
+  if (!file) return 0;
+  uint32_t size = (uint32_t)file.size();
+  file.close();
+  return size;
+}
+
+static StorageHealthLevel levelFor(uint32_t totalBytes, uint32_t usedBytes) {
+  if (totalBytes == 0) return STORAGE_HEALTH_CRITICAL;
+  uint32_t freeBytes = usedBytes < totalBytes ? totalBytes - usedBytes : 0;
+  uint32_t freePct = (uint32_t)(((uint64_t)freeBytes * 100) / totalBytes);
+  if (freePct < CRITICAL_FREE_PCT) return STORAGE_HEALTH_CRITICAL;
+  if (freePct < LOW_FREE_PCT) return STORAGE_HEALTH_LOW;
+  return STORAGE_HEALTH_OK;
+}
+
+static void measure(StorageHealth &h) {
+  h.totalBytes = (uint32_t)flashFsTotalBytes();
+  h.usedBytes = (uint32_t)flashFsUsedBytes();
+  h.usageBytes = fileSize(USAGE_CSV_PATH);
+  h.intervalsBytes = fileSize(INTERVALS_CSV_PATH);
+  h.leaksBytes = fileSize(LEAKS_CSV_PATH);
+  IntervalArchiveStats archive;
+  getIntervalArchiveStats(archive);
+  h.archiveBytes = archive.bytes;
+  h.oldestUsageDay = oldestCsvUsageDay();
+  uint32_t oldestMonth = oldestArchivedMonth();
+  h.oldestIntervalDay = oldestMonth ? (oldestMonth * 100) + 1 : oldestCsvIntervalDay();
+  h.level = levelFor(h.totalBytes, h.usedBytes);
+}
+
+static uint32_t daysBefore(uint32_t dayKey, int days) {
+  return dayKeyFromDays(daysFromDayKey(dayKey) - days);
+}
+
+// First day of the month after monthKey (yyyymm).
+static uint32_t monthEndKey(uint32_t monthKey) {
+  uint32_t next = (monthKey % 100 == 12) ? ((monthKey / 100) + 1) * 100 + 1 : monthKey + 1;
+  return next * 100 + 1;
+}
+
+// Drops the oldest archived month if all of it is older than cutoffKey.
+static bool expireArchiveMonth(uint32_t cutoffKey, bool &ok) {
+  uint32_t month = oldestArchivedMonth();
+  if (month == 0 || monthEndKey(month) > cutoffKey) return false;
+  ok = dropArchivedMonth(month);
+  return true;
+}
+
+// Runs the first retention step that has work and says which one it was;
+// null when nothing was due.
+static const char *runStep(const StorageHealth &h, uint32_t todayKey, bool &ok) {
+  bool pressed = h.level != STORAGE_HEALTH_OK;
+  uint32_t leaksCap = pressed ? LEAKS_CSV_MAX_BYTES / 2 : LEAKS_CSV_MAX_BYTES;
+  if (h.leaksBytes > leaksCap) {
+    ok = trimLeaksCsv(leaksCap / 2);
+    return "trim_leaks";
+  }
+  if (todayKey == 0) return nullptr;
+
+  if (config->intervalKeepDays > 0 &&
+      expireArchiveMonth(daysBefore(todayKey, (int)config->intervalKeepDays), ok)) {
+    return "expire_intervals";
+  }
+  if (config->usageKeepDays > 0 && h.oldestUsageDay != 0) {
+    int keep = (int)config->usageKeepDays;
+    if (h.oldestUsageDay < daysBefore(todayKey, keep + USAGE_TRIM_SLACK_DAYS)) {
+      ok = dropUsageRowsBefore(daysBefore(todayKey, keep));
+      return "expire_usage";
+    }
+  }
+  if (!pressed) return nullptr;
+
+  uint32_t floorKey = daysBefore(todayKey, PRESSURE_KEEP_DAYS);
+  if (expireArchiveMonth(floorKey, ok)) return "pressure_intervals";
+  if (h.oldestUsageDay != 0 && h.oldestUsageDay < floorKey) {
+    uint32_t cutoff = dayKeyFromDays(daysFromDayKey(h.oldestUsageDay) + PRESSURE_USAGE_STEP_DAYS);
+    ok = dropUsageRowsBefore(cutoff < floorKey ? cutoff : floorKey);
+    return "pressure_usage";
+  }
+  return nullptr;
+}
+
+bool runStorageMaintenanceSlice(uint32_t todayKey) {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  uint32_t startMs = millis();
+  StorageHealth h;
+  getStorageHealth(h);
+  StorageHealthLevel before = h.level;
+  measure(h);
+  uint32_t usedBefore = h.usedBytes;
+
+  bool ok = true;
+  const char *step = runStep(h, todayKey, ok);
+  if (step) {
+    measure(h);
+    if (h.usedBytes < usedBefore) h.reclaimedBytes += usedBefore - h.usedBytes;
+    h.slices++;
+    h.lastStep = step;
+  }
+  // A failed step is retried on the next regular check, not right away.
+  h.pending = step && ok;
+  h.lastSliceMs = millis() - startMs;
+  if (h.level != before) {
+    Serial.printf("Storage %s: %lu of %lu KB used\n", storageHealthLevelName(h.level),
+                  (unsigned long)(h.usedBytes / 1024), (unsigned long)(h.totalBytes / 1024));
+  }
+
+  portENTER_CRITICAL(&healthMux);
+  h.writeFailures = health.writeFailures;
+  health = h;
+  sliceQueued = false;
+  portEXIT_CRITICAL(&healthMux);
+  return ok;
+}
+
+void serviceStorageManager(uint32_t nowMs, uint32_t todayKey) {
+  portENTER_CRITICAL(&healthMux);
+  bool busy = sliceQueued;
+  bool soon = health.pending || checkSoon;
+  portEXIT_CRITICAL(&healthMux);
+  if (busy) return;
+  if (lastQueueMs != 0 && nowMs - lastQueueMs < (soon ? SLICE_GAP_MS : CHECK_INTERVAL_MS)) {
+    return;
+  }
+  lastQueueMs = nowMs ? nowMs : 1;
+  checkSoon = false;
+  portENTER_CRITICAL(&healthMux);
+  sliceQueued = true;
+  portEXIT_CRITICAL(&healthMux);
+  if (!queueStorageMaintenance(todayKey)) {
+    portENTER_CRITICAL(&healthMux);
+    sliceQueued = false;
+    portEXIT_CRITICAL(&healthMux);
+  }
+}
+
+void noteStorageWriteFailed() {
+  portENTER_CRITICAL(&healthMux);
+  health.writeFailures++;
+  portEXIT_CRITICAL(&healthMux);
+  checkSoon = true;
+}
+
+void getStorageHealth(StorageHealth &out) {
+  portENTER_CRITICAL(&healthMux);
+  out = health;
+  portEXIT_CRITICAL(&healthMux);
+}
+
+void printStorageHealthTo(Print &out) {
+  StorageHealth h;
+  getStorageHealth(h);
+  out.println("\n=== STORAGE ===");
+  out.printf("Flash: %lu / %lu KB used (%s)\n", (unsigned long)(h.usedBytes / 1024),
+             (unsigned long)(h.totalBytes / 1024), storageHealthLevelName(h.level));
+  out.printf("usage.csv %lu  intervals.csv %lu  leaks.csv %lu  archive %lu bytes\n",
+             (unsigned long)h.usageBytes, (unsigned long)h.intervalsBytes,
+             (unsigned long)h.leaksBytes, (unsigned long)h.archiveBytes);
+  out.printf("Oldest totals %lu  oldest intervals %lu\n", (unsigned long)h.oldestUsageDay,
+             (unsigned long)h.oldestIntervalDay);
+  out.printf("Keep intervals %lu d  totals %lu d\n", (unsigned long)config->intervalKeepDays,
+             (unsigned long)config->usageKeepDays);
+  out.printf("Slices %lu  reclaimed %lu bytes  last %s (%lu ms)  write failures %lu\n",
+             (unsigned long)h.slices, (unsigned long)h.reclaimedBytes,
+             h.lastStep ? h.lastStep : "-", (unsigned long)h.lastSliceMs,
+             (unsigned long)h.writeFailures);
+  out.println("===============\n");
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Keeps the history files inside the flash partition. Retention runs in
+// slices on the storage writer task: each slice takes one bounded step
+// (trim leaks.csv, delete one archived month, cut old rows off usage.csv),
+// so snapshots queued meanwhile only wait for that step. Interval detail
+// expires first; usage.csv keeps the daily totals of the days it covered.
+// Below the low watermark retention tightens to about two months.
+static const long MIN_KEEP_DAYS = 31;
+static const long MAX_KEEP_DAYS = 3650;
+
+enum StorageHealthLevel : uint8_t {
+  STORAGE_HEALTH_OK,
+  STORAGE_HEALTH_LOW,
+  // Appends are about to fail.
+  STORAGE_HEALTH_CRITICAL
+};
+
+struct StorageHealth {
+  uint32_t totalBytes;
+  uint32_t usedBytes;
+  uint32_t usageBytes;
+  uint32_t intervalsBytes;
+  uint32_t leaksBytes;
+  uint32_t archiveBytes;
+  // yyyymmdd; 0 if none.
+  uint32_t oldestUsageDay;
+  uint32_t oldestIntervalDay;
+  StorageHealthLevel level;
+  // The last slice did something, so another one follows shortly.
+  bool pending;
+  uint32_t slices;
+  uint32_t reclaimedBytes;
+  uint32_t lastSliceMs;
+  const char *lastStep;
+  uint32_t writeFailures;
+};
+
+bool validKeepDays(long days);
+// Loop: queues the next slice when one is due. todayKey is 0 while the
+// clock is unset; only the size-based steps run then.
+void serviceStorageManager(uint32_t nowMs, uint32_t todayKey);
+// Storage writer only.
+bool runStorageMaintenanceSlice(uint32_t todayKey);
+// Storage writer: a write failed, so look at free space on the next tick.
+void noteStorageWriteFailed();
+void getStorageHealth(StorageHealth &health);
+const char *storageHealthLevelName(StorageHealthLevel level);
+void printStorageHealthTo(Print &out);
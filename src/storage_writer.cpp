@@ -0,0 +1,401 @@
+#include "storage_writer.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "baseline.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "interval_archive.h"
+#include "interval_pool.h"
+#include "storage.h"
+#include "storage_manager.h"
+#include "telemetry.h"
+
+static const int STORAGE_QUEUE_DEPTH = 8;
+// Free slots only day snapshots and leak events may take, so a backlog of
+// telemetry, maintenance or wear saves cannot crowd out a day close.
+static const int STORAGE_RESERVED_SLOTS = 2;
+static const uint32_t STORAGE_TASK_STACK = 6144;
+static const UBaseType_t STORAGE_TASK_PRIORITY = 1;
+
+enum StorageRequestType : uint8_t {
+  STORAGE_REQ_DAY_SNAPSHOT,
+  STORAGE_REQ_LEAK_EVENT,
+  STORAGE_REQ_BASELINE_SAVE,
+  STORAGE_REQ_CHANNEL_DAY,
+  STORAGE_REQ_TELEMETRY_SPOOL,
+  STORAGE_REQ_TELEMETRY_TAIL,
+  STORAGE_REQ_TELEMETRY_PREFETCH,
+  STORAGE_REQ_INTERVAL_ARCHIVE,
+  STORAGE_REQ_MAINTENANCE,
+  STORAGE_REQ_FLASH_BENCH,
+  STORAGE_REQ_WEAR_SAVE
+};
+
+enum StorageSlotState : uint8_t {
+  SLOT_FREE,
+  SLOT_QUEUED,
+  SLOT_WRITING
+};
+
+struct LeakEventRequest {
+  struct tm tmNow;
+  bool hasTime;
+  char reason[24];
+  float totalLiters;
+  float dailyLiters;
+  float continuousLiters;
+  float thresholdLiters;
+  bool valveClosed;
+};
+
+// A day snapshot carries its own copy of the RAM intervals (heap), so the
+// writer never walks the live interval pool.
+struct DaySnapshotRequest {
+  DayUsage day;
+  DayInterval *rows;
+  int rowCount;
+};
+
+struct ChannelDayRequest {
+  uint8_t channel;
+  uint32_t dayKey;
+  uint32_t seconds;
+  float liters;
+};
+
+// A spooled MQTT batch; the payload is a heap copy owned by the request.
+struct TelemetrySpoolRequest {
+  uint32_t seq;
+  char *payload;
+  size_t len;
+};
+
+struct StorageRequest {
+  StorageSlotState state;
+  StorageRequestType type;
+  uint32_t enqueuedMs;
+  union {
+    DaySnapshotRequest snapshot;
+    LeakEventRequest leak;
+    ChannelDayRequest channelDay;
+    TelemetrySpoolRequest spool;
+    uint32_t archiveDayKey;
+    uint32_t maintenanceDayKey;
+  };
+};
+
+// Requests live in a static pool; the queue only carries slot indices so a
+// queued snapshot can still be overwritten in place by a newer one.
+static StorageRequest slots[STORAGE_QUEUE_DEPTH];
+static QueueHandle_t slotQueue = nullptr;
+static portMUX_TYPE slotMux = portMUX_INITIALIZER_UNLOCKED;
+static StorageWriterStats writerStats;
+
+static bool sameDate(const DayUsage &a, const DayUsage &b) {
+  return a.year == b.year && a.month == b.month && a.day == b.day;
+}
+
+static bool runRequest(StorageRequest &req) {
+  switch (req.type) {
+    case STORAGE_REQ_DAY_SNAPSHOT: {
+      bool ok = writeDaySnapshotCsv(req.snapshot.day, req.snapshot.rows, req.snapshot.rowCount);
+      if (ok) noteDaySnapshotSaved(req.snapshot.day, req.snapshot.rowCount);
+      free(req.snapshot.rows);
+      req.snapshot.rows = nullptr;
+      return ok;
+    }
+    case STORAGE_REQ_LEAK_EVENT:
+      return appendLeakEventCsv(req.leak.hasTime ? &req.leak.tmNow : nullptr, req.leak.reason,
+                                req.leak.totalLiters, req.leak.dailyLiters,
+                                req.leak.continuousLiters, req.leak.thresholdLiters,
+                                req.leak.valveClosed);
+    case STORAGE_REQ_BASELINE_SAVE:
+      return writeBaselineFile();
+    case STORAGE_REQ_CHANNEL_DAY:
+      return writeChannelDayCsv(req.channelDay.channel, req.channelDay.dayKey,
+                                req.channelDay.seconds, req.channelDay.liters);
+    case STORAGE_REQ_TELEMETRY_SPOOL: {
+      bool ok = writeTelemetrySpoolRecord(req.spool.seq, req.spool.payload, req.spool.len);
+      free(req.spool.payload);
+      req.spool.payload = nullptr;
+      return ok;
+    }
+    case STORAGE_REQ_TELEMETRY_TAIL:
+      return saveTelemetrySpoolTail();
+    case STORAGE_REQ_TELEMETRY_PREFETCH:
+      return prefetchTelemetrySpool();
+    case STORAGE_REQ_INTERVAL_ARCHIVE:
+      return archiveClosedIntervalMonths(req.archiveDayKey);
+    case STORAGE_REQ_MAINTENANCE:
+      return runStorageMaintenanceSlice(req.maintenanceDayKey);
+    case STORAGE_REQ_FLASH_BENCH:
+      return runFlashBenchmark();
+    case STORAGE_REQ_WEAR_SAVE:
+      return saveFlashWear();
+  }
+  return false;
+}
+
+static void storageWriterTask(void *) {
+  uint8_t index = 0;
+  while (true) {
+    if (xQueueReceive(slotQueue, &index, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    StorageRequest &req = slots[index];
+    portENTER_CRITICAL(&slotMux);
+    req.state = SLOT_WRITING;
+    portEXIT_CRITICAL(&slotMux);
+
+    uint32_t startMs = millis();
+    bool ok = runRequest(req);
+    uint32_t doneMs = millis();
+    // A failing retention slice is retried on its own schedule.
+    if (!ok && req.type != STORAGE_REQ_MAINTENANCE) noteStorageWriteFailed();
+
+    portENTER_CRITICAL(&slotMux);
+    uint32_t latency = doneMs - req.enqueuedMs;
+    writerStats.lastLatencyMs = latency;
+    if (latency > writerStats.maxLatencyMs) writerStats.maxLatencyMs = latency;
+    writerStats.lastWriteMs = doneMs - startMs;
+    if (ok) {
+      writerStats.written++;
+    } else {
+      writerStats.failed++;
+    }
+    writerStats.depth--;
+    req.state = SLOT_FREE;
+    portEXIT_CRITICAL(&slotMux);
+  }
+}
+
+void startStorageWriter() {
+  if (slotQueue) return;
+  slotQueue = xQueueCreate(STORAGE_QUEUE_DEPTH, sizeof(uint8_t));
+  if (!slotQueue) return;
+  if (xTaskCreate(storageWriterTask, "storage", STORAGE_TASK_STACK, nullptr,
+                  STORAGE_TASK_PRIORITY, nullptr) != pdPASS) {
+    slotQueue = nullptr;
+  }
+}
+
+// Claims a free slot, or for snapshots reuses a queued snapshot of the same
+// day; a baseline save, spool tail save or prefetch, interval archive run
+// or retention slice already queued covers any later one, since the state is
+// read when it runs (archive and retention just take the newer date), and a
+// channel day snapshot replaces a queued one of the same channel and day.
+// Returns the slot and sets `fresh` when it still has to be queued; null when
+// the pool is full for this type.
+// A snapshot taken after a spill keeps more rows from flash, so it must not
+// replace one queued before that spill.
+static StorageRequest *claimSlot(StorageRequestType type, const DayUsage *day,
+                                 const ChannelDayRequest *channelDay, int &index, bool &fresh) {
+  if (type == STORAGE_REQ_DAY_SNAPSHOT) {
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++) {
+      if (slots[i].state == SLOT_QUEUED && slots[i].type == STORAGE_REQ_DAY_SNAPSHOT &&
+          sameDate(slots[i].snapshot.day, *day) &&
+          slots[i].snapshot.day.spilledCount == day->spilledCount) {
+        index = i;
+        fresh = false;
+        return &slots[i];
+      }
+    }
+  }
+  if (type == STORAGE_REQ_BASELINE_SAVE || type == STORAGE_REQ_TELEMETRY_TAIL ||
+      type == STORAGE_REQ_TELEMETRY_PREFETCH ||
+      type == STORAGE_REQ_INTERVAL_ARCHIVE || type == STORAGE_REQ_MAINTENANCE ||
+      type == STORAGE_REQ_FLASH_BENCH || type == STORAGE_REQ_WEAR_SAVE) {
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++) {
+      if (slots[i].state == SLOT_QUEUED && slots[i].type == type) {
+        index = i;
+        fresh = false;
+        return &slots[i];
+      }
+    }
+  }
+  if (type == STORAGE_REQ_CHANNEL_DAY) {
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++) {
+      if (slots[i].state == SLOT_QUEUED && slots[i].type == STORAGE_REQ_CHANNEL_DAY &&
+          slots[i].channelDay.channel == channelDay->channel &&
+          slots[i].channelDay.dayKey == channelDay->dayKey) {
+        index = i;
+        fresh = false;
+        return &slots[i];
+      }
+    }
+  }
+  if (type != STORAGE_REQ_DAY_SNAPSHOT && type != STORAGE_REQ_LEAK_EVENT) {
+    int freeSlots = 0;
+    for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++) {
+      if (slots[i].state == SLOT_FREE) freeSlots++;
+    }
+    if (freeSlots <= STORAGE_RESERVED_SLOTS) return nullptr;
+  }
+  for (int i = 0; i < STORAGE_QUEUE_DEPTH; i++) {
+    if (slots[i].state == SLOT_FREE) {
+      slots[i].state = SLOT_QUEUED;
+      slots[i].type = type;
+      index = i;
+      fresh = true;
+      return &slots[i];
+    }
+  }
+  return nullptr;
+}
+
+template <typename Fill>
+static bool enqueue(StorageRequestType type, const DayUsage *day,
+                    const ChannelDayRequest *channelDay, Fill fill) {
+  int index = -1;
+  bool fresh = false;
+  portENTER_CRITICAL(&slotMux);
+  StorageRequest *req = claimSlot(type, day, channelDay, index, fresh);
+  if (!req) {
+    writerStats.dropped++;
+    portEXIT_CRITICAL(&slotMux);
+    return false;
+  }
+  fill(*req, fresh);
+  if (fresh) {
+    req->enqueuedMs = millis();
+    writerStats.enqueued++;
+    writerStats.depth++;
+    if (writerStats.depth > writerStats.maxDepth) writerStats.maxDepth = writerStats.depth;
+  } else {
+    writerStats.coalesced++;
+  }
+  portEXIT_CRITICAL(&slotMux);
+
+  if (fresh) {
+    uint8_t slotIndex = (uint8_t)index;
+    xQueueSend(slotQueue, &slotIndex, 0);
+  }
+  return true;
+}
+
+bool queueDaySnapshot(const DayUsage &day) {
+  if (!slotQueue) return snapshotDayUsageCsv(day);
+  if (day.year < 0) return false;
+
+  int count = day.intervalCount - day.spilledCount;
+  DayInterval *rows = nullptr;
+  if (count > 0) {
+    rows = (DayInterval *)malloc(count * sizeof(DayInterval));
+    if (!rows) {
+      portENTER_CRITICAL(&slotMux);
+      writerStats.dropped++;
+      portEXIT_CRITICAL(&slotMux);
+      return false;
+    }
+    count = copyDayIntervals(day, rows, count);
+  }
+  DayInterval *replaced = nullptr;
+  bool ok = enqueue(STORAGE_REQ_DAY_SNAPSHOT, &day, nullptr, [&](StorageRequest &req, bool fresh) {
+    if (!fresh) {
+      replaced = req.snapshot.rows;
+    }
+    req.snapshot.day = day;
+    req.snapshot.rows = rows;
+    req.snapshot.rowCount = count;
+  });
+  free(ok ? replaced : rows);
+  return ok;
+}
+
+bool queueLeakEvent(const struct tm *tmNow, const char *reason,
+                    float totalLiters, float dailyLiters, float continuousLiters,
+                    float thresholdLiters, bool valveClosed) {
+  if (!slotQueue) {
+    return appendLeakEventCsv(tmNow, reason, totalLiters, dailyLiters, continuousLiters,
+                              thresholdLiters, valveClosed);
+  }
+  return enqueue(STORAGE_REQ_LEAK_EVENT, nullptr, nullptr, [&](StorageRequest &req, bool) {
+    req.leak.hasTime = (tmNow != nullptr);
+    if (tmNow) req.leak.tmNow = *tmNow;
+    strncpy(req.leak.reason, reason ? reason : "", sizeof(req.leak.reason) - 1);
+    req.leak.reason[sizeof(req.leak.reason) - 1] = '\0';
+    req.leak.totalLiters = totalLiters;
+    req.leak.dailyLiters = dailyLiters;
+    req.leak.continuousLiters = continuousLiters;
+    req.leak.thresholdLiters = thresholdLiters;
+    req.leak.valveClosed = valveClosed;
+  });
+}
+
+bool queueBaselineSave() {
+  if (!slotQueue) return writeBaselineFile();
+  return enqueue(STORAGE_REQ_BASELINE_SAVE, nullptr, nullptr, [](StorageRequest &, bool) {});
+}
+
+bool queueChannelDay(int ch, uint32_t dayKey, uint32_t seconds, float liters) {
+  if (!slotQueue) return writeChannelDayCsv(ch, dayKey, seconds, liters);
+  ChannelDayRequest row;
+  row.channel = (uint8_t)ch;
+  row.dayKey = dayKey;
+  row.seconds = seconds;
+  row.liters = liters;
+  return enqueue(STORAGE_REQ_CHANNEL_DAY, nullptr, &row,
+                 [&](StorageRequest &req, bool) { req.channelDay = row; });
+}
+
+bool queueTelemetrySpool(uint32_t seq, const char *payload, size_t len) {
+  if (!slotQueue) return writeTelemetrySpoolRecord(seq, payload, len);
+  char *copy = (char *)malloc(len);
+  if (!copy) {
+    portENTER_CRITICAL(&slotMux);
+    writerStats.dropped++;
+    portEXIT_CRITICAL(&slotMux);
+    return false;
+  }
+  memcpy(copy, payload, len);
+  bool ok = enqueue(STORAGE_REQ_TELEMETRY_SPOOL, nullptr, nullptr, [&](StorageRequest &req, bool) {
+    req.spool.seq = seq;
+    req.spool.payload = copy;
+    req.spool.len = len;
+  });
+  if (!ok) free(copy);
+  return ok;
+}
+
+bool queueTelemetryTail() {
+  if (!slotQueue) return saveTelemetrySpoolTail();
+  return enqueue(STORAGE_REQ_TELEMETRY_TAIL, nullptr, nullptr, [](StorageRequest &, bool) {});
+}
+
+bool queueTelemetryPrefetch() {
+  if (!slotQueue) return prefetchTelemetrySpool();
+  return enqueue(STORAGE_REQ_TELEMETRY_PREFETCH, nullptr, nullptr, [](StorageRequest &, bool) {});
+}
+
+bool queueIntervalArchive(uint32_t todayKey) {
+  if (!slotQueue) return archiveClosedIntervalMonths(todayKey);
+  return enqueue(STORAGE_REQ_INTERVAL_ARCHIVE, nullptr, nullptr,
+                 [&](StorageRequest &req, bool) { req.archiveDayKey = todayKey; });
+}
+
+bool queueStorageMaintenance(uint32_t todayKey) {
+  if (!slotQueue) return runStorageMaintenanceSlice(todayKey);
+  return enqueue(STORAGE_REQ_MAINTENANCE, nullptr, nullptr,
+                 [&](StorageRequest &req, bool) { req.maintenanceDayKey = todayKey; });
+}
+
+bool queueFlashBenchmark() {
+  if (!slotQueue) return runFlashBenchmark();
+  return enqueue(STORAGE_REQ_FLASH_BENCH, nullptr, nullptr, [](StorageRequest &, bool) {});
+}
+
+bool queueFlashWearSave() {
+  if (!slotQueue) return saveFlashWear();
+  return enqueue(STORAGE_REQ_WEAR_SAVE, nullptr, nullptr, [](StorageRequest &, bool) {});
+}
+
+void getStorageWriterStats(StorageWriterStats &stats) {
+  portENTER_CRITICAL(&slotMux);
+  stats = writerStats;
+  portEXIT_CRITICAL(&slotMux);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+#include "app_state.h"
+
+// Background task that owns all flash writes requested from the control
+// loop. The queue* functions copy their arguments and return immediately;
+// before startStorageWriter() they fall back to writing synchronously.
+struct StorageWriterStats {
+  uint32_t enqueued;
+  uint32_t written;
+  uint32_t coalesced;
+  uint32_t dropped;
+  uint32_t failed;
+  uint8_t depth;
+  uint8_t maxDepth;
+  uint32_t lastLatencyMs;
+  uint32_t maxLatencyMs;
+  uint32_t lastWriteMs;
+};
+
+void startStorageWriter();
+bool queueDaySnapshot(const DayUsage &day);
+bool queueLeakEvent(const struct tm *tmNow, const char *reason,
+                    float totalLiters, float dailyLiters, float continuousLiters,
+                    float thresholdLiters, bool valveClosed);
+bool queueBaselineSave();
+bool queueChannelDay(int ch, uint32_t dayKey, uint32_t seconds, float liters);
+bool queueTelemetrySpool(uint32_t seq, const char *payload, size_t len);
+bool queueTelemetryTail();
+bool queueTelemetryPrefetch();
+// Moves closed months of intervals.csv into the archive (interval_archive.h).
+bool queueIntervalArchive(uint32_t todayKey);
+// One retention slice (storage_manager.h).
+bool queueStorageMaintenance(uint32_t todayKey);
+// Times the mounted filesystem (flash_fs.h).
+bool queueFlashBenchmark();
+// Persists the write counters (flash_wear.h).
+bool queueFlashWearSave();
+void getStorageWriterStats(StorageWriterStats &stats);
@@ -0,0 +1,600 @@
+#include "telemetry.h"
+
+#include <Preferences.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <rom/crc.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "channels.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "interval_coalescer.h"
+#include "mqtt_client.h"
+#include "pending_usage.h"
+#include "storage.h"
+#include "storage_writer.h"
+
+const char *TELEMETRY_SPOOL_PATH = "/mqtt_spool.bin";
+
+static const uint32_t MQTT_RETRY_MS = 15000;
+static const uint16_t MQTT_KEEPALIVE_SEC = 60;
+static const int32_t MQTT_CONNECT_TIMEOUT_MS = 5000;
+static const uint32_t MQTT_CONNECT_TASK_STACK = 4096;
+static const UBaseType_t MQTT_CONNECT_TASK_PRIORITY = 1;
+// A batch goes out when it is this old or would not take another event.
+static const uint32_t BATCH_MAX_AGE_MS = 5000;
+// One spooled batch per interval keeps a long backlog from starving the
+// control loop and the broker.
+static const uint32_t DRAIN_INTERVAL_MS = 500;
+
+static const int SPOOL_SLOTS = 32;
+static const size_t SPOOL_RECORD_SIZE = 512;
+static const uint32_t SPOOL_FILE_SIZE = SPOOL_SLOTS * SPOOL_RECORD_SIZE;
+static const uint16_t SPOOL_RECORD_MAGIC = 0x5351;  // "QS"
+// The drained position is saved to NVS after this many batches and whenever
+// the spool runs empty; a reboot may send up to this many batches again.
+static const uint32_t SPOOL_TAIL_SAVE_STEP = 8;
+
+// The file is just the slots: the head is rebuilt at boot from the newest
+// intact record, so an append writes nothing but its own slot.
+struct __attribute__((packed)) SpoolRecordHeader {
+  uint32_t seq;
+  uint16_t len;
+  uint16_t magic;
+  uint32_t crc;
+};
+
+static const size_t SPOOL_PAYLOAD_MAX = SPOOL_RECORD_SIZE - sizeof(SpoolRecordHeader);
+// Room left for the {"seq":N,"ev":[...]} envelope.
+static const size_t BATCH_EVENTS_MAX = SPOOL_PAYLOAD_MAX - 32;
+
+TelemetryConfig telemetryConfig;
+
+static WiFiClient mqttNet;
+static MqttClient mqtt(mqttNet);
+
+// The DNS lookup and TCP handshake run in a one-shot task so a dead broker
+// never blocks loop(); the socket is only touched by loop() while the link
+// is not OPENING. A link the settings dropped meanwhile is closed once the
+// task is done instead of being handed to the MQTT client.
+enum LinkState : uint8_t { LINK_IDLE, LINK_OPENING, LINK_OPEN, LINK_FAILED };
+static portMUX_TYPE linkMux = portMUX_INITIALIZER_UNLOCKED;
+static LinkState linkState = LINK_IDLE;
+static bool linkStale = false;
+static char linkHost[sizeof(telemetryConfig.host)];
+static uint16_t linkPort = 0;
+static char deviceId[20];
+static char eventsTopic[96];
+static char statusTopic[96];
+
+static char batchBuf[BATCH_EVENTS_MAX];
+static size_t batchLen = 0;
+static uint16_t batchEvents = 0;
+static uint32_t batchStartMs = 0;
+static uint32_t batchSeq = 0;
+
+// Sequence numbers of spooled batches: [tail, head) are waiting, and those
+// below committed are on flash. The writer task advances committed.
+static portMUX_TYPE spoolMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t spoolHead = 0;
+static uint32_t spoolTail = 0;
+static uint32_t spoolCommitted = 0;
+static bool spoolReady = false;
+// Last tail written to NVS; only the writer task touches it after boot.
+static uint32_t spoolSavedTail = 0;
+
+// The writer task reads the record at the tail ahead of the drain, so
+// loop() never waits on flash. The writer only fills the buffer while a
+// prefetch is PENDING and loop() only reads it while it is READY.
+enum PrefetchState : uint8_t { PREFETCH_EMPTY, PREFETCH_PENDING, PREFETCH_READY };
+static PrefetchState prefetchState = PREFETCH_EMPTY;
+static uint32_t prefetchSeq = 0;
+static size_t prefetchLen = 0;
+static bool prefetchValid = false;
+static char prefetchBuf[SPOOL_PAYLOAD_MAX];
+
+static uint32_t lastConnectMs = 0;
+static uint32_t lastDrainMs = 0;
+static uint32_t lastStatusMs = 0;
+static bool wasConnected = false;
+static TelemetryStats stats;
+
+void loadTelemetryConfig() {
+  Preferences prefs;
+  prefs.begin("watermqtt", true);
+  telemetryConfig.enabled = prefs.getBool("en", false);
+  String host = prefs.getString("host", "");
+  host.toCharArray(telemetryConfig.host, sizeof(telemetryConfig.host));
+  telemetryConfig.port = (uint16_t)prefs.getUInt("port", 1883);
+  String prefix = prefs.getString("prefix", "water");
+  prefix.toCharArray(telemetryConfig.prefix, sizeof(telemetryConfig.prefix));
+  telemetryConfig.statusSec = prefs.getUInt("status_s", 60);
+  prefs.end();
+  deviceId[0] = '\0';
+}
+
+static void mqttConnectTask(void *) {
+  bool ok = mqttNet.connect(linkHost, linkPort, MQTT_CONNECT_TIMEOUT_MS);
+  portENTER_CRITICAL(&linkMux);
+  linkState = ok ? LINK_OPEN : LINK_FAILED;
+  portEXIT_CRITICAL(&linkMux);
+  vTaskDelete(nullptr);
+}
+
+static LinkState currentLinkState() {
+  portENTER_CRITICAL(&linkMux);
+  LinkState state = linkState;
+  portEXIT_CRITICAL(&linkMux);
+  return state;
+}
+
+static void openMqttLink() {
+  strncpy(linkHost, telemetryConfig.host, sizeof(linkHost) - 1);
+  linkHost[sizeof(linkHost) - 1] = '\0';
+  linkPort = telemetryConfig.port;
+  linkStale = false;
+  linkState = LINK_OPENING;
+  if (xTaskCreate(mqttConnectTask, "mqttconn", MQTT_CONNECT_TASK_STACK, nullptr,
+                  MQTT_CONNECT_TASK_PRIORITY, nullptr) != pdPASS) {
+    linkState = LINK_IDLE;
+  }
+}
+
+// Hands a finished connect to the MQTT client, or drops it when it failed
+// or went stale.
+static void collectMqttLink() {
+  LinkState state = currentLinkState();
+  if (state != LINK_OPEN && state != LINK_FAILED) return;
+  if (state == LINK_OPEN) {
+    if (linkStale) {
+      mqttNet.stop();
+    } else {
+      mqtt.start(deviceId, MQTT_KEEPALIVE_SEC);
+    }
+  }
+  linkState = LINK_IDLE;
+}
+
+static void closeMqtt() {
+  linkStale = true;
+  if (currentLinkState() == LINK_OPENING) return;
+  collectMqttLink();
+  mqtt.stop();
+}
+
+void saveTelemetryConfig() {
+  Preferences prefs;
+  prefs.begin("watermqtt", false);
+  size_t bytes = prefs.putBool("en", telemetryConfig.enabled);
+  bytes += prefs.putString("host", telemetryConfig.host);
+  bytes += prefs.putUInt("port", telemetryConfig.port);
+  bytes += prefs.putString("prefix", telemetryConfig.prefix);
+  bytes += prefs.putUInt("status_s", telemetryConfig.statusSec);
+  prefs.end();
+  noteNvsWrite(5, (uint32_t)bytes);
+  // Reconnect with the new broker and topics on the next service call.
+  closeMqtt();
+  deviceId[0] = '\0';
+  lastConnectMs = millis() - MQTT_RETRY_MS;
+}
+
+static void buildTopics() {
+  String mac = WiFi.macAddress();
+  char hex[7];
+  int n = 0;
+  // Last three bytes of the MAC, e.g. "AA:BB:CC:DD:EE:FF" -> "ddeeff".
+  for (unsigned int i = 9; i < mac.length() && n < 6; i++) {
+    char c = mac.charAt(i);
+    if (c == ':') continue;
+    hex[n++] = (c >= 'A' && c <= 'F') ? (char)(c - 'A' + 'a') : c;
+  }
+  hex[n] = '\0';
+  snprintf(deviceId, sizeof(deviceId), "water-%s", hex);
+  snprintf(eventsTopic, sizeof(eventsTopic), "%s/%s/events", telemetryConfig.prefix, deviceId);
+  snprintf(statusTopic, sizeof(statusTopic), "%s/%s/status", telemetryConfig.prefix, deviceId);
+}
+
+static uint32_t spoolOffset(uint32_t seq) {
+  return (seq % SPOOL_SLOTS) * SPOOL_RECORD_SIZE;
+}
+
+bool loadTelemetrySpool() {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  File file = flashFs.open(TELEMETRY_SPOOL_PATH, "r");
+  bool valid = file && file.size() == SPOOL_FILE_SIZE;
+  bool found = false;
+  uint32_t head = 0;
+  for (int i = 0; valid && i < SPOOL_SLOTS; i++) {
+    SpoolRecordHeader rec;
+    if (!file.seek(spoolOffset(i)) || file.read((uint8_t *)&rec, sizeof(rec)) != sizeof(rec)) {
+      valid = false;
+      break;
+    }
+    if (rec.magic != SPOOL_RECORD_MAGIC || rec.len == 0 || rec.len > SPOOL_PAYLOAD_MAX ||
+        rec.seq % SPOOL_SLOTS != (uint32_t)i) {
+      continue;
+    }
+    if (!found || (int32_t)(rec.seq + 1 - head) > 0) head = rec.seq + 1;
+    found = true;
+  }
+  if (file) file.close();
+
+  if (!valid) {
+    // Lay out every slot now; records are later overwritten in place.
+    file = flashFs.open(TELEMETRY_SPOOL_PATH, "w");
+    if (!file) return false;
+    uint8_t zero[64] = {};
+    bool ok = true;
+    for (size_t i = 0; ok && i < SPOOL_FILE_SIZE / sizeof(zero); i++) {
+      ok = file.write(zero, sizeof(zero)) == sizeof(zero);
+    }
+    file.close();
+    if (!ok) return false;
+    noteFlashRewrite(WEAR_FILE_TELEMETRY, 0, SPOOL_FILE_SIZE);
+    head = 0;
+  }
+
+  Preferences prefs;
+  prefs.begin("watermqtt", true);
+  uint32_t tail = prefs.getUInt("spool_tail", head);
+  prefs.end();
+  // A tail from another spool file, or one the ring has since overrun.
+  if ((int32_t)(head - tail) < 0) tail = head;
+  if (head - tail > (uint32_t)SPOOL_SLOTS) tail = head - SPOOL_SLOTS;
+
+  portENTER_CRITICAL(&spoolMux);
+  spoolHead = head;
+  spoolTail = tail;
+  spoolCommitted = head;
+  spoolSavedTail = tail;
+  spoolReady = true;
+  portEXIT_CRITICAL(&spoolMux);
+  return true;
+}
+
+bool writeTelemetrySpoolRecord(uint32_t seq, const char *payload, size_t len) {
+  bool ok = false;
+  if (storageReady() && len <= SPOOL_PAYLOAD_MAX) {
+    uint8_t record[SPOOL_RECORD_SIZE];
+    SpoolRecordHeader rec = {seq, (uint16_t)len, SPOOL_RECORD_MAGIC,
+                             crc32_le(0, (const uint8_t *)payload, len)};
+    memcpy(record, &rec, sizeof(rec));
+    memcpy(record + sizeof(rec), payload, len);
+    size_t used = sizeof(rec) + len;
+
+    StorageLock lock;
+    File file = flashFs.open(TELEMETRY_SPOOL_PATH, "r+");
+    if (file) {
+      ok = file.seek(spoolOffset(seq)) && file.write(record, used) == used;
+      noteFlashPatch(WEAR_FILE_TELEMETRY, used, spoolOffset(seq), (uint32_t)file.size());
+      file.close();
+    }
+  }
+  // A failed record still advances committed; the drain skips it by CRC.
+  portENTER_CRITICAL(&spoolMux);
+  if ((int32_t)(seq + 1 - spoolCommitted) > 0) spoolCommitted = seq + 1;
+  portEXIT_CRITICAL(&spoolMux);
+  return ok;
+}
+
+bool saveTelemetrySpoolTail() {
+  portENTER_CRITICAL(&spoolMux);
+  uint32_t tail = spoolTail;
+  bool empty = tail == spoolHead;
+  portEXIT_CRITICAL(&spoolMux);
+  if (tail == spoolSavedTail || (!empty && tail - spoolSavedTail < SPOOL_TAIL_SAVE_STEP)) {
+    return true;
+  }
+  Preferences prefs;
+  prefs.begin("watermqtt", false);
+  bool ok = prefs.putUInt("spool_tail", tail) == sizeof(tail);
+  prefs.end();
+  noteNvsWrite(1, sizeof(tail));
+  if (ok) spoolSavedTail = tail;
+  return ok;
+}
+
+static bool readSpoolRecord(uint32_t seq, char *payload, size_t &len) {
+  if (!storageReady()) return false;
+  StorageLock lock;
+  File file = flashFs.open(TELEMETRY_SPOOL_PATH, "r");
+  if (!file) return false;
+  SpoolRecordHeader rec;
+  bool ok = file.seek(spoolOffset(seq)) &&
+            file.read((uint8_t *)&rec, sizeof(rec)) == sizeof(rec) &&
+            rec.seq == seq && rec.len <= SPOOL_PAYLOAD_MAX &&
+            file.read((uint8_t *)payload, rec.len) == rec.len &&
+            crc32_le(0, (const uint8_t *)payload, rec.len) == rec.crc;
+  file.close();
+  if (ok) len = rec.len;
+  return ok;
+}
+
+bool prefetchTelemetrySpool() {
+  portENTER_CRITICAL(&spoolMux);
+  uint32_t seq = spoolTail;
+  bool ready = prefetchState == PREFETCH_PENDING && seq != spoolHead &&
+               (int32_t)(spoolCommitted - seq) > 0;
+  if (!ready && prefetchState == PREFETCH_PENDING) prefetchState = PREFETCH_EMPTY;
+  portEXIT_CRITICAL(&spoolMux);
+  if (!ready) return true;
+
+  size_t len = 0;
+  bool valid = readSpoolRecord(seq, prefetchBuf, len);
+  portENTER_CRITICAL(&spoolMux);
+  prefetchSeq = seq;
+  prefetchLen = len;
+  prefetchValid = valid;
+  prefetchState = PREFETCH_READY;
+  portEXIT_CRITICAL(&spoolMux);
+  // A record that fails its CRC is the drain's to count, not a write error.
+  return true;
+}
+
+// Asks the writer task for the record at the tail unless one is already
+// read or on its way.
+static void requestPrefetch() {
+  portENTER_CRITICAL(&spoolMux);
+  bool ready = prefetchState == PREFETCH_EMPTY && spoolTail != spoolHead &&
+               (int32_t)(spoolCommitted - spoolTail) > 0;
+  if (ready) prefetchState = PREFETCH_PENDING;
+  portEXIT_CRITICAL(&spoolMux);
+  if (ready && !queueTelemetryPrefetch()) {
+    portENTER_CRITICAL(&spoolMux);
+    if (prefetchState == PREFETCH_PENDING) prefetchState = PREFETCH_EMPTY;
+    portEXIT_CRITICAL(&spoolMux);
+  }
+}
+
+static uint32_t spoolDepth() {
+  portENTER_CRITICAL(&spoolMux);
+  uint32_t depth = spoolHead - spoolTail;
+  portEXIT_CRITICAL(&spoolMux);
+  return depth;
+}
+
+static void spoolBatch(const char *payload, size_t len) {
+  if (!spoolReady) {
+    stats.dropped++;
+    return;
+  }
+  uint32_t seq = spoolHead;
+  if (!queueTelemetrySpool(seq, payload, len)) {
+    stats.dropped++;
+    return;
+  }
+  portENTER_CRITICAL(&spoolMux);
+  spoolHead = seq + 1;
+  bool overrun = spoolHead - spoolTail > (uint32_t)SPOOL_SLOTS;
+  // The ring is full: the new batch overwrites the oldest one.
+  if (overrun) spoolTail = spoolHead - SPOOL_SLOTS;
+  portEXIT_CRITICAL(&spoolMux);
+  if (overrun) stats.dropped++;
+  stats.spooled++;
+}
+
+static void flushBatch() {
+  if (batchEvents == 0) return;
+  char payload[SPOOL_PAYLOAD_MAX];
+  int len = snprintf(payload, sizeof(payload), "{\"seq\":%lu,\"ev\":[%.*s]}",
+                     (unsigned long)batchSeq++, (int)batchLen, batchBuf);
+  batchLen = 0;
+  batchEvents = 0;
+  stats.batches++;
+  if (len <= 0 || (size_t)len >= sizeof(payload)) {
+    stats.dropped++;
+    return;
+  }
+  // Anything already spooled goes first, so new batches queue behind it.
+  if (mqtt.connected() && spoolDepth() == 0 &&
+      mqtt.publish(eventsTopic, (const uint8_t *)payload, (size_t)len)) {
+    stats.published++;
+    return;
+  }
+  spoolBatch(payload, (size_t)len);
+}
+
+static void addEvent(const char *json, int len) {
+  if (!telemetryConfig.enabled) return;
+  if (len <= 0 || (size_t)len + 1 > sizeof(batchBuf)) {
+    stats.dropped++;
+    return;
+  }
+  if (batchLen + (size_t)len + 1 > sizeof(batchBuf)) flushBatch();
+  if (batchEvents == 0) batchStartMs = millis();
+  if (batchLen > 0) batchBuf[batchLen++] = ',';
+  memcpy(batchBuf + batchLen, json, (size_t)len);
+  batchLen += (size_t)len;
+  batchEvents++;
+  stats.events++;
+}
+
+static long eventTimestamp() {
+  return timeValid ? (long)time(nullptr) : 0L;
+}
+
+static void addIntervalEvent(const ClosedInterval &closed) {
+  const DayInterval &it = closed.row;
+  if (it.liters < config->minIntervalLiters) return;
+  char json[192];
+  int len = snprintf(json, sizeof(json),
+                     "{\"t\":\"interval\",\"date\":\"%04d-%02d-%02d\",\"start\":%lu,\"end\":%lu,"
+                     "\"l\":%.3f,\"peak\":%.2f,\"mean\":%.2f,\"gaps\":%u}",
+                     closed.year, closed.month, closed.day, (unsigned long)it.startSec,
+                     (unsigned long)it.endSec, it.liters, intervalPeakLpm(it), intervalMeanLpm(it),
+                     (unsigned)it.mergedGaps);
+  addEvent(json, len);
+}
+
+void telemetryDayClosed(const DayUsage &day) {
+  char json[128];
+  int len = snprintf(json, sizeof(json),
+                     "{\"t\":\"day\",\"date\":\"%04d-%02d-%02d\",\"sec\":%lu,\"l\":%.3f,\"intervals\":%u}",
+                     day.year, day.month, day.day, (unsigned long)day.totalSeconds,
+                     day.totalLiters, (unsigned)day.intervalCount);
+  addEvent(json, len);
+}
+
+void telemetryLeak(int channel, const char *reason, float value, float limit, bool valveClosed) {
+  char json[160];
+  int len = snprintf(json, sizeof(json),
+                     "{\"t\":\"leak\",\"ts\":%ld,\"ch\":%d,\"reason\":\"%s\",\"value\":%.3f,"
+                     "\"limit\":%.3f,\"closed\":%s}",
+                     eventTimestamp(), channel, reason, value, limit, valveClosed ? "true" : "false");
+  addEvent(json, len);
+}
+
+void telemetryValve(int channel, bool open) {
+  char json[80];
+  int len = snprintf(json, sizeof(json), "{\"t\":\"valve\",\"ts\":%ld,\"ch\":%d,\"open\":%s}",
+                     eventTimestamp(), channel, open ? "true" : "false");
+  addEvent(json, len);
+}
+
+static void publishStatus() {
+  char json[224];
+  int len = snprintf(json, sizeof(json),
+                     "{\"ts\":%ld,\"up\":%lu,\"flow_lpm\":%.2f,\"total_l\":%.3f,\"daily_l\":%.3f,"
+                     "\"valve\":%s,\"leak\":%s,\"rssi\":%d,\"spool\":%lu}",
+                     eventTimestamp(), (unsigned long)uptimeSeconds(), flowRateLpm, totalLiters,
+                     dailyLiters, channels[MAIN_CHANNEL].valveOpen ? "true" : "false",
+                     channels[MAIN_CHANNEL].leakTripped ? "true" : "false",
+                     WiFi.RSSI(), (unsigned long)spoolDepth());
+  if (len > 0 && (size_t)len < sizeof(json)) {
+    // Retained, so a dashboard that subscribes later sees the last state.
+    mqtt.publish(statusTopic, (const uint8_t *)json, (size_t)len, true);
+  }
+}
+
+static void drainSpool(uint32_t nowMs) {
+  if (nowMs - lastDrainMs < DRAIN_INTERVAL_MS) return;
+  portENTER_CRITICAL(&spoolMux);
+  uint32_t seq = spoolTail;
+  // An overrun may have moved the tail past the prefetched record.
+  if (prefetchState == PREFETCH_READY && prefetchSeq != seq) prefetchState = PREFETCH_EMPTY;
+  bool ready = prefetchState == PREFETCH_READY;
+  portEXIT_CRITICAL(&spoolMux);
+  if (!ready) {
+    requestPrefetch();
+    return;
+  }
+  lastDrainMs = nowMs;
+
+  if (prefetchValid) {
+    if (!mqtt.publish(eventsTopic, (const uint8_t *)prefetchBuf, prefetchLen)) return;
+    stats.drained++;
+  } else {
+    stats.dropped++;
+  }
+  portENTER_CRITICAL(&spoolMux);
+  if (spoolTail == seq) spoolTail = seq + 1;
+  prefetchState = PREFETCH_EMPTY;
+  portEXIT_CRITICAL(&spoolMux);
+  queueTelemetryTail();
+  requestPrefetch();
+}
+
+void serviceTelemetry(uint32_t nowMs) {
+  ClosedInterval closed;
+  while (takeClosedInterval(closed)) {
+    if (telemetryConfig.enabled) addIntervalEvent(closed);
+  }
+  if (batchEvents > 0 && nowMs - batchStartMs >= BATCH_MAX_AGE_MS) flushBatch();
+
+  if (!telemetryConfig.enabled || telemetryConfig.host[0] == '\0' ||
+      WiFi.status() != WL_CONNECTED) {
+    closeMqtt();
+    wasConnected = false;
+    return;
+  }
+  if (deviceId[0] == '\0') buildTopics();
+
+  collectMqttLink();
+  mqtt.loop(nowMs);
+  if (!mqtt.connected() && !mqtt.connecting() && currentLinkState() == LINK_IDLE &&
+      nowMs - lastConnectMs >= MQTT_RETRY_MS) {
+    lastConnectMs = nowMs;
+    openMqttLink();
+  }
+  if (!mqtt.connected()) {
+    wasConnected = false;
+    return;
+  }
+  if (!wasConnected) {
+    wasConnected = true;
+    stats.connects++;
+    lastStatusMs = nowMs - (telemetryConfig.statusSec * 1000);
+  }
+
+  drainSpool(nowMs);
+  if (telemetryConfig.statusSec > 0 && nowMs - lastStatusMs >= telemetryConfig.statusSec * 1000) {
+    lastStatusMs = nowMs;
+    publishStatus();
+  }
+}
+
+void getTelemetryStats(TelemetryStats &out) {
+  out = stats;
+  out.connected = mqtt.connected();
+  out.spoolDepth = spoolDepth();
+  out.lastRefusal = mqtt.lastRefusal();
+}
+
+String buildTelemetryJson() {
+  TelemetryStats st;
+  getTelemetryStats(st);
+  String json;
+  json.reserve(384);
+  json += "{\"enabled\":";
+  json += telemetryConfig.enabled ? "true" : "false";
+  json += ",\"host\":\"";
+  json += telemetryConfig.host;
+  json += "\",\"port\":";
+  json += telemetryConfig.port;
+  json += ",\"prefix\":\"";
+  json += telemetryConfig.prefix;
+  json += "\",\"status_s\":";
+  json += telemetryConfig.statusSec;
+  json += ",\"device\":\"";
+  json += deviceId;
+  json += "\",\"connected\":";
+  json += st.connected ? "true" : "false";
+  json += ",\"connects\":";
+  json += st.connects;
+  json += ",\"events\":";
+  json += st.events;
+  json += ",\"batches\":";
+  json += st.batches;
+  json += ",\"published\":";
+  json += st.published;
+  json += ",\"spooled\":";
+  json += st.spooled;
+  json += ",\"drained\":";
+  json += st.drained;
+  json += ",\"dropped\":";
+  json += st.dropped;
+  json += ",\"spool_depth\":";
+  json += st.spoolDepth;
+  json += ",\"last_refusal\":";
+  json += st.lastRefusal;
+  json += "}";
+  return json;
+}
+
+void printTelemetryTo(Print &out) {
+  TelemetryStats st;
+  getTelemetryStats(st);
+  out.println("\n=== MQTT ===");
+  out.printf("Broker: %s:%u %s\n", telemetryConfig.host, (unsigned)telemetryConfig.port,
+             !telemetryConfig.enabled ? "(disabled)" : (st.connected ? "connected" : "offline"));
+  out.printf("Events %lu  batches %lu  published %lu\n", (unsigned long)st.events,
+             (unsigned long)st.batches, (unsigned long)st.published);
+  out.printf("Spooled %lu  drained %lu  dropped %lu  depth %lu\n", (unsigned long)st.spooled,
+             (unsigned long)st.drained, (unsigned long)st.dropped, (unsigned long)st.spoolDepth);
+  out.println("============\n");
+}
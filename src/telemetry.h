@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "app_state.h"
+
+// MQTT telemetry. Interval-closed, day-closed, leak and valve events are
+// batched into one JSON message per publish on <prefix>/<device>/events.
+// While the broker is unreachable, batches go to a flash ring
+// (/mqtt_spool.bin) and drain at a bounded rate after reconnecting; after a
+// reboot the last few drained batches may be sent again. A compact retained
+// status goes to <prefix>/<device>/status.
+struct TelemetryConfig {
+  bool enabled;
+  char host[64];
+  uint16_t port;
+  char prefix[32];
+  // Status publish period; 0 disables it.
+  uint32_t statusSec;
+};
+
+struct TelemetryStats {
+  bool connected;
+  uint32_t connects;
+  uint32_t events;
+  uint32_t batches;
+  uint32_t published;
+  uint32_t spooled;
+  uint32_t drained;
+  uint32_t dropped;
+  uint32_t spoolDepth;
+  uint8_t lastRefusal;
+};
+
+extern TelemetryConfig telemetryConfig;
+
+void loadTelemetryConfig();
+void saveTelemetryConfig();
+// Opens or creates the spool; call before startStorageWriter().
+bool loadTelemetrySpool();
+void serviceTelemetry(uint32_t nowMs);
+
+void telemetryDayClosed(const DayUsage &day);
+void telemetryLeak(int channel, const char *reason, float value, float limit, bool valveClosed);
+void telemetryValve(int channel, bool open);
+
+void getTelemetryStats(TelemetryStats &stats);
+String buildTelemetryJson();
+void printTelemetryTo(Print &out);
+
+// Called on the storage writer task.
+bool writeTelemetrySpoolRecord(uint32_t seq, const char *payload, size_t len);
+// Saves the drained position to NVS every few batches.
+bool saveTelemetrySpoolTail();
+// Reads the record at the spool tail into RAM for the next drain.
+bool prefetchTelemetrySpool();
+
+extern const char *TELEMETRY_SPOOL_PATH;
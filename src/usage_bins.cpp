@@ -0,0 +1,12 @@
+#include "usage_bins.h"
+
+#include "app_state.h"
+
+void appendBinsJson(String &json, const float *bins) {
+  json += "[";
+  for (int i = 0; i < USAGE_BINS_PER_DAY; i++) {
+    if (i > 0) json += ",";
+    json += String(bins[i], 2);
+  }
+  json += "]";
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Time-of-day usage bins (DayUsage::binLiters and the history/summary rows
+// copied from it) as a JSON array, USAGE_BIN_SECONDS apart from midnight.
+void appendBinsJson(String &json, const float *bins);
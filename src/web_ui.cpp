@@ -1,18 +1,32 @@
 #include "web_ui.h"
 
 #include <WebServer.h>
-#include <SPIFFS.h>
 #include <time.h>
 
 #include "app_state.h"
+#include "baseline.h"
+#include "channels.h"
 #include "config.h"
+#include "csv_import.h"
+#include "drip_detector.h"
+#include "flash_fs.h"
+#include "flash_wear.h"
+#include "flow_series.h"
+#include "history.h"
+#include "interval_archive.h"
+#include "interval_coalescer.h"
+#include "interval_pool.h"
+#include "leak_engine.h"
+#include "pending_usage.h"
 #include "report.h"
+#include "rolling_usage.h"
 #include "storage.h"
+#include "storage_manager.h"
+#include "storage_writer.h"
+#include "telemetry.h"
 #include "web_ui_html.h"
 
 static WebServer server(80);
-static File uploadFile;
-static String uploadTarget;
 static bool uploadOk = false;
 
 class StringPrint : public Print {
@@ -33,6 +47,32 @@ private:
   String &buf;
 };
 
+// Sends whatever is printed as chunks of a CONTENT_LENGTH_UNKNOWN response.
+class ChunkedPrint : public Print {
+public:
+  ~ChunkedPrint() { flush(); }
+  size_t write(uint8_t c) override {
+    if (len == sizeof(buf)) flush();
+    buf[len++] = (char)c;
+    return 1;
+  }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    for (size_t i = 0; i < size; i++) {
+      write(buffer[i]);
+    }
+    return size;
+  }
+  void flush() {
+    if (len == 0) return;
+    server.sendContent(buf, len);
+    len = 0;
+  }
+
+private:
+  char buf[1024];
+  size_t len = 0;
+};
+
 static void appendTime(String &json, int hour, int minute) {
   if (hour < 10) json += "0";
   json += String(hour);
@@ -43,7 +83,7 @@ static void appendTime(String &json, int hour, int minute) {
 
 static String buildStatusJson() {
   String json;
-  json.reserve(512);
+  json.reserve(2560);
   json += "{";
   json += "\"time_valid\":";
   json += (timeValid ? "true" : "false");
@@ -68,7 +108,7 @@ static String buildStatusJson() {
   computeWeekTotals(weekSeconds, weekLiters);
 
   json += ",\"valve\":\"";
-  json += (valveState ? "OPEN" : "CLOSED");
+  json += (channels[MAIN_CHANNEL].valveOpen ? "OPEN" : "CLOSED");
   json += "\"";
   json += ",\"flow_lpm\":";
   json += String(flowRateLpm, 2);
@@ -81,67 +121,367 @@ static String buildStatusJson() {
   json += ",\"week_liters\":";
   json += String(weekLiters, 3);
   json += ",\"flow_active_lpm\":";
-  json += String(config.flowActiveLpm, 3);
+  json += String(config->flowActiveLpm, 3);
   json += ",\"report_interval_ms\":";
-  json += String(config.reportIntervalMs);
+  json += String(config->reportIntervalMs);
   json += ",\"leak_enabled\":";
-  json += (config.leakProtectionEnabled ? "true" : "false");
+  json += (config->leakProtectionEnabled ? "true" : "false");
   json += ",\"leak_threshold_l\":";
-  json += String(config.leakThresholdLiters, 2);
+  json += String(config->leakThresholdLiters, 2);
   json += ",\"leak_progress_l\":";
   json += String(continuousLiters, 3);
   json += ",\"leak_tripped\":";
-  json += (leakTripped ? "true" : "false");
+  json += (channels[MAIN_CHANNEL].leakTripped ? "true" : "false");
+  json += ",\"leak_detectors\":[";
+  for (int i = 0; i < leakDetectorCount(); i++) {
+    LeakDetectorStats det;
+    getLeakDetectorStats(MAIN_CHANNEL, i, det);
+    if (i > 0) json += ",";
+    json += "{\"reason\":\"";
+    json += det.reason;
+    json += "\",\"enabled\":";
+    json += (det.enabled ? "true" : "false");
+    json += ",\"value\":";
+    json += String(det.value, 2);
+    json += ",\"limit\":";
+    json += String(det.limit, 2);
+    json += ",\"trips\":";
+    json += String(det.trips);
+    json += ",\"avg_cycles\":";
+    json += String(det.avgCycles);
+    json += ",\"max_cycles\":";
+    json += String(det.maxCycles);
+    json += "}";
+  }
+  json += "]";
+  BaselineBucketInfo baseline;
+  getBaselineInfo(baseline);
+  json += ",\"baseline\":{\"bucket\":";
+  json += String(baseline.bucket);
+  json += ",\"hour_l\":";
+  json += String(baseline.hourLiters, 3);
+  json += ",\"mean_l\":";
+  json += String(baseline.meanLiters, 2);
+  json += ",\"sd_l\":";
+  json += String(baseline.sdLiters, 2);
+  json += ",\"weeks\":";
+  json += String(baseline.samples);
+  json += "}";
+  DripStatus drip;
+  getDripStatus(drip);
+  json += ",\"drip\":{\"suspected\":";
+  json += (drip.suspected ? "true" : "false");
+  json += ",\"period_s\":";
+  json += String(drip.periodSec, 1);
+  json += ",\"cv\":";
+  json += String(drip.cv, 2);
+  json += ",\"pulses\":";
+  json += String(drip.pulses);
+  json += ",\"observed_s\":";
+  json += String(drip.observedSec);
+  json += ",\"l_per_day\":";
+  json += String(drip.litersPerDay, 2);
+  json += "}";
+  json += ",\"rolling_l\":{";
+  for (int i = 0; i < ROLLING_WINDOW_COUNT; i++) {
+    if (i > 0) json += ",";
+    json += "\"";
+    json += rollingWindowName((RollingWindow)i);
+    json += "\":";
+    json += String(rollingLiters((RollingWindow)i), 3);
+  }
+  json += "}";
+  json += ",\"pending_intervals\":";
+  json += String(pendingIntervalCount());
+  json += ",\"pending_l\":";
+  json += String(pendingLiters(), 3);
   json += ",\"close_start\":\"";
-  appendTime(json, config.closeStartHour[0], config.closeStartMin[0]);
+  appendTime(json, config->closeStartHour[0], config->closeStartMin[0]);
   json += "\"";
   json += ",\"close_end\":\"";
-  appendTime(json, config.closeEndHour[0], config.closeEndMin[0]);
+  appendTime(json, config->closeEndHour[0], config->closeEndMin[0]);
   json += "\"";
   json += ",\"close_windows\":[";
   for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
     if (i > 0) json += ",";
     json += "{\"start\":\"";
-    appendTime(json, config.closeStartHour[i], config.closeStartMin[i]);
+    appendTime(json, config->closeStartHour[i], config->closeStartMin[i]);
     json += "\",\"end\":\"";
-    appendTime(json, config.closeEndHour[i], config.closeEndMin[i]);
+    appendTime(json, config->closeEndHour[i], config->closeEndMin[i]);
     json += "\"}";
   }
   json += "]";
+  IntervalPoolStats pool;
+  getIntervalPoolStats(pool);
+  json += ",\"interval_pool\":{\"chunks_used\":";
+  json += String(pool.chunksUsed);
+  json += ",\"chunks_total\":";
+  json += String(INTERVAL_POOL_CHUNKS);
+  json += ",\"chunks_peak\":";
+  json += String(pool.chunksPeak);
+  json += ",\"spilled\":";
+  json += String(pool.spilledIntervals);
+  json += ",\"dropped\":";
+  json += String(pool.droppedIntervals);
+  json += ",\"merged_gaps\":";
+  json += String(mergedGapTotal());
+  json += "}";
+  IntervalArchiveStats archive;
+  getIntervalArchiveStats(archive);
+  json += ",\"interval_archive\":{\"months\":";
+  json += String(archive.months);
+  json += ",\"bad_months\":";
+  json += String(archive.badMonths);
+  json += ",\"rows\":";
+  json += String(archive.rows);
+  json += ",\"bytes\":";
+  json += String(archive.bytes);
+  json += ",\"csv_bytes\":";
+  json += String(archive.csvBytes);
+  json += "}";
+  StorageHealth storage;
+  getStorageHealth(storage);
+  json += ",\"storage\":{\"level\":\"";
+  json += storageHealthLevelName(storage.level);
+  json += "\",\"total_bytes\":";
+  json += String(storage.totalBytes);
+  json += ",\"used_bytes\":";
+  json += String(storage.usedBytes);
+  json += ",\"files\":{\"usage\":";
+  json += String(storage.usageBytes);
+  json += ",\"intervals\":";
+  json += String(storage.intervalsBytes);
+  json += ",\"leaks\":";
+  json += String(storage.leaksBytes);
+  json += ",\"archive\":";
+  json += String(storage.archiveBytes);
+  json += "},\"oldest_usage\":";
+  json += String(storage.oldestUsageDay);
+  json += ",\"oldest_interval\":";
+  json += String(storage.oldestIntervalDay);
+  json += ",\"pending\":";
+  json += (storage.pending ? "true" : "false");
+  json += ",\"slices\":";
+  json += String(storage.slices);
+  json += ",\"reclaimed_bytes\":";
+  json += String(storage.reclaimedBytes);
+  json += ",\"last_step\":\"";
+  json += storage.lastStep ? storage.lastStep : "";
+  json += "\",\"last_slice_ms\":";
+  json += String(storage.lastSliceMs);
+  json += ",\"write_failures\":";
+  json += String(storage.writeFailures);
+  json += "}";
+  FlashFsMigration migration;
+  getFlashFsMigration(migration);
+  json += ",\"flash_fs\":{\"backend\":\"";
+  json += flashFsName(flashFsBackend());
+  json += "\",\"migration\":";
+  if (migration.ran) {
+    json += "{\"ok\":";
+    json += (migration.ok ? "true" : "false");
+    json += ",\"error\":\"";
+    json += migration.error ? migration.error : "";
+    json += "\",\"files\":";
+    json += String(migration.files);
+    json += ",\"bytes\":";
+    json += String(migration.bytes);
+    json += ",\"ms\":";
+    json += String(migration.ms);
+    json += "}";
+  } else {
+    json += "null";
+  }
+  json += ",\"bench\":[";
+  bool firstBench = true;
+  for (int i = FLASH_BACKEND_SPIFFS; i <= FLASH_BACKEND_LITTLEFS; i++) {
+    FlashBenchResult r;
+    if (!getFlashBenchResult((FlashFsBackend)i, r)) continue;
+    if (!firstBench) json += ",";
+    firstBench = false;
+    json += "{\"backend\":\"";
+    json += flashFsName(r.backend);
+    json += "\",\"files\":";
+    json += String(r.files);
+    json += ",\"open_us\":";
+    json += String(r.openUs);
+    json += ",\"append_us\":";
+    json += String(r.appendUs);
+    json += ",\"scan_kbps\":";
+    json += String(r.scanKBps);
+    json += ",\"rewrite_ms\":";
+    json += String(r.rewriteMs);
+    json += ",\"bytes_written\":";
+    json += String(r.bytesWritten);
+    json += ",\"allocated_bytes\":";
+    json += String(r.allocatedBytes);
+    json += "}";
+  }
+  json += "]}";
+  StorageWriterStats writer;
+  getStorageWriterStats(writer);
+  json += ",\"storage_queue\":{\"depth\":";
+  json += String(writer.depth);
+  json += ",\"max_depth\":";
+  json += String(writer.maxDepth);
+  json += ",\"enqueued\":";
+  json += String(writer.enqueued);
+  json += ",\"written\":";
+  json += String(writer.written);
+  json += ",\"coalesced\":";
+  json += String(writer.coalesced);
+  json += ",\"dropped\":";
+  json += String(writer.dropped);
+  json += ",\"failed\":";
+  json += String(writer.failed);
+  json += ",\"last_latency_ms\":";
+  json += String(writer.lastLatencyMs);
+  json += ",\"max_latency_ms\":";
+  json += String(writer.maxLatencyMs);
+  json += ",\"last_write_ms\":";
+  json += String(writer.lastWriteMs);
+  json += "}";
+  json += ",\"boot_complete\":";
+  json += (bootComplete() ? "true" : "false");
+  json += ",\"boot_phases\":[";
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    if (i > 0) json += ",";
+    json += "{\"name\":\"";
+    json += bootPhaseName(i);
+    json += "\",\"start_ms\":";
+    json += String(bootPhases[i].startMs);
+    json += ",\"dur_ms\":";
+    if (bootPhases[i].done) {
+      json += String(bootPhases[i].endMs - bootPhases[i].startMs);
+    } else {
+      json += "null";
+    }
+    json += "}";
+  }
+  json += "]";
   json += "}";
   return json;
 }
 
+static void appendWearCounters(String &json, const FlashWearCounters &c, uint32_t trackedSeconds) {
+  char buf[160];
+  uint64_t perDay = trackedSeconds >= 3600 ? (c.physicalBytes * 86400ULL) / trackedSeconds : 0;
+  snprintf(buf, sizeof(buf),
+           "{\"ops\":%llu,\"logical\":%llu,\"fs\":%llu,\"physical\":%llu,\"physical_per_day\":%llu,"
+           "\"amplification\":",
+           (unsigned long long)c.ops, (unsigned long long)c.logicalBytes,
+           (unsigned long long)c.fsBytes, (unsigned long long)c.physicalBytes,
+           (unsigned long long)perDay);
+  json += buf;
+  if (c.logicalBytes > 0) {
+    json += String((float)c.physicalBytes / (float)c.logicalBytes, 2);
+  } else {
+    json += "null";
+  }
+  json += "}";
+}
+
+static String buildMetricsJson() {
+  FlashWear wear;
+  getFlashWear(wear);
+  String json;
+  json.reserve(3072);
+  json += "{\"uptime_s\":";
+  json += String(millis() / 1000);
+  json += ",\"flash\":{\"backend\":\"";
+  json += flashFsName(flashFsBackend());
+  json += "\",\"tracked_s\":";
+  json += String(wear.trackedSeconds);
+  json += ",\"total\":";
+  appendWearCounters(json, wear.total, wear.trackedSeconds);
+  json += ",\"files\":{";
+  for (int i = 0; i < WEAR_FILE_COUNT; i++) {
+    if (i > 0) json += ",";
+    json += "\"";
+    json += flashWearFileName((FlashWearFile)i);
+    json += "\":";
+    appendWearCounters(json, wear.files[i], wear.trackedSeconds);
+  }
+  json += "},\"ops\":{";
+  for (int i = 0; i < WEAR_OP_COUNT; i++) {
+    if (i > 0) json += ",";
+    json += "\"";
+    json += flashWearOpName((FlashWearOp)i);
+    json += "\":";
+    appendWearCounters(json, wear.ops[i], wear.trackedSeconds);
+  }
+  json += "},\"data_wear_pct\":";
+  json += String(wear.dataWearPct, 5);
+  json += ",\"nvs_wear_pct\":";
+  json += String(wear.nvsWearPct, 5);
+  json += ",\"physical_per_day\":";
+  json += String(wear.physicalPerDay);
+  json += ",\"data_lifetime_days\":";
+  json += String(wear.dataLifetimeDays);
+  json += ",\"nvs_lifetime_days\":";
+  json += String(wear.nvsLifetimeDays);
+  json += "}}";
+  return json;
+}
+
+// Shows a change applied since the last tick, not only the published one.
 static String buildConfigJson() {
+  const Config &cfg = latestConfig();
   String json;
-  json.reserve(512);
+  json.reserve(1024);
   json += "{";
   json += "\"flow_active_lpm\":";
-  json += String(config.flowActiveLpm, 3);
+  json += String(cfg.flowActiveLpm, 3);
   json += ",\"min_interval_l\":";
-  json += String(config.minIntervalLiters, 3);
+  json += String(cfg.minIntervalLiters, 3);
   json += ",\"report_interval_ms\":";
-  json += String(config.reportIntervalMs);
+  json += String(cfg.reportIntervalMs);
   json += ",\"leak_enabled\":";
-  json += (config.leakProtectionEnabled ? "true" : "false");
+  json += (cfg.leakProtectionEnabled ? "true" : "false");
   json += ",\"leak_threshold_l\":";
-  json += String(config.leakThresholdLiters, 2);
+  json += String(cfg.leakThresholdLiters, 2);
+  json += ",\"merge_gap_s\":";
+  json += String(cfg.mergeGapSec);
+  json += ",\"leak_1h_l\":";
+  json += String(cfg.leakHourLiters, 2);
+  json += ",\"leak_24h_l\":";
+  json += String(cfg.leakDayLiters, 2);
+  json += ",\"leak_max_dur_s\":";
+  json += String(cfg.leakMaxDurationSec);
+  json += ",\"leak_max_lpm\":";
+  json += String(cfg.leakMaxRateLpm, 2);
+  json += ",\"night_start_hour\":";
+  json += String(cfg.nightStartHour);
+  json += ",\"night_end_hour\":";
+  json += String(cfg.nightEndHour);
+  json += ",\"night_min_lpm\":";
+  json += String(cfg.nightMinLpm, 2);
+  json += ",\"closed_window_l\":";
+  json += String(cfg.closedWindowLiters, 2);
+  json += ",\"baseline_sigma\":";
+  json += String(cfg.baselineSigma, 2);
+  json += ",\"baseline_close\":";
+  json += (cfg.baselineCloseValve ? "true" : "false");
+  json += ",\"interval_keep_days\":";
+  json += String(cfg.intervalKeepDays);
+  json += ",\"usage_keep_days\":";
+  json += String(cfg.usageKeepDays);
   for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
     json += ",\"close_start_";
     json += String(i + 1);
     json += "\":\"";
-    appendTime(json, config.closeStartHour[i], config.closeStartMin[i]);
+    appendTime(json, cfg.closeStartHour[i], cfg.closeStartMin[i]);
     json += "\"";
     json += ",\"close_end_";
     json += String(i + 1);
     json += "\":\"";
-    appendTime(json, config.closeEndHour[i], config.closeEndMin[i]);
+    appendTime(json, cfg.closeEndHour[i], cfg.closeEndMin[i]);
     json += "\"";
   }
   json += ",\"pulses_per_liter\":";
-  json += String(config.pulsesPerLiter, 2);
+  json += String(cfg.pulsesPerLiter, 2);
   json += ",\"tz_info\":\"";
-  json += config.tzInfo;
+  json += cfg.tzInfo;
   json += "\"";
   json += "}";
   return json;
@@ -165,31 +505,86 @@ static bool applyConfigFromArgs() {
     return false;
   }
 
+  const Config &cfg = latestConfig();
   float flow = server.arg("flow_active_lpm").toFloat();
-  float minInterval = config.minIntervalLiters;
+  float minInterval = cfg.minIntervalLiters;
   if (server.hasArg("min_interval_l")) {
     minInterval = server.arg("min_interval_l").toFloat();
   }
   uint32_t reportMs = (uint32_t)server.arg("report_interval_ms").toInt();
-  bool leakEnabled = config.leakProtectionEnabled;
+  bool leakEnabled = cfg.leakProtectionEnabled;
   if (server.hasArg("leak_enabled")) {
     String leakArg = server.arg("leak_enabled");
     leakArg.toLowerCase();
     leakEnabled = (leakArg == "1" || leakArg == "true" || leakArg == "on");
   }
-  float leakThreshold = config.leakThresholdLiters;
+  float leakThreshold = cfg.leakThresholdLiters;
   if (server.hasArg("leak_threshold_l")) {
     leakThreshold = server.arg("leak_threshold_l").toFloat();
   }
+  long mergeGap = (long)cfg.mergeGapSec;
+  if (server.hasArg("merge_gap_s")) {
+    mergeGap = server.arg("merge_gap_s").toInt();
+  }
+  float leakHour = cfg.leakHourLiters;
+  if (server.hasArg("leak_1h_l")) {
+    leakHour = server.arg("leak_1h_l").toFloat();
+  }
+  float leakDay = cfg.leakDayLiters;
+  if (server.hasArg("leak_24h_l")) {
+    leakDay = server.arg("leak_24h_l").toFloat();
+  }
+  long leakDuration = (long)cfg.leakMaxDurationSec;
+  if (server.hasArg("leak_max_dur_s")) {
+    leakDuration = server.arg("leak_max_dur_s").toInt();
+  }
+  float leakRate = cfg.leakMaxRateLpm;
+  if (server.hasArg("leak_max_lpm")) {
+    leakRate = server.arg("leak_max_lpm").toFloat();
+  }
+  int nightStart = cfg.nightStartHour;
+  if (server.hasArg("night_start_hour")) {
+    nightStart = server.arg("night_start_hour").toInt();
+  }
+  int nightEnd = cfg.nightEndHour;
+  if (server.hasArg("night_end_hour")) {
+    nightEnd = server.arg("night_end_hour").toInt();
+  }
+  float nightMin = cfg.nightMinLpm;
+  if (server.hasArg("night_min_lpm")) {
+    nightMin = server.arg("night_min_lpm").toFloat();
+  }
+  float closedLiters = cfg.closedWindowLiters;
+  if (server.hasArg("closed_window_l")) {
+    closedLiters = server.arg("closed_window_l").toFloat();
+  }
+  float baselineSigma = cfg.baselineSigma;
+  if (server.hasArg("baseline_sigma")) {
+    baselineSigma = server.arg("baseline_sigma").toFloat();
+  }
+  bool baselineClose = cfg.baselineCloseValve;
+  if (server.hasArg("baseline_close")) {
+    String closeArg = server.arg("baseline_close");
+    closeArg.toLowerCase();
+    baselineClose = (closeArg == "1" || closeArg == "true" || closeArg == "on");
+  }
+  long intervalKeep = (long)cfg.intervalKeepDays;
+  if (server.hasArg("interval_keep_days")) {
+    intervalKeep = server.arg("interval_keep_days").toInt();
+  }
+  long usageKeep = (long)cfg.usageKeepDays;
+  if (server.hasArg("usage_keep_days")) {
+    usageKeep = server.arg("usage_keep_days").toInt();
+  }
   int csh[BLOCKED_WINDOW_COUNT];
   int csm[BLOCKED_WINDOW_COUNT];
   int ceh[BLOCKED_WINDOW_COUNT];
   int cem[BLOCKED_WINDOW_COUNT];
   for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    csh[i] = config.closeStartHour[i];
-    csm[i] = config.closeStartMin[i];
-    ceh[i] = config.closeEndHour[i];
-    cem[i] = config.closeEndMin[i];
+    csh[i] = cfg.closeStartHour[i];
+    csm[i] = cfg.closeStartMin[i];
+    ceh[i] = cfg.closeEndHour[i];
+    cem[i] = cfg.closeEndMin[i];
 
     String startKey = "close_start_" + String(i + 1);
     String endKey = "close_end_" + String(i + 1);
@@ -214,36 +609,37 @@ static bool applyConfigFromArgs() {
   float ppl = server.arg("pulses_per_liter").toFloat();
   String tz = server.arg("tz_info");
 
-  if (flow <= 0.0f || flow > 100.0f) return false;
-  if (minInterval < 0.0f || minInterval > 1000.0f) return false;
-  if (reportMs < 1000 || reportMs > 3600000) return false;
-  if (leakThreshold < 1.0f || leakThreshold > 100000.0f) return false;
-  for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    if (csh[i] < 0 || csh[i] > 23) return false;
-    if (csm[i] < 0 || csm[i] > 59) return false;
-    if (ceh[i] < 0 || ceh[i] > 23) return false;
-    if (cem[i] < 0 || cem[i] > 59) return false;
-  }
-  if (ppl <= 1.0f || ppl > 10000.0f) return false;
-  if (tz.length() == 0 || tz.length() >= (int)sizeof(config.tzInfo)) return false;
-
-  config.flowActiveLpm = flow;
-  config.minIntervalLiters = minInterval;
-  config.reportIntervalMs = reportMs;
-  config.leakProtectionEnabled = leakEnabled;
-  config.leakThresholdLiters = leakThreshold;
+  if (mergeGap < 0 || leakDuration < 0 || intervalKeep < 0 || usageKeep < 0) return false;
+  if (tz.length() == 0 || tz.length() >= (int)sizeof(cfg.tzInfo)) return false;
+
+  Config next = cfg;
+  next.flowActiveLpm = flow;
+  next.minIntervalLiters = minInterval;
+  next.reportIntervalMs = reportMs;
+  next.leakProtectionEnabled = leakEnabled;
+  next.leakThresholdLiters = leakThreshold;
+  next.mergeGapSec = (uint32_t)mergeGap;
+  next.leakHourLiters = leakHour;
+  next.leakDayLiters = leakDay;
+  next.leakMaxDurationSec = (uint32_t)leakDuration;
+  next.leakMaxRateLpm = leakRate;
+  next.nightStartHour = nightStart;
+  next.nightEndHour = nightEnd;
+  next.nightMinLpm = nightMin;
+  next.closedWindowLiters = closedLiters;
+  next.baselineSigma = baselineSigma;
+  next.baselineCloseValve = baselineClose;
+  next.intervalKeepDays = (uint32_t)intervalKeep;
+  next.usageKeepDays = (uint32_t)usageKeep;
   for (int i = 0; i < BLOCKED_WINDOW_COUNT; i++) {
-    config.closeStartHour[i] = csh[i];
-    config.closeStartMin[i] = csm[i];
-    config.closeEndHour[i] = ceh[i];
-    config.closeEndMin[i] = cem[i];
-  }
-  config.pulsesPerLiter = ppl;
-  tz.toCharArray(config.tzInfo, sizeof(config.tzInfo));
-  saveConfig();
-  setenv("TZ", config.tzInfo, 1);
-  tzset();
-  return true;
+    next.closeStartHour[i] = csh[i];
+    next.closeStartMin[i] = csm[i];
+    next.closeEndHour[i] = ceh[i];
+    next.closeEndMin[i] = cem[i];
+  }
+  next.pulsesPerLiter = ppl;
+  tz.toCharArray(next.tzInfo, sizeof(next.tzInfo));
+  return applyConfig(next);
 }
 
 static void handleRoot() {
@@ -254,6 +650,10 @@ static void handleStatus() {
   server.send(200, "application/json", buildStatusJson());
 }
 
+static void handleMetrics() {
+  server.send(200, "application/json", buildMetricsJson());
+}
+
 static void handleReport() {
   String out;
   out.reserve(4096);
@@ -275,25 +675,46 @@ static void handleReportDayJson() {
   server.send(200, "application/json", buildReportDayJson(date));
 }
 
-static bool reloadUsageFromCsv() {
-  int lastYear = 0;
-  int lastMonth = 0;
-  int lastDay = 0;
-  bool usageLoaded = loadUsageFromCsv(lastYear, lastMonth, lastDay);
-  if (timeValid && usageLoaded) {
-    struct tm tmLast = {};
-    tmLast.tm_year = lastYear - 1900;
-    tmLast.tm_mon = lastMonth - 1;
-    tmLast.tm_mday = lastDay;
-    tmLast.tm_hour = 12;
-    tmLast.tm_isdst = -1;
-    time_t lastTs = mktime(&tmLast);
-    localtime_r(&lastTs, &tmLast);
-    currentYear = tmLast.tm_year;
-    currentYday = tmLast.tm_yday;
-    skipPersistOnNextRollover = true;
+// Binary, little-endian: uint32 first_ts, uint32 res_s, uint16 count,
+// uint16 scale, then count uint16 samples (flow * scale L/min, 0xFFFF = no
+// data). The samples are sent straight from the ring buffer.
+static void handleSeries() {
+  uint32_t res = server.hasArg("res") ? (uint32_t)server.arg("res").toInt() : 60;
+  int level = flowSeriesLevel(res);
+  if (level < 0) {
+    server.send(400, "application/json", "{\"ok\":false}");
+    return;
+  }
+  uint32_t span = res * flowSeriesCapacity(level);
+  uint32_t to = timeValid ? (uint32_t)time(nullptr) : 0xFFFFFFFFUL;
+  if (server.hasArg("to")) {
+    to = (uint32_t)strtoul(server.arg("to").c_str(), nullptr, 10);
+  }
+  uint32_t from = (to > span) ? to - span : 0;
+  if (server.hasArg("from")) {
+    from = (uint32_t)strtoul(server.arg("from").c_str(), nullptr, 10);
+  }
+
+  FlowSeriesSpan spans[2];
+  uint32_t firstTs = 0;
+  int spanCount = flowSeriesSpans(level, from, to, spans, firstTs);
+  uint16_t count = 0;
+  for (int i = 0; i < spanCount; i++) {
+    count += (uint16_t)spans[i].count;
+  }
+
+  uint8_t header[12];
+  uint16_t scale = FLOW_SERIES_SCALE;
+  memcpy(header, &firstTs, 4);
+  memcpy(header + 4, &res, 4);
+  memcpy(header + 8, &count, 2);
+  memcpy(header + 10, &scale, 2);
+  server.setContentLength(sizeof(header) + (count * sizeof(uint16_t)));
+  server.send(200, "application/octet-stream", "");
+  server.sendContent((const char *)header, sizeof(header));
+  for (int i = 0; i < spanCount; i++) {
+    server.sendContent((const char *)spans[i].data, spans[i].count * sizeof(uint16_t));
   }
-  return usageLoaded;
 }
 
 static const char *uploadPathForType(const String &type) {
@@ -306,48 +727,155 @@ static const char *uploadPathForType(const String &type) {
 static void handleUploadBody() {
   HTTPUpload &upload = server.upload();
   if (upload.status == UPLOAD_FILE_START) {
-    uploadOk = false;
-    uploadTarget = "";
-    String type = server.arg("type");
-    const char *path = uploadPathForType(type);
-    if (!path || !storageReady()) {
-      return;
-    }
-    uploadTarget = String(path);
-    SPIFFS.remove(path);
-    uploadFile = SPIFFS.open(path, "w");
-    uploadOk = uploadFile;
+    const char *path = uploadPathForType(server.arg("type"));
+    uploadOk = path && beginCsvImport(path, server.arg("lenient") == "1");
   } else if (upload.status == UPLOAD_FILE_WRITE) {
-    if (uploadOk && uploadFile) {
-      uploadFile.write(upload.buf, upload.currentSize);
-    }
+    if (uploadOk) feedCsvImport(upload.buf, upload.currentSize);
   } else if (upload.status == UPLOAD_FILE_END) {
-    if (uploadFile) {
-      uploadFile.close();
-    }
+    if (uploadOk) uploadOk = finishCsvImport();
   } else if (upload.status == UPLOAD_FILE_ABORTED) {
-    if (uploadFile) {
-      uploadFile.close();
-    }
-    if (uploadTarget.length()) {
-      SPIFFS.remove(uploadTarget);
-    }
+    abortCsvImport();
     uploadOk = false;
   }
 }
 
 static void handleUploadDone() {
-  if (!uploadOk || uploadTarget.isEmpty()) {
+  if (!uploadPathForType(server.arg("type"))) {
     server.send(400, "application/json", "{\"ok\":false}");
     return;
   }
-  String type = server.arg("type");
-  bool reloaded = false;
-  if (type == "usage" || type == "intervals") {
-    reloaded = reloadUsageFromCsv();
+  server.send(uploadOk ? 200 : 400, "application/json", buildCsvImportJson());
+  uploadOk = false;
+}
+
+static int channelArg(int fallback) {
+  if (!server.hasArg("channel") && !server.hasArg("ch")) return fallback;
+  String value = server.hasArg("channel") ? server.arg("channel") : server.arg("ch");
+  int ch = value.toInt();
+  if (ch < 0 || ch >= METER_CHANNEL_COUNT || (ch == 0 && value != "0")) return -1;
+  return ch;
+}
+
+static bool pinInUse(int pin, int exceptCh) {
+  for (int ch = 0; ch < METER_CHANNEL_COUNT; ch++) {
+    if (ch == exceptCh || !channelConfigs[ch].enabled) continue;
+    if (channelConfigs[ch].flowPin == pin || channelConfigs[ch].valvePin == pin) return true;
   }
-  server.send(200, "application/json",
-              reloaded ? "{\"ok\":true,\"reloaded\":true}" : "{\"ok\":true}");
+  return false;
+}
+
+// Branch channels only; the main line is configured through /api/config.
+static bool applyChannelConfigFromArgs(int ch) {
+  ChannelConfig cfg = channelConfigs[ch];
+  if (server.hasArg("enabled")) {
+    String value = server.arg("enabled");
+    value.toLowerCase();
+    cfg.enabled = (value == "1" || value == "true" || value == "on");
+  }
+  if (server.hasArg("name")) {
+    String name = server.arg("name");
+    if (name.length() == 0 || name.length() >= sizeof(cfg.name) || name.indexOf('"') >= 0) return false;
+    name.toCharArray(cfg.name, sizeof(cfg.name));
+  }
+  // Checked before narrowing, so 300 cannot wrap to a valid pin.
+  if (server.hasArg("flow_pin")) {
+    long pin = server.arg("flow_pin").toInt();
+    if (!validFlowPin(pin)) return false;
+    cfg.flowPin = (int8_t)pin;
+  }
+  if (server.hasArg("valve_pin")) {
+    long pin = server.arg("valve_pin").toInt();
+    if (pin != -1 && !validValvePin(pin)) return false;
+    cfg.valvePin = (int8_t)pin;
+  }
+  if (server.hasArg("pulses_per_liter")) cfg.pulsesPerLiter = server.arg("pulses_per_liter").toFloat();
+  if (server.hasArg("flow_active_lpm")) cfg.flowActiveLpm = server.arg("flow_active_lpm").toFloat();
+  if (server.hasArg("leak_l")) cfg.leakLiters = server.arg("leak_l").toFloat();
+  if (server.hasArg("leak_max_s")) cfg.leakMaxSec = (uint32_t)server.arg("leak_max_s").toInt();
+  if (server.hasArg("leak_max_lpm")) cfg.leakRateLpm = server.arg("leak_max_lpm").toFloat();
+  if (server.hasArg("night_min_lpm")) cfg.nightMinLpm = server.arg("night_min_lpm").toFloat();
+  if (server.hasArg("closed_window_l")) cfg.closedLiters = server.arg("closed_window_l").toFloat();
+  int hour = 0;
+  int minute = 0;
+  if (server.hasArg("close_start")) {
+    if (!parseTimeArg(server.arg("close_start"), hour, minute)) return false;
+    cfg.closeStartMin = (hour * 60) + minute;
+  }
+  if (server.hasArg("close_end")) {
+    if (!parseTimeArg(server.arg("close_end"), hour, minute)) return false;
+    cfg.closeEndMin = (hour * 60) + minute;
+  }
+
+  if (!validFlowPin(cfg.flowPin)) return false;
+  if (cfg.valvePin != -1 && !validValvePin(cfg.valvePin)) return false;
+  if (cfg.valvePin == cfg.flowPin) return false;
+  if (cfg.pulsesPerLiter <= 0.0f || cfg.flowActiveLpm < 0.0f) return false;
+  if (cfg.leakLiters < 0.0f || cfg.leakRateLpm < 0.0f || cfg.nightMinLpm < 0.0f ||
+      cfg.closedLiters < 0.0f) {
+    return false;
+  }
+  if (cfg.enabled && (pinInUse(cfg.flowPin, ch) || (cfg.valvePin >= 0 && pinInUse(cfg.valvePin, ch)))) {
+    return false;
+  }
+
+  channelConfigs[ch] = cfg;
+  saveChannelConfig(ch);
+  return true;
+}
+
+static void handleChannelsGet() {
+  server.send(200, "application/json", buildChannelsJson());
+}
+
+static void handleChannelConfigPost() {
+  int ch = channelArg(-1);
+  if (ch <= MAIN_CHANNEL || !applyChannelConfigFromArgs(ch)) {
+    server.send(400, "application/json", "{\"ok\":false}");
+    return;
+  }
+  server.send(200, "application/json", "{\"ok\":true}");
+}
+
+static void handleMqttGet() {
+  server.send(200, "application/json", buildTelemetryJson());
+}
+
+static void handleMqttPost() {
+  TelemetryConfig cfg = telemetryConfig;
+  if (server.hasArg("enabled")) {
+    String value = server.arg("enabled");
+    value.toLowerCase();
+    cfg.enabled = (value == "1" || value == "true" || value == "on");
+  }
+  bool ok = true;
+  if (server.hasArg("host")) {
+    String host = server.arg("host");
+    ok = ok && host.length() < sizeof(cfg.host) && host.indexOf('"') < 0;
+    if (ok) host.toCharArray(cfg.host, sizeof(cfg.host));
+  }
+  if (server.hasArg("port")) {
+    long port = server.arg("port").toInt();
+    ok = ok && port > 0 && port <= 65535;
+    cfg.port = (uint16_t)port;
+  }
+  if (server.hasArg("prefix")) {
+    String prefix = server.arg("prefix");
+    ok = ok && prefix.length() > 0 && prefix.length() < sizeof(cfg.prefix) &&
+         prefix.indexOf('"') < 0 && prefix.indexOf('#') < 0 && prefix.indexOf('+') < 0;
+    if (ok) prefix.toCharArray(cfg.prefix, sizeof(cfg.prefix));
+  }
+  if (server.hasArg("status_s")) {
+    long statusSec = server.arg("status_s").toInt();
+    ok = ok && statusSec >= 0 && statusSec <= 86400;
+    cfg.statusSec = (uint32_t)statusSec;
+  }
+  if (!ok) {
+    server.send(400, "application/json", "{\"ok\":false}");
+    return;
+  }
+  telemetryConfig = cfg;
+  saveTelemetryConfig();
+  server.send(200, "application/json", "{\"ok\":true}");
 }
 
 static void handleConfigGet() {
@@ -359,7 +887,8 @@ static void streamCsvFile(const char *path) {
     server.send(503, "text/plain", "Storage not ready.");
     return;
   }
-  File file = SPIFFS.open(path, "r");
+  StorageLock lock;
+  File file = flashFs.open(path, "r");
   if (!file) {
     server.send(404, "text/plain", "CSV not found.");
     return;
@@ -369,21 +898,63 @@ static void streamCsvFile(const char *path) {
 }
 
 static void handleConfigCsv() {
-  streamCsvFile(CONFIG_CSV_PATH);
+  String out;
+  out.reserve(512);
+  StringPrint printer(out);
+  printConfigCsvTo(printer, latestConfig());
+  server.send(200, "text/csv", out);
+}
+
+// Body: a config.csv as exported above, or from older firmware.
+static void handleConfigCsvPost() {
+  String body = server.arg("plain");
+  Config next = latestConfig();
+  if (!parseConfigCsv(body.c_str(), body.length(), next) || !applyConfig(next)) {
+    server.send(400, "application/json", "{\"ok\":false}");
+    return;
+  }
+  server.send(200, "application/json", "{\"ok\":true}");
 }
 
 static void handleUsageCsv() {
   streamCsvFile(USAGE_CSV_PATH);
 }
 
+// Archived months are decoded back into rows ahead of the live file.
 static void handleIntervalsCsv() {
-  streamCsvFile(INTERVALS_CSV_PATH);
+  if (!storageReady()) {
+    server.send(503, "text/plain", "Storage not ready.");
+    return;
+  }
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/csv", "");
+  {
+    ChunkedPrint out;
+    writeIntervalsCsvExport(out);
+  }
+  server.sendContent("");
 }
 
 static void handleLeaksCsv() {
   streamCsvFile(LEAKS_CSV_PATH);
 }
 
+static void handleChannelUsageCsv() {
+  int ch = channelArg(-1);
+  if (ch <= MAIN_CHANNEL) {
+    // The main line keeps its history in usage.csv.
+    if (ch == MAIN_CHANNEL) {
+      streamCsvFile(USAGE_CSV_PATH);
+    } else {
+      server.send(400, "text/plain", "Bad channel.");
+    }
+    return;
+  }
+  char path[24];
+  channelUsagePath(ch, path, sizeof(path));
+  streamCsvFile(path);
+}
+
 static void handleSummaryJson() {
   String period = server.arg("period");
   period.toLowerCase();
@@ -391,7 +962,31 @@ static void handleSummaryJson() {
     period = "week";
   }
   int limit = server.hasArg("limit") ? server.arg("limit").toInt() : 12;
-  server.send(200, "application/json", buildSummaryJson(period, limit));
+  bool bins = server.hasArg("bins") && server.arg("bins") != "0";
+  server.send(200, "application/json", buildSummaryJson(period, limit, bins));
+}
+
+static void handleHistory() {
+  HistoryQuery query;
+  if (!parseHistoryDate(server.arg("from"), query.fromKey) ||
+      !parseHistoryDate(server.arg("to"), query.toKey) || query.toKey < query.fromKey) {
+    server.send(400, "application/json", "{\"ok\":false}");
+    return;
+  }
+  if (!storageReady()) {
+    server.send(503, "application/json", "{\"ok\":false}");
+    return;
+  }
+  query.limitDays = server.hasArg("limit") ? server.arg("limit").toInt() : HISTORY_DEFAULT_DAYS;
+  query.bins = server.hasArg("bins") && server.arg("bins") != "0";
+  query.intervals = server.hasArg("intervals") && server.arg("intervals") != "0";
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  {
+    ChunkedPrint out;
+    if (!writeHistoryJson(query, out)) out.print("{\"ok\":false}");
+  }
+  server.sendContent("");
 }
 
 static void handleConfigPost() {
@@ -405,17 +1000,18 @@ static void handleConfigPost() {
 static void handleValve() {
   String action = server.arg("action");
   action.toLowerCase();
-  if (action == "open") {
-    manualOverrideOpen();
-    server.send(200, "application/json", "{\"ok\":true,\"valve\":\"OPEN\"}");
+  int ch = channelArg(MAIN_CHANNEL);
+  if (ch < 0 || (action != "open" && action != "close")) {
+    server.send(400, "application/json", "{\"ok\":false}");
     return;
   }
-  if (action == "close") {
-    manualOverrideClose();
-    server.send(200, "application/json", "{\"ok\":true,\"valve\":\"CLOSED\"}");
+  if (!channelHasValve(ch)) {
+    server.send(409, "application/json", "{\"ok\":false}");
     return;
   }
-  server.send(400, "application/json", "{\"ok\":false}");
+  channelManualOverride(ch, action == "open");
+  server.send(200, "application/json",
+              action == "open" ? "{\"ok\":true,\"valve\":\"OPEN\"}" : "{\"ok\":true,\"valve\":\"CLOSED\"}");
 }
 
 static void handleReset() {
@@ -430,18 +1026,27 @@ static void handleNotFound() {
 void setupServer() {
   server.on("/", HTTP_GET, handleRoot);
   server.on("/api/status", HTTP_GET, handleStatus);
+  server.on("/api/metrics", HTTP_GET, handleMetrics);
   server.on("/api/report", HTTP_GET, handleReport);
   server.on("/api/report.json", HTTP_GET, handleReportJson);
   server.on("/api/report_day.json", HTTP_GET, handleReportDayJson);
+  server.on("/api/series", HTTP_GET, handleSeries);
   server.on("/api/upload", HTTP_POST, handleUploadDone, handleUploadBody);
   server.on("/api/summary.json", HTTP_GET, handleSummaryJson);
+  server.on("/api/history", HTTP_GET, handleHistory);
   server.on("/api/config", HTTP_GET, handleConfigGet);
   server.on("/api/config", HTTP_POST, handleConfigPost);
   server.on("/api/config.csv", HTTP_GET, handleConfigCsv);
+  server.on("/api/config.csv", HTTP_POST, handleConfigCsvPost);
   server.on("/api/usage.csv", HTTP_GET, handleUsageCsv);
   server.on("/api/intervals.csv", HTTP_GET, handleIntervalsCsv);
   server.on("/api/leaks.csv", HTTP_GET, handleLeaksCsv);
   server.on("/api/valve", HTTP_POST, handleValve);
+  server.on("/api/channels", HTTP_GET, handleChannelsGet);
+  server.on("/api/channels/config", HTTP_POST, handleChannelConfigPost);
+  server.on("/api/channel_usage.csv", HTTP_GET, handleChannelUsageCsv);
+  server.on("/api/mqtt", HTTP_GET, handleMqttGet);
+  server.on("/api/mqtt", HTTP_POST, handleMqttPost);
   server.onNotFound(handleNotFound);
   server.begin();
 }
@@ -207,7 +207,7 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
     }
     .interval-row {
       display: grid;
-      grid-template-columns: 70px 70px 90px 1fr;
+      grid-template-columns: 70px 70px 90px 1fr 1fr;
       gap: 8px;
       padding: 6px 0;
       border-bottom: 1px dashed #e5e7eb;
@@ -344,6 +344,10 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
             <label for="min_interval_l">Min Interval (L)</label>
             <input id="min_interval_l" name="min_interval_l" type="number" step="0.01" min="0" required>
           </div>
+          <div>
+            <label for="merge_gap_s">Merge Gap (s)</label>
+            <input id="merge_gap_s" name="merge_gap_s" type="number" step="1" min="0" max="3600" required>
+          </div>
           <div>
             <label for="report_interval_ms">Report Interval (ms)</label>
             <input id="report_interval_ms" name="report_interval_ms" type="number" step="1000" min="1000" required>
@@ -359,6 +363,57 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
             <label for="leak_threshold_l">Leak Threshold (L)</label>
             <input id="leak_threshold_l" name="leak_threshold_l" type="number" step="0.1" min="1" required>
           </div>
+          <div>
+            <label for="leak_1h_l">Leak Limit 1 h (L, 0 = off)</label>
+            <input id="leak_1h_l" name="leak_1h_l" type="number" step="0.1" min="0" required>
+          </div>
+          <div>
+            <label for="leak_24h_l">Leak Limit 24 h (L, 0 = off)</label>
+            <input id="leak_24h_l" name="leak_24h_l" type="number" step="0.1" min="0" required>
+          </div>
+          <div>
+            <label for="leak_max_dur_s">Max Run Time (s, 0 = off)</label>
+            <input id="leak_max_dur_s" name="leak_max_dur_s" type="number" step="1" min="0" max="86400" required>
+          </div>
+          <div>
+            <label for="leak_max_lpm">Max Flow (L/min, 0 = off)</label>
+            <input id="leak_max_lpm" name="leak_max_lpm" type="number" step="0.1" min="0" required>
+          </div>
+          <div>
+            <label for="night_start_hour">Night Start Hour</label>
+            <input id="night_start_hour" name="night_start_hour" type="number" step="1" min="0" max="23" required>
+          </div>
+          <div>
+            <label for="night_end_hour">Night End Hour</label>
+            <input id="night_end_hour" name="night_end_hour" type="number" step="1" min="0" max="23" required>
+          </div>
+          <div>
+            <label for="night_min_lpm">Night Min Flow (L/min, 0 = off)</label>
+            <input id="night_min_lpm" name="night_min_lpm" type="number" step="0.01" min="0" required>
+          </div>
+          <div>
+            <label for="closed_window_l">Closed Window Limit (L, 0 = off)</label>
+            <input id="closed_window_l" name="closed_window_l" type="number" step="0.1" min="0" required>
+          </div>
+          <div>
+            <label for="baseline_sigma">Baseline Sigmas (0 = off)</label>
+            <input id="baseline_sigma" name="baseline_sigma" type="number" step="0.5" min="0" max="20" required>
+          </div>
+          <div>
+            <label for="baseline_close">Baseline Action</label>
+            <select id="baseline_close" name="baseline_close" required>
+              <option value="false">Log only</option>
+              <option value="true">Close valve</option>
+            </select>
+          </div>
+          <div>
+            <label for="interval_keep_days">Keep Intervals (days, 0 = all)</label>
+            <input id="interval_keep_days" name="interval_keep_days" type="number" step="1" min="0" max="3650" required>
+          </div>
+          <div>
+            <label for="usage_keep_days">Keep Daily Totals (days, 0 = all)</label>
+            <input id="usage_keep_days" name="usage_keep_days" type="number" step="1" min="0" max="3650" required>
+          </div>
           <div>
             <label for="close_start_1">Blocked Start 1</label>
             <input id="close_start_1" name="close_start_1" type="time" required>
@@ -534,7 +589,7 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
           dhtml = `<div class="sub">No intervals</div>`;
         } else if (day.intervals && day.intervals.length) {
           dhtml = `<div class="interval-row interval-header">` +
-                  `<div>From</div><div>To</div><div>Dur</div><div>Liters</div>` +
+                  `<div>From</div><div>To</div><div>Dur</div><div>Liters</div><div>Peak</div>` +
                   `</div>`;
           day.intervals.forEach(it => {
             dhtml += `<div class="interval-row">` +
@@ -542,6 +597,7 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
                      `<div>${it.to}</div>` +
                      `<div>${it.dur}</div>` +
                      `<div>${Number(it.liters || 0).toFixed(3)} L</div>` +
+                     `<div>${Number(it.peak_lpm || 0).toFixed(2)} L/m</div>` +
                      `</div>`;
           });
         } else {
@@ -772,10 +828,16 @@ extern const char DASHBOARD_HTML[] PROGMEM = R"HTML(
         method: 'POST',
         body: form
       });
+      const info = await res.json().catch(() => ({}));
       if (res.ok) {
-        msg.textContent = 'Uploaded.';
+        const kbps = ((info.bytes_per_sec || 0) / 1024).toFixed(1);
+        msg.textContent = 'Imported ' + info.rows + ' rows (' + kbps + ' KB/s' +
+          (info.bad_rows ? ', ' + info.bad_rows + ' skipped' : '') + ').';
         await loadReport();
         await loadLeaks();
+      } else if (info.error) {
+        msg.textContent = 'Upload rejected: ' + info.error +
+          (info.first_bad_line ? ' at line ' + info.first_bad_line : '') + '. Nothing was changed.';
       } else {
         msg.textContent = 'Upload failed.';
       }
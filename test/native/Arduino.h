@@ -0,0 +1,13 @@
+#pragma once
+
+// Just enough of the Arduino core for the host tests; the test provides
+// millis() so it can move time by hand.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+uint32_t millis();
+
+// Only passed by reference in the headers the tests pull in.
+class Print;
+class String;
@@ -0,0 +1,7 @@
+#pragma once
+
+// Host tests are single-threaded; critical sections do nothing.
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
@@ -0,0 +1,109 @@
+// Runs the hour-of-week baseline on the host: hours are fed through
+// feedBaseline() the way the 1 s tick does, and the buckets are checked
+// directly.
+#include <unity.h>
+
+#include "baseline.cpp"
+
+ChannelState channels[METER_CHANNEL_COUNT];
+fs::FS flashFs;
+static int baselineSaves = 0;
+
+uint32_t millis() { return 0; }
+uint32_t crc32_le(uint32_t crc, const uint8_t *, uint32_t) { return crc; }
+bool storageReady() { return false; }
+StorageLock::StorageLock() {}
+StorageLock::~StorageLock() {}
+bool replaceFileAtomic(const char *, const char *, uint32_t) { return false; }
+void noteFlashRewrite(FlashWearFile, uint32_t, uint32_t) {}
+bool queueBaselineSave() {
+  baselineSaves++;
+  return true;
+}
+
+static const float SIGMAS = 3.0f;
+
+static struct tm hourOf(int bucket) {
+  struct tm t = {};
+  t.tm_wday = bucket / 24;
+  t.tm_hour = bucket % 24;
+  return t;
+}
+
+// One tick per minute is enough; only the hour's sum matters. Runs the
+// detector after each feed, as loop() does.
+static bool runHour(int bucket, float liters) {
+  struct tm t = hourOf(bucket);
+  bool flagged = false;
+  for (int i = 0; i < 60; i++) {
+    feedBaseline(t, liters / 60.0f);
+    float value = 0.0f;
+    float limit = 0.0f;
+    if (checkBaseline(SIGMAS, value, limit)) flagged = true;
+  }
+  return flagged;
+}
+
+void setUp() {
+  for (int i = 0; i < BASELINE_BUCKETS; i++) {
+    buckets[i].mean = 10.0f;
+    buckets[i].var = 4.0f;
+    buckets[i].samples = 5;
+  }
+  currentBucket = -1;
+  hourLiters = 0.0f;
+  hourComplete = false;
+  hourFlagged = false;
+  channels[MAIN_CHANNEL].leakTripped = false;
+  baselineSaves = 0;
+}
+
+void tearDown() {}
+
+static void test_normal_hour_is_learned() {
+  runHour(10, 0.0f);
+  TEST_ASSERT_FALSE(runHour(11, 12.0f));
+  runHour(12, 0.0f);
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, 10.4f, buckets[11].mean);
+  TEST_ASSERT_EQUAL(6, buckets[11].samples);
+  TEST_ASSERT_EQUAL(1, baselineSaves);
+}
+
+static void test_flagged_hour_is_not_learned() {
+  runHour(10, 0.0f);
+  // mean 10 + 3 * sd 2 = 16 L; 40 L is flagged.
+  TEST_ASSERT_TRUE(runHour(11, 40.0f));
+  runHour(12, 0.0f);
+  TEST_ASSERT_EQUAL_FLOAT(10.0f, buckets[11].mean);
+  TEST_ASSERT_EQUAL_FLOAT(4.0f, buckets[11].var);
+  TEST_ASSERT_EQUAL(5, buckets[11].samples);
+  // The hour after it is learned again.
+  runHour(13, 0.0f);
+  TEST_ASSERT_EQUAL(6, buckets[12].samples);
+}
+
+static void test_tripped_hour_is_not_learned() {
+  runHour(10, 0.0f);
+  channels[MAIN_CHANNEL].leakTripped = true;
+  runHour(11, 5.0f);
+  channels[MAIN_CHANNEL].leakTripped = false;
+  runHour(12, 0.0f);
+  TEST_ASSERT_EQUAL_FLOAT(10.0f, buckets[11].mean);
+  TEST_ASSERT_EQUAL(5, buckets[11].samples);
+}
+
+static void test_partial_hour_is_not_learned() {
+  // Boot in the middle of hour 11: nothing saw its start.
+  runHour(11, 12.0f);
+  runHour(12, 0.0f);
+  TEST_ASSERT_EQUAL(5, buckets[11].samples);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_normal_hour_is_learned);
+  RUN_TEST(test_flagged_hour_is_not_learned);
+  RUN_TEST(test_tripped_hour_is_not_learned);
+  RUN_TEST(test_partial_hour_is_not_learned);
+  return UNITY_END();
+}
@@ -0,0 +1,263 @@
+// Runs MqttClient on the host against a loopback broker stand-in: the test
+// queues the broker's replies and checks the frames the client wrote.
+#include <unity.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "mqtt_client.cpp"
+
+static uint32_t nowMs = 0;
+
+uint32_t millis() { return nowMs; }
+
+class LoopbackClient : public Client {
+public:
+  std::vector<uint8_t> sent;
+  std::deque<uint8_t> inbox;
+  bool open = false;
+  bool refuseConnect = false;
+  int stops = 0;
+
+  int connect(const char *, uint16_t) override {
+    open = !refuseConnect;
+    return open ? 1 : 0;
+  }
+  size_t write(const uint8_t *buf, size_t size) override {
+    if (!open) return 0;
+    sent.insert(sent.end(), buf, buf + size);
+    return size;
+  }
+  int available() override { return (int)inbox.size(); }
+  int read() override {
+    if (inbox.empty()) return -1;
+    uint8_t b = inbox.front();
+    inbox.pop_front();
+    return b;
+  }
+  void stop() override {
+    open = false;
+    stops++;
+  }
+  uint8_t connected() override { return open ? 1 : 0; }
+
+  void reply(std::initializer_list<uint8_t> bytes) { inbox.insert(inbox.end(), bytes); }
+  // Removes and returns the next complete packet the client wrote.
+  std::vector<uint8_t> takePacket() {
+    size_t pos = 1;
+    uint32_t len = 0;
+    uint32_t mult = 1;
+    while (pos < sent.size()) {
+      uint8_t b = sent[pos++];
+      len += (uint32_t)(b & 0x7F) * mult;
+      mult *= 128;
+      if (!(b & 0x80)) break;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(pos + len <= sent.size(), "incomplete packet");
+    std::vector<uint8_t> packet(sent.begin(), sent.begin() + pos + len);
+    sent.erase(sent.begin(), sent.begin() + pos + len);
+    return packet;
+  }
+};
+
+static LoopbackClient *net;
+static MqttClient *mqtt;
+
+void setUp() {
+  nowMs = 1000;
+  net = new LoopbackClient();
+  mqtt = new MqttClient(*net);
+}
+
+void tearDown() {
+  delete mqtt;
+  delete net;
+}
+
+static void connectAndAck() {
+  TEST_ASSERT_TRUE(mqtt->begin("broker", 1883, "water-abc", 60));
+  net->takePacket();
+  net->reply({0x20, 0x02, 0x00, 0x00});
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+static std::string publishedTopic(const std::vector<uint8_t> &packet, size_t &payloadAt) {
+  size_t pos = 1;
+  while (packet[pos] & 0x80) pos++;
+  pos++;
+  size_t topicLen = ((size_t)packet[pos] << 8) | packet[pos + 1];
+  payloadAt = pos + 2 + topicLen;
+  return std::string(packet.begin() + pos + 2, packet.begin() + payloadAt);
+}
+
+static void test_encode_length() {
+  uint8_t out[4];
+  TEST_ASSERT_EQUAL(1, mqttEncodeLength(0, out));
+  TEST_ASSERT_EQUAL(1, mqttEncodeLength(127, out));
+  TEST_ASSERT_EQUAL(2, mqttEncodeLength(128, out));
+  TEST_ASSERT_EQUAL_HEX8(0x80, out[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, out[1]);
+  TEST_ASSERT_EQUAL(2, mqttEncodeLength(16383, out));
+  TEST_ASSERT_EQUAL(3, mqttEncodeLength(16384, out));
+  TEST_ASSERT_EQUAL(4, mqttEncodeLength(268435455, out));
+  TEST_ASSERT_EQUAL(0, mqttEncodeLength(268435456, out));
+}
+
+static void test_connect_frame() {
+  TEST_ASSERT_TRUE(mqtt->begin("broker", 1883, "water-abc", 60));
+  TEST_ASSERT_TRUE(mqtt->connecting());
+  const uint8_t expected[] = {0x10, 21,  0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 60,
+                              0x00, 9,   'w',  'a',  't', 'e', 'r', '-', 'a',  'b',  'c'};
+  std::vector<uint8_t> packet = net->takePacket();
+  TEST_ASSERT_EQUAL(sizeof(expected), packet.size());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, packet.data(), sizeof(expected));
+
+  net->reply({0x20, 0x02, 0x00, 0x00});
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connected());
+  TEST_ASSERT_EQUAL(0, mqtt->lastRefusal());
+}
+
+static void test_start_on_open_link() {
+  TEST_ASSERT_EQUAL(1, net->connect("broker", 1883));
+  TEST_ASSERT_TRUE(mqtt->start("water-abc", 60));
+  TEST_ASSERT_EQUAL_HEX8(0x10, net->takePacket()[0]);
+  net->reply({0x20, 0x02, 0x00, 0x00});
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+static void test_refused_connect() {
+  TEST_ASSERT_TRUE(mqtt->begin("broker", 1883, "water-abc", 60));
+  net->reply({0x20, 0x02, 0x00, 0x05});
+  mqtt->loop(nowMs);
+  TEST_ASSERT_FALSE(mqtt->connected());
+  TEST_ASSERT_FALSE(mqtt->connecting());
+  TEST_ASSERT_EQUAL(5, mqtt->lastRefusal());
+  TEST_ASSERT_FALSE(net->open);
+}
+
+static void test_unreachable_broker() {
+  net->refuseConnect = true;
+  TEST_ASSERT_FALSE(mqtt->begin("broker", 1883, "water-abc", 60));
+  TEST_ASSERT_FALSE(mqtt->connecting());
+  TEST_ASSERT_TRUE(net->sent.empty());
+}
+
+static void test_connack_timeout() {
+  TEST_ASSERT_TRUE(mqtt->begin("broker", 1883, "water-abc", 60));
+  nowMs += 4999;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connecting());
+  nowMs += 1;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_FALSE(mqtt->connecting());
+  TEST_ASSERT_FALSE(net->open);
+}
+
+static void test_publish_frames_in_order() {
+  TEST_ASSERT_FALSE(mqtt->publish("water/x/events", (const uint8_t *)"early", 5));
+  connectAndAck();
+
+  const char *payloads[] = {"{\"seq\":7}", "{\"seq\":8}", "{\"seq\":9}"};
+  for (const char *p : payloads) {
+    TEST_ASSERT_TRUE(mqtt->publish("water/x/events", (const uint8_t *)p, strlen(p)));
+  }
+  TEST_ASSERT_TRUE(mqtt->publish("water/x/status", (const uint8_t *)"{}", 2, true));
+
+  for (const char *p : payloads) {
+    std::vector<uint8_t> packet = net->takePacket();
+    TEST_ASSERT_EQUAL_HEX8(0x30, packet[0]);
+    size_t payloadAt = 0;
+    TEST_ASSERT_EQUAL_STRING("water/x/events", publishedTopic(packet, payloadAt).c_str());
+    TEST_ASSERT_EQUAL_STRING(p, std::string(packet.begin() + payloadAt, packet.end()).c_str());
+  }
+  std::vector<uint8_t> status = net->takePacket();
+  TEST_ASSERT_EQUAL_HEX8(0x31, status[0]);
+  TEST_ASSERT_TRUE(net->sent.empty());
+}
+
+static void test_long_payload_length() {
+  connectAndAck();
+  std::string payload(300, 'x');
+  TEST_ASSERT_TRUE(mqtt->publish("t", (const uint8_t *)payload.data(), payload.size()));
+  std::vector<uint8_t> packet = net->takePacket();
+  // 2 + 1 topic bytes + 300 = 303 -> 0xAF 0x02.
+  TEST_ASSERT_EQUAL_HEX8(0xAF, packet[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x02, packet[2]);
+  TEST_ASSERT_EQUAL(1 + 2 + 303, packet.size());
+}
+
+static void test_keepalive_ping() {
+  connectAndAck();
+  nowMs += 29999;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(net->sent.empty());
+  nowMs += 1;
+  mqtt->loop(nowMs);
+  std::vector<uint8_t> ping = net->takePacket();
+  TEST_ASSERT_EQUAL_HEX8(0xC0, ping[0]);
+
+  // Only one ping is outstanding at a time.
+  nowMs += 1000;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(net->sent.empty());
+
+  net->reply({0xD0, 0x00});
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connected());
+}
+
+static void test_silent_broker_dropped() {
+  connectAndAck();
+  nowMs += 30000;
+  mqtt->loop(nowMs);
+  net->takePacket();
+  nowMs += 59999;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_TRUE(mqtt->connected());
+  nowMs += 1;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_FALSE(mqtt->connected());
+  TEST_ASSERT_FALSE(net->open);
+}
+
+static void test_broker_closes_link() {
+  connectAndAck();
+  net->open = false;
+  mqtt->loop(nowMs);
+  TEST_ASSERT_FALSE(mqtt->connected());
+  // The caller keeps the batch spooled when the publish is refused.
+  TEST_ASSERT_FALSE(mqtt->publish("t", (const uint8_t *)"x", 1));
+}
+
+static void test_stop_sends_disconnect() {
+  connectAndAck();
+  mqtt->stop();
+  const uint8_t disconnect[] = {0xE0, 0x00};
+  std::vector<uint8_t> packet = net->takePacket();
+  TEST_ASSERT_EQUAL(2, packet.size());
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(disconnect, packet.data(), 2);
+  TEST_ASSERT_EQUAL(1, net->stops);
+  mqtt->stop();
+  TEST_ASSERT_EQUAL(1, net->stops);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_encode_length);
+  RUN_TEST(test_connect_frame);
+  RUN_TEST(test_start_on_open_link);
+  RUN_TEST(test_refused_connect);
+  RUN_TEST(test_unreachable_broker);
+  RUN_TEST(test_connack_timeout);
+  RUN_TEST(test_publish_frames_in_order);
+  RUN_TEST(test_long_payload_length);
+  RUN_TEST(test_keepalive_ping);
+  RUN_TEST(test_silent_broker_dropped);
+  RUN_TEST(test_broker_closes_link);
+  RUN_TEST(test_stop_sends_disconnect);
+  return UNITY_END();
+}
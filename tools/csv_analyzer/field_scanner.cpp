@@ -0,0 +1,158 @@
+#include "field_scanner.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static inline void addField(FieldView *fields, int maxFields, int &count, const char *start,
+                            const char *stop) {
+  if (count < maxFields) {
+    fields[count].p = start;
+    fields[count].len = (uint32_t)(stop - start);
+  }
+  count++;
+}
+
+static inline void finishLine(FieldView *fields, int maxFields, int &count, const char *start,
+                              const char *stop) {
+  if (stop > start && stop[-1] == '\r') stop--;
+  addField(fields, maxFields, count, start, stop);
+}
+
+bool FieldScanner::next(FieldView *fields, int maxFields, int &count) {
+  if (p >= end) return false;
+  count = 0;
+  const char *fieldStart = p;
+  const char *q = p;
+
+#if defined(__SSE2__)
+  const __m128i commas = _mm_set1_epi8(',');
+  const __m128i newlines = _mm_set1_epi8('\n');
+  while (end - q >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)q);
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(block, commas), _mm_cmpeq_epi8(block, newlines)));
+    while (mask) {
+      const char *sep = q + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (*sep == ',') {
+        addField(fields, maxFields, count, fieldStart, sep);
+        fieldStart = sep + 1;
+      } else {
+        finishLine(fields, maxFields, count, fieldStart, sep);
+        p = sep + 1;
+        return true;
+      }
+    }
+    q += 16;
+  }
+#endif
+
+  for (; q < end; q++) {
+    if (*q == ',') {
+      addField(fields, maxFields, count, fieldStart, q);
+      fieldStart = q + 1;
+    } else if (*q == '\n') {
+      finishLine(fields, maxFields, count, fieldStart, q);
+      p = q + 1;
+      return true;
+    }
+  }
+  // Last line without a trailing newline.
+  finishLine(fields, maxFields, count, fieldStart, end);
+  p = end;
+  return true;
+}
+
+const char *skipPastNewline(const char *pos, const char *end) {
+  const char *nl = (const char *)memchr(pos, '\n', (size_t)(end - pos));
+  return nl ? nl + 1 : end;
+}
+
+static inline bool digitsAt(const char *s, int n, uint32_t &value) {
+  uint32_t v = 0;
+  for (int i = 0; i < n; i++) {
+    unsigned d = (unsigned)(s[i] - '0');
+    if (d > 9) return false;
+    v = (v * 10) + d;
+  }
+  value = v;
+  return true;
+}
+
+bool parseDateKey(const FieldView &f, uint32_t &key) {
+  if (f.len != 10 || f.p[4] != '-' || f.p[7] != '-') return false;
+  uint32_t year = 0;
+  uint32_t month = 0;
+  uint32_t day = 0;
+  if (!digitsAt(f.p, 4, year) || !digitsAt(f.p + 5, 2, month) || !digitsAt(f.p + 8, 2, day)) {
+    return false;
+  }
+  if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+  key = (year * 10000) + (month * 100) + day;
+  return true;
+}
+
+bool parseU32(const FieldView &f, uint32_t &value) {
+  if (f.len == 0 || f.len > 10) return false;
+  uint64_t v = 0;
+  for (uint32_t i = 0; i < f.len; i++) {
+    unsigned d = (unsigned)(f.p[i] - '0');
+    if (d > 9) return false;
+    v = (v * 10) + d;
+  }
+  if (v > 0xFFFFFFFFull) return false;
+  value = (uint32_t)v;
+  return true;
+}
+
+bool parseI64(const FieldView &f, int64_t &value) {
+  uint32_t i = 0;
+  bool neg = false;
+  if (f.len > 0 && (f.p[0] == '-' || f.p[0] == '+')) {
+    neg = (f.p[0] == '-');
+    i = 1;
+  }
+  if (i >= f.len || f.len - i > 18) return false;
+  int64_t v = 0;
+  for (; i < f.len; i++) {
+    unsigned d = (unsigned)(f.p[i] - '0');
+    if (d > 9) return false;
+    v = (v * 10) + d;
+  }
+  value = neg ? -v : v;
+  return true;
+}
+
+// Devices print %.2f/%.3f, so a plain decimal parser is enough and far
+// faster than strtod.
+bool parseF64(const FieldView &f, double &value) {
+  static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+  uint32_t i = 0;
+  bool neg = false;
+  if (f.len > 0 && (f.p[0] == '-' || f.p[0] == '+')) {
+    neg = (f.p[0] == '-');
+    i = 1;
+  }
+  uint64_t whole = 0;
+  int digits = 0;
+  for (; i < f.len && (unsigned)(f.p[i] - '0') <= 9; i++, digits++) {
+    whole = (whole * 10) + (uint64_t)(f.p[i] - '0');
+  }
+  uint64_t frac = 0;
+  int fracDigits = 0;
+  if (i < f.len && f.p[i] == '.') {
+    for (i++; i < f.len && (unsigned)(f.p[i] - '0') <= 9; i++, digits++) {
+      if (fracDigits < 9) {
+        frac = (frac * 10) + (uint64_t)(f.p[i] - '0');
+        fracDigits++;
+      }
+    }
+  }
+  if (digits == 0 || i != f.len || digits > 18) return false;
+  double v = (double)whole + ((double)frac / POW10[fracDigits]);
+  value = neg ? -v : v;
+  return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Splits a memory range into lines and comma-separated fields. Separators
+// are found 16 bytes at a time with SSE2 compare+movemask (a scalar loop
+// elsewhere), so a line costs a few instructions per 16 bytes plus one per
+// field.
+struct FieldView {
+  const char *p;
+  uint32_t len;
+};
+
+class FieldScanner {
+public:
+  FieldScanner(const char *begin, const char *end) : p(begin), end(end) {}
+
+  // Fills up to maxFields views for the next line and sets count to the
+  // number of fields seen (which may exceed maxFields). A trailing '\r' is
+  // dropped. Returns false at the end of the range.
+  bool next(FieldView *fields, int maxFields, int &count);
+
+private:
+  const char *p;
+  const char *end;
+};
+
+// Field parsers; all return false on malformed input.
+bool parseDateKey(const FieldView &f, uint32_t &key);  // YYYY-MM-DD -> yyyymmdd
+bool parseU32(const FieldView &f, uint32_t &value);
+bool parseI64(const FieldView &f, int64_t &value);
+bool parseF64(const FieldView &f, double &value);
+
+// Moves `pos` forward to just past the next '\n' (or to `end`).
+const char *skipPastNewline(const char *pos, const char *end);
@@ -0,0 +1,386 @@
+// Fleet analyzer for the CSV files the water controller exports.
+//
+//   water_csv_analyzer [-j N] [--json] [--sigma S] [--long-s SEC] PATH...
+//
+// Each PATH is a device directory holding usage.csv / intervals.csv /
+// leaks.csv / chN_usage.csv, a directory of such device directories, or a
+// single CSV file (its directory names the device). Files are mmap'ed and
+// cut into line-aligned chunks that all cores parse in parallel.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "field_scanner.h"
+#include "rollup.h"
+
+namespace fs = std::filesystem;
+
+static const size_t CHUNK_BYTES = 8u << 20;
+
+struct InputFile {
+  std::string path;
+  int device;
+  CsvKind kind;
+  std::string channel;
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+struct Chunk {
+  int file;
+  size_t begin;
+  size_t end;
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: water_csv_analyzer [-j threads] [--json] [--sigma S] [--long-s SEC] PATH...\n");
+}
+
+static bool hasDeviceCsv(const fs::path &dir) {
+  std::error_code ec;
+  for (const auto &entry : fs::directory_iterator(dir, ec)) {
+    if (entry.is_regular_file() &&
+        kindForFileName(entry.path().filename().string()) != CsvKind::Unknown) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int deviceIndex(std::vector<std::string> &devices, const std::string &name) {
+  auto it = std::find(devices.begin(), devices.end(), name);
+  if (it != devices.end()) return (int)(it - devices.begin());
+  devices.push_back(name);
+  return (int)devices.size() - 1;
+}
+
+static void addFile(const fs::path &file, const std::string &device,
+                    std::vector<std::string> &devices, std::vector<InputFile> &files) {
+  std::string name = file.filename().string();
+  CsvKind kind = kindForFileName(name);
+  if (kind == CsvKind::Unknown) return;
+  InputFile in;
+  in.path = file.string();
+  in.device = deviceIndex(devices, device);
+  in.kind = kind;
+  if (kind == CsvKind::ChannelUsage) in.channel = name.substr(0, name.size() - 10);
+  files.push_back(in);
+}
+
+static void addDeviceDir(const fs::path &dir, std::vector<std::string> &devices,
+                         std::vector<InputFile> &files) {
+  std::vector<fs::path> entries;
+  for (const auto &entry : fs::directory_iterator(dir)) {
+    if (entry.is_regular_file()) entries.push_back(entry.path());
+  }
+  std::sort(entries.begin(), entries.end());
+  std::string device = fs::absolute(dir).lexically_normal().filename().string();
+  if (device.empty()) device = fs::absolute(dir).parent_path().filename().string();
+  for (const auto &p : entries) addFile(p, device, devices, files);
+}
+
+static bool collectInputs(const std::vector<std::string> &paths, std::vector<std::string> &devices,
+                          std::vector<InputFile> &files) {
+  for (const std::string &arg : paths) {
+    fs::path p(arg);
+    std::error_code ec;
+    if (fs::is_regular_file(p, ec)) {
+      std::string device = fs::absolute(p).parent_path().filename().string();
+      addFile(p, device, devices, files);
+    } else if (fs::is_directory(p, ec)) {
+      if (hasDeviceCsv(p)) {
+        addDeviceDir(p, devices, files);
+      } else {
+        std::vector<fs::path> subdirs;
+        for (const auto &entry : fs::directory_iterator(p)) {
+          if (entry.is_directory()) subdirs.push_back(entry.path());
+        }
+        std::sort(subdirs.begin(), subdirs.end());
+        for (const auto &d : subdirs) addDeviceDir(d, devices, files);
+      }
+    } else {
+      fprintf(stderr, "%s: not found\n", arg.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool mapFile(InputFile &in) {
+  int fd = open(in.path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  in.size = (size_t)st.st_size;
+  if (in.size > 0) {
+    void *p = mmap(nullptr, in.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(p, in.size, MADV_SEQUENTIAL | MADV_WILLNEED);
+    in.data = (const char *)p;
+  }
+  close(fd);
+  return true;
+}
+
+// Cuts a file into chunks of about CHUNK_BYTES that end on a newline.
+static void splitFile(const InputFile &in, int fileIndex, std::vector<Chunk> &chunks) {
+  size_t pos = 0;
+  while (pos < in.size) {
+    size_t target = std::min(in.size, pos + CHUNK_BYTES);
+    size_t end = in.size;
+    if (target < in.size) {
+      end = (size_t)(skipPastNewline(in.data + target, in.data + in.size) - in.data);
+    }
+    chunks.push_back({fileIndex, pos, end});
+    pos = end;
+  }
+}
+
+static void printJsonString(const std::string &s) {
+  putchar('"');
+  for (char c : s) {
+    if (c == '"' || c == '\\') putchar('\\');
+    if ((unsigned char)c < 0x20) {
+      printf("\\u%04x", c);
+      continue;
+    }
+    putchar(c);
+  }
+  putchar('"');
+}
+
+static void printText(const std::vector<DeviceReport> &reports,
+                      const std::vector<Anomaly> &anomalies) {
+  printf("%-20s %6s %12s %10s %-10s %10s %9s %9s %7s %7s %8s %6s\n", "device", "days", "total_l",
+         "avg_l_day", "max_day", "max_day_l", "intervals", "mean_iv_l", "p50_s", "p95_s",
+         "peak_lpm", "leaks");
+  double fleetLiters = 0.0;
+  uint64_t fleetDays = 0;
+  uint64_t fleetIntervals = 0;
+  uint64_t fleetLeaks = 0;
+  double hours[HOUR_BINS] = {};
+  for (const DeviceReport &r : reports) {
+    const DeviceAccum &a = r.acc;
+    uint64_t leaks = 0;
+    for (const auto &kv : a.leaks) leaks += kv.second.events;
+    printf("%-20s %6zu %12.1f %10.1f %-10s %10.1f %9llu %9.2f %7u %7u %8.2f %6llu\n",
+           r.name.c_str(), a.days.size(), r.totalLiters, r.meanDayLiters,
+           r.maxDayDate ? formatDate(r.maxDayDate).c_str() : "-", r.maxDayLiters,
+           (unsigned long long)a.intervalCount,
+           a.intervalCount ? a.intervalLiters / (double)a.intervalCount : 0.0, r.p50IntervalSec,
+           r.p95IntervalSec, a.peakLpm, (unsigned long long)leaks);
+    for (const auto &kv : a.channelDays) {
+      double liters = 0.0;
+      for (const DayRow &d : kv.second) liters += d.liters;
+      printf("  %-18s %6zu %12.1f\n", kv.first.c_str(), kv.second.size(), liters);
+    }
+    fleetLiters += r.totalLiters;
+    fleetDays += a.days.size();
+    fleetIntervals += a.intervalCount;
+    fleetLeaks += leaks;
+    for (int i = 0; i < HOUR_BINS; i++) hours[i] += a.hourLiters[i];
+  }
+  printf("%-20s %6llu %12.1f %10.1f %-10s %10s %9llu %9s %7s %7s %8s %6llu\n", "FLEET",
+         (unsigned long long)fleetDays, fleetLiters,
+         fleetDays ? fleetLiters / (double)fleetDays : 0.0, "", "",
+         (unsigned long long)fleetIntervals, "", "", "", "", (unsigned long long)fleetLeaks);
+
+  printf("\nFleet liters by hour of day:\n");
+  for (int i = 0; i < HOUR_BINS; i++) {
+    printf("  %02d  %12.1f\n", i, hours[i]);
+  }
+
+  printf("\nLeak events:\n");
+  for (const DeviceReport &r : reports) {
+    for (const auto &kv : r.acc.leaks) {
+      printf("  %-20s %-16s %6llu (valve closed %llu)\n", r.name.c_str(), kv.first.c_str(),
+             (unsigned long long)kv.second.events, (unsigned long long)kv.second.valveClosed);
+    }
+  }
+
+  printf("\nAnomalies: %zu\n", anomalies.size());
+  for (const Anomaly &a : anomalies) {
+    printf("  %-20s %s %-17s %s\n", a.device.c_str(), formatDate(a.date).c_str(), a.kind.c_str(),
+           a.detail.c_str());
+  }
+}
+
+static void printJson(const std::vector<DeviceReport> &reports,
+                      const std::vector<Anomaly> &anomalies) {
+  printf("{\"devices\":[");
+  for (size_t i = 0; i < reports.size(); i++) {
+    const DeviceReport &r = reports[i];
+    const DeviceAccum &a = r.acc;
+    if (i) putchar(',');
+    printf("{\"name\":");
+    printJsonString(r.name);
+    printf(",\"days\":%zu,\"total_l\":%.3f,\"total_sec\":%llu,\"mean_day_l\":%.3f,"
+           "\"sd_day_l\":%.3f,\"max_day\":\"%s\",\"max_day_l\":%.3f,\"intervals\":%llu,"
+           "\"interval_l\":%.3f,\"interval_sec\":%llu,\"max_interval_l\":%.3f,"
+           "\"p50_interval_s\":%u,\"p95_interval_s\":%u,\"peak_lpm\":%.2f,\"merged_gaps\":%llu,"
+           "\"bad_lines\":%llu,\"hours_l\":[",
+           a.days.size(), r.totalLiters, (unsigned long long)r.totalSeconds, r.meanDayLiters,
+           r.sdDayLiters, r.maxDayDate ? formatDate(r.maxDayDate).c_str() : "",
+           r.maxDayLiters, (unsigned long long)a.intervalCount, a.intervalLiters,
+           (unsigned long long)a.intervalSeconds, a.maxIntervalLiters, r.p50IntervalSec,
+           r.p95IntervalSec, a.peakLpm, (unsigned long long)a.mergedGaps,
+           (unsigned long long)a.badLines);
+    for (int h = 0; h < HOUR_BINS; h++) printf(h ? ",%.2f" : "%.2f", a.hourLiters[h]);
+    printf("],\"channels\":{");
+    bool first = true;
+    for (const auto &kv : a.channelDays) {
+      double liters = 0.0;
+      for (const DayRow &d : kv.second) liters += d.liters;
+      printf("%s\"%s\":{\"days\":%zu,\"total_l\":%.3f}", first ? "" : ",", kv.first.c_str(),
+             kv.second.size(), liters);
+      first = false;
+    }
+    printf("},\"leaks\":{");
+    first = true;
+    for (const auto &kv : a.leaks) {
+      printf("%s", first ? "" : ",");
+      printJsonString(kv.first);
+      printf(":{\"events\":%llu,\"valve_closed\":%llu}", (unsigned long long)kv.second.events,
+             (unsigned long long)kv.second.valveClosed);
+      first = false;
+    }
+    printf("}}");
+  }
+  printf("],\"anomalies\":[");
+  for (size_t i = 0; i < anomalies.size(); i++) {
+    const Anomaly &a = anomalies[i];
+    if (i) putchar(',');
+    printf("{\"device\":");
+    printJsonString(a.device);
+    printf(",\"date\":\"%s\",\"kind\":\"%s\",\"detail\":", formatDate(a.date).c_str(),
+           a.kind.c_str());
+    printJsonString(a.detail);
+    putchar('}');
+  }
+  printf("]}\n");
+}
+
+int main(int argc, char **argv) {
+  AnalyzerOptions opts;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  bool json = false;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if ((a == "-j" || a == "--threads") && i + 1 < argc) {
+      threads = (unsigned)std::max(1, atoi(argv[++i]));
+    } else if (a == "--json") {
+      json = true;
+    } else if (a == "--sigma" && i + 1 < argc) {
+      opts.daySigma = atof(argv[++i]);
+    } else if (a == "--long-s" && i + 1 < argc) {
+      opts.longIntervalSec = (uint32_t)strtoul(argv[++i], nullptr, 10);
+    } else if (a == "-h" || a == "--help") {
+      usage();
+      return 0;
+    } else if (!a.empty() && a[0] == '-') {
+      usage();
+      return 2;
+    } else {
+      paths.push_back(a);
+    }
+  }
+  if (paths.empty()) {
+    usage();
+    return 2;
+  }
+
+  std::vector<std::string> devices;
+  std::vector<InputFile> files;
+  if (!collectInputs(paths, devices, files)) return 1;
+  if (files.empty()) {
+    fprintf(stderr, "no device CSV files found\n");
+    return 1;
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<Chunk> chunks;
+  uint64_t totalBytes = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (!mapFile(files[i])) {
+      fprintf(stderr, "%s: %s\n", files[i].path.c_str(), strerror(errno));
+      return 1;
+    }
+    totalBytes += files[i].size;
+    splitFile(files[i], (int)i, chunks);
+  }
+  // Big chunks first so the tail of the run is not one thread on one file.
+  std::stable_sort(chunks.begin(), chunks.end(), [](const Chunk &a, const Chunk &b) {
+    return (a.end - a.begin) > (b.end - b.begin);
+  });
+  threads = std::min<unsigned>(threads, (unsigned)std::max<size_t>(1, chunks.size()));
+
+  std::vector<std::vector<DeviceAccum>> perThread(threads, std::vector<DeviceAccum>(devices.size()));
+  std::atomic<size_t> nextChunk(0);
+  auto worker = [&](unsigned t) {
+    std::vector<DeviceAccum> &local = perThread[t];
+    size_t i;
+    while ((i = nextChunk.fetch_add(1)) < chunks.size()) {
+      const Chunk &c = chunks[i];
+      const InputFile &in = files[c.file];
+      uint64_t orderBase = ((uint64_t)c.file << 40) + c.begin;
+      parseChunk(in.kind, in.channel, in.data + c.begin, in.data + c.end, orderBase, opts,
+                 local[in.device]);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker, t);
+  worker(0);
+  for (auto &th : pool) th.join();
+  auto t1 = std::chrono::steady_clock::now();
+
+  std::vector<DeviceReport> reports(devices.size());
+  std::vector<Anomaly> anomalies;
+  for (size_t d = 0; d < devices.size(); d++) {
+    reports[d].name = devices[d];
+    for (unsigned t = 0; t < threads; t++) reports[d].acc.merge(perThread[t][d]);
+    finishDevice(reports[d], opts, anomalies);
+  }
+  for (InputFile &in : files) {
+    if (in.data) munmap((void *)in.data, in.size);
+  }
+
+  if (json) {
+    printJson(reports, anomalies);
+  } else {
+    printText(reports, anomalies);
+  }
+
+  double secs = std::chrono::duration<double>(t1 - t0).count();
+  uint64_t lines = 0;
+  uint64_t bad = 0;
+  for (const DeviceReport &r : reports) {
+    lines += r.acc.lines;
+    bad += r.acc.badLines;
+  }
+  fprintf(stderr, "parsed %llu lines (%llu bad), %.1f MB in %.3f s on %u threads: %.2f GB/s\n",
+          (unsigned long long)lines, (unsigned long long)bad, (double)totalBytes / 1e6, secs,
+          threads, secs > 0 ? (double)totalBytes / secs / 1e9 : 0.0);
+  return 0;
+}
@@ -0,0 +1,290 @@
+#include "rollup.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "field_scanner.h"
+
+CsvKind kindForFileName(const std::string &name) {
+  if (name == "usage.csv") return CsvKind::Usage;
+  if (name == "intervals.csv") return CsvKind::Intervals;
+  if (name == "leaks.csv") return CsvKind::Leaks;
+  if (name.size() > 12 && name.compare(0, 2, "ch") == 0 &&
+      name.compare(name.size() - 10, 10, "_usage.csv") == 0) {
+    return CsvKind::ChannelUsage;
+  }
+  return CsvKind::Unknown;
+}
+
+std::string formatDate(uint32_t key) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%04u-%02u-%02u", key / 10000, (key / 100) % 100, key % 100);
+  return buf;
+}
+
+static int durationBucket(uint32_t sec) {
+  uint64_t x = (uint64_t)sec + 1;
+  int octave = 63 - __builtin_clzll(x);
+  int quarter = octave >= 2 ? (int)((x >> (octave - 2)) & 3) : (int)((x << (2 - octave)) & 3);
+  return std::min((octave * 4) + quarter, DURATION_BUCKETS - 1);
+}
+
+// Smallest sec+1 that lands in the bucket.
+static double bucketLow(int bucket) {
+  return std::ldexp(4.0 + (bucket & 3), (bucket / 4) - 2);
+}
+
+static uint32_t bucketMidSec(int bucket) {
+  double mid = std::sqrt(bucketLow(bucket) * bucketLow(bucket + 1)) - 1.0;
+  return (uint32_t)std::lround(std::max(mid, 1.0));
+}
+
+void DeviceAccum::flushRun() {
+  if (runDate) intervalLitersByDate[runDate] += runLiters;
+  runDate = 0;
+  runLiters = 0.0;
+}
+
+void DeviceAccum::merge(DeviceAccum &o) {
+  flushRun();
+  o.flushRun();
+  bytes += o.bytes;
+  lines += o.lines;
+  badLines += o.badLines;
+  days.insert(days.end(), o.days.begin(), o.days.end());
+  for (auto &kv : o.channelDays) {
+    auto &dst = channelDays[kv.first];
+    dst.insert(dst.end(), kv.second.begin(), kv.second.end());
+  }
+  for (int i = 0; i < HOUR_BINS; i++) hourLiters[i] += o.hourLiters[i];
+  intervalCount += o.intervalCount;
+  intervalLiters += o.intervalLiters;
+  intervalSeconds += o.intervalSeconds;
+  maxIntervalLiters = std::max(maxIntervalLiters, o.maxIntervalLiters);
+  peakLpm = std::max(peakLpm, o.peakLpm);
+  mergedGaps += o.mergedGaps;
+  for (int i = 0; i < DURATION_BUCKETS; i++) durationHist[i] += o.durationHist[i];
+  for (auto &kv : o.intervalLitersByDate) intervalLitersByDate[kv.first] += kv.second;
+  longIntervals.insert(longIntervals.end(), o.longIntervals.begin(), o.longIntervals.end());
+  for (auto &kv : o.leaks) {
+    leaks[kv.first].events += kv.second.events;
+    leaks[kv.first].valveClosed += kv.second.valveClosed;
+  }
+  if (o.firstLeakTs && (!firstLeakTs || o.firstLeakTs < firstLeakTs)) firstLeakTs = o.firstLeakTs;
+  if (o.lastLeakTs > lastLeakTs) lastLeakTs = o.lastLeakTs;
+}
+
+static bool parseUsage(const FieldView *f, int count, uint64_t order, DeviceAccum &acc) {
+  DayRow row;
+  row.order = order;
+  uint32_t wday = 0;
+  if (count < 4 || !parseDateKey(f[0], row.date) || !parseU32(f[1], wday) ||
+      !parseU32(f[2], row.seconds) || !parseF64(f[3], row.liters)) {
+    return false;
+  }
+  acc.days.push_back(row);
+  // Rows from before hour bins existed, or with a different bin count, add
+  // nothing to the profile.
+  if (count == 4 + HOUR_BINS) {
+    for (int i = 0; i < HOUR_BINS; i++) {
+      double v = 0.0;
+      if (parseF64(f[4 + i], v)) acc.hourLiters[i] += v;
+    }
+  }
+  return true;
+}
+
+static bool parseInterval(const FieldView *f, int count, const AnalyzerOptions &opts,
+                          DeviceAccum &acc) {
+  uint32_t date = 0;
+  uint32_t wday = 0;
+  uint32_t start = 0;
+  uint32_t end = 0;
+  double liters = 0.0;
+  if (count < 5 || !parseDateKey(f[0], date) || !parseU32(f[1], wday) || !parseU32(f[2], start) ||
+      !parseU32(f[3], end) || !parseF64(f[4], liters) || end < start) {
+    return false;
+  }
+  uint32_t duration = end - start + 1;
+  acc.intervalCount++;
+  acc.intervalLiters += liters;
+  acc.intervalSeconds += duration;
+  acc.maxIntervalLiters = std::max(acc.maxIntervalLiters, liters);
+  acc.durationHist[durationBucket(duration)]++;
+  if (date != acc.runDate) {
+    acc.flushRun();
+    acc.runDate = date;
+  }
+  acc.runLiters += liters;
+  if (count >= 7) {
+    uint32_t gaps = 0;
+    double peak = 0.0;
+    if (parseU32(f[5], gaps)) acc.mergedGaps += gaps;
+    if (parseF64(f[6], peak)) acc.peakLpm = std::max(acc.peakLpm, peak);
+  }
+  if (duration > opts.longIntervalSec) {
+    acc.longIntervals.push_back({date, start, duration, liters});
+  }
+  return true;
+}
+
+static bool parseLeak(const FieldView *f, int count, DeviceAccum &acc) {
+  int64_t ts = 0;
+  if (count < 9 || !parseI64(f[0], ts) || f[3].len == 0) return false;
+  LeakCount &lc = acc.leaks[std::string(f[3].p, f[3].len)];
+  lc.events++;
+  if (f[8].len == 6 && std::equal(f[8].p, f[8].p + 6, "CLOSED")) lc.valveClosed++;
+  if (ts > 0) {
+    if (!acc.firstLeakTs || ts < acc.firstLeakTs) acc.firstLeakTs = ts;
+    if (ts > acc.lastLeakTs) acc.lastLeakTs = ts;
+  }
+  return true;
+}
+
+static bool parseChannelUsage(const FieldView *f, int count, const std::string &channel,
+                              uint64_t order, DeviceAccum &acc) {
+  DayRow row;
+  row.order = order;
+  if (count < 3 || !parseDateKey(f[0], row.date) || !parseU32(f[1], row.seconds) ||
+      !parseF64(f[2], row.liters)) {
+    return false;
+  }
+  acc.channelDays[channel].push_back(row);
+  return true;
+}
+
+void parseChunk(CsvKind kind, const std::string &channel, const char *begin, const char *end,
+                uint64_t orderBase, const AnalyzerOptions &opts, DeviceAccum &acc) {
+  static const int MAX_FIELDS = 4 + HOUR_BINS;
+  FieldView fields[MAX_FIELDS];
+  FieldScanner scanner(begin, end);
+  int count = 0;
+  acc.bytes += (uint64_t)(end - begin);
+  while (scanner.next(fields, MAX_FIELDS, count)) {
+    if (count == 1 && fields[0].len == 0) continue;
+    // Header lines (and anything else not starting with a digit).
+    if (fields[0].len == 0 || (unsigned)(fields[0].p[0] - '0') > 9) continue;
+    acc.lines++;
+    int used = std::min(count, MAX_FIELDS);
+    uint64_t order = orderBase + (uint64_t)(fields[0].p - begin);
+    bool ok = false;
+    switch (kind) {
+      case CsvKind::Usage:
+        ok = parseUsage(fields, count == used ? count : 4, order, acc);
+        break;
+      case CsvKind::Intervals:
+        ok = parseInterval(fields, used, opts, acc);
+        break;
+      case CsvKind::Leaks:
+        ok = parseLeak(fields, used, acc);
+        break;
+      case CsvKind::ChannelUsage:
+        ok = parseChannelUsage(fields, used, channel, order, acc);
+        break;
+      case CsvKind::Unknown:
+        break;
+    }
+    if (!ok) acc.badLines++;
+  }
+}
+
+static void sortUniqueDays(std::vector<DayRow> &days) {
+  // A day can appear in several exports of the same device; the later row
+  // in input order wins, as it does on the device.
+  std::sort(days.begin(), days.end(), [](const DayRow &a, const DayRow &b) {
+    return a.date != b.date ? a.date < b.date : a.order < b.order;
+  });
+  std::vector<DayRow> unique;
+  unique.reserve(days.size());
+  for (const DayRow &d : days) {
+    if (!unique.empty() && unique.back().date == d.date) {
+      unique.back() = d;
+    } else {
+      unique.push_back(d);
+    }
+  }
+  days.swap(unique);
+}
+
+static uint32_t histogramPercentile(const uint64_t *hist, uint64_t total, double share) {
+  if (total == 0) return 0;
+  uint64_t target = (uint64_t)std::ceil(share * (double)total);
+  uint64_t seen = 0;
+  for (int i = 0; i < DURATION_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen >= target) return bucketMidSec(i);
+  }
+  return bucketMidSec(DURATION_BUCKETS - 1);
+}
+
+void finishDevice(DeviceReport &dev, const AnalyzerOptions &opts, std::vector<Anomaly> &anomalies) {
+  DeviceAccum &acc = dev.acc;
+  acc.flushRun();
+  sortUniqueDays(acc.days);
+  for (auto &kv : acc.channelDays) sortUniqueDays(kv.second);
+
+  double sum = 0.0;
+  double sumSq = 0.0;
+  for (const DayRow &d : acc.days) {
+    dev.totalLiters += d.liters;
+    dev.totalSeconds += d.seconds;
+    sum += d.liters;
+    sumSq += d.liters * d.liters;
+    if (d.liters > dev.maxDayLiters) {
+      dev.maxDayLiters = d.liters;
+      dev.maxDayDate = d.date;
+    }
+  }
+  size_t n = acc.days.size();
+  if (n > 0) {
+    dev.meanDayLiters = sum / (double)n;
+    double var = (sumSq / (double)n) - (dev.meanDayLiters * dev.meanDayLiters);
+    dev.sdDayLiters = var > 0.0 ? std::sqrt(var) : 0.0;
+  }
+  dev.p50IntervalSec = histogramPercentile(acc.durationHist, acc.intervalCount, 0.50);
+  dev.p95IntervalSec = histogramPercentile(acc.durationHist, acc.intervalCount, 0.95);
+
+  char detail[160];
+  // A week is the least that says anything about a "normal" day.
+  if (n >= 7 && dev.sdDayLiters > 0.0) {
+    double limit = dev.meanDayLiters + (opts.daySigma * dev.sdDayLiters);
+    for (const DayRow &d : acc.days) {
+      if (d.liters > limit) {
+        snprintf(detail, sizeof(detail), "%.1f L (mean %.1f, sd %.1f)", d.liters,
+                 dev.meanDayLiters, dev.sdDayLiters);
+        anomalies.push_back({dev.name, d.date, "day_outlier", detail});
+      }
+    }
+  }
+  if (acc.intervalCount > 0) {
+    // intervals.csv keeps fewer days than usage.csv; days outside its range
+    // have no intervals to compare.
+    uint32_t firstIntervalDate = UINT32_MAX;
+    uint32_t lastIntervalDate = 0;
+    for (const auto &kv : acc.intervalLitersByDate) {
+      firstIntervalDate = std::min(firstIntervalDate, kv.first);
+      lastIntervalDate = std::max(lastIntervalDate, kv.first);
+    }
+    for (const DayRow &d : acc.days) {
+      if (d.liters < 1.0) continue;
+      if (d.date < firstIntervalDate || d.date > lastIntervalDate) continue;
+      auto it = acc.intervalLitersByDate.find(d.date);
+      double intervalLiters = it == acc.intervalLitersByDate.end() ? 0.0 : it->second;
+      if (std::fabs(intervalLiters - d.liters) > opts.mismatchShare * d.liters) {
+        snprintf(detail, sizeof(detail), "day %.1f L vs intervals %.1f L", d.liters,
+                 intervalLiters);
+        anomalies.push_back({dev.name, d.date, "interval_mismatch", detail});
+      }
+    }
+  }
+  std::sort(acc.longIntervals.begin(), acc.longIntervals.end(),
+            [](const LongInterval &a, const LongInterval &b) {
+              return a.date != b.date ? a.date < b.date : a.startSec < b.startSec;
+            });
+  for (const LongInterval &li : acc.longIntervals) {
+    snprintf(detail, sizeof(detail), "%02u:%02u for %u s, %.1f L", li.startSec / 3600,
+             (li.startSec / 60) % 60, li.durationSec, li.liters);
+    anomalies.push_back({dev.name, li.date, "long_interval", detail});
+  }
+}
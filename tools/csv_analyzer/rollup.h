@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// CSV formats written by the firmware (src/storage.cpp):
+//   usage.csv      date,wday,total_seconds,total_liters[,bin00..bin23]
+//   intervals.csv  date,wday,start_sec,end_sec,liters[,merged_gaps,peak_lpm
+//                  [,min_lpm,mean_lpm,sd_lpm,samples,pulses]]
+//   leaks.csv      timestamp,date,time,reason,total_liters,daily_liters,
+//                  continuous_liters,threshold_liters,valve
+//   chN_usage.csv  date,seconds,liters
+enum class CsvKind { Usage, Intervals, Leaks, ChannelUsage, Unknown };
+
+CsvKind kindForFileName(const std::string &name);
+
+constexpr int HOUR_BINS = 24;
+// Interval durations in quarter-octave buckets: the octave of sec+1 and its
+// next two bits.
+constexpr int DURATION_BUCKETS = 128;
+
+struct DayRow {
+  uint32_t date;
+  uint32_t seconds;
+  double liters;
+  // Input position (file index, byte offset), so duplicates resolve the
+  // same way however the files were split between threads.
+  uint64_t order;
+};
+
+struct LongInterval {
+  uint32_t date;
+  uint32_t startSec;
+  uint32_t durationSec;
+  double liters;
+};
+
+struct LeakCount {
+  uint64_t events = 0;
+  uint64_t valveClosed = 0;
+};
+
+// Everything one worker learned about one device; workers merge theirs at
+// the end, so nothing here is shared while parsing.
+struct DeviceAccum {
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  uint64_t badLines = 0;
+
+  std::vector<DayRow> days;
+  std::map<std::string, std::vector<DayRow>> channelDays;
+  double hourLiters[HOUR_BINS] = {};
+
+  uint64_t intervalCount = 0;
+  double intervalLiters = 0.0;
+  uint64_t intervalSeconds = 0;
+  double maxIntervalLiters = 0.0;
+  double peakLpm = 0.0;
+  uint64_t mergedGaps = 0;
+  uint64_t durationHist[DURATION_BUCKETS] = {};
+  std::unordered_map<uint32_t, double> intervalLitersByDate;
+  // Rows of one day are adjacent; they sum here before touching the map.
+  uint32_t runDate = 0;
+  double runLiters = 0.0;
+  void flushRun();
+  std::vector<LongInterval> longIntervals;
+
+  std::map<std::string, LeakCount> leaks;
+  int64_t firstLeakTs = 0;
+  int64_t lastLeakTs = 0;
+
+  void merge(DeviceAccum &other);
+};
+
+struct AnalyzerOptions {
+  // A day above mean + sigma * sd of the device's days is an outlier.
+  double daySigma = 3.0;
+  // Intervals longer than this are reported.
+  uint32_t longIntervalSec = 3600;
+  // Day totals and the sum of that day's intervals may differ by this share.
+  double mismatchShare = 0.10;
+};
+
+// Parses [begin, end) of one file, which must start at a line boundary.
+// orderBase is the input position of `begin`.
+void parseChunk(CsvKind kind, const std::string &channel, const char *begin, const char *end,
+                uint64_t orderBase, const AnalyzerOptions &opts, DeviceAccum &acc);
+
+struct Anomaly {
+  std::string device;
+  uint32_t date;
+  std::string kind;
+  std::string detail;
+};
+
+struct DeviceReport {
+  std::string name;
+  DeviceAccum acc;
+  double meanDayLiters = 0.0;
+  double sdDayLiters = 0.0;
+  uint32_t maxDayDate = 0;
+  double maxDayLiters = 0.0;
+  double totalLiters = 0.0;
+  uint64_t totalSeconds = 0;
+  uint32_t p50IntervalSec = 0;
+  uint32_t p95IntervalSec = 0;
+};
+
+// Sorts the device's days and derives its report fields and anomalies.
+void finishDevice(DeviceReport &dev, const AnalyzerOptions &opts, std::vector<Anomaly> &anomalies);
+
+std::string formatDate(uint32_t key);